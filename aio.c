@@ -0,0 +1,401 @@
+/*-------------------------------------------------------------------------
+ *
+ * aio.c: asynchronous reads and writes of local files.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <unistd.h>
+
+#include "pgut/pgut-pthread.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * An I/O started by async_io_start() runs while the caller processes other
+ * buffers, and async_io_wait() takes its result. Both must be called by the
+ * same thread. It is submitted to the io_uring of the thread when built with
+ * USE_IO_URING=1 and the kernel supports it, or run by I/O threads shared by
+ * all threads otherwise.
+ */
+typedef struct AsyncIOJob
+{
+	void	  (*routine)(struct AsyncIOJob *);
+	AsyncIO	   *io;
+} AsyncIOJob;
+
+static pthread_mutex_t	io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	io_done = PTHREAD_COND_INITIALIZER;
+static JobQueue		   *io_queue = NULL;
+
+static void async_io_run(AsyncIOJob *job);
+static ssize_t async_io_sync(AsyncIO *io);
+static void async_io_atfork_child(void);
+
+#ifdef HAVE_IO_URING
+#define RING_ENTRIES	16
+
+typedef struct Ring
+{
+	int					fd;
+	void			   *sq_ptr;
+	size_t				sq_size;
+	void			   *cq_ptr;		/* same as sq_ptr with single mmap */
+	size_t				cq_size;
+	struct io_uring_sqe *sqes;
+	size_t				sqes_size;
+	unsigned		   *sq_head;
+	unsigned		   *sq_tail;
+	unsigned		   *sq_mask;
+	unsigned		   *sq_array;
+	unsigned		   *cq_head;
+	unsigned		   *cq_tail;
+	unsigned		   *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned			entries;
+} Ring;
+
+/* the ring of the thread, or NO_RING if io_uring is not available */
+#define NO_RING		((Ring *) -1)
+
+static pthread_key_t	ring_key;
+static pthread_once_t	ring_once = PTHREAD_ONCE_INIT;
+
+static void ring_key_init(void);
+static Ring *ring_get(void);
+static void ring_free(void *arg);
+static bool ring_submit(Ring *ring, AsyncIO *io);
+static void ring_reap(Ring *ring, AsyncIO *io);
+#endif
+
+/*
+ * Start reading or writing len bytes of buf at offset of fd. The buffer must
+ * not be used until async_io_wait() returns.
+ */
+void
+async_io_start(AsyncIO *io, int fd, bool write, char *buf, size_t len,
+			   off_t offset)
+{
+	AsyncIOJob *job;
+
+	io->fd = fd;
+	io->write = write;
+	io->buf = buf;
+	io->len = len;
+	io->offset = offset;
+	io->result = 0;
+	io->error = 0;
+	io->done = false;
+	io->pending = true;
+	io->ring = NULL;
+
+#ifdef HAVE_IO_URING
+	{
+		Ring   *ring = ring_get();
+
+		if (ring != NO_RING && ring_submit(ring, io))
+			return;
+	}
+#endif
+
+	pgut_mutex_lock(&io_lock);
+	if (io_queue == NULL)
+	{
+		static bool	atfork = false;
+
+		/* at most one I/O is in flight for a reader or writer */
+		io_queue = JobQueue_new(Max(num_threads, 1) * 2);
+		if (!atfork)
+			pthread_atfork(NULL, NULL, async_io_atfork_child);
+		atfork = true;
+	}
+	pthread_mutex_unlock(&io_lock);
+
+	job = pgut_new(AsyncIOJob);
+	job->routine = async_io_run;
+	job->io = io;
+	JobQueue_push(io_queue, (Job *) job);
+}
+
+/*
+ * Wait for the I/O and return the number of bytes transferred, or -1 with
+ * errno. A read may return fewer bytes than requested as pread() does, and
+ * a write returns the length only when all of it has been written.
+ */
+ssize_t
+async_io_wait(AsyncIO *io)
+{
+	if (!io->pending)
+		return io->result;
+
+#ifdef HAVE_IO_URING
+	if (io->ring != NULL)
+		ring_reap((Ring *) io->ring, io);
+	else
+#endif
+	{
+		pgut_mutex_lock(&io_lock);
+		while (!io->done)
+			pgut_cond_wait(&io_done, &io_lock);
+		pthread_mutex_unlock(&io_lock);
+	}
+	io->pending = false;
+
+	/* the rest of a short write is written here */
+	if (io->write && io->result >= 0 && (size_t) io->result < io->len)
+	{
+		size_t	done = io->result;
+
+		io->buf += done;
+		io->len -= done;
+		io->offset += done;
+		io->result = async_io_sync(io);
+		if (io->result >= 0)
+			io->result += done;
+	}
+
+	if (io->result < 0)
+		errno = io->error;
+	return io->result;
+}
+
+/* run the I/O in an I/O thread */
+static void
+async_io_run(AsyncIOJob *job)
+{
+	AsyncIO    *io = job->io;
+	ssize_t		result;
+
+	result = async_io_sync(io);
+
+	pgut_mutex_lock(&io_lock);
+	io->result = result;
+	io->done = true;
+	pthread_cond_broadcast(&io_done);
+	pthread_mutex_unlock(&io_lock);
+}
+
+/* do the I/O in the current thread, setting io->error on failure */
+static ssize_t
+async_io_sync(AsyncIO *io)
+{
+	size_t	done = 0;
+
+	for (;;)
+	{
+		ssize_t	rc;
+
+		if (io->write)
+			rc = pwrite(io->fd, io->buf + done, io->len - done,
+						io->offset + done);
+		else
+			rc = pread(io->fd, io->buf, io->len, io->offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 || (io->write && rc == 0))
+		{
+			io->error = (rc == 0 ? ENOSPC : errno);
+			return -1;
+		}
+		if (!io->write)
+			return rc;
+		done += rc;
+		if (done >= io->len)
+			return done;
+	}
+}
+
+/*
+ * Only the forking thread exists in the child, so I/O threads and the ring
+ * shared with the parent are not usable there.
+ */
+static void
+async_io_atfork_child(void)
+{
+	io_queue = NULL;
+#ifdef HAVE_IO_URING
+	{
+		Ring   *ring = (Ring *) pthread_getspecific(ring_key);
+
+		if (ring != NULL && ring != NO_RING)
+		{
+			ring_free(ring);
+			pthread_setspecific(ring_key, NULL);
+		}
+	}
+#endif
+}
+
+#ifdef HAVE_IO_URING
+static void
+ring_key_init(void)
+{
+	pthread_key_create(&ring_key, ring_free);
+}
+
+/*
+ * Return the ring of the thread, set up at the first call. NO_RING is
+ * returned if the kernel doesn't support io_uring, or reads and writes with
+ * it (Linux 5.6 or later).
+ */
+static Ring *
+ring_get(void)
+{
+	Ring				   *ring;
+	struct io_uring_params	p;
+	int						fd;
+
+	pthread_once(&ring_once, ring_key_init);
+	if ((ring = (Ring *) pthread_getspecific(ring_key)) != NULL)
+		return ring;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (fd < 0 || !(p.features & IORING_FEAT_RW_CUR_POS))
+	{
+		if (fd >= 0)
+			close(fd);
+		elog(LOG, _("io_uring is not available; using I/O threads"));
+		pthread_setspecific(ring_key, NO_RING);
+		return NO_RING;
+	}
+
+	ring = pgut_new(Ring);
+	memset(ring, 0, sizeof(Ring));
+	ring->fd = fd;
+	ring->entries = p.sq_entries;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_size = ring->cq_size = Max(ring->sq_size, ring->cq_size);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		elog(ERROR_SYSTEM, _("can't map io_uring: %s"), strerror(errno));
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			elog(ERROR_SYSTEM, _("can't map io_uring: %s"), strerror(errno));
+	}
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		elog(ERROR_SYSTEM, _("can't map io_uring: %s"), strerror(errno));
+
+	ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+static void
+ring_free(void *arg)
+{
+	Ring   *ring = (Ring *) arg;
+
+	if (ring == NO_RING)
+		return;
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	free(ring);
+}
+
+/* queue the I/O into the ring; returns false if the ring is full */
+static bool
+ring_submit(Ring *ring, AsyncIO *io)
+{
+	unsigned			tail = *ring->sq_tail;
+	unsigned			index;
+	struct io_uring_sqe *sqe;
+	int					rc;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+		ring->entries)
+		return false;
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = io->fd;
+	sqe->addr = (uint64) (uintptr_t) io->buf;
+	sqe->len = io->len;
+	sqe->off = io->offset;
+	sqe->user_data = (uint64) (uintptr_t) io;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do
+		rc = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+	while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		elog(ERROR_SYSTEM, _("can't submit I/O to io_uring: %s"),
+			strerror(errno));
+
+	io->ring = ring;
+	return true;
+}
+
+/* take completions of the ring until the I/O is done */
+static void
+ring_reap(Ring *ring, AsyncIO *io)
+{
+	while (!io->done)
+	{
+		unsigned	head = *ring->cq_head;
+
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+						IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+				elog(ERROR_SYSTEM, _("can't wait for I/O of io_uring: %s"),
+					strerror(errno));
+			continue;
+		}
+
+		{
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			AsyncIO			   *done = (AsyncIO *) (uintptr_t) cqe->user_data;
+
+			if (cqe->res < 0)
+			{
+				done->result = -1;
+				done->error = -cqe->res;
+			}
+			else
+				done->result = cqe->res;
+			done->done = true;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	/* an interrupted I/O is retried in the current thread */
+	if (io->result < 0 && (io->error == EINTR || io->error == EAGAIN))
+		io->result = async_io_sync(io);
+	io->ring = NULL;
+}
+#endif
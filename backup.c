@@ -21,25 +21,53 @@
 #include "pgut/pgut-port.h"
 
 #define TIMEOUT_ARCHIVE		10		/* wait 10 sec until WAL archive complete */
+#define TIMEOUT_REPLAY		300		/* wait 300 sec until standby replays WAL */
+
+/* data files are read from a standby, and the primary is connected by -h */
+#define BACKUP_FROM_STANDBY	(standby_host != NULL || standby_port != NULL)
 
 static bool		 in_backup = false;	/* TODO: more robust logic */
+static bool		 in_standby_backup = false;	/* pg_start_backup() is done */
 static parray	*cleanup_list;		/* list of command to execute at error processing for snapshot */
 
+/* a regular file to be backed up, possibly by a worker thread */
+typedef struct BackupJob
+{
+	void			  (*routine)(struct BackupJob *);
+	const char		   *from_root;
+	const char		   *to_root;
+	pgFile			   *file;
+	const XLogRecPtr   *lsn;
+	datapagemap_t	   *pagemap;	/* blocks to be read, or NULL */
+	bool				compress;
+	bool				is_arclog;	/* WAL segments are copied as used */
+	char				progress[MAXPGPATH + 32];	/* for verbose mode */
+} BackupJob;
+
 /*
  * Backup routines
  */
 static void backup_cleanup(bool fatal, void *userdata);
 static void delete_old_files(const char *root, parray *files, int keep_files,
-							 int keep_days, int server_version, bool is_arclog);
+							 int keep_days, int server_version, bool is_arclog,
+							 parray *old_files);
+static void backup_file(BackupJob *job);
 static void backup_files(const char *from_root, const char *to_root,
-	parray *files, parray *prev_files, const XLogRecPtr *lsn, bool compress, const char *prefix);
+	parray *files, Manifest *prev_files, const XLogRecPtr *lsn, parray *pagemap,
+	bool compress, const char *prefix, MetricsPhase phase);
 static parray *do_backup_database(parray *backup_list, bool smooth_checkpoint);
 static parray *do_backup_arclog(parray *backup_list);
 static parray *do_backup_srvlog(parray *backup_list);
 static void confirm_block_size(const char *name, int blcksz);
+static parray *read_wal_pagemap(const XLogRecPtr *lsn);
 static void pg_start_backup(const char *label, bool smooth, pgBackup *backup);
 static void pg_stop_backup(pgBackup *backup);
 static void pg_switch_xlog(pgBackup *backup);
+static void reconnect_standby(void);
+static void confirm_standby(void);
+static char *read_backup_label(XLogRecPtr *checkpoint);
+static void wait_for_replay(const XLogRecPtr *lsn);
+static void finish_standby_backup(parray *files, const char *label);
 static void get_lsn(PGresult *res, TimeLineID *timeline, XLogRecPtr *lsn);
 static void get_xid(PGresult *res, uint32 *xid);
 
@@ -69,12 +97,15 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 {
 	int			i;
 	parray	   *files;				/* backup file list from non-snapshot */
-	parray	   *prev_files = NULL;	/* file list of previous database backup */
+	Manifest   *prev_files = NULL;	/* file list of previous database backup */
 	FILE	   *fp;
 	char		path[MAXPGPATH];
 	char		label[1024];
 	XLogRecPtr *lsn = NULL;
+	parray	   *pagemap = NULL;		/* pages modified since previous backup */
 	char		prev_file_txt[MAXPGPATH];	/* path of the previous backup list file */
+	char	   *standby_label = NULL;	/* backup_label made in the primary */
+	MetricsTimer	timer;
 
 	if (!HAVE_DATABASE(&current)) {
 		/* check if arclog backup. if arclog backup and no suitable full backup, */
@@ -106,12 +137,31 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 	/* notify start of backup to PostgreSQL server */
 	time2iso(label, lengthof(label), current.start_time);
 	strncat(label, " with pg_rman", lengthof(label));
+	metrics_start(&timer, PHASE_START_BACKUP);
+	if (BACKUP_FROM_STANDBY)
+		confirm_standby();
 	pg_start_backup(label, smooth_checkpoint, &current);
+	if (BACKUP_FROM_STANDBY)
+	{
+		XLogRecPtr	checkpoint;
+
+		/*
+		 * The checkpoint of pg_start_backup() must be replayed and the pages
+		 * flushed by a restartpoint in the standby before copying its files.
+		 */
+		in_standby_backup = true;
+		standby_label = read_backup_label(&checkpoint);
+		wait_for_replay(&checkpoint);
+		reconnect_standby();
+		command("CHECKPOINT", 0, NULL);
+		disconnect();
+	}
+	metrics_stop(&timer, 0, 0);
 
 	/* If backup_label does not exist in $PGDATA, stop taking backup */
 	snprintf(path, lengthof(path), "%s/backup_label", pgdata);
 	make_native_path(path);
-	if (!fileExists(path)) {
+	if (!BACKUP_FROM_STANDBY && !fileExists(path)) {
 		if (verbose)
 			printf(_("backup_label does not exist, stop backup\n"));
 		pg_stop_backup(NULL);
@@ -124,13 +174,15 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 	 * Sort in order of path.
 	 * omit $PGDATA.
 	 */
+	metrics_start(&timer, PHASE_LIST_FILES);
 	files = parray_new();
 	dir_list_file(files, pgdata, NULL, false, false);
+	metrics_stop(&timer, 0, parray_num(files));
 
 	if (!check)
 	{
 		pgBackupGetPath(&current, path, lengthof(path), MKDIRS_SH_FILE);
-		fp = fopen(path, "wt");
+		fp = storage_fopen(path, "wt");
 		if (fp == NULL)
 			elog(ERROR_SYSTEM, _("can't open make directory script \"%s\": %s"),
 				path, strerror(errno));
@@ -168,7 +220,7 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 		{
 			pgBackupGetPath(prev_backup, prev_file_txt, lengthof(prev_file_txt),
 				DATABASE_FILE_LIST);
-			prev_files = dir_read_file_list(pgdata, prev_file_txt);
+			prev_files = manifest_open(prev_file_txt);
 
 			/*
 			 * Do backup only pages having larger LSN than previous backup.
@@ -176,6 +228,10 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 			lsn = &prev_backup->start_lsn;
 			elog(LOG, _("backup only the page that there was of the update from LSN(%X/%08X).\n"),
 				lsn->xlogid, lsn->xrecoff);
+
+			/* find the pages from WAL instead of reading all pages */
+			if (wal_pagemap)
+				pagemap = read_wal_pagemap(lsn);
 		}
 	}
 
@@ -224,7 +280,11 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 		 */
 		parray_qsort(tblspc_list, strCompare);
 		if (parray_bsearch(tblspc_list, "PG-DATA", strCompare) == NULL)
+		{
+			metrics_start(&timer, PHASE_LIST_FILES);
 			add_files(files, pgdata, false, true);
+			metrics_stop(&timer, 0, parray_num(files));
+		}
 		else
 			/* remove the detected tablespace("PG-DATA") from tblspc_list */
 			parray_rm(tblspc_list, "PG-DATA", strCompare);
@@ -270,10 +330,13 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 
 		/* backup files from non-snapshot */
 		pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR);
-		backup_files(pgdata, path, files, prev_files, lsn, current.compress_data, NULL);
+		backup_files(pgdata, path, files, prev_files, lsn, pagemap,
+					 current.compress_data, NULL, PHASE_COPY_DATABASE);
 
 		/* notify end of backup */
 		pg_stop_backup(&current);
+		if (standby_label)
+			finish_standby_backup(files, standby_label);
 
 		/* create file list of non-snapshot objects */
 		create_file_list(files, pgdata, NULL, false);
@@ -308,20 +371,14 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 			if (!dirExists(mp))
 				elog(ERROR_SYSTEM, _("tablespace storage directory doesn't exist: %s"), mp);
 
-			/*
-			 * create the previous backup file list to take incremental backup
-			 * from the snapshot volume.
-			 */
-			if (prev_files != NULL)
-				prev_files = dir_read_file_list(mp, prev_file_txt);
-
 			/* when DB cluster is backup from snapshot, it backup from the snapshot */
 			if (strcmp(spcname, "PG-DATA") == 0)
 			{
 				/* append DB cluster to backup file list */
 				add_files(snapshot_files, mp, false, true);
 				/* backup files of DB cluster from snapshot volume */
-				backup_files(mp, path, snapshot_files, prev_files, lsn, current.compress_data, NULL);
+				backup_files(mp, path, snapshot_files, prev_files, lsn, pagemap,
+							 current.compress_data, NULL, PHASE_COPY_DATABASE);
 				/* create file list of snapshot objects (DB cluster) */
 				create_file_list(snapshot_files, mp, NULL, true);
 				/* remove the detected tablespace("PG-DATA") from tblspcmp_list */
@@ -352,7 +409,9 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 						/* backup files of TABLESPACE from snapshot volume */
 						join_path_components(prefix, PG_TBLSPC_DIR, oid);
 						join_path_components(dest, path, prefix);
-						backup_files(mp, dest, snapshot_files, prev_files, lsn, current.compress_data, prefix);
+						backup_files(mp, dest, snapshot_files, prev_files, lsn,
+									 pagemap, current.compress_data, prefix,
+									 PHASE_COPY_DATABASE);
 
 						/* create file list of snapshot objects (TABLESPACE) */
 						create_file_list(snapshot_files, mp, prefix, true);
@@ -364,6 +423,7 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 				}
 			}
 			parray_concat(files, snapshot_files);
+			parray_free(snapshot_files);
 		}
 
 		/*
@@ -398,18 +458,30 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 	else
 	{
 		/* list files with the logical path. omit $PGDATA */
+		metrics_start(&timer, PHASE_LIST_FILES);
 		add_files(files, pgdata, false, true);
+		metrics_stop(&timer, 0, parray_num(files));
 
 		/* backup files */
 		pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR);
-		backup_files(pgdata, path, files, prev_files, lsn, current.compress_data, NULL);
+		backup_files(pgdata, path, files, prev_files, lsn, pagemap,
+					 current.compress_data, NULL, PHASE_COPY_DATABASE);
 
 		/* notify end of backup */
 		pg_stop_backup(&current);
+		if (standby_label)
+			finish_standby_backup(files, standby_label);
 
 		/* create file list */
 		create_file_list(files, pgdata, NULL, false);
 	}
+
+	/* the binary manifest is made from the completed file list */
+	if (!check)
+	{
+		pgBackupGetPath(&current, path, lengthof(path), DATABASE_FILE_LIST);
+		manifest_write(path);
+	}
 	
 	/* print summary of size of backup mode files */
 	for (i = 0; i < parray_num(files); i++)
@@ -423,6 +495,10 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 			current.write_bytes += file->write_size;
 	}
 
+	/* data files hold only hashes of chunks newly put into the dedup store */
+	if (current.dedup)
+		current.write_bytes += dedup_stored_bytes();
+
 	if (verbose)
 	{
 		printf(_("database backup completed(read: " INT64_FORMAT " write: " INT64_FORMAT ")\n"),
@@ -430,6 +506,10 @@ do_backup_database(parray *backup_list, bool smooth_checkpoint)
 		printf(_("========================================\n"));
 	}
 
+	xlog_free_pagemap(pagemap);
+	manifest_free(prev_files);
+	free(standby_label);
+
 	return files;
 }
 
@@ -440,8 +520,9 @@ static parray *
 do_backup_arclog(parray *backup_list)
 {
 	int			i;
+	int			j;
 	parray	   *files;
-	parray	   *prev_files = NULL;	/* file list of previous database backup */
+	Manifest   *prev_files = NULL;	/* file list of previous database backup */
 	FILE	   *fp;
 	char		path[MAXPGPATH];
 	char		timeline_dir[MAXPGPATH];
@@ -449,6 +530,7 @@ do_backup_arclog(parray *backup_list)
 	pgBackup   *prev_backup;
 	int64		arclog_write_bytes = 0;
 	char		last_wal[MAXPGPATH];
+	MetricsTimer	timer;
 
 	if (!HAVE_ARCLOG(&current))
 		return NULL;
@@ -478,16 +560,21 @@ do_backup_arclog(parray *backup_list)
 	{
 		pgBackupGetPath(prev_backup, prev_file_txt, lengthof(prev_file_txt),
 			ARCLOG_FILE_LIST);
-		prev_files = dir_read_file_list(arclog_path, prev_file_txt);
+		prev_files = manifest_open(prev_file_txt);
 	}
 
 	/* list files with the logical path. omit ARCLOG_PATH */
+	metrics_start(&timer, PHASE_LIST_FILES);
 	files = parray_new();
 	dir_list_file(files, arclog_path, NULL, true, false);
+	metrics_stop(&timer, 0, parray_num(files));
 
-	/* remove WALs archived after pg_stop_backup()/pg_switch_xlog() */
+	/*
+	 * Remove WALs archived after pg_stop_backup()/pg_switch_xlog(). The list
+	 * is compacted in one pass, as the archive can have many segments.
+	 */
 	xlog_fname(last_wal, lengthof(last_wal), current.tli, &current.stop_lsn);
-	for (i = 0; i < parray_num(files); i++)
+	for (i = 0, j = 0; i < parray_num(files); i++)
 	{
 		pgFile *file = (pgFile *) parray_get(files, i);
 		char *fname;
@@ -498,26 +585,28 @@ do_backup_arclog(parray *backup_list)
 
 		/* to backup backup history files, compare tli/lsn portion only */
 		if (strncmp(fname, last_wal, 24) > 0)
-		{
-			parray_remove(files, i);
-			i--;
-		}
+			pgFileFree(file);
+		else
+			parray_set(files, j++, file);
 	}
+	parray_shrink(files, j);
 
 	pgBackupGetPath(&current, path, lengthof(path), ARCLOG_DIR);
-	backup_files(arclog_path, path, files, prev_files, NULL,
-				 current.compress_data, NULL);
+	backup_files(arclog_path, path, files, prev_files, NULL, NULL,
+				 current.compress_data, NULL, PHASE_COPY_ARCLOG);
+	manifest_free(prev_files);
 
 	/* create file list */
 	if (!check)
 	{
 		pgBackupGetPath(&current, path, lengthof(path), ARCLOG_FILE_LIST);
-		fp = fopen(path, "wt");
+		fp = storage_fopen(path, "wt");
 		if (fp == NULL)
 			elog(ERROR_SYSTEM, _("can't open file list \"%s\": %s"), path,
 				strerror(errno));
 		dir_print_file_list(fp, files, arclog_path, NULL);
 		fclose(fp);
+		manifest_write(path);
 	}
 
 	/* print summary of size of backup files */
@@ -549,7 +638,8 @@ do_backup_arclog(parray *backup_list)
 				file->path + strlen(file->path) - strlen(".history"))
 		{
 			elog(LOG, _("(timeline history) %s"), file->path);
-			copy_file(arclog_path, timeline_dir, file, NO_COMPRESSION);
+			copy_file(arclog_path, timeline_dir, file, NO_COMPRESSION,
+				current.compress_method);
 		}
 	}
 
@@ -571,12 +661,13 @@ do_backup_srvlog(parray *backup_list)
 {
 	int			i;
 	parray	   *files;
-	parray	   *prev_files = NULL;	/* file list of previous database backup */
+	Manifest   *prev_files = NULL;	/* file list of previous database backup */
 	FILE	   *fp;
 	char		path[MAXPGPATH];
 	char		prev_file_txt[MAXPGPATH];
 	pgBackup   *prev_backup;
 	int64		srvlog_write_bytes = 0;
+	MetricsTimer	timer;
 
 	if (!current.with_serverlog)
 		return NULL;
@@ -602,26 +693,31 @@ do_backup_srvlog(parray *backup_list)
 	{
 		pgBackupGetPath(prev_backup, prev_file_txt, lengthof(prev_file_txt),
 			SRVLOG_FILE_LIST);
-		prev_files = dir_read_file_list(srvlog_path, prev_file_txt);
+		prev_files = manifest_open(prev_file_txt);
 	}
 
 	/* list files with the logical path. omit SRVLOG_PATH */
+	metrics_start(&timer, PHASE_LIST_FILES);
 	files = parray_new();
 	dir_list_file(files, srvlog_path, NULL, true, false);
+	metrics_stop(&timer, 0, parray_num(files));
 
 	pgBackupGetPath(&current, path, lengthof(path), SRVLOG_DIR);
-	backup_files(srvlog_path, path, files, prev_files, NULL, false, NULL);
+	backup_files(srvlog_path, path, files, prev_files, NULL, NULL, false, NULL,
+				 PHASE_COPY_SRVLOG);
+	manifest_free(prev_files);
 
 	/* create file list */
 	if (!check)
 	{
 		pgBackupGetPath(&current, path, lengthof(path), SRVLOG_FILE_LIST);
-		fp = fopen(path, "wt");
+		fp = storage_fopen(path, "wt");
 		if (fp == NULL)
 			elog(ERROR_SYSTEM, _("can't open file list \"%s\": %s"), path,
 				strerror(errno));
 		dir_print_file_list(fp, files, srvlog_path, NULL);
 		fclose(fp);
+		manifest_write(path);
 	}
 
 	/* print summary of size of backup mode files */
@@ -655,12 +751,14 @@ do_backup(bool smooth_checkpoint,
 		  int keep_srvlog_files,
 		  int keep_srvlog_days,
 		  int keep_data_generations,
-		  int keep_data_days)
+		  int keep_data_days,
+		  const char *stream)
 {
 	parray *backup_list;
 	parray *files_database;
 	parray *files_arclog;
 	parray *files_srvlog;
+	parray *old_files;
 	int		server_version;
 	int		ret;
 
@@ -679,17 +777,30 @@ do_backup(bool smooth_checkpoint,
 	if (current.with_serverlog && srvlog_path == NULL)
 		elog(ERROR_ARGS, _("required parameter not specified: SRVLOG_PATH (-S, --srvlog-path)"));
 
-#ifndef HAVE_LIBZ
-	if (current->compress_data)
+	if (current.compress_data &&
+		!compress_method_supported(current.compress_method))
 	{
 		elog(WARNING, _("requested compression not available in this: installation -- archive will be uncompressed"));
-		current->compress_data = false;
+		current.compress_data = false;
+	}
+
+	/* the dedup store is not in the stream */
+	if (current.dedup && stream)
+	{
+		elog(WARNING, _("--dedup can't be used with --stream -- data files will not be deduplicated"));
+		current.dedup = false;
 	}
-#endif
 
 	/* confirm data block size and xlog block size are compatible */
 	server_version = get_server_version();
 
+	/* open the stream before any messages for stdout */
+	if (stream && !check)
+	{
+		current.stream = true;
+		stream_open_writer(stream);
+	}
+
 	/* setup cleanup callback function */
 	in_backup = true;
 
@@ -736,6 +847,8 @@ current.recovery_time = (time_t) 0;
 		if (pgBackupCreateDir(&current))
 			elog(ERROR_SYSTEM, _("can't create backup directory."));
 		pgBackupWriteIni(&current);
+		if (current.stream)
+			stream_begin_backup(&current);
 	}
 	if (verbose)
 		printf(_("backup destination is initialized.\n"));
@@ -752,6 +865,10 @@ current.recovery_time = (time_t) 0;
 	/* backup data */
 	files_database = do_backup_database(backup_list, smooth_checkpoint);
 
+	/* chunks must be listed before the backup can be used */
+	if (current.dedup && !check)
+		dedup_write_refs(&current);
+
 	/* backup archived WAL */
 	files_arclog = do_backup_arclog(backup_list);
 
@@ -763,7 +880,18 @@ current.recovery_time = (time_t) 0;
 	current.end_time = time(NULL);
 	current.status = BACKUP_STATUS_DONE;
 	if (!check)
+	{
 		pgBackupWriteIni(&current);
+		metrics_write(&current, "backup");
+	}
+
+	/* the stream ends with the final backup.ini and file lists */
+	if (current.stream && !stream_close_writer())
+	{
+		current.status = BACKUP_STATUS_ERROR;
+		pgBackupWriteIni(&current);
+		elog(ERROR_SYSTEM, _("can't finish backup stream"));
+	}
 
 	if (verbose)
 	{
@@ -778,13 +906,15 @@ current.recovery_time = (time_t) 0;
 
 	/*
 	 * Delete old files (archived WAL and serverlog) after update of status.
+	 * They are removed after the catalog lock is released.
 	 */
+	old_files = parray_new();
 	if (HAVE_ARCLOG(&current))
 		delete_old_files(arclog_path, files_arclog, keep_arclog_files,
-			keep_arclog_days, server_version, true);
+			keep_arclog_days, server_version, true, old_files);
 	if (current.with_serverlog)
 		delete_old_files(srvlog_path, files_srvlog, keep_srvlog_files,
-			keep_srvlog_days, server_version, false);
+			keep_srvlog_days, server_version, false, old_files);
 
 	/* Delete old backup files after all backup operation. */
 	pgBackupDelete(keep_data_generations, keep_data_days);
@@ -812,24 +942,36 @@ current.recovery_time = (time_t) 0;
 		delete_arclog_link();
 	}
 
+	/* stop the workers of compression */
+	chunk_queue_free();
+
 	/* release catalog lock */
 	catalog_unlock();
 
+	/* remove old files and deleted backups without blocking other commands */
+	remove_files(old_files);
+	parray_walk(old_files, pgFileFree);
+	parray_free(old_files);
+	trash_purge();
+
 	return 0;
 }
 
+/* cached by get_server_version(), or set by set_server_version() */
+static int	cached_server_version = 0;
+
 /*
  * get server version and confirm block sizes.
  */
 int
 get_server_version(void)
 {
-	static int	server_version = 0;
+	int			server_version;
 	bool		my_conn;
 
 	/* return cached server version */
-	if (server_version > 0)
-		return server_version;
+	if (cached_server_version > 0)
+		return cached_server_version;
 
 	my_conn = (connection == NULL);
 
@@ -853,9 +995,20 @@ get_server_version(void)
 	if (my_conn)
 		disconnect();
 
+	cached_server_version = server_version;
 	return server_version;
 }
 
+/*
+ * Use the version of a backed-up server without connecting to the server,
+ * for commands which process only the backup catalog.
+ */
+void
+set_server_version(int version)
+{
+	cached_server_version = version;
+}
+
 static void
 confirm_block_size(const char *name, int blcksz)
 {
@@ -875,6 +1028,40 @@ confirm_block_size(const char *name, int blcksz)
 			name, block_size, blcksz);
 }
 
+/*
+ * Find the pages modified from lsn to the start of the current backup in
+ * WAL. Returns NULL if WAL can't be used, and then all pages are read.
+ */
+static parray *
+read_wal_pagemap(const XLogRecPtr *lsn)
+{
+	PGresult   *res;
+	bool		full_page_writes;
+	parray	   *pagemap;
+
+	/* every first change of a page after checkpoint must be logged whole */
+	reconnect();
+	res = execute("SELECT current_setting('full_page_writes')", 0, NULL);
+	full_page_writes = (PQntuples(res) == 1 &&
+						strcmp(PQgetvalue(res, 0, 0), "on") == 0);
+	PQclear(res);
+	disconnect();
+	if (!full_page_writes)
+	{
+		elog(INFO, _("full_page_writes is off, read all pages of data files"));
+		return NULL;
+	}
+
+	pagemap = xlog_read_pagemap(current.tli, *lsn, current.start_lsn,
+								get_server_version());
+	if (pagemap == NULL)
+		elog(INFO, _("can't read WAL from %X/%08X to %X/%08X, read all pages of data files"),
+			lsn->xlogid, lsn->xrecoff,
+			current.start_lsn.xlogid, current.start_lsn.xrecoff);
+
+	return pagemap;
+}
+
 /*
  * Notify start of backup to PostgreSQL server.
  */
@@ -912,9 +1099,11 @@ static void
 wait_for_archive(pgBackup *backup, const char *sql)
 {
 	PGresult	   *res;
-	char			ready_path[MAXPGPATH];
+	char			wait_path[MAXPGPATH];
 	int				try_count;
+	MetricsTimer	timer;
 
+	metrics_start(&timer, PHASE_STOP_BACKUP);
 	reconnect();
 	res = execute(sql, 0, NULL);
 	if (backup != NULL)
@@ -924,10 +1113,19 @@ wait_for_archive(pgBackup *backup, const char *sql)
 			backup->stop_lsn.xlogid, backup->stop_lsn.xrecoff);
 	}
 
-	/* get filename from the result of pg_xlogfile_name_offset() */
-	snprintf(ready_path, lengthof(ready_path),
-		"%s/pg_xlog/archive_status/%s.ready", pgdata, PQgetvalue(res, 0, 0));
-	elog(LOG, "%s() wait for %s", __FUNCTION__, ready_path);
+	/*
+	 * get filename from the result of pg_xlogfile_name_offset(). Archive
+	 * status of the primary isn't visible from the standby, so the segment is
+	 * waited for in the archive instead.
+	 */
+	if (BACKUP_FROM_STANDBY && arclog_path)
+		join_path_components(wait_path, arclog_path, PQgetvalue(res, 0, 0));
+	else if (BACKUP_FROM_STANDBY)
+		wait_path[0] = '\0';
+	else
+		snprintf(wait_path, lengthof(wait_path),
+			"%s/pg_xlog/archive_status/%s.ready", pgdata, PQgetvalue(res, 0, 0));
+	elog(LOG, "%s() wait for %s", __FUNCTION__, wait_path);
 
 	PQclear(res);
 
@@ -937,10 +1135,13 @@ wait_for_archive(pgBackup *backup, const char *sql)
 		backup->recovery_time = time(NULL);
 	}
 	disconnect();
+	metrics_stop(&timer, 0, 0);
 
 	/* wait until switched WAL is archived */
+	metrics_start(&timer, PHASE_WAIT_ARCHIVE);
 	try_count = 0;
-	while (fileExists(ready_path))
+	while (wait_path[0] != '\0' &&
+		   (BACKUP_FROM_STANDBY ? !fileExists(wait_path) : fileExists(wait_path)))
 	{
 		sleep(1);
 		if (interrupted)
@@ -952,7 +1153,8 @@ wait_for_archive(pgBackup *backup, const char *sql)
 				_("switched WAL could not be archived in %d seconds"),
 				TIMEOUT_ARCHIVE);
 	}
-	elog(LOG, "%s() .ready deleted in %d try", __FUNCTION__, try_count);
+	metrics_stop(&timer, 0, 0);
+	elog(LOG, "%s() archived in %d try", __FUNCTION__, try_count);
 }
 
 /*
@@ -961,6 +1163,7 @@ wait_for_archive(pgBackup *backup, const char *sql)
 static void
 pg_stop_backup(pgBackup *backup)
 {
+	in_standby_backup = false;
 	wait_for_archive(backup,
 		"SELECT * FROM pg_xlogfile_name_offset(pg_stop_backup())");
 }
@@ -975,6 +1178,159 @@ pg_switch_xlog(pgBackup *backup)
 		"SELECT * FROM pg_xlogfile_name_offset(pg_switch_xlog())");
 }
 
+/*
+ * Connect to the standby given by --standby-host and --standby-port instead
+ * of the primary.
+ */
+static void
+reconnect_standby(void)
+{
+	const char *primary_host = host;
+	const char *primary_port = port;
+
+	host = standby_host ? standby_host : host;
+	port = standby_port ? standby_port : port;
+	reconnect();
+	host = primary_host;
+	port = primary_port;
+}
+
+/* confirm the standby is in recovery, which needs hot standby */
+static void
+confirm_standby(void)
+{
+	PGresult   *res;
+
+	reconnect_standby();
+	if (PQserverVersion(connection) < 90000)
+		elog(ERROR_PG_INCOMPATIBLE,
+			_("backup from standby requires PostgreSQL 9.0 or later"));
+	res = execute("SELECT pg_is_in_recovery()", 0, NULL);
+	if (PQntuples(res) != 1 || strcmp(PQgetvalue(res, 0, 0), "t") != 0)
+		elog(ERROR_ARGS, _("server of --standby-host and --standby-port is not a standby"));
+	PQclear(res);
+	disconnect();
+}
+
+/*
+ * Read backup_label made by pg_start_backup() in PGDATA of the primary, and
+ * the location of the checkpoint in it.
+ */
+static char *
+read_backup_label(XLogRecPtr *checkpoint)
+{
+	PGresult   *res;
+	char	   *label;
+	char	   *line;
+
+	reconnect();
+	res = execute("SELECT pg_read_file('backup_label', 0, 8192)", 0, NULL);
+	if (PQntuples(res) != 1)
+		elog(ERROR_PG_COMMAND, _("can't read backup_label of the primary: %s"),
+			PQerrorMessage(connection));
+	label = pgut_strdup(PQgetvalue(res, 0, 0));
+	PQclear(res);
+	disconnect();
+
+	line = strstr(label, "CHECKPOINT LOCATION: ");
+	if (line == NULL ||
+		sscanf(line, "CHECKPOINT LOCATION: %X/%X",
+			   &checkpoint->xlogid, &checkpoint->xrecoff) != 2)
+		elog(ERROR_PG_COMMAND, _("backup_label of the primary is invalid"));
+
+	return label;
+}
+
+/* wait until the standby replays WAL beyond lsn */
+static void
+wait_for_replay(const XLogRecPtr *lsn)
+{
+	int		try_count;
+
+	reconnect_standby();
+	for (try_count = 0;; try_count++)
+	{
+		PGresult   *res;
+		XLogRecPtr	replayed;
+
+		res = execute("SELECT pg_last_xlog_replay_location()", 0, NULL);
+		if (PQntuples(res) != 1 ||
+			sscanf(PQgetvalue(res, 0, 0), "%X/%X",
+				   &replayed.xlogid, &replayed.xrecoff) != 2)
+			elog(ERROR_PG_COMMAND,
+				_("result of pg_last_xlog_replay_location() is invalid: %s"),
+				PQerrorMessage(connection));
+		PQclear(res);
+		if (XLByteLT(*lsn, replayed))
+			break;
+
+		if (try_count >= TIMEOUT_REPLAY)
+			elog(ERROR_PG_COMMAND,
+				_("standby could not replay WAL to %X/%08X in %d seconds"),
+				lsn->xlogid, lsn->xrecoff, TIMEOUT_REPLAY);
+		sleep(1);
+		if (interrupted)
+			elog(ERROR_INTERRUPTED,
+				_("interrupted during waiting for WAL replay"));
+	}
+	disconnect();
+	elog(LOG, "%s() replayed %X/%08X in %d try", __FUNCTION__,
+		lsn->xlogid, lsn->xrecoff, try_count);
+}
+
+/*
+ * Wait for the standby to replay WAL to the end of backup, and add
+ * backup_label of the primary into the backup, which is not in PGDATA of
+ * the standby.
+ */
+static void
+finish_standby_backup(parray *files, const char *label)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char	tmp_root[MAXPGPATH];
+	char	tmp_path[MAXPGPATH];
+	char	path[MAXPGPATH];
+	FILE   *fp;
+	pgFile *tmp;
+	pgFile *file;
+
+	wait_for_replay(&current.stop_lsn);
+
+	/*
+	 * Copy the label through a local temporary file to compress it as
+	 * others, and to write it into object storage or the stream. The file is
+	 * in a temporary directory to be copied with the name backup_label.
+	 */
+	snprintf(tmp_root, lengthof(tmp_root), "%s/pg_rman_XXXXXX",
+			 tmpdir && tmpdir[0] ? tmpdir : "/tmp");
+	if (mkdtemp(tmp_root) == NULL)
+		elog(ERROR_SYSTEM, _("can't create temporary directory \"%s\": %s"),
+			tmp_root, strerror(errno));
+	join_path_components(tmp_path, tmp_root, "backup_label");
+	if ((fp = fopen(tmp_path, "w")) == NULL ||
+		fputs(label, fp) == EOF || fclose(fp) != 0)
+		elog(ERROR_SYSTEM, _("can't write \"%s\": %s"), tmp_path,
+			strerror(errno));
+
+	tmp = storage_file_new(tmp_path, S_IFREG | FILE_PERMISSION, strlen(label),
+						   time(NULL));
+	pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR);
+	copy_file(tmp_root, path, tmp, current.compress_data ? COMPRESSION :
+			  NO_COMPRESSION, current.compress_method);
+	unlink(tmp_path);
+	rmdir(tmp_root);
+
+	join_path_components(path, pgdata, "backup_label");
+	file = storage_file_new(path, tmp->mode, tmp->size, tmp->mtime);
+	file->read_size = tmp->read_size;
+	file->write_size = tmp->write_size;
+	file->crc = tmp->crc;
+	pgFileFree(tmp);
+
+	parray_append(files, file);
+	parray_qsort(files, pgFileComparePath);
+}
+
 /*
  * Get TimeLineID and LSN from result of pg_xlogfile_name_offset().
  */
@@ -1068,10 +1424,13 @@ backup_cleanup(bool fatal, void *userdata)
 	if (!in_backup)
 		return;
 
-	/* If backup_label exist in $PGDATA, notify stop of backup to PostgreSQL */
+	/*
+	 * If backup_label exist in $PGDATA, notify stop of backup to PostgreSQL.
+	 * It is in the primary for a backup from standby.
+	 */
 	snprintf(path, lengthof(path), "%s/backup_label", pgdata);
 	make_native_path(path);
-	if (fileExists(path))
+	if (BACKUP_FROM_STANDBY ? in_standby_backup : fileExists(path))
 	{
 		if (verbose)
 			printf(_("backup_label exists, stop backup\n"));
@@ -1092,29 +1451,111 @@ backup_cleanup(bool fatal, void *userdata)
 	}
 }
 
+/*
+ * Backup a regular file. This is called in a worker thread when the backup
+ * runs with multiple jobs, so the progress message is printed at once after
+ * the file is copied.
+ */
+static void
+backup_file(BackupJob *job)
+{
+	pgFile		   *file = job->file;
+	struct timeval	tv;
+	bool			copied;
+
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during backup"));
+
+	/*
+	 * We will wait until the next second of mtime so that backup
+	 * file should contain all modifications at the clock of mtime.
+	 * timer resolution of ext3 file system is one second.
+	 * Files with mtime in the future are not waited for.
+	 */
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec == file->mtime)
+		usleep(1000000 - tv.tv_usec);
+
+	/* copy the file into backup */
+	copied = file->is_datafile
+		? backup_data_file(job->from_root, job->to_root, file, job->lsn,
+						   job->pagemap, job->compress,
+						   current.compress_method)
+		: job->is_arclog
+		? copy_wal_file(job->from_root, job->to_root, file,
+						job->compress ? COMPRESSION : NO_COMPRESSION,
+						current.compress_method, get_server_version())
+		: copy_file(job->from_root, job->to_root, file,
+					job->compress ? COMPRESSION : NO_COMPRESSION,
+					current.compress_method);
+
+	if (job->pagemap)
+	{
+		datapagemap_clear(job->pagemap);
+		free(job->pagemap);
+	}
+
+	if (!copied)
+	{
+		/* record as skipped file in file_xxx.txt */
+		file->write_size = BYTES_INVALID;
+		if (verbose)
+			printf(_("%sskip\n"), job->progress);
+		return;
+	}
+
+	if (verbose)
+	{
+		/* print compression rate */
+		if (file->write_size != file->size)
+			printf(_("%scompressed %lu (%.2f%% of %lu)\n"), job->progress,
+				(unsigned long) file->write_size,
+				100.0 * file->write_size / file->size,
+				(unsigned long) file->size);
+		else
+			printf(_("%scopied %lu\n"), job->progress,
+				(unsigned long) file->write_size);
+	}
+}
+
 /* take incremental backup. */
 static void
 backup_files(const char *from_root,
 			 const char *to_root,
 			 parray *files,
-			 parray *prev_files,
+			 Manifest *prev_files,
 			 const XLogRecPtr *lsn,
+			 parray *pagemap,
 			 bool compress,
-			 const char *prefix)
+			 const char *prefix,
+			 MetricsPhase phase)
 {
 	int				i;
 	struct timeval	tv;
+	JobQueue	   *queue = NULL;
+	MetricsTimer	timer;
+	int64			read_bytes = 0;
+	int64			copied = 0;
+
+	metrics_start(&timer, phase);
 
 	/* sort pathname ascending */
 	parray_qsort(files, pgFileComparePath);
 
 	gettimeofday(&tv, NULL);
 
+	/*
+	 * Copy files in parallel if requested. Check mode shares one temporary
+	 * file, so it always works in serial.
+	 */
+	if (num_threads > 1 && !check)
+		queue = JobQueue_new(num_threads);
+
 	/* backup a file or create a directory */
 	for (i = 0; i < parray_num(files); i++)
 	{
-		int			ret;
-		struct stat	buf;
+		BackupJob	job;
 
 		pgFile *file = (pgFile *) parray_get(files, i);
 
@@ -1127,155 +1568,132 @@ backup_files(const char *from_root,
 		if (interrupted)
 			elog(ERROR_INTERRUPTED, _("interrupted during backup"));
 
-		/* print progress in verbose mode */
+		/* prepare progress message in verbose mode */
+		job.progress[0] = '\0';
 		if (verbose)
 		{
 			if (prefix)
 			{
 				char path[MAXPGPATH];
 				join_path_components(path, prefix, file->path + strlen(from_root) + 1);
-				printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files), path);
+				snprintf(job.progress, lengthof(job.progress), _("(%d/%lu) %s "),
+					i + 1, (unsigned long) parray_num(files), path);
 			}
 			else
-				printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files),
+				snprintf(job.progress, lengthof(job.progress), _("(%d/%lu) %s "),
+					i + 1, (unsigned long) parray_num(files),
 					file->path + strlen(from_root) + 1);
 		}
 
-		/* stat file to get file type, size and modify timestamp */
-		ret = stat(file->path, &buf);
-		if (ret == -1)
-		{
-			if (errno == ENOENT)
-			{
-				/* record as skipped file in file_xxx.txt */
-				file->write_size = BYTES_INVALID;
-				if (verbose)
-					printf(_("skip\n"));
-				continue;
-			}
-			else
-			{
-				if (verbose)
-					printf("\n");
-				elog(ERROR_SYSTEM,
-					_("can't stat backup mode. \"%s\": %s"),
-					file->path, strerror(errno));
-			}
-		}
-
-		/* if the entry was a directory, create it in the backup */
-		if (S_ISDIR(buf.st_mode))
+		/*
+		 * File type, size and modify timestamp are of the stat when listed.
+		 * A file removed after that is skipped when it is opened to copy.
+		 */
+		if (S_ISDIR(file->mode))
 		{
 			char dirpath[MAXPGPATH];
 
 			join_path_components(dirpath, to_root, JoinPathEnd(file->path, from_root));
 			if (!check){
-				dir_create_dir(dirpath, DIR_PERMISSION);
+				stream_mkdir(dirpath, DIR_PERMISSION);
 			}
 			if (verbose)
-				printf(_("directory\n"));
+				printf(_("%sdirectory\n"), job.progress);
 		}
-		else if (S_ISREG(buf.st_mode))
+		else if (S_ISREG(file->mode))
 		{
+			char	path[MAXPGPATH];
+
+			/*
+			 * If prefix is not NULL, the table space is backup from the snapshot.
+			 * Therefore, adjust file name to correspond to the file list.
+			 */
+			if (prefix)
+				join_path_components(path, prefix,
+									 file->path + strlen(from_root) + 1);
+			else
+				strlcpy(path, file->path + strlen(from_root) + 1,
+						lengthof(path));
+
 			/* skip files which have not been modified since last backup */
 			if (prev_files)
 			{
-				pgFile *prev_file = NULL;
-
-				/*
-				 * If prefix is not NULL, the table space is backup from the snapshot.
-				 * Therefore, adjust file name to correspond to the file list.
-				 */
-				if (prefix)
-				{
-					int j;
-
-					for (j = 0; j < parray_num(prev_files); j++)
-					{
-						pgFile *p = (pgFile *) parray_get(prev_files, j);
-						char *prev_path;
-						char curr_path[MAXPGPATH];
-
-						prev_path = p->path + strlen(from_root) + 1;
-						join_path_components(curr_path, prefix, file->path + strlen(from_root) + 1);
-						if (strcmp(curr_path, prev_path) == 0)
-						{
-							prev_file = p;
-							break;
-						}
-					}
-				}
-				else
-				{
-					pgFile **p = (pgFile **) parray_bsearch(prev_files, file, pgFileComparePath);
-					if (p)
-						prev_file = *p;
-				}
+				pgFile	prev_file;
 
-				if (prev_file && prev_file->mtime == file->mtime)
+				if (manifest_find(prev_files, path, &prev_file) &&
+					prev_file.mtime == file->mtime)
 				{
 					/* record as skipped file in file_xxx.txt */
 					file->write_size = BYTES_INVALID;
 					if (verbose)
-						printf(_("skip\n"));
+						printf(_("%sskip\n"), job.progress);
 					continue;
 				}
 			}
 
-			/*
-			 * We will wait until the next second of mtime so that backup
-			 * file should contain all modifications at the clock of mtime.
-			 * timer resolution of ext3 file system is one second.
-			 */
-
-			if (tv.tv_sec == file->mtime)
+			job.routine = backup_file;
+			job.from_root = from_root;
+			job.to_root = to_root;
+			job.file = file;
+			job.lsn = lsn;
+			job.pagemap = NULL;
+			job.compress = compress;
+			job.is_arclog = (phase == PHASE_COPY_ARCLOG);
+
+			/* read only the pages modified in WAL */
+			if (pagemap && file->is_datafile)
 			{
-				/* update time and recheck */
-				gettimeofday(&tv, NULL);
-				while (tv.tv_sec <= file->mtime)
+				job.pagemap = pgut_new(datapagemap_t);
+				job.pagemap->bitmap = NULL;
+				job.pagemap->bitmapsize = 0;
+				if (!xlog_get_file_pagemap(pagemap, path, job.pagemap))
 				{
-					usleep(1000000 - tv.tv_usec);
-					gettimeofday(&tv, NULL);
+					free(job.pagemap);
+					job.pagemap = NULL;
 				}
 			}
 
-			/* copy the file into backup */
-			if (!(file->is_datafile
-					? backup_data_file(from_root, to_root, file, lsn, compress)
-					: copy_file(from_root, to_root, file,
-								compress ? COMPRESSION : NO_COMPRESSION)))
+			if (queue)
 			{
-				/* record as skipped file in file_xxx.txt */
-				file->write_size = BYTES_INVALID;
-				if (verbose)
-					printf(_("skip\n"));
-				continue;
-			}
+				BackupJob  *qjob = pgut_new(BackupJob);
 
-			if (verbose)
-			{
-				/* print compression rate */
-				if (file->write_size != file->size)
-					printf(_("compressed %lu (%.2f%% of %lu)\n"),
-						(unsigned long) file->write_size,
-						100.0 * file->write_size / file->size,
-						(unsigned long) file->size);
-				else
-					printf(_("copied %lu\n"), (unsigned long) file->write_size);
+				memcpy(qjob, &job, sizeof(BackupJob));
+				JobQueue_push(queue, (Job *) qjob);
 			}
-
+			else
+				backup_file(&job);
 		}
 		else
 		{
 			if (verbose)
-				printf(_(" unexpected file type %d\n"), buf.st_mode);
+				printf(_("%s unexpected file type %d\n"), job.progress, file->mode);
 		}
 	}
+
+	/* wait for all files copied by the workers */
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
+	}
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+
+		if (S_ISREG(file->mode) && file->write_size != BYTES_INVALID)
+		{
+			read_bytes += file->read_size;
+			copied++;
+		}
+	}
+	metrics_stop(&timer, read_bytes, copied);
 }
 
 /*
  * Delete files modified before than KEEP_xxx_DAYS or more than KEEP_xxx_FILES
- * of newer files exist.
+ * of newer files exist. The files are copied into old_files to be removed
+ * later, since ones in the list are freed with the list.
  */
 static void
 delete_old_files(const char *root,
@@ -1283,7 +1701,8 @@ delete_old_files(const char *root,
 				 int keep_files,
 				 int keep_days,
 				 int server_version,
-				 bool is_arclog)
+				 bool is_arclog,
+				 parray *old_files)
 {
 	int		i;
 	int		j;
@@ -1366,12 +1785,14 @@ delete_old_files(const char *root,
 					printf(_("delete \"%s\"\n"),
 						file2->path + strlen(root) + 1);
 				if (!check)
-					pgFileDelete(file2);
+					parray_append(old_files, storage_file_new(file2->path,
+						file2->mode, file2->size, file2->mtime));
 				pgFileFree(file2);
 			}
 		}
 		if (!check)
-			pgFileDelete(file);
+			parray_append(old_files, storage_file_new(file->path,
+				file->mode, file->size, file->mtime));
 		pgFileFree(file);
 	}
 }
@@ -1687,6 +2108,7 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 		file->is_datafile = true;
 	}
 	parray_concat(files, list_file);
+	parray_free(list_file);
 }
 
 /*
@@ -1711,7 +2133,7 @@ create_file_list(parray *files, const char *root, const char *prefix, bool is_ap
 	{
 		/* output path is '$BACKUP_PATH/file_database.txt' */
 		pgBackupGetPath(&current, path, lengthof(path), DATABASE_FILE_LIST);
-		fp = fopen(path, is_append ? "at" : "wt");
+		fp = storage_fopen(path, is_append ? "at" : "wt");
 		if (fp == NULL)
 			elog(ERROR_SYSTEM, _("can't open file list \"%s\": %s"), path,
 				strerror(errno));
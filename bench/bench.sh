@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Time backup, validate and restore of a synthetic database with
+# "make bench". Each step prints a line of time, MB/s of BENCH_SIZE and the
+# peak RSS of pg_rman; the server must be in PATH as for backup_restore.
+#
+
+BASE_PATH=`pwd`
+BENCH=$BASE_PATH/bench/rman_bench
+export PGDATA=$BASE_PATH/results/bench/data
+export BACKUP_PATH=$BASE_PATH/results/bench/backup
+export ARCLOG_PATH=$BASE_PATH/results/bench/arclog
+export SRVLOG_PATH=$PGDATA/pg_log
+LOG_PATH=$BASE_PATH/results/bench/log
+
+# Port used for benchmark database cluster
+BENCH_PGPORT=54322
+
+# configuration
+BENCH_SIZE=${BENCH_SIZE:-256}
+BENCH_FILES=${BENCH_FILES:-64}
+BENCH_HOLE=${BENCH_HOLE:-0.3}
+BENCH_CHANGE=${BENCH_CHANGE:-0.1}
+BENCH_JOBS=${BENCH_JOBS:-1}
+
+# the generated relations in a database the server doesn't know
+BENCH_DB=$PGDATA/base/99999
+
+# delete old database cluster
+pg_ctl stop -m immediate > /dev/null 2>&1
+rm -rf $BASE_PATH/results/bench
+mkdir -p $ARCLOG_PATH $LOG_PATH
+
+# create new backup catalog
+pg_rman init -B $BACKUP_PATH --quiet
+
+# create new database cluster
+initdb --no-locale > $LOG_PATH/initdb.log 2>&1
+cat << EOF >> $PGDATA/postgresql.conf
+port = $BENCH_PGPORT
+logging_collector = on
+log_directory = 'pg_log'
+wal_level = archive
+archive_mode = on
+archive_command = 'cp "%p" "$ARCLOG_PATH/%f"'
+EOF
+
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+
+$BENCH generate -s $BENCH_SIZE -n $BENCH_FILES -H $BENCH_HOLE $BENCH_DB || exit 1
+psql -p $BENCH_PGPORT postgres -c "checkpoint" > /dev/null
+
+echo "# size=${BENCH_SIZE}MB files=$BENCH_FILES hole=$BENCH_HOLE change=$BENCH_CHANGE jobs=$BENCH_JOBS"
+
+bench_run()
+{
+	name=$1
+	shift
+	$BENCH run $name $BENCH_SIZE "$@" > $LOG_PATH/$name.out 2> $LOG_PATH/$name.log
+	status=$?
+	cat $LOG_PATH/$name.out
+	return $status
+}
+
+bench_run full_backup pg_rman -w -p $BENCH_PGPORT backup -b full -j $BENCH_JOBS -d postgres --verbose
+bench_run validate pg_rman validate -j $BENCH_JOBS --verbose
+
+# change pages with an LSN later than the full backup
+lsn=`psql -p $BENCH_PGPORT postgres -tA -c "SELECT pg_current_xlog_location()"`
+$BENCH generate -c $BENCH_CHANGE -l $lsn $BENCH_DB || exit 1
+psql -p $BENCH_PGPORT postgres -c "checkpoint" > /dev/null
+
+bench_run incremental_backup pg_rman -w -p $BENCH_PGPORT backup -b incremental -j $BENCH_JOBS -d postgres --verbose
+bench_run compressed_backup pg_rman -w -p $BENCH_PGPORT backup -b full -Z -j $BENCH_JOBS -d postgres --verbose
+bench_run validate_compressed pg_rman validate -j $BENCH_JOBS --verbose
+
+pg_ctl stop -m immediate > /dev/null 2>&1
+bench_run restore pg_rman restore -j $BENCH_JOBS --verbose
@@ -0,0 +1,385 @@
+/*-------------------------------------------------------------------------
+ *
+ * rman_bench.c: synthetic data directory and timer for benchmarks.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres_fe.h"
+
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef RELSEG_SIZE
+#define RELSEG_SIZE		(1024 * 1024 * 1024 / BLCKSZ)
+#endif
+
+/*
+ * Page header of data files, as in data.c. Only the fields parsed by
+ * pg_rman are set; the data out of the hole is printable random text, about
+ * as compressible as table data.
+ */
+typedef struct XLogRecPtr_bench
+{
+	uint32		xlogid;
+	uint32		xrecoff;
+} XLogRecPtr_bench;
+
+#if PG_VERSION_NUM < 80300
+typedef struct PageHeader_bench
+{
+	XLogRecPtr_bench pd_lsn;
+	uint32		pd_tli;
+	uint16		pd_lower;
+	uint16		pd_upper;
+	uint16		pd_special;
+	uint16		pd_pagesize_version;
+} PageHeader_bench;
+#if PG_VERSION_NUM < 80100
+#define PAGE_LAYOUT_VERSION		2
+#else
+#define PAGE_LAYOUT_VERSION		3
+#endif
+#else
+typedef struct PageHeader_bench
+{
+	XLogRecPtr_bench pd_lsn;
+	uint16		pd_tli;
+	uint16		pd_flags;
+	uint16		pd_lower;
+	uint16		pd_upper;
+	uint16		pd_special;
+	uint16		pd_pagesize_version;
+	uint32		pd_prune_xid;
+} PageHeader_bench;
+#define PAGE_LAYOUT_VERSION		4
+#endif
+
+#define FIRST_RELFILENODE		16384
+
+static uint64	rand_state = 1;
+
+static int generate(int argc, char *argv[]);
+static int run(int argc, char *argv[]);
+static void make_page(char *page, double hole, XLogRecPtr_bench lsn);
+static void write_file(const char *path, long npages, double hole,
+					   XLogRecPtr_bench lsn);
+static void change_file(const char *path, double change,
+						XLogRecPtr_bench lsn);
+static uint32 next_rand(void);
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "generate") == 0)
+		return generate(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "run") == 0)
+		return run(argc - 1, argv + 1);
+	usage();
+	return 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"  rman_bench generate [-s MB] [-n FILES] [-H HOLE] [-r SEED] DIR\n"
+		"  rman_bench generate -c CHANGE -l LSN [-r SEED] DIR\n"
+		"  rman_bench run NAME MB COMMAND [ARGS...]\n"
+		"\n"
+		"generate writes FILES relation files of MB megabytes in total into\n"
+		"DIR, with HOLE (0 to 1) of each page empty. With -c, CHANGE (0 to 1)\n"
+		"of the pages in DIR are rewritten with LSN (like 0/3000020).\n"
+		"\n"
+		"run executes COMMAND and prints its time, MB/s of MB megabytes and\n"
+		"peak RSS in a line.\n");
+}
+
+/*
+ * Create a data directory, or change pages in it.
+ */
+static int
+generate(int argc, char *argv[])
+{
+	long		size = 64;
+	int			nfiles = 16;
+	double		hole = 0.3;
+	double		change = -1;
+	XLogRecPtr_bench lsn = { 0, 1 };
+	const char *dir;
+	char		path[MAXPGPATH];
+	long		npages;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "s:n:H:c:l:r:")) != -1)
+	{
+		switch (c)
+		{
+			case 's':
+				size = atol(optarg);
+				break;
+			case 'n':
+				nfiles = atoi(optarg);
+				break;
+			case 'H':
+				hole = atof(optarg);
+				break;
+			case 'c':
+				change = atof(optarg);
+				break;
+			case 'l':
+				if (sscanf(optarg, "%X/%X", &lsn.xlogid, &lsn.xrecoff) != 2)
+				{
+					fprintf(stderr, "invalid LSN \"%s\"\n", optarg);
+					return 1;
+				}
+				break;
+			case 'r':
+				rand_state = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || size < 1 || nfiles < 1 ||
+		hole < 0 || hole >= 1 || change > 1)
+	{
+		usage();
+		return 1;
+	}
+	dir = argv[optind];
+	if (rand_state == 0)
+		rand_state = 1;
+
+	/* change pages of the files created before */
+	if (change >= 0)
+	{
+		for (i = 0; ; i++)
+		{
+			struct stat	st;
+			int			seg;
+
+			snprintf(path, lengthof(path), "%s/%d", dir, FIRST_RELFILENODE + i);
+			if (stat(path, &st) == -1)
+				break;
+			change_file(path, change, lsn);
+			for (seg = 1; ; seg++)
+			{
+				snprintf(path, lengthof(path), "%s/%d.%d", dir,
+						 FIRST_RELFILENODE + i, seg);
+				if (stat(path, &st) == -1)
+					break;
+				change_file(path, change, lsn);
+			}
+		}
+		return 0;
+	}
+
+	if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST)
+	{
+		fprintf(stderr, "can't create directory \"%s\": %s\n", dir,
+			strerror(errno));
+		return 1;
+	}
+
+	/* split files into segments of RELSEG_SIZE pages as the server does */
+	npages = size * 1024 * 1024 / BLCKSZ / nfiles;
+	for (i = 0; i < nfiles; i++)
+	{
+		long	left = npages;
+		int		seg;
+
+		for (seg = 0; seg == 0 || left > 0; seg++)
+		{
+			long	n = Min(left, RELSEG_SIZE);
+
+			if (seg == 0)
+				snprintf(path, lengthof(path), "%s/%d", dir,
+						 FIRST_RELFILENODE + i);
+			else
+				snprintf(path, lengthof(path), "%s/%d.%d", dir,
+						 FIRST_RELFILENODE + i, seg);
+			write_file(path, n, hole, lsn);
+			left -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Run a command, and print the wall time, throughput and peak RSS of it.
+ */
+static int
+run(int argc, char *argv[])
+{
+	const char	   *name;
+	double			mb;
+	struct timeval	start;
+	struct timeval	end;
+	struct rusage	ru;
+	double			elapsed;
+	pid_t			pid;
+	int				status;
+
+	if (argc < 4)
+	{
+		usage();
+		return 1;
+	}
+	name = argv[1];
+	mb = atof(argv[2]);
+
+	gettimeofday(&start, NULL);
+	pid = fork();
+	if (pid == -1)
+	{
+		fprintf(stderr, "can't fork: %s\n", strerror(errno));
+		return 1;
+	}
+	if (pid == 0)
+	{
+		execvp(argv[3], argv + 3);
+		fprintf(stderr, "can't execute \"%s\": %s\n", argv[3], strerror(errno));
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+	{
+		if (errno != EINTR)
+		{
+			fprintf(stderr, "can't wait for \"%s\": %s\n", argv[3],
+				strerror(errno));
+			return 1;
+		}
+	}
+	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_CHILDREN, &ru);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+			  (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	/* ru_maxrss is in kilobytes, except on Mac OS X in bytes */
+#ifdef __APPLE__
+	ru.ru_maxrss /= 1024;
+#endif
+	printf("%-20s sec=%.3f mb_per_sec=%.1f peak_rss_kb=%ld status=%s\n",
+		name, elapsed, elapsed > 0 ? mb / elapsed : 0.0, (long) ru.ru_maxrss,
+		WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "ok" : "failed");
+	fflush(stdout);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static void
+make_page(char *page, double hole, XLogRecPtr_bench lsn)
+{
+	static const char chars[] =
+		"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ ,";
+	PageHeader_bench   *header = (PageHeader_bench *) page;
+	int					hole_length = (int) (BLCKSZ * hole);
+	int					lower;
+	int					i;
+
+	/* some line pointers, according to the data out of the hole */
+	lower = sizeof(PageHeader_bench) +
+		MAXALIGN((BLCKSZ - hole_length) / 256) * 4;
+	if (lower + hole_length > BLCKSZ)
+		hole_length = BLCKSZ - lower;
+
+	for (i = 0; i < BLCKSZ; i++)
+		page[i] = chars[next_rand() % 64];
+	memset(page, 0, sizeof(PageHeader_bench));
+	memset(page + lower, 0, hole_length);
+
+	header->pd_lsn = lsn;
+	header->pd_lower = lower;
+	header->pd_upper = lower + hole_length;
+	header->pd_special = BLCKSZ;
+	header->pd_pagesize_version = BLCKSZ | PAGE_LAYOUT_VERSION;
+}
+
+static void
+write_file(const char *path, long npages, double hole, XLogRecPtr_bench lsn)
+{
+	FILE   *fp;
+	char	page[BLCKSZ];
+	long	i;
+
+	if ((fp = fopen(path, "wb")) == NULL)
+	{
+		fprintf(stderr, "can't open \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < npages; i++)
+	{
+		make_page(page, hole, lsn);
+		if (fwrite(page, 1, BLCKSZ, fp) != BLCKSZ)
+		{
+			fprintf(stderr, "can't write \"%s\": %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "can't write \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+}
+
+/* rewrite change of the pages with the hole of each page kept */
+static void
+change_file(const char *path, double change, XLogRecPtr_bench lsn)
+{
+	FILE   *fp;
+	char	page[BLCKSZ];
+	long	blknum;
+
+	if ((fp = fopen(path, "r+b")) == NULL)
+	{
+		fprintf(stderr, "can't open \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+	for (blknum = 0; fread(page, 1, BLCKSZ, fp) == BLCKSZ; blknum++)
+	{
+		PageHeader_bench   *header = (PageHeader_bench *) page;
+		double				hole;
+
+		if (next_rand() % 10000 >= change * 10000)
+			continue;
+
+		hole = (double) (header->pd_upper - header->pd_lower) / BLCKSZ;
+		make_page(page, hole, lsn);
+		if (fseek(fp, blknum * BLCKSZ, SEEK_SET) != 0 ||
+			fwrite(page, 1, BLCKSZ, fp) != BLCKSZ ||
+			fseek(fp, (blknum + 1) * BLCKSZ, SEEK_SET) != 0)
+		{
+			fprintf(stderr, "can't write \"%s\": %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "can't write \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+}
+
+/* xorshift, to generate the same data with the same seed everywhere */
+static uint32
+next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return (uint32) (rand_state >> 32);
+}
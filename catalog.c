@@ -18,13 +18,32 @@
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include "pgut/pgut-port.h"
 
 static pgBackup *catalog_read_ini(const char *path);
+static parray *catalog_scan_backup_list(const pgBackupRange *range);
+static parray *catalog_read_index(void);
+static void catalog_write_index(parray *backups);
+static void catalog_update_index(const pgBackup *backup);
+static void catalog_invalidate_index(void);
+static bool catalog_index_lock(bool *locked);
 
 #define BOOL_TO_STR(val)	((val) ? "true" : "false")
 
+/*
+ * The catalog index holds the contents of backup.ini of all backups, so the
+ * backup list is read from one file instead of scanning every directory of
+ * BACKUP_PATH. The index is updated under the catalog lock whenever backup.ini
+ * is written. It is stale if BACKUP_PATH or the date directory of the newest
+ * backup was modified after the index, or if the dirty marker was left by one
+ * which wrote backup.ini without the lock. Then the directories are scanned
+ * and the index is rebuilt.
+ */
+#define CATALOG_INDEX_HEADER	"# pg_rman catalog index version %d\n"
+#define CATALOG_INDEX_VERSION	3
+
 static int lock_fd = -1;
 
 /*
@@ -49,12 +68,14 @@ catalog_lock(void)
 		if (errno == EWOULDBLOCK)
 		{
 			close(lock_fd);
+			lock_fd = -1;
 			return 1;
 		}
 		else
 		{
 			int errno_tmp = errno;
 			close(lock_fd);
+			lock_fd = -1;
 			elog(ERROR_SYSTEM, _("can't lock file \"%s\": %s"), id_path,
 				strerror(errno_tmp));
 		}
@@ -89,27 +110,6 @@ catalog_get_backup(time_t timestamp)
 	return catalog_read_ini(ini_path);
 }
 
-static bool
-IsDir(const char *dirpath, const DIR *dir, const struct dirent *ent)
-{
-#if defined(DT_DIR)
-	return ent->d_type == DT_DIR;
-#elif defined(_finddata_t)
-	/* Optimization for VC++ on Windows. */
-	return (dir->dd_dta.attrib & FILE_ATTRIBUTE_DIRECTORY) != 0;
-#else
-	/* Portable implementation because dirent.d_type is not in POSIX. */
-	char		path[MAXPGPATH];
-	struct stat	st;
-
-	strlcpy(path, dirpath, MAXPGPATH);
-	strlcat(path, "/", MAXPGPATH);
-	strlcat(path, ent->d_name, MAXPGPATH);
-
-	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
-#endif
-}
-
 /*
  * Create list fo backups started between begin and end from backup catalog.
  * If range was NULL, all of backup are listed.
@@ -117,20 +117,88 @@ IsDir(const char *dirpath, const DIR *dir, const struct dirent *ent)
  */
 parray *
 catalog_get_backup_list(const pgBackupRange *range)
+{
+	parray	   *backups;
+	parray	   *in_range;
+	char		begin_date[100];
+	char		begin_time[100];
+	char		end_date[100];
+	char		end_time[100];
+	int			i;
+
+	backups = catalog_read_index();
+	if (backups == NULL)
+	{
+		bool	locked = false;
+		bool	rebuild = !check && catalog_index_lock(&locked);
+
+		/* backup.ini written after the marker is removed are scanned */
+		if (rebuild)
+		{
+			char	path[MAXPGPATH];
+
+			join_path_components(path, backup_path, CATALOG_INDEX_DIRTY_FILE);
+			unlink(path);
+		}
+
+		backups = catalog_scan_backup_list(rebuild ? NULL : range);
+		if (backups && rebuild)
+			catalog_write_index(backups);
+		if (locked)
+			catalog_unlock();
+		if (backups == NULL)
+			return NULL;
+	}
+
+	if (range == NULL || !pgBackupRangeIsValid(range))
+		return backups;
+
+	/* compare the date and the time separately as the directories */
+	strftime(begin_date, lengthof(begin_date), "%Y%m%d", localtime(&range->begin));
+	strftime(begin_time, lengthof(begin_time), "%H%M%S", localtime(&range->begin));
+	strftime(end_date, lengthof(end_date), "%Y%m%d", localtime(&range->end));
+	strftime(end_time, lengthof(end_time), "%H%M%S", localtime(&range->end));
+
+	in_range = parray_new();
+	for (i = 0; i < parray_num(backups); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backups, i);
+		char		date_str[100];
+		char		time_str[100];
+
+		strftime(date_str, lengthof(date_str), "%Y%m%d",
+				 localtime(&backup->start_time));
+		strftime(time_str, lengthof(time_str), "%H%M%S",
+				 localtime(&backup->start_time));
+		if (strcmp(begin_date, date_str) > 0 || strcmp(end_date, date_str) < 0 ||
+			strcmp(begin_time, time_str) > 0 || strcmp(end_time, time_str) < 0)
+			pgBackupFree(backup);
+		else
+			parray_append(in_range, backup);
+	}
+	parray_free(backups);
+
+	return in_range;
+}
+
+/*
+ * Scan date/time directories and read backup.ini of the backups in the range.
+ */
+static parray *
+catalog_scan_backup_list(const pgBackupRange *range)
 {
 	const pgBackupRange range_all = { 0, 0 };
-	DIR			   *date_dir = NULL;
-	struct dirent  *date_ent = NULL;
-	DIR			   *time_dir = NULL;
-	struct dirent  *time_ent = NULL;
-	char			date_path[MAXPGPATH];
+	const char	   *root = BACKUP_ROOT;
+	parray		   *date_dirs;
+	parray		   *time_dirs = NULL;
 	parray		   *backups = NULL;
-	pgBackup	   *backup = NULL;
 	struct tm	   *tm;
 	char			begin_date[100];
 	char			begin_time[100];
 	char			end_date[100];
 	char			end_time[100];
+	int				i;
+	int				j;
 
 	if (range == NULL)
 		range = &range_all;
@@ -143,101 +211,351 @@ catalog_get_backup_list(const pgBackupRange *range)
 	strftime(end_date, lengthof(end_date), "%Y%m%d", tm);
 	strftime(end_time, lengthof(end_time), "%H%M%S", tm);
 
-	/* open backup root directory */
-	date_dir = opendir(backup_path);
-	if (date_dir == NULL)
+	/* list backup root directory */
+	date_dirs = storage_list_dir(root);
+	if (date_dirs == NULL)
 	{
-		elog(WARNING, _("can't open directory \"%s\": %s"), backup_path,
+		elog(WARNING, _("can't open directory \"%s\": %s"), root,
 			strerror(errno));
-		goto err_proc;
+		return NULL;
 	}
 
 	/* scan date/time directories and list backups in the range */
 	backups = parray_new();
-	for (; (date_ent = readdir(date_dir)) != NULL; errno = 0)
+	for (i = 0; i < parray_num(date_dirs); i++)
 	{
+		pgFile	   *date_dir = (pgFile *) parray_get(date_dirs, i);
+		const char *date_name = date_dir->path + strlen(root) + 1;
+
 		/* skip not-directory entries and hidden entries */
-		if (!IsDir(backup_path, date_dir, date_ent) || date_ent->d_name[0] == '.')
+		if (!S_ISDIR(date_dir->mode) || date_name[0] == '.')
 			continue;
 
-		/* skip online WAL & serverlog backup directory */
-		if (strcmp(date_ent->d_name, RESTORE_WORK_DIR) == 0)
+		/* skip online WAL & serverlog backup directory, and deleted backups */
+		if (strcmp(date_name, RESTORE_WORK_DIR) == 0 ||
+			strcmp(date_name, TRASH_DIR) == 0)
 			continue;
 
 		/* If the date is out of range, skip it. */
 		if (pgBackupRangeIsValid(range) &&
-				(strcmp(begin_date, date_ent->d_name) > 0 ||
-								strcmp(end_date, date_ent->d_name) < 0))
+				(strcmp(begin_date, date_name) > 0 ||
+								strcmp(end_date, date_name) < 0))
 			continue;
 
-		/* open subdirectory (date directory) and search time directory */
-		join_path_components(date_path, backup_path, date_ent->d_name);
-		time_dir = opendir(date_path);
-		if (time_dir == NULL)
+		/* list subdirectory (date directory) and search time directory */
+		time_dirs = storage_list_dir(date_dir->path);
+		if (time_dirs == NULL)
 		{
-			elog(WARNING, _("can't open directory \"%s\": %s"),
-				date_ent->d_name, strerror(errno));
+			elog(WARNING, _("can't read date directory \"%s\": %s"),
+				date_name, strerror(errno));
 			goto err_proc;
 		}
-		for (; (time_ent = readdir(time_dir)) != NULL; errno = 0)
+		for (j = 0; j < parray_num(time_dirs); j++)
 		{
-			char ini_path[MAXPGPATH];
+			pgFile	   *time_dir = (pgFile *) parray_get(time_dirs, j);
+			const char *time_name = time_dir->path + strlen(date_dir->path) + 1;
+			char		ini_path[MAXPGPATH];
+			pgBackup   *backup;
 
 			/* skip not-directory and hidden directories */
-			if (!IsDir(date_path, date_dir, time_ent) || time_ent->d_name[0] == '.')
+			if (!S_ISDIR(time_dir->mode) || time_name[0] == '.')
 				continue;
 
 			/* If the time is out of range, skip it. */
 			if (pgBackupRangeIsValid(range) &&
-					(strcmp(begin_time, time_ent->d_name) > 0 ||
-									strcmp(end_time, time_ent->d_name) < 0))
+					(strcmp(begin_time, time_name) > 0 ||
+									strcmp(end_time, time_name) < 0))
 				continue;
 
 			/* read backup information from backup.ini */
-			snprintf(ini_path, MAXPGPATH, "%s/%s/%s", date_path,
-				time_ent->d_name, BACKUP_INI_FILE);
+			join_path_components(ini_path, time_dir->path, BACKUP_INI_FILE);
 			backup = catalog_read_ini(ini_path);
 			/* ignore corrupted backup */
 			if (backup)
-			{
 				parray_append(backups, backup);
-				backup = NULL;
-			}
 		}
-		if (errno && errno != ENOENT)
-		{
-			elog(WARNING, _("can't read date directory \"%s\": %s"),
-				date_ent->d_name, strerror(errno));
-			goto err_proc;
-		}
-		closedir(time_dir);
-		time_dir = NULL;
+		parray_walk(time_dirs, pgFileFree);
+		parray_free(time_dirs);
+		time_dirs = NULL;
 	}
-	if (errno)
+
+	parray_walk(date_dirs, pgFileFree);
+	parray_free(date_dirs);
+
+	parray_qsort(backups, pgBackupCompareIdDesc);
+
+	return backups;
+
+err_proc:
+	parray_walk(date_dirs, pgFileFree);
+	parray_free(date_dirs);
+	parray_walk(backups, pgBackupFree);
+	parray_free(backups);
+	return NULL;
+}
+
+/*
+ * Read the catalog index. Returns NULL if the index is missing or stale.
+ * The list is sorted in order of descending start time.
+ */
+static parray *
+catalog_read_index(void)
+{
+	char		path[MAXPGPATH];
+	char		buf[1024];
+	struct stat	st;
+	struct stat	st_dir;
+	FILE	   *fp;
+	parray	   *backups;
+	int			version;
+
+	join_path_components(path, backup_path, CATALOG_INDEX_DIRTY_FILE);
+	if (access(path, F_OK) == 0)
+		return NULL;
+
+	join_path_components(path, backup_path, CATALOG_INDEX_FILE);
+	fp = fopen(path, "rt");
+	if (fp == NULL)
+		return NULL;
+
+	if (fstat(fileno(fp), &st) == -1 ||
+		stat(backup_path, &st_dir) == -1 || st_dir.st_mtime > st.st_mtime ||
+		fgets(buf, lengthof(buf), fp) == NULL ||
+		sscanf(buf, CATALOG_INDEX_HEADER, &version) != 1 ||
+		version != CATALOG_INDEX_VERSION)
 	{
-		elog(WARNING, _("can't read backup root directory \"%s\": %s"),
-			backup_path, strerror(errno));
-		goto err_proc;
+		fclose(fp);
+		return NULL;
 	}
 
-	closedir(date_dir);
-	date_dir = NULL;
+	backups = parray_new();
+	while (fgets(buf, lengthof(buf), fp))
+	{
+		pgBackup   *backup;
+		int64		start_time;
+		int64		end_time;
+		int64		recovery_time;
+		int			backup_mode;
+		int			with_serverlog;
+		int			compress_data;
+		int			compress_method;
+		int			checksum;
+		int			stream;
+		int			dedup;
+		int			status;
+
+		backup = pgut_new(pgBackup);
+		catalog_init_config(backup);
+		if (sscanf(buf, INT64_FORMAT " %d %d %d %d %d %d %d %d %u %X/%X %X/%X "
+				   INT64_FORMAT " " INT64_FORMAT " %u "
+				   INT64_FORMAT " " INT64_FORMAT " " INT64_FORMAT " "
+				   INT64_FORMAT " " INT64_FORMAT " %u %u",
+				   &start_time, &backup_mode, &with_serverlog,
+				   &compress_data, &compress_method, &checksum, &stream,
+				   &dedup, &status,
+				   &backup->tli,
+				   &backup->start_lsn.xlogid, &backup->start_lsn.xrecoff,
+				   &backup->stop_lsn.xlogid, &backup->stop_lsn.xrecoff,
+				   &end_time, &recovery_time, &backup->recovery_xid,
+				   &backup->total_data_bytes, &backup->read_data_bytes,
+				   &backup->read_arclog_bytes, &backup->read_srvlog_bytes,
+				   &backup->write_bytes,
+				   &backup->block_size, &backup->wal_block_size) != 24)
+		{
+			elog(LOG, _("invalid format found in \"%s\""), path);
+			pgBackupFree(backup);
+			parray_walk(backups, pgBackupFree);
+			parray_free(backups);
+			fclose(fp);
+			return NULL;
+		}
+		backup->backup_mode = (BackupMode) backup_mode;
+		backup->with_serverlog = (with_serverlog != 0);
+		backup->compress_data = (compress_data != 0);
+		backup->compress_method = (CompressMethod) compress_method;
+		backup->checksum = (ChecksumAlgorithm) checksum;
+		backup->stream = (stream != 0);
+		backup->dedup = (dedup != 0);
+		backup->status = (BackupStatus) status;
+		backup->start_time = (time_t) start_time;
+		backup->end_time = (time_t) end_time;
+		backup->recovery_time = (time_t) recovery_time;
+		parray_append(backups, backup);
+	}
+	fclose(fp);
 
 	parray_qsort(backups, pgBackupCompareIdDesc);
 
+	/*
+	 * A backup might be added in the date directory of the newest one.
+	 * Directories of object storage have no mtime, and backups in it are
+	 * added only through the catalog.
+	 */
+	if (parray_num(backups) > 0 && !storage_is_remote(BACKUP_ROOT))
+	{
+		char   *sep;
+
+		pgBackupGetPath((pgBackup *) parray_get(backups, 0), path,
+						lengthof(path), NULL);
+		if ((sep = strrchr(path, '/')) != NULL)
+			*sep = '\0';
+		if (stat(path, &st_dir) == -1 || st_dir.st_mtime > st.st_mtime)
+		{
+			parray_walk(backups, pgBackupFree);
+			parray_free(backups);
+			return NULL;
+		}
+	}
+
 	return backups;
+}
 
-err_proc:
-	if (time_dir)
-		closedir(time_dir);
-	if (date_dir)
-		closedir(date_dir);
-	if (backup)
-		pgBackupFree(backup);
+/*
+ * Write the catalog index of the backups. The catalog lock must be held.
+ * The mtime of the index is set after it is renamed, so that the index is
+ * not newer than BACKUP_PATH modified by the rename.
+ */
+static void
+catalog_write_index(parray *backups)
+{
+	char	path[MAXPGPATH];
+	char	tmp[MAXPGPATH];
+	FILE   *fp;
+	int		i;
+	bool	ok;
+
+	join_path_components(path, backup_path, CATALOG_INDEX_FILE);
+	snprintf(tmp, lengthof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "wt");
+	if (fp == NULL)
+	{
+		elog(WARNING, _("can't open \"%s\": %s"), tmp, strerror(errno));
+		catalog_invalidate_index();
+		return;
+	}
+
+	ok = (fprintf(fp, CATALOG_INDEX_HEADER, CATALOG_INDEX_VERSION) > 0);
+	for (i = 0; ok && i < parray_num(backups); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		ok = (fprintf(fp, INT64_FORMAT " %d %d %d %d %d %d %d %d %u %X/%08X %X/%08X "
+					  INT64_FORMAT " " INT64_FORMAT " %u "
+					  INT64_FORMAT " " INT64_FORMAT " " INT64_FORMAT " "
+					  INT64_FORMAT " " INT64_FORMAT " %u %u\n",
+					  (int64) backup->start_time, backup->backup_mode,
+					  backup->with_serverlog, backup->compress_data,
+					  backup->compress_method, backup->checksum,
+					  backup->stream, backup->dedup, backup->status,
+					  backup->tli,
+					  backup->start_lsn.xlogid, backup->start_lsn.xrecoff,
+					  backup->stop_lsn.xlogid, backup->stop_lsn.xrecoff,
+					  (int64) backup->end_time, (int64) backup->recovery_time,
+					  backup->recovery_xid,
+					  backup->total_data_bytes, backup->read_data_bytes,
+					  backup->read_arclog_bytes, backup->read_srvlog_bytes,
+					  backup->write_bytes,
+					  backup->block_size, backup->wal_block_size) > 0);
+	}
+
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1 ||
+		utime(path, NULL) == -1)
+	{
+		elog(WARNING, _("can't write \"%s\": %s"), path, strerror(errno));
+		unlink(tmp);
+		catalog_invalidate_index();
+	}
+}
+
+/*
+ * Replace the backup in the catalog index, or add it if not found.
+ */
+static void
+catalog_update_index(const pgBackup *backup)
+{
+	parray *backups;
+	bool	locked;
+	int		i;
+
+	if (!catalog_index_lock(&locked))
+	{
+		catalog_invalidate_index();
+		return;
+	}
+
+	/* stale index is left to be rebuilt */
+	backups = catalog_read_index();
 	if (backups)
+	{
+		pgBackup   *entry = NULL;
+
+		for (i = 0; i < parray_num(backups); i++)
+		{
+			entry = (pgBackup *) parray_get(backups, i);
+			if (entry->start_time == backup->start_time)
+				break;
+		}
+		if (i == parray_num(backups))
+		{
+			entry = pgut_new(pgBackup);
+			parray_append(backups, entry);
+		}
+		memcpy(entry, backup, sizeof(pgBackup));
+
+		parray_qsort(backups, pgBackupCompareIdDesc);
+		catalog_write_index(backups);
 		parray_walk(backups, pgBackupFree);
-	parray_free(backups);
-	return NULL;
+		parray_free(backups);
+	}
+
+	if (locked)
+		catalog_unlock();
+}
+
+/* make the catalog index stale until it is rebuilt */
+static void
+catalog_invalidate_index(void)
+{
+	char	path[MAXPGPATH];
+	int		fd;
+
+	join_path_components(path, backup_path, CATALOG_INDEX_DIRTY_FILE);
+	fd = open(path, O_WRONLY | O_CREAT, FILE_PERMISSION);
+	if (fd == -1)
+	{
+		elog(WARNING, _("can't open \"%s\": %s"), path, strerror(errno));
+		return;
+	}
+	close(fd);
+}
+
+/*
+ * Take the catalog lock to write the index if not held yet, without waiting.
+ * *locked is set to true if the lock should be released by the caller.
+ */
+static bool
+catalog_index_lock(bool *locked)
+{
+	char	id_path[MAXPGPATH];
+	int		fd;
+
+	*locked = false;
+	if (lock_fd != -1)
+		return true;
+
+	join_path_components(id_path, backup_path, PG_RMAN_INI_FILE);
+	fd = open(id_path, O_RDWR);
+	if (fd == -1)
+		return false;
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+	{
+		close(fd);
+		return false;
+	}
+
+	lock_fd = fd;
+	*locked = true;
+	return true;
 }
 
 /*
@@ -254,8 +572,8 @@ catalog_get_last_data_backup(parray *backup_list)
 	{
 		backup = (pgBackup *) parray_get(backup_list, i);
 
-		/* we need completed database backup */
-		if (backup->status == BACKUP_STATUS_OK && HAVE_DATABASE(backup))
+		/* we need completed database backup, whose file list is enough */
+		if (BACKUP_IS_COMPLETED(backup) && HAVE_DATABASE(backup))
 			return backup;
 	}
 
@@ -306,22 +624,34 @@ catalog_get_last_srvlog_backup(parray *backup_list)
 	return NULL;
 }
 
-/* create backup directory in $BACKUP_PATH */
+/* create backup directory in $BACKUP_PATH or $STORAGE_PATH */
 int
 pgBackupCreateDir(pgBackup *backup)
 {
 	int		i;
 	char	path[MAXPGPATH];
 	char   *subdirs[] = { DATABASE_DIR, ARCLOG_DIR, SRVLOG_DIR, NULL };
+	parray *backups = NULL;
+
+	/* the index is kept fresh after the new directories are created */
+	if (lock_fd != -1)
+		backups = catalog_read_index();
 
 	pgBackupGetPath(backup, path, lengthof(path), NULL);
-	dir_create_dir(path, DIR_PERMISSION);
+	storage_mkdir(path, DIR_PERMISSION);
 
 	/* create directories for actual backup files */
 	for (i = 0; subdirs[i]; i++)
 	{
 		pgBackupGetPath(backup, path, lengthof(path), subdirs[i]);
-		dir_create_dir(path, DIR_PERMISSION);
+		storage_mkdir(path, DIR_PERMISSION);
+	}
+
+	if (backups)
+	{
+		catalog_write_index(backups);
+		parray_walk(backups, pgBackupFree);
+		parray_free(backups);
 	}
 
 	return 0;
@@ -340,6 +670,15 @@ pgBackupWriteConfigSection(FILE *out, pgBackup *backup)
 	fprintf(out, "BACKUP_MODE=%s\n", modes[backup->backup_mode]);
 	fprintf(out, "WITH_SERVERLOG=%s\n", BOOL_TO_STR(backup->with_serverlog));
 	fprintf(out, "COMPRESS_DATA=%s\n", BOOL_TO_STR(backup->compress_data));
+	if (backup->compress_data)
+		fprintf(out, "COMPRESS_METHOD=%s\n",
+			compress_method_name(backup->compress_method));
+	if (backup->checksum != CHECKSUM_CRC32)
+		fprintf(out, "CHECKSUM=%s\n", checksum_name(backup->checksum));
+	if (backup->stream)
+		fprintf(out, "STREAM=true\n");
+	if (backup->dedup)
+		fprintf(out, "DEDUP=true\n");
 }
 
 /*
@@ -401,7 +740,7 @@ pgBackupWriteIni(pgBackup *backup)
 	char	ini_path[MAXPGPATH];
 
 	pgBackupGetPath(backup, ini_path, lengthof(ini_path), BACKUP_INI_FILE);
-	fp = fopen(ini_path, "wt");
+	fp = storage_fopen(ini_path, "wt");
 	if (fp == NULL)
 		elog(ERROR_SYSTEM, _("can't open INI file \"%s\": %s"), ini_path,
 			strerror(errno));
@@ -413,6 +752,8 @@ pgBackupWriteIni(pgBackup *backup)
 	pgBackupWriteResultSection(fp, backup);
 
 	fclose(fp);
+
+	catalog_update_index(backup);
 }
 
 /*
@@ -423,8 +764,11 @@ pgBackupWriteIni(pgBackup *backup)
 static pgBackup *
 catalog_read_ini(const char *path)
 {
+	FILE	   *fp;
 	pgBackup   *backup;
 	char	   *backup_mode = NULL;
+	char	   *compress_method = NULL;
+	char	   *checksum = NULL;
 	char	   *start_lsn = NULL;
 	char	   *stop_lsn = NULL;
 	char	   *status = NULL;
@@ -435,6 +779,10 @@ catalog_read_ini(const char *path)
 		{ 's', 0, "backup-mode"			, NULL, SOURCE_ENV },
 		{ 'b', 0, "with-serverlog"		, NULL, SOURCE_ENV },
 		{ 'b', 0, "compress-data"		, NULL, SOURCE_ENV },
+		{ 's', 0, "compress-method"		, NULL, SOURCE_ENV },
+		{ 's', 0, "checksum"			, NULL, SOURCE_ENV },
+		{ 'b', 0, "stream"				, NULL, SOURCE_ENV },
+		{ 'b', 0, "dedup"				, NULL, SOURCE_ENV },
 		{ 'u', 0, "timelineid"			, NULL, SOURCE_ENV },
 		{ 's', 0, "start-lsn"			, NULL, SOURCE_ENV },
 		{ 's', 0, "stop-lsn"			, NULL, SOURCE_ENV },
@@ -453,9 +801,8 @@ catalog_read_ini(const char *path)
 		{ 0 }
 	};
 
-	if (access(path, F_OK) != 0){
+	if ((fp = storage_fopen(path, "rt")) == NULL)
 		return NULL;
-	}
 
 	backup = pgut_new(pgBackup);
 	catalog_init_config(backup);
@@ -464,6 +811,10 @@ catalog_read_ini(const char *path)
 	options[i++].var = &backup_mode;
 	options[i++].var = &backup->with_serverlog;
 	options[i++].var = &backup->compress_data;
+	options[i++].var = &compress_method;
+	options[i++].var = &checksum;
+	options[i++].var = &backup->stream;
+	options[i++].var = &backup->dedup;
 	options[i++].var = &backup->tli;
 	options[i++].var = &start_lsn;
 	options[i++].var = &stop_lsn;
@@ -481,7 +832,8 @@ catalog_read_ini(const char *path)
 	options[i++].var = &status;
 	Assert(i == lengthof(options) - 1);
 
-	pgut_readopt(path, options, ERROR_CORRUPTED);
+	pgut_readopt_file(fp, options, ERROR_CORRUPTED);
+	fclose(fp);
 
 	if (backup_mode)
 	{
@@ -489,6 +841,23 @@ catalog_read_ini(const char *path)
 		free(backup_mode);
 	}
 
+	/* backups without COMPRESS_METHOD are compressed with zlib */
+	if (compress_method)
+	{
+		backup->compress_method = parse_compress_method(compress_method,
+														WARNING);
+		free(compress_method);
+	}
+
+	/* backups without CHECKSUM are checksummed with the legacy CRC32 */
+	if (checksum)
+	{
+		backup->checksum = parse_checksum(checksum, WARNING);
+		free(checksum);
+	}
+	else
+		backup->checksum = CHECKSUM_CRC32;
+
 	if (start_lsn)
 	{
 		XLogRecPtr lsn;
@@ -596,9 +965,9 @@ pgBackupGetPath(const pgBackup *backup, char *path, size_t len, const char *subd
 	tm = localtime(&backup->start_time);
 	strftime(datetime, lengthof(datetime), "%Y%m%d/%H%M%S", tm);
 	if (subdir)
-		snprintf(path, len, "%s/%s/%s", backup_path, datetime, subdir);
+		snprintf(path, len, "%s/%s/%s", BACKUP_ROOT, datetime, subdir);
 	else
-		snprintf(path, len, "%s/%s", backup_path, datetime);
+		snprintf(path, len, "%s/%s", BACKUP_ROOT, datetime);
 }
 
 void
@@ -607,6 +976,11 @@ catalog_init_config(pgBackup *backup)
 	backup->backup_mode = BACKUP_MODE_INVALID;
 	backup->with_serverlog = false;
 	backup->compress_data = false;
+	backup->compress_method = COMPRESS_METHOD_ZLIB;
+	backup->compress_level = 0;
+	backup->checksum = CHECKSUM_CRC32C;
+	backup->stream = false;
+	backup->dedup = false;
 	backup->status = BACKUP_STATUS_INVALID;
 	backup->tli = 0;
 	backup->start_lsn.xlogid = 0;
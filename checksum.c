@@ -0,0 +1,281 @@
+/*-------------------------------------------------------------------------
+ *
+ * checksum.c: checksum algorithms of backup files.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include "pgut/pgut-pthread.h"
+
+/*
+ * CRC-32C (Castagnoli) is computed with the SSE 4.2 instruction when the CPU
+ * supports it, with the ARMv8 CRC instruction when the compiler targets it,
+ * or with slicing-by-8 tables otherwise. Both CRC32 and CRC32C start with
+ * INIT_CRC32() and end with FIN_CRC32().
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SSE42_CRC32C
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define USE_ARMV8_CRC32C
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY		0x82F63B78	/* reflected 0x1EDC6F41 */
+
+typedef pg_crc32 (*crc32c_func)(pg_crc32 crc, const void *data, size_t len);
+
+static uint32			crc32c_table[8][256];
+static crc32c_func		crc32c_impl = NULL;
+static pthread_once_t	crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void);
+static pg_crc32 crc32c_sb8(pg_crc32 crc, const void *data, size_t len);
+
+ChecksumAlgorithm
+parse_checksum(const char *value, int elevel)
+{
+	const char *v = value;
+
+	while (IsSpace(*v)) { v++; }
+
+	if (pg_strcasecmp("crc32", v) == 0)
+		return CHECKSUM_CRC32;
+	else if (pg_strcasecmp("crc32c", v) == 0)
+		return CHECKSUM_CRC32C;
+
+	elog(elevel, _("invalid checksum \"%s\""), value);
+	return CHECKSUM_CRC32;
+}
+
+const char *
+checksum_name(ChecksumAlgorithm checksum)
+{
+	static const char *names[] = { "CRC32", "CRC32C" };
+
+	return names[checksum];
+}
+
+/*
+ * Add len bytes of data to crc computed with the algorithm.
+ */
+pg_crc32
+checksum_update(ChecksumAlgorithm checksum, pg_crc32 crc,
+				const void *data, size_t len)
+{
+	if (checksum == CHECKSUM_CRC32C)
+	{
+		pthread_once(&crc32c_once, crc32c_init);
+		return crc32c_impl(crc, data, len);
+	}
+
+	COMP_CRC32(crc, data, len);
+	return crc;
+}
+
+#ifdef USE_SSE42_CRC32C
+__attribute__((target("sse4.2")))
+static pg_crc32
+crc32c_sse42(pg_crc32 crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (; len > 0 && ((size_t) p & 7) != 0; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+#ifdef __x86_64__
+	for (; len >= 8; len -= 8, p += 8)
+		crc = (pg_crc32) _mm_crc32_u64(crc, *(const uint64 *) p);
+#endif
+	for (; len >= 4; len -= 4, p += 4)
+		crc = _mm_crc32_u32(crc, *(const uint32 *) p);
+	for (; len > 0; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+#ifdef USE_ARMV8_CRC32C
+static pg_crc32
+crc32c_armv8(pg_crc32 crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (; len > 0 && ((size_t) p & 7) != 0; len--)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8)
+		crc = __crc32cd(crc, *(const uint64 *) p);
+	for (; len > 0; len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/*
+ * Slicing-by-8 processes 8 bytes with 8 table lookups. Input bytes are
+ * combined one by one, so it doesn't depend on the byte order.
+ */
+static pg_crc32
+crc32c_sb8(pg_crc32 crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		crc ^= (uint32) p[0] | ((uint32) p[1] << 8) |
+			   ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+		crc = crc32c_table[7][crc & 0xFF] ^
+			  crc32c_table[6][(crc >> 8) & 0xFF] ^
+			  crc32c_table[5][(crc >> 16) & 0xFF] ^
+			  crc32c_table[4][crc >> 24] ^
+			  crc32c_table[3][p[4]] ^
+			  crc32c_table[2][p[5]] ^
+			  crc32c_table[1][p[6]] ^
+			  crc32c_table[0][p[7]];
+	}
+	for (; len > 0; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+/* build the tables and choose the fastest implementation available */
+static void
+crc32c_init(void)
+{
+	uint32	i;
+	int		k;
+
+	for (i = 0; i < 256; i++)
+	{
+		uint32	crc = i;
+
+		for (k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+
+	crc32c_impl = crc32c_sb8;
+#if defined(USE_ARMV8_CRC32C)
+	crc32c_impl = crc32c_armv8;
+#elif defined(USE_SSE42_CRC32C)
+	{
+		unsigned int	eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+			crc32c_impl = crc32c_sse42;
+	}
+#endif
+}
+
+/*
+ * SHA-256 identifies chunks of the dedup store by their contents, where
+ * collisions of CRC are not acceptable. It's used only for chunks of pages,
+ * so the whole data is given at once.
+ */
+static const uint32 sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(uint32 state[8], const unsigned char *p)
+{
+	uint32	w[64];
+	uint32	a, b, c, d, e, f, g, h;
+	int		i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32) p[i * 4] << 24) | ((uint32) p[i * 4 + 1] << 16) |
+			   ((uint32) p[i * 4 + 2] << 8) | (uint32) p[i * 4 + 3];
+	for (i = 16; i < 64; i++)
+	{
+		uint32	s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^
+					 (w[i - 15] >> 3);
+		uint32	s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^
+					 (w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++)
+	{
+		uint32	t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+					 ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32	t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+					 ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void
+sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+	static const uint32 init[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	const unsigned char *p = data;
+	unsigned char	tail[128];
+	size_t			rest;
+	size_t			ntail;
+	uint64			bits = (uint64) len * 8;
+	uint32			state[8];
+	int				i;
+
+	memcpy(state, init, sizeof(state));
+	for (rest = len; rest >= 64; rest -= 64, p += 64)
+		sha256_block(state, p);
+
+	/* pad the last block with 0x80, zeros and the length in bits */
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p, rest);
+	tail[rest] = 0x80;
+	ntail = (rest < 56 ? 64 : 128);
+	for (i = 0; i < 8; i++)
+		tail[ntail - 1 - i] = (unsigned char) (bits >> (i * 8));
+	sha256_block(state, tail);
+	if (ntail == 128)
+		sha256_block(state, tail + 64);
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[i * 4] = (unsigned char) (state[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char) (state[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char) (state[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char) state[i];
+	}
+}
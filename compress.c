@@ -0,0 +1,693 @@
+/*-------------------------------------------------------------------------
+ *
+ * compress.c: compression methods of backup files.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_BUFSIZE	(64 * 1024)
+
+/*
+ * Compressor writes a compressed stream to "out", or into memory if "out" is
+ * NULL. The stream is not started until the first input, so an empty input
+ * produces an empty file.
+ */
+struct Compressor
+{
+	CompressMethod	method;
+	int				level;
+	FILE		   *out;
+	char		  **mem;		/* malloc'd output if out is NULL */
+	size_t			memlen;
+	size_t			memsize;
+	ChecksumAlgorithm checksum;
+	pg_crc32	   *crc;		/* CRC of compressed data */
+	size_t		   *write_size;	/* size of compressed data */
+	bool			started;
+	char		   *buf;
+	size_t			bufsize;
+#ifdef HAVE_LIBZ
+	z_stream		z;
+#endif
+#ifdef HAVE_LIBLZ4
+	LZ4F_cctx	   *lz4;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_CCtx	   *zstd;
+#endif
+};
+
+/*
+ * Decompressor reads a compressed stream from "in", or from memory if "in" is
+ * NULL.
+ */
+struct Decompressor
+{
+	CompressMethod	method;
+	FILE		   *in;
+	const char	   *mem;		/* input not read yet if in is NULL */
+	size_t			memlen;
+	size_t		   *read_size;	/* size of compressed data */
+	bool			eof;		/* reached to end of the input file */
+	bool			finished;	/* reached to end of the stream */
+	char		   *buf;
+	size_t			avail;		/* input bytes not decompressed yet */
+	size_t			pos;		/* offset of the first input byte in buf */
+#ifdef HAVE_LIBZ
+	z_stream		z;
+#endif
+#ifdef HAVE_LIBLZ4
+	LZ4F_dctx	   *lz4;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DCtx	   *zstd;
+#endif
+};
+
+static void compressor_start(Compressor *self);
+static void compressor_flush(Compressor *self, size_t len);
+static void decompressor_fill(Decompressor *self);
+
+/*
+ * Parse name of a compression method.
+ */
+CompressMethod
+parse_compress_method(const char *value, int elevel)
+{
+	const char *v = value;
+	size_t		len;
+
+	while (IsSpace(*v)) { v++; }
+	len = strlen(v);
+
+	if (len > 0 && pg_strncasecmp("zlib", v, len) == 0)
+		return COMPRESS_METHOD_ZLIB;
+	else if (len > 0 && pg_strncasecmp("lz4", v, len) == 0)
+		return COMPRESS_METHOD_LZ4;
+	else if (len > 0 && pg_strncasecmp("zstd", v, len) == 0)
+		return COMPRESS_METHOD_ZSTD;
+
+	elog(elevel, _("invalid compress-method \"%s\""), value);
+	return COMPRESS_METHOD_ZLIB;
+}
+
+const char *
+compress_method_name(CompressMethod method)
+{
+	static const char *names[] = { "ZLIB", "LZ4", "ZSTD" };
+
+	return names[method];
+}
+
+/*
+ * Return true if the compression method is built in this installation.
+ */
+bool
+compress_method_supported(CompressMethod method)
+{
+	switch (method)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_METHOD_ZLIB:
+			return true;
+#endif
+#ifdef HAVE_LIBLZ4
+		case COMPRESS_METHOD_LZ4:
+			return true;
+#endif
+#ifdef HAVE_LIBZSTD
+		case COMPRESS_METHOD_ZSTD:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+/*
+ * Return the highest compression level of the method. Level 0 means the
+ * default level of each method.
+ */
+int
+compress_max_level(CompressMethod method)
+{
+	switch (method)
+	{
+		case COMPRESS_METHOD_LZ4:
+			return 12;
+		case COMPRESS_METHOD_ZSTD:
+			return 22;
+		default:
+			return 9;
+	}
+}
+
+Compressor *
+compressor_open(CompressMethod method, int level, FILE *out,
+				ChecksumAlgorithm checksum, pg_crc32 *crc, size_t *write_size)
+{
+	Compressor *self;
+
+	if (!compress_method_supported(method))
+		elog(ERROR_SYSTEM,
+			_("compress-method %s is not supported in this installation"),
+			compress_method_name(method));
+
+	self = pgut_new(Compressor);
+	memset(self, 0, sizeof(Compressor));
+	self->method = method;
+	self->level = level;
+	self->out = out;
+	self->checksum = checksum;
+	self->crc = crc;
+	self->write_size = write_size;
+
+	return self;
+}
+
+/*
+ * Open a compressor writing into *out, which is allocated with malloc and
+ * must be freed by the caller. *out is NULL if nothing is written.
+ */
+Compressor *
+compressor_open_mem(CompressMethod method, int level, char **out,
+					ChecksumAlgorithm checksum, pg_crc32 *crc,
+					size_t *write_size)
+{
+	Compressor *self;
+
+	self = compressor_open(method, level, NULL, checksum, crc, write_size);
+	self->mem = out;
+	*out = NULL;
+
+	return self;
+}
+
+/*
+ * Allocate the stream and the output buffer, and write the header of the
+ * stream if the method has it.
+ */
+static void
+compressor_start(Compressor *self)
+{
+	self->started = true;
+
+	switch (self->method)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_METHOD_ZLIB:
+			self->bufsize = COMPRESS_BUFSIZE;
+			self->buf = pgut_malloc(self->bufsize);
+			self->z.zalloc = Z_NULL;
+			self->z.zfree = Z_NULL;
+			self->z.opaque = Z_NULL;
+			if (deflateInit(&self->z, self->level > 0 ? self->level
+							: Z_DEFAULT_COMPRESSION) != Z_OK)
+				elog(ERROR_SYSTEM, _("can't initialize compression library: %s"),
+					self->z.msg);
+			self->z.next_out = (void *) self->buf;
+			self->z.avail_out = self->bufsize;
+			break;
+#endif
+#ifdef HAVE_LIBLZ4
+		case COMPRESS_METHOD_LZ4:
+		{
+			LZ4F_preferences_t	prefs;
+			size_t				ret;
+
+			memset(&prefs, 0, sizeof(prefs));
+			prefs.compressionLevel = self->level;
+
+			/* large enough for any input of COMPRESS_BUFSIZE bytes */
+			self->bufsize = LZ4F_compressBound(COMPRESS_BUFSIZE, &prefs) +
+							LZ4F_HEADER_SIZE_MAX;
+			self->buf = pgut_malloc(self->bufsize);
+
+			if (LZ4F_isError(LZ4F_createCompressionContext(&self->lz4,
+														   LZ4F_VERSION)))
+				elog(ERROR_SYSTEM, _("can't initialize compression library"));
+			ret = LZ4F_compressBegin(self->lz4, self->buf, self->bufsize, &prefs);
+			if (LZ4F_isError(ret))
+				elog(ERROR_SYSTEM, _("can't compress data: %s"),
+					LZ4F_getErrorName(ret));
+			compressor_flush(self, ret);
+			break;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case COMPRESS_METHOD_ZSTD:
+			self->bufsize = ZSTD_CStreamOutSize();
+			self->buf = pgut_malloc(self->bufsize);
+			self->zstd = ZSTD_createCCtx();
+			if (self->zstd == NULL ||
+				ZSTD_isError(ZSTD_CCtx_setParameter(self->zstd,
+									ZSTD_c_compressionLevel, self->level)))
+				elog(ERROR_SYSTEM, _("can't initialize compression library"));
+			break;
+#endif
+		default:
+			elog(ERROR_SYSTEM, _("unexpected compress-method %d"), self->method);
+	}
+}
+
+/* write len bytes of compressed data in the buffer */
+static void
+compressor_flush(Compressor *self, size_t len)
+{
+	if (len == 0)
+		return;
+
+	if (self->out == NULL)
+	{
+		if (self->memlen + len > self->memsize)
+		{
+			self->memsize = Max(self->memsize * 2, self->memlen + len);
+			*self->mem = pgut_realloc(*self->mem, self->memsize);
+		}
+		memcpy(*self->mem + self->memlen, self->buf, len);
+		self->memlen += len;
+	}
+	else if (fwrite(self->buf, 1, len, self->out) != len)
+		elog(ERROR_SYSTEM, _("can't write file: %s"), strerror(errno));
+
+	/* update CRC */
+	*self->crc = checksum_update(self->checksum, *self->crc, self->buf, len);
+	*self->write_size += len;
+}
+
+void
+compressor_write(Compressor *self, const void *buf, size_t len)
+{
+	MetricsTimer	timer;
+	size_t			input = len;
+
+	if (len == 0)
+		return;
+
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during deflate"));
+
+	/* compression time includes writing the compressed data */
+	metrics_start(&timer, PHASE_COMPRESS);
+
+	if (!self->started)
+		compressor_start(self);
+
+	switch (self->method)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_METHOD_ZLIB:
+			self->z.next_in = (void *) buf;
+			self->z.avail_in = len;
+
+			/* compresses until an input buffer becomes empty. */
+			while (self->z.avail_in > 0)
+			{
+				if (deflate(&self->z, Z_NO_FLUSH) == Z_STREAM_ERROR)
+					elog(ERROR_SYSTEM, _("can't compress data: %s"),
+						self->z.msg);
+				if (self->z.avail_out == 0)
+				{
+					compressor_flush(self, self->bufsize);
+					self->z.next_out = (void *) self->buf;
+					self->z.avail_out = self->bufsize;
+				}
+			}
+			break;
+#endif
+#ifdef HAVE_LIBLZ4
+		case COMPRESS_METHOD_LZ4:
+			while (len > 0)
+			{
+				size_t	chunk = Min(len, COMPRESS_BUFSIZE);
+				size_t	ret;
+
+				ret = LZ4F_compressUpdate(self->lz4, self->buf, self->bufsize,
+										  buf, chunk, NULL);
+				if (LZ4F_isError(ret))
+					elog(ERROR_SYSTEM, _("can't compress data: %s"),
+						LZ4F_getErrorName(ret));
+				compressor_flush(self, ret);
+				buf = (const char *) buf + chunk;
+				len -= chunk;
+			}
+			break;
+#endif
+#ifdef HAVE_LIBZSTD
+		case COMPRESS_METHOD_ZSTD:
+		{
+			ZSTD_inBuffer	in = { buf, len, 0 };
+
+			while (in.pos < in.size)
+			{
+				ZSTD_outBuffer	out = { self->buf, self->bufsize, 0 };
+				size_t			ret;
+
+				ret = ZSTD_compressStream2(self->zstd, &out, &in, ZSTD_e_continue);
+				if (ZSTD_isError(ret))
+					elog(ERROR_SYSTEM, _("can't compress data: %s"),
+						ZSTD_getErrorName(ret));
+				compressor_flush(self, out.pos);
+			}
+			break;
+		}
+#endif
+		default:
+			elog(ERROR_SYSTEM, _("unexpected compress-method %d"), self->method);
+	}
+
+	metrics_stop(&timer, input, 0);
+}
+
+/*
+ * Finish the stream and free the compressor. The output file is not closed.
+ */
+void
+compressor_close(Compressor *self)
+{
+	if (self->started)
+	{
+		MetricsTimer	timer;
+
+		metrics_start(&timer, PHASE_COMPRESS);
+		switch (self->method)
+		{
+#ifdef HAVE_LIBZ
+			case COMPRESS_METHOD_ZLIB:
+			{
+				int		status;
+
+				self->z.next_in = NULL;
+				self->z.avail_in = 0;
+				do
+				{
+					status = deflate(&self->z, Z_FINISH);
+					if (status == Z_STREAM_ERROR)
+						elog(ERROR_SYSTEM, _("can't compress data: %s"),
+							self->z.msg);
+					compressor_flush(self, self->bufsize - self->z.avail_out);
+					self->z.next_out = (void *) self->buf;
+					self->z.avail_out = self->bufsize;
+				} while (status != Z_STREAM_END);
+
+				if (deflateEnd(&self->z) != Z_OK)
+					elog(ERROR_SYSTEM, _("can't close compression stream: %s"),
+						self->z.msg);
+				break;
+			}
+#endif
+#ifdef HAVE_LIBLZ4
+			case COMPRESS_METHOD_LZ4:
+			{
+				size_t	ret;
+
+				ret = LZ4F_compressEnd(self->lz4, self->buf, self->bufsize, NULL);
+				if (LZ4F_isError(ret))
+					elog(ERROR_SYSTEM, _("can't compress data: %s"),
+						LZ4F_getErrorName(ret));
+				compressor_flush(self, ret);
+				LZ4F_freeCompressionContext(self->lz4);
+				break;
+			}
+#endif
+#ifdef HAVE_LIBZSTD
+			case COMPRESS_METHOD_ZSTD:
+			{
+				ZSTD_inBuffer	in = { NULL, 0, 0 };
+				size_t			ret;
+
+				do
+				{
+					ZSTD_outBuffer	out = { self->buf, self->bufsize, 0 };
+
+					ret = ZSTD_compressStream2(self->zstd, &out, &in, ZSTD_e_end);
+					if (ZSTD_isError(ret))
+						elog(ERROR_SYSTEM, _("can't compress data: %s"),
+							ZSTD_getErrorName(ret));
+					compressor_flush(self, out.pos);
+				} while (ret != 0);
+				ZSTD_freeCCtx(self->zstd);
+				break;
+			}
+#endif
+			default:
+				break;
+		}
+		metrics_stop(&timer, 0, 0);
+	}
+
+	free(self->buf);
+	free(self);
+}
+
+Decompressor *
+decompressor_open(CompressMethod method, FILE *in, size_t *read_size)
+{
+	Decompressor *self;
+
+	if (!compress_method_supported(method))
+		elog(ERROR_SYSTEM,
+			_("compress-method %s is not supported in this installation"),
+			compress_method_name(method));
+
+	self = pgut_new(Decompressor);
+	memset(self, 0, sizeof(Decompressor));
+	self->method = method;
+	self->in = in;
+	self->read_size = read_size;
+	self->buf = pgut_malloc(COMPRESS_BUFSIZE);
+
+	switch (method)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_METHOD_ZLIB:
+			self->z.zalloc = Z_NULL;
+			self->z.zfree = Z_NULL;
+			self->z.opaque = Z_NULL;
+			self->z.next_in = Z_NULL;
+			self->z.avail_in = 0;
+			if (inflateInit(&self->z) != Z_OK)
+				elog(ERROR_SYSTEM, _("can't initialize compression library: %s"),
+					self->z.msg);
+			break;
+#endif
+#ifdef HAVE_LIBLZ4
+		case COMPRESS_METHOD_LZ4:
+			if (LZ4F_isError(LZ4F_createDecompressionContext(&self->lz4,
+															 LZ4F_VERSION)))
+				elog(ERROR_SYSTEM, _("can't initialize compression library"));
+			break;
+#endif
+#ifdef HAVE_LIBZSTD
+		case COMPRESS_METHOD_ZSTD:
+			self->zstd = ZSTD_createDCtx();
+			if (self->zstd == NULL)
+				elog(ERROR_SYSTEM, _("can't initialize compression library"));
+			break;
+#endif
+		default:
+			elog(ERROR_SYSTEM, _("unexpected compress-method %d"), method);
+	}
+
+	return self;
+}
+
+/* open a decompressor reading len bytes of compressed data in memory */
+Decompressor *
+decompressor_open_mem(CompressMethod method, const char *data, size_t len,
+					  size_t *read_size)
+{
+	Decompressor *self;
+
+	self = decompressor_open(method, NULL, read_size);
+	self->mem = data;
+	self->memlen = len;
+
+	return self;
+}
+
+/* read the next part of the compressed file into the input buffer */
+static void
+decompressor_fill(Decompressor *self)
+{
+	size_t	read_len;
+
+	if (self->in == NULL)
+	{
+		read_len = Min(self->memlen, COMPRESS_BUFSIZE);
+		memcpy(self->buf, self->mem, read_len);
+		self->mem += read_len;
+		self->memlen -= read_len;
+		if (self->memlen == 0)
+			self->eof = true;
+	}
+	else if ((read_len = fread(self->buf, 1, COMPRESS_BUFSIZE, self->in)) !=
+			 COMPRESS_BUFSIZE)
+	{
+		if (!feof(self->in))
+			elog(ERROR_CORRUPTED, _("can't read compress file: %s"),
+				strerror(errno));
+		self->eof = true;
+	}
+
+	self->pos = 0;
+	self->avail = read_len;
+	*self->read_size += read_len;
+}
+
+/*
+ * Read up to len bytes of decompressed data into buf. Return the number of
+ * bytes read, which is less than len only at the end of the stream. An empty
+ * file is treated as an empty stream.
+ */
+size_t
+decompressor_read(Decompressor *self, void *buf, size_t len)
+{
+	MetricsTimer	timer;
+	size_t			done = 0;
+
+	/* decompression time includes reading the compressed data */
+	metrics_start(&timer, PHASE_DECOMPRESS);
+	while (done < len && !self->finished)
+	{
+		size_t	produced;
+		size_t	consumed;
+
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during inflate"));
+
+		/* input buffer becomes empty, read it from a file. */
+		if (self->avail == 0 && !self->eof)
+			decompressor_fill(self);
+
+		/* empty file has no stream */
+		if (self->avail == 0 && *self->read_size == 0)
+		{
+			self->finished = true;
+			break;
+		}
+
+		switch (self->method)
+		{
+#ifdef HAVE_LIBZ
+			case COMPRESS_METHOD_ZLIB:
+			{
+				int		status;
+
+				self->z.next_in = (void *) (self->buf + self->pos);
+				self->z.avail_in = self->avail;
+				self->z.next_out = (void *) ((char *) buf + done);
+				self->z.avail_out = len - done;
+				status = inflate(&self->z, Z_NO_FLUSH);
+				if (status != Z_OK && status != Z_STREAM_END &&
+					status != Z_BUF_ERROR)
+					elog(ERROR_CORRUPTED, _("can't uncompress data: %s"),
+						self->z.msg ? self->z.msg : "");
+				consumed = self->avail - self->z.avail_in;
+				produced = (len - done) - self->z.avail_out;
+				if (status == Z_STREAM_END)
+					self->finished = true;
+				break;
+			}
+#endif
+#ifdef HAVE_LIBLZ4
+			case COMPRESS_METHOD_LZ4:
+			{
+				size_t	ret;
+
+				consumed = self->avail;
+				produced = len - done;
+				ret = LZ4F_decompress(self->lz4, (char *) buf + done, &produced,
+									  self->buf + self->pos, &consumed, NULL);
+				if (LZ4F_isError(ret))
+					elog(ERROR_CORRUPTED, _("can't uncompress data: %s"),
+						LZ4F_getErrorName(ret));
+				if (ret == 0)
+					self->finished = true;
+				break;
+			}
+#endif
+#ifdef HAVE_LIBZSTD
+			case COMPRESS_METHOD_ZSTD:
+			{
+				ZSTD_inBuffer	in = { self->buf + self->pos, self->avail, 0 };
+				ZSTD_outBuffer	out = { (char *) buf + done, len - done, 0 };
+				size_t			ret;
+
+				ret = ZSTD_decompressStream(self->zstd, &out, &in);
+				if (ZSTD_isError(ret))
+					elog(ERROR_CORRUPTED, _("can't uncompress data: %s"),
+						ZSTD_getErrorName(ret));
+				consumed = in.pos;
+				produced = out.pos;
+				if (ret == 0)
+					self->finished = true;
+				break;
+			}
+#endif
+			default:
+				elog(ERROR_SYSTEM, _("unexpected compress-method %d"),
+					self->method);
+				return 0;
+		}
+
+		/* no more input and no more output, but the stream is not ended */
+		if (consumed == 0 && produced == 0 && !self->finished &&
+			self->avail == 0 && self->eof)
+			elog(ERROR_CORRUPTED, _("compressed file is truncated"));
+
+		self->pos += consumed;
+		self->avail -= consumed;
+		done += produced;
+	}
+	metrics_stop(&timer, done, 0);
+
+	return done;
+}
+
+/*
+ * Free the decompressor. The input file is not closed.
+ */
+void
+decompressor_close(Decompressor *self)
+{
+	switch (self->method)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_METHOD_ZLIB:
+			if (inflateEnd(&self->z) != Z_OK)
+				elog(ERROR_SYSTEM, _("can't close compression stream: %s"),
+					self->z.msg);
+			break;
+#endif
+#ifdef HAVE_LIBLZ4
+		case COMPRESS_METHOD_LZ4:
+			LZ4F_freeDecompressionContext(self->lz4);
+			break;
+#endif
+#ifdef HAVE_LIBZSTD
+		case COMPRESS_METHOD_ZSTD:
+			ZSTD_freeDCtx(self->zstd);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	free(self->buf);
+	free(self);
+}
@@ -9,12 +9,20 @@
 
 #include "pg_rman.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(__linux__) && !defined(WIN32)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
 #include "libpq/pqsignal.h"
+#include "pgut/pgut-pthread.h"
 #include "storage/block.h"
 #include "storage/bufpage.h"
 
@@ -22,140 +30,6 @@
 #define XLogRecPtrIsInvalid(r)	((r).xrecoff == 0)
 #endif
 
-#ifdef HAVE_LIBZ
-#include <zlib.h>
-
-#define zlibOutSize 4096
-#define zlibInSize  4096
-
-static int doDeflate(z_stream *zp, size_t in_size, size_t out_size, void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32 *crc, size_t *write_size,
-	int flash);
-static int doInflate(z_stream *zp, size_t in_size, size_t out_size,void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32 *crc, size_t *read_size);
-
-static int
-doDeflate(z_stream *zp, size_t in_size, size_t out_size, void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32 *crc, size_t *write_size,
-	int flash)
-{
-	int	status;
-
-	zp->next_in = inbuf;
-	zp->avail_in = in_size;
-
-	/* compresses until an input buffer becomes empty. */
-	do
-	{
-		if (interrupted)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_INTERRUPTED, _("interrupted during deflate"));
-		}
-
-		status = deflate(zp, flash);
-
-		if (status == Z_STREAM_ERROR)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't compress data: %s"), zp->msg);
-		}
-
-		if (fwrite(outbuf, 1, out_size - zp->avail_out, out) !=
-				out_size - zp->avail_out)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't write file: %s"), strerror(errno));
-		}
-
-		/* update CRC */
-		COMP_CRC32(*crc, outbuf, out_size - zp->avail_out);
-
-		*write_size += out_size - zp->avail_out;
-
-		zp->next_out = outbuf;
-		zp->avail_out = out_size;
-	} while (zp->avail_in != 0);
-
-	return status;
-}
-
-static int
-doInflate(z_stream *zp, size_t in_size, size_t out_size,void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32 *crc, size_t *read_size)
-{
-	int	status = Z_OK;
-
-	zp->next_out = outbuf;
-	zp->avail_out = out_size;
-
-	/* decompresses until an output buffer becomes full. */
-	for (;;)
-	{
-		if (interrupted)
-			elog(ERROR_INTERRUPTED, _("interrupted during inflate"));
-
-		/* input buffer becomes empty, read it from a file. */
-		if (zp->avail_in == 0)
-		{
-			size_t	read_len;
-
-			read_len = fread(inbuf, 1, in_size, in);
-
-			if (read_len != in_size)
-			{
-				int errno_tmp = errno;
-
-				if (!feof(in))
-				{
-					fclose(in);
-					fclose(out);
-					elog(ERROR_CORRUPTED,
-						_("can't read compress file: %s"), strerror(errno_tmp));
-				}
-
-				if (read_len == 0 && *read_size == 0)
-					return Z_STREAM_END;
-			}
-
-			zp->next_in = inbuf;
-			zp->avail_in = read_len;
-			*read_size += read_len;
-		}
-
-		/* decompresses input file data */
-		status = inflate(zp, Z_NO_FLUSH);
-
-		if (status == Z_STREAM_END)
-		{
-			if (feof(in))
-				break;
-			/* not reached to EOF, read again */
-		}
-		else if (status == Z_OK)
-		{
-			if (zp->avail_out == 0)
-				break;
-			/* more input needed to fill out_buf */
-		}
-		else if (status != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't uncompress data: %s"), strerror(errno));
-		}
-	}
-
-	/* update CRC */
-	COMP_CRC32(*crc, outbuf, out_size - zp->avail_out);
-
-	return status;
-}
-#endif
-
 #define PG_PAGE_LAYOUT_VERSION_v80		2	/* 8.0 */
 #define PG_PAGE_LAYOUT_VERSION_v81		3	/* 8.1 - 8.2 */
 #define PG_PAGE_LAYOUT_VERSION_v83		4	/* 8.3 - */
@@ -213,6 +87,8 @@ typedef struct BackupPageHeader
 	uint16		hole_length;	/* number of bytes in "hole" */
 } BackupPageHeader;
 
+static bool page_is_zero(const DataPage *page);
+
 static bool
 parse_page(const DataPage *page, int server_version,
 		   XLogRecPtr *lsn, uint16 *offset, uint16 *length)
@@ -265,35 +141,1016 @@ parse_page(const DataPage *page, int server_version,
 			return true;
 		}
 	}
+
+	/*
+	 * Pages never initialized, which bulk-extended relations often have, are
+	 * all zero. Whole of the page is the hole, and only the header is stored.
+	 */
+	if (page_is_zero(page))
+	{
+		lsn->xlogid = lsn->xrecoff = 0;
+		*offset = 0;
+		*length = BLCKSZ;
+		return true;
+	}
 	
 	*offset = *length = 0;
 	return false;
 }
 
+static bool
+page_is_zero(const DataPage *page)
+{
+	static const char	zero_page[BLCKSZ];
+
+	return memcmp(page->data, zero_page, BLCKSZ) == 0;
+}
+
+/*
+ * Restored pages are gathered in runs of contiguous blocks and each run is
+ * written with one pwrite(), instead of seeking and writing every page
+ * through stdio. Pages are read directly into the run buffer, which is
+ * aligned to BLCKSZ and reused for all runs of the file.
+ *
+ * A full run is written asynchronously from the buffer while the next run
+ * is gathered in another buffer, so writing overlaps with decompression.
+ *
+ * With --delta, the pages of the run in the existing file are read first,
+ * and only the pages which differ from them are written.
+ */
+#define BLOCK_WRITER_PAGES		32		/* 256kB runs with 8kB pages */
+
+typedef struct BlockWriter
+{
+	int			fd;			/* restore target file */
+	const char *path;		/* path of fd, for messages */
+	BlockNumber	start;		/* first block of the run */
+	int			npages;		/* number of pages in the run */
+	char	   *buf;		/* BLOCK_WRITER_PAGES pages, aligned */
+	char	   *unaligned;	/* buf before alignment, to be freed */
+	AsyncIO		io;			/* write of the previous run */
+	char	   *spare;		/* buffer of the previous run, or NULL */
+	char	   *spare_unaligned;
+	char	   *existing;	/* pages of the run in the file, for --delta */
+	BlockNumber	nkept;		/* pages not written since they are the same */
+} BlockWriter;
+
+static void block_writer_init(BlockWriter *bw, int fd, const char *path);
+static char *block_writer_get(BlockWriter *bw, BlockNumber blknum);
+static void block_writer_flush(BlockWriter *bw, bool async);
+static void block_writer_write(BlockWriter *bw, int first, int npages);
+static void block_writer_wait(BlockWriter *bw);
+static void block_writer_term(BlockWriter *bw);
+static void preallocate_file(int fd, off_t size);
+
+static void
+block_writer_init(BlockWriter *bw, int fd, const char *path)
+{
+	bw->fd = fd;
+	bw->path = path;
+	bw->start = 0;
+	bw->npages = 0;
+	bw->unaligned = pgut_malloc(BLOCK_WRITER_PAGES * BLCKSZ + BLCKSZ);
+	bw->buf = (char *) TYPEALIGN(BLCKSZ, bw->unaligned);
+	bw->io.pending = false;
+	bw->spare = bw->spare_unaligned = NULL;
+	bw->existing = delta ? pgut_malloc(BLOCK_WRITER_PAGES * BLCKSZ) : NULL;
+	bw->nkept = 0;
+}
+
+/*
+ * Return the buffer for the page of blknum in the run. The current run is
+ * written first if the block doesn't follow it or the run is full.
+ */
+static char *
+block_writer_get(BlockWriter *bw, BlockNumber blknum)
+{
+	if (bw->npages > 0 &&
+		(blknum != bw->start + bw->npages || bw->npages >= BLOCK_WRITER_PAGES))
+		block_writer_flush(bw, true);
+	if (bw->npages == 0)
+		bw->start = blknum;
+	return bw->buf + (bw->npages++) * BLCKSZ;
+}
+
+/*
+ * Write the run. If async is true, the write is started and the buffer is
+ * swapped with the spare one after the previous write finishes.
+ */
+static void
+block_writer_flush(BlockWriter *bw, bool async)
+{
+	ssize_t	len;
+	int		first;
+	int		i;
+
+	block_writer_wait(bw);
+
+	if (bw->existing == NULL && async)
+	{
+		char   *buf = bw->buf;
+
+		if (bw->spare == NULL)
+		{
+			bw->spare_unaligned = pgut_malloc(BLOCK_WRITER_PAGES * BLCKSZ +
+											  BLCKSZ);
+			bw->spare = (char *) TYPEALIGN(BLCKSZ, bw->spare_unaligned);
+		}
+		async_io_start(&bw->io, bw->fd, true, buf, (size_t) bw->npages * BLCKSZ,
+					   (off_t) bw->start * BLCKSZ);
+		bw->buf = bw->spare;
+		bw->spare = buf;
+		bw->npages = 0;
+		return;
+	}
+	if (bw->existing == NULL)
+	{
+		block_writer_write(bw, 0, bw->npages);
+		bw->npages = 0;
+		return;
+	}
+
+	/* pages beyond the end of the existing file always differ */
+	len = pread(bw->fd, bw->existing, (size_t) bw->npages * BLCKSZ,
+				(off_t) bw->start * BLCKSZ);
+	if (len < 0)
+		elog(ERROR_SYSTEM, _("can't read block %u of \"%s\": %s"),
+			bw->start, bw->path, strerror(errno));
+
+	/* write each run of pages which differ */
+	for (first = -1, i = 0; i <= bw->npages; i++)
+	{
+		bool	same = (i < bw->npages &&
+						(i + 1) * BLCKSZ <= len &&
+						memcmp(bw->buf + i * BLCKSZ,
+							   bw->existing + i * BLCKSZ, BLCKSZ) == 0);
+
+		if (i < bw->npages && !same)
+		{
+			if (first < 0)
+				first = i;
+			continue;
+		}
+		if (first >= 0)
+			block_writer_write(bw, first, i - first);
+		if (same)
+			bw->nkept++;
+		first = -1;
+	}
+	bw->npages = 0;
+}
+
+/* write npages pages from the first one in the run */
+static void
+block_writer_write(BlockWriter *bw, int first, int npages)
+{
+	size_t	len = (size_t) npages * BLCKSZ;
+	size_t	done = 0;
+	off_t	offset = (off_t) (bw->start + first) * BLCKSZ;
+
+	while (done < len)
+	{
+		ssize_t	rc;
+
+		rc = pwrite(bw->fd, bw->buf + (size_t) first * BLCKSZ + done,
+					len - done, offset + done);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+		{
+			if (rc == 0)
+				errno = ENOSPC;
+			elog(ERROR_SYSTEM, _("can't write block %u of \"%s\": %s"),
+				bw->start + first + (BlockNumber) (done / BLCKSZ), bw->path,
+				strerror(errno));
+		}
+		done += rc;
+	}
+}
+
+/* wait for the write of the previous run */
+static void
+block_writer_wait(BlockWriter *bw)
+{
+	if (!bw->io.pending)
+		return;
+	if (async_io_wait(&bw->io) < 0)
+		elog(ERROR_SYSTEM, _("can't write block %u of \"%s\": %s"),
+			(BlockNumber) (bw->io.offset / BLCKSZ), bw->path, strerror(errno));
+}
+
+/* write the last run and release the buffers */
+static void
+block_writer_term(BlockWriter *bw)
+{
+	if (bw->npages > 0)
+		block_writer_flush(bw, false);
+	block_writer_wait(bw);
+	free(bw->unaligned);
+	free(bw->spare_unaligned);
+	free(bw->existing);
+	bw->buf = bw->unaligned = bw->existing = NULL;
+	bw->spare = bw->spare_unaligned = NULL;
+}
+
+/*
+ * Extend the restore target to the size in advance, so that the file system
+ * can allocate contiguous space for it. It is only a hint; files are never
+ * shrunk and errors are ignored because writing pages reports them anyway.
+ */
+static void
+preallocate_file(int fd, off_t size)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+	struct stat	st;
+
+	if (fstat(fd, &st) == 0 && st.st_size < size)
+		(void) posix_fallocate(fd, st.st_size, size - st.st_size);
+#endif
+}
+
+/*
+ * Compressed data files are written in chunked format. Blocks are grouped
+ * into chunks of chunk_pages blocks, and each chunk is an independent
+ * compressed stream of BackupPageHeader and page images, so chunks of one
+ * file can be compressed and decompressed by several threads. Chunks are
+ * appended in the order they are finished, and the index at the end of file
+ * locates the chunk of any block.
+ *
+ *   ChunkedFileHeader
+ *   compressed chunk ...
+ *   ChunkIndexEntry[nchunks]	(sorted by first_block)
+ *   ChunkedFileTrailer
+ *
+ * The magic at the beginning never matches a zlib, lz4 or zstd stream, so
+ * compressed data files of older backups are still read as one stream.
+ *
+ * Data files backed up with --dedup have the same layout with another magic,
+ * but chunks are in the dedup store and DedupIndexEntry holds the hash of the
+ * chunk instead of the offset. Chunks are smaller so that more of them are
+ * shared; the length and CRC in the entry are of pages before compression.
+ */
+#define CHUNKED_FILE_MAGIC		"PGRMCHNK"
+#define CHUNKED_FILE_PAGES		128		/* 1MB chunks with 8kB pages */
+#define DEDUP_FILE_MAGIC		"PGRMDDUP"
+#define DEDUP_FILE_PAGES		16		/* 128kB chunks with 8kB pages */
+
+typedef struct ChunkedFileHeader
+{
+	char		magic[8];		/* CHUNKED_FILE_MAGIC */
+	uint32		chunk_pages;	/* number of blocks covered by a chunk */
+	uint32		method;			/* CompressMethod of chunks */
+} ChunkedFileHeader;
+
+typedef struct ChunkIndexEntry
+{
+	BlockNumber	first_block;	/* first block covered by the chunk */
+	uint32		length;			/* compressed size of the chunk */
+	uint64		offset;			/* offset of the chunk in the file */
+	pg_crc32	crc;			/* CRC of the compressed chunk */
+	uint32		tail_len;		/* bytes of the last page of the file in the
+								   chunk if it is partial, or 0 */
+} ChunkIndexEntry;
+
+typedef struct ChunkedFileTrailer
+{
+	uint64		index_offset;	/* offset of the chunk index */
+	uint32		nchunks;		/* number of index entries */
+	char		magic[4];		/* first 4 bytes of CHUNKED_FILE_MAGIC */
+} ChunkedFileTrailer;
+
+typedef struct DedupIndexEntry
+{
+	ChunkIndexEntry	chunk;		/* offset is not used */
+	unsigned char	hash[SHA256_DIGEST_LENGTH];
+} DedupIndexEntry;
+
+/* a chunked file being written or read, shared by chunk jobs */
+typedef struct ChunkedFile
+{
+	pthread_mutex_t	lock;		/* protects fields below */
+	pthread_cond_t	changed;	/* fired when a chunk job finishes */
+	int				pending;	/* number of unfinished chunk jobs */
+	FILE		   *fp;			/* backup or restore target file */
+	const char	   *path;		/* path of fp, for messages */
+	CompressMethod	method;
+	ChecksumAlgorithm checksum;	/* of chunks and the whole file */
+	uint32			chunk_pages;
+	bool			dedup;		/* chunks are in the dedup store? */
+	bool			compress;	/* chunks in the dedup store are compressed? */
+	/* for backup */
+	bool			started;	/* header is written? */
+	parray		   *index;		/* list of ChunkIndexEntry */
+	uint64			offset;		/* current end of the file */
+	pg_crc32		crc;		/* CRC of the whole file */
+	/* for restore */
+	datapagemap_t  *written;	/* blocks not to be overwritten, or NULL */
+	BlockNumber		nblocks;	/* blocks of the file restored */
+	BlockNumber		nkept;		/* pages not written for --delta */
+} ChunkedFile;
+
+/* a chunk to be compressed or decompressed, possibly by a worker thread */
+typedef struct ChunkJob
+{
+	void		  (*routine)(struct ChunkJob *);
+	ChunkedFile	   *cf;
+	ChunkIndexEntry	entry;
+	unsigned char	hash[SHA256_DIGEST_LENGTH];	/* of a chunk in dedup store */
+	char		   *data;		/* raw pages for backup, compressed for restore */
+	size_t			len;
+} ChunkJob;
+
+/* worker threads shared by all chunked files, until chunk_queue_free() */
+static JobQueue		   *chunk_queue = NULL;
+static pthread_mutex_t	chunk_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void chunked_file_run(ChunkedFile *cf, ChunkJob *job);
+static void chunked_file_wait(ChunkedFile *cf, int maximum);
+static void chunked_file_done(ChunkedFile *cf);
+static ChunkedFile *chunked_file_new(FILE *fp, const char *path,
+									 CompressMethod method,
+									 ChecksumAlgorithm checksum);
+static void chunked_file_free(ChunkedFile *cf);
+static ChunkJob *chunk_add_page(ChunkedFile *cf, ChunkJob *chunk,
+								const BackupPageHeader *header,
+								const char *page);
+static void chunk_compress(ChunkJob *job);
+static void chunk_decompress(ChunkJob *job);
+static void chunked_file_write(ChunkedFile *cf, const void *buf, size_t len,
+							   size_t *write_size);
+static void chunked_file_finish(ChunkedFile *cf, ChunkJob *chunk,
+								size_t *write_size);
+static size_t chunk_read(Decompressor *zp, const char **raw, const char *end,
+						 void *buf, size_t len);
+static void *read_chunk_index(FILE *in, const char *path,
+							  const ChunkedFileHeader *header,
+							  size_t entry_size, uint32 *nchunks, int elevel);
+static bool restore_chunked_file(FILE *in, FILE *out, const char *to_path,
+								 pgFile *file, ChecksumAlgorithm checksum,
+								 datapagemap_t *written, BlockNumber *nblocks,
+								 BlockNumber *nkept);
+
+/*
+ * Terminate the worker threads of chunks at the end of a command. All of the
+ * chunked files must have been finished.
+ */
+void
+chunk_queue_free(void)
+{
+	pgut_mutex_lock(&chunk_queue_lock);
+	if (chunk_queue != NULL)
+	{
+		JobQueue_wait(chunk_queue);
+		JobQueue_free(chunk_queue);
+		chunk_queue = NULL;
+	}
+	pthread_mutex_unlock(&chunk_queue_lock);
+}
+
+/*
+ * Run a chunk job in the worker threads, or in the current thread when the
+ * backup runs with single job. The number of chunks in flight is limited to
+ * bound the memory used by a file. The job is freed after it runs.
+ */
+static void
+chunked_file_run(ChunkedFile *cf, ChunkJob *job)
+{
+	if (num_threads <= 1)
+	{
+		cf->pending++;
+		job->routine(job);
+		free(job);
+		return;
+	}
+
+	pgut_mutex_lock(&chunk_queue_lock);
+	if (chunk_queue == NULL)
+		chunk_queue = JobQueue_new(num_threads);
+	pthread_mutex_unlock(&chunk_queue_lock);
+	chunked_file_wait(cf, num_threads * 2);
+
+	pgut_mutex_lock(&cf->lock);
+	cf->pending++;
+	pthread_mutex_unlock(&cf->lock);
+	JobQueue_push(chunk_queue, (Job *) job);
+}
+
+/* wait until the number of unfinished chunk jobs goes under maximum */
+static void
+chunked_file_wait(ChunkedFile *cf, int maximum)
+{
+	pgut_mutex_lock(&cf->lock);
+	while (cf->pending > 0 && cf->pending >= maximum)
+		pgut_cond_wait(&cf->changed, &cf->lock);
+	pthread_mutex_unlock(&cf->lock);
+}
+
+/* finish a chunk job; must be called with the lock held */
+static void
+chunked_file_done(ChunkedFile *cf)
+{
+	cf->pending--;
+	pthread_cond_broadcast(&cf->changed);
+}
+
+static ChunkedFile *
+chunked_file_new(FILE *fp, const char *path, CompressMethod method,
+				 ChecksumAlgorithm checksum)
+{
+	ChunkedFile *cf = pgut_new(ChunkedFile);
+
+	memset(cf, 0, sizeof(ChunkedFile));
+	pthread_mutex_init(&cf->lock, NULL);
+	pthread_cond_init(&cf->changed, NULL);
+	cf->fp = fp;
+	cf->path = path;
+	cf->method = method;
+	cf->checksum = checksum;
+	cf->chunk_pages = CHUNKED_FILE_PAGES;
+	cf->index = parray_new();
+	INIT_CRC32(cf->crc);
+
+	return cf;
+}
+
+/* free the chunked file after all chunk jobs are finished */
+static void
+chunked_file_free(ChunkedFile *cf)
+{
+	chunked_file_wait(cf, 1);
+	pthread_mutex_destroy(&cf->lock);
+	pthread_cond_destroy(&cf->changed);
+	parray_walk(cf->index, free);
+	parray_free(cf->index);
+	free(cf);
+}
+
+/*
+ * Add a page image excluding hole into the chunk covering the block. The
+ * previous chunk is handed to the compression when the block is out of the
+ * range of it. Returns the chunk the page was added to.
+ */
+static ChunkJob *
+chunk_add_page(ChunkedFile *cf, ChunkJob *chunk,
+			   const BackupPageHeader *header, const char *page)
+{
+	int		upper_offset = header->hole_offset + header->hole_length;
+	int		upper_length = BLCKSZ - upper_offset;
+
+	if (chunk != NULL &&
+		header->block >= chunk->entry.first_block + cf->chunk_pages)
+	{
+		chunked_file_run(cf, chunk);
+		chunk = NULL;
+	}
+
+	/* write the header before the first chunk */
+	if (!cf->started)
+	{
+		ChunkedFileHeader	fheader;
+
+		memset(&fheader, 0, sizeof(fheader));
+		memcpy(fheader.magic, cf->dedup ? DEDUP_FILE_MAGIC : CHUNKED_FILE_MAGIC,
+			   sizeof(fheader.magic));
+		fheader.chunk_pages = cf->chunk_pages;
+		fheader.method = cf->method;
+		chunked_file_write(cf, &fheader, sizeof(fheader), NULL);
+		cf->started = true;
+	}
+
+	if (chunk == NULL)
+	{
+		chunk = pgut_new(ChunkJob);
+		memset(chunk, 0, sizeof(ChunkJob));
+		chunk->routine = chunk_compress;
+		chunk->cf = cf;
+		chunk->entry.first_block = header->block - header->block % cf->chunk_pages;
+		chunk->data = pgut_malloc(cf->chunk_pages *
+								  (sizeof(BackupPageHeader) + BLCKSZ));
+	}
+
+	memcpy(chunk->data + chunk->len, header, sizeof(BackupPageHeader));
+	chunk->len += sizeof(BackupPageHeader);
+	memcpy(chunk->data + chunk->len, page, header->hole_offset);
+	chunk->len += header->hole_offset;
+	memcpy(chunk->data + chunk->len, page + upper_offset, upper_length);
+	chunk->len += upper_length;
+
+	return chunk;
+}
+
+/*
+ * Write to the backup file and update the CRC of the whole file. Must be
+ * called with the lock held, or with no chunk jobs running.
+ */
+static void
+chunked_file_write(ChunkedFile *cf, const void *buf, size_t len,
+				   size_t *write_size)
+{
+	if (fwrite(buf, 1, len, cf->fp) != len)
+		elog(ERROR_SYSTEM, _("can't write backup file \"%s\": %s"),
+			cf->path, strerror(errno));
+	cf->crc = checksum_update(cf->checksum, cf->crc, buf, len);
+	cf->offset += len;
+	if (write_size)
+		*write_size += len;
+}
+
+/*
+ * Compress a chunk into memory, and append it to the backup file. Chunks of
+ * a deduplicated file are put into the dedup store instead.
+ */
+static void
+chunk_compress(ChunkJob *job)
+{
+	ChunkedFile	   *cf = job->cf;
+	char		   *buf = NULL;
+	size_t			len = 0;
+	pg_crc32		crc;
+	Compressor	   *zp;
+	ChunkIndexEntry *entry;
+
+	if (cf->dedup)
+	{
+		DedupIndexEntry *dentry = pgut_new(DedupIndexEntry);
+
+		memset(dentry, 0, sizeof(DedupIndexEntry));
+		dentry->chunk.first_block = job->entry.first_block;
+		dentry->chunk.tail_len = job->entry.tail_len;
+		dentry->chunk.length = job->len;
+		INIT_CRC32(crc);
+		crc = checksum_update(cf->checksum, crc, job->data, job->len);
+		FIN_CRC32(crc);
+		dentry->chunk.crc = crc;
+		dedup_put(job->data, job->len, cf->compress, cf->method, dentry->hash);
+
+		pgut_mutex_lock(&cf->lock);
+		parray_append(cf->index, dentry);
+		chunked_file_done(cf);
+		pthread_mutex_unlock(&cf->lock);
+
+		free(job->data);
+		return;
+	}
+
+	INIT_CRC32(crc);
+	zp = compressor_open_mem(cf->method, current.compress_level, &buf,
+							 cf->checksum, &crc, &len);
+	compressor_write(zp, job->data, job->len);
+	compressor_close(zp);
+	FIN_CRC32(crc);
+
+	entry = pgut_new(ChunkIndexEntry);
+	memset(entry, 0, sizeof(ChunkIndexEntry));
+	entry->first_block = job->entry.first_block;
+	entry->tail_len = job->entry.tail_len;
+	entry->length = len;
+	entry->crc = crc;
+
+	pgut_mutex_lock(&cf->lock);
+	entry->offset = cf->offset;
+	chunked_file_write(cf, buf, len, NULL);
+	parray_append(cf->index, entry);
+	chunked_file_done(cf);
+	pthread_mutex_unlock(&cf->lock);
+
+	free(buf);
+	free(job->data);
+}
+
+static int
+chunk_index_compare(const void *l, const void *r)
+{
+	const ChunkIndexEntry *le = *(const ChunkIndexEntry **) l;
+	const ChunkIndexEntry *re = *(const ChunkIndexEntry **) r;
+
+	if (le->first_block < re->first_block)
+		return -1;
+	else if (le->first_block > re->first_block)
+		return 1;
+	return 0;
+}
+
+/*
+ * Compress the last chunk, wait for all chunks and write the index. The
+ * header is written before the first chunk, so nothing is written if the
+ * file has no chunk.
+ */
+static void
+chunked_file_finish(ChunkedFile *cf, ChunkJob *chunk, size_t *write_size)
+{
+	ChunkedFileTrailer	trailer;
+	int					i;
+
+	if (chunk != NULL)
+		chunked_file_run(cf, chunk);
+	chunked_file_wait(cf, 1);
+
+	/* chunk sizes are counted here, after all of them are written */
+	*write_size = cf->offset;
+	if (parray_num(cf->index) == 0)
+		return;
+
+	parray_qsort(cf->index, chunk_index_compare);
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.index_offset = cf->offset;
+	trailer.nchunks = parray_num(cf->index);
+	memcpy(trailer.magic, CHUNKED_FILE_MAGIC, sizeof(trailer.magic));
+
+	for (i = 0; i < parray_num(cf->index); i++)
+		chunked_file_write(cf, parray_get(cf->index, i),
+						   cf->dedup ? sizeof(DedupIndexEntry) :
+						   sizeof(ChunkIndexEntry), write_size);
+	chunked_file_write(cf, &trailer, sizeof(trailer), write_size);
+}
+
+/* read from the decompressor, or from pages in memory if zp is NULL */
+static size_t
+chunk_read(Decompressor *zp, const char **raw, const char *end, void *buf,
+		   size_t len)
+{
+	if (zp != NULL)
+		return decompressor_read(zp, buf, len);
+
+	len = Min(len, (size_t) (end - *raw));
+	memcpy(buf, *raw, len);
+	*raw += len;
+	return len;
+}
+
+/*
+ * Decompress a chunk and write its pages into the restore target. Chunks in
+ * the dedup store are read here, so they are read in parallel too.
+ */
+static void
+chunk_decompress(ChunkJob *job)
+{
+	ChunkedFile	   *cf = job->cf;
+	Decompressor   *zp = NULL;
+	const char	   *raw = NULL;
+	const char	   *raw_end = NULL;
+	BlockWriter		bw;
+	size_t			read_size = 0;
+	BlockNumber		end_block = job->entry.first_block + cf->chunk_pages;
+	BlockNumber		nblocks = 0;
+	BlockNumber		last_block = InvalidBlockNumber;	/* last page written */
+
+	if (cf->dedup)
+	{
+		job->data = dedup_get(job->hash, job->entry.length, job->entry.crc,
+							  cf->checksum, ERROR_CORRUPTED);
+		raw = job->data;
+		raw_end = raw + job->entry.length;
+	}
+	else
+	{
+		zp = decompressor_open_mem(cf->method, job->data, job->len,
+								   &read_size);
+	}
+	block_writer_init(&bw, fileno(cf->fp), cf->path);
+
+	for (;;)
+	{
+		BackupPageHeader	header;
+		DataPage			page;	/* used for skipped pages */
+		char			   *data;
+		size_t				read_len;
+		int					upper_offset;
+		int					upper_length;
+		bool				skip = false;
+
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during restore database"));
+
+		read_len = chunk_read(zp, &raw, raw_end, &header, sizeof(header));
+		if (read_len == 0)
+			break;		/* end of chunk */
+		if (read_len != sizeof(header) ||
+			header.block < job->entry.first_block ||
+			header.block >= end_block || header.hole_offset > BLCKSZ ||
+			(int) header.hole_offset + (int) header.hole_length > BLCKSZ)
+			elog(ERROR_CORRUPTED, _("backup is broken at block %u of \"%s\""),
+				header.block, cf->path);
+		if (header.block >= nblocks)
+			nblocks = header.block + 1;
+
+		/* blocks of a chunk don't overlap with other chunks of the file */
+		if (cf->written != NULL)
+		{
+			pgut_mutex_lock(&cf->lock);
+			if (datapagemap_is_set(cf->written, header.block))
+				skip = true;
+			else
+				datapagemap_add(cf->written, header.block);
+			pthread_mutex_unlock(&cf->lock);
+		}
+		data = skip ? page.data : block_writer_get(&bw, header.block);
+		last_block = skip ? InvalidBlockNumber : header.block;
+
+		upper_offset = header.hole_offset + header.hole_length;
+		upper_length = BLCKSZ - upper_offset;
+
+		/* read lower/upper into the page and restore hole */
+		memset(data + header.hole_offset, 0, header.hole_length);
+		if (chunk_read(zp, &raw, raw_end, data, header.hole_offset) !=
+				header.hole_offset ||
+			chunk_read(zp, &raw, raw_end, data + upper_offset, upper_length) !=
+				upper_length)
+			elog(ERROR_CORRUPTED, _("can't read block %u of \"%s\""),
+				header.block, cf->path);
+	}
+
+	block_writer_term(&bw);
+	if (zp != NULL)
+		decompressor_close(zp);
+
+	/* the partial last page was restored as a whole page, so cut it */
+	if (job->entry.tail_len > 0 && last_block != InvalidBlockNumber &&
+		ftruncate(fileno(cf->fp),
+				  (off_t) last_block * BLCKSZ + job->entry.tail_len) == -1)
+		elog(ERROR_SYSTEM, _("can't truncate \"%s\": %s"), cf->path,
+			strerror(errno));
+
+	pgut_mutex_lock(&cf->lock);
+	cf->nblocks = Max(cf->nblocks, nblocks);
+	cf->nkept += bw.nkept;
+	chunked_file_done(cf);
+	pthread_mutex_unlock(&cf->lock);
+
+	free(job->data);
+}
+
+/*
+ * Read the chunk index of a chunked file whose header has been read. Returns
+ * a malloc'd array of nchunks entries, or NULL after a message at elevel if
+ * the index is broken.
+ */
+static void *
+read_chunk_index(FILE *in, const char *path, const ChunkedFileHeader *header,
+				 size_t entry_size, uint32 *nchunks, int elevel)
+{
+	ChunkedFileTrailer	trailer;
+	char			   *index;
+
+	if (header->chunk_pages == 0 ||
+		fseeko(in, -(off_t) sizeof(trailer), SEEK_END) != 0 ||
+		fread(&trailer, 1, sizeof(trailer), in) != sizeof(trailer) ||
+		memcmp(trailer.magic, CHUNKED_FILE_MAGIC, sizeof(trailer.magic)) != 0 ||
+		fseeko(in, (off_t) trailer.index_offset, SEEK_SET) != 0)
+	{
+		elog(elevel, _("chunk index of \"%s\" is broken"), path);
+		return NULL;
+	}
+
+	index = pgut_malloc(entry_size * Max(trailer.nchunks, 1));
+	if (fread(index, entry_size, trailer.nchunks, in) != trailer.nchunks)
+	{
+		free(index);
+		elog(elevel, _("chunk index of \"%s\" is broken"), path);
+		return NULL;
+	}
+
+	/* chunks are before the index, unless they are in the dedup store */
+	if (entry_size == sizeof(ChunkIndexEntry))
+	{
+		uint32	i;
+
+		for (i = 0; i < trailer.nchunks; i++)
+		{
+			ChunkIndexEntry *entry = (ChunkIndexEntry *) index + i;
+
+			if (entry->offset + entry->length > trailer.index_offset)
+			{
+				free(index);
+				elog(elevel, _("chunk index of \"%s\" is broken"), path);
+				return NULL;
+			}
+		}
+	}
+
+	*nchunks = trailer.nchunks;
+	return index;
+}
+
+/*
+ * Restore a data file in chunked format, or deduplicated one. Returns false
+ * with rewinding the input if the file is not in these formats. The number
+ * of blocks of the file and pages kept for --delta are set to nblocks and
+ * nkept.
+ */
+static bool
+restore_chunked_file(FILE *in, FILE *out, const char *to_path, pgFile *file,
+					 ChecksumAlgorithm checksum, datapagemap_t *written,
+					 BlockNumber *nblocks, BlockNumber *nkept)
+{
+	ChunkedFileHeader	header;
+	char			   *index;
+	size_t				entry_size;
+	uint32				nchunks;
+	bool				dedup;
+	ChunkedFile		   *cf;
+	uint32				i;
+
+	if (fread(&header, 1, sizeof(header), in) != sizeof(header))
+	{
+		rewind(in);
+		return false;
+	}
+	dedup = (memcmp(header.magic, DEDUP_FILE_MAGIC, sizeof(header.magic)) == 0);
+	if (!dedup &&
+		memcmp(header.magic, CHUNKED_FILE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		rewind(in);
+		return false;
+	}
+
+	entry_size = dedup ? sizeof(DedupIndexEntry) : sizeof(ChunkIndexEntry);
+	index = read_chunk_index(in, file->path, &header, entry_size, &nchunks,
+							 ERROR_CORRUPTED);
+
+	/* the file has at least as many blocks as the last chunk begins at */
+	if (nchunks > 0)
+	{
+		ChunkIndexEntry *last;
+
+		last = (ChunkIndexEntry *) (index + entry_size * (nchunks - 1));
+		if (last->first_block < RELSEG_SIZE)
+			preallocate_file(fileno(out), (off_t) last->first_block * BLCKSZ);
+	}
+
+	cf = chunked_file_new(out, to_path, (CompressMethod) header.method,
+						  checksum);
+	cf->chunk_pages = header.chunk_pages;
+	cf->dedup = dedup;
+	cf->written = written;
+
+	for (i = 0; i < nchunks; i++)
+	{
+		ChunkIndexEntry *entry = (ChunkIndexEntry *) (index + entry_size * i);
+		ChunkJob   *job;
+		pg_crc32	crc;
+
+		job = pgut_new(ChunkJob);
+		memset(job, 0, sizeof(ChunkJob));
+		job->routine = chunk_decompress;
+		job->cf = cf;
+		job->entry = *entry;
+
+		/* chunks in the dedup store are read and verified by the job */
+		if (dedup)
+		{
+			memcpy(job->hash, ((DedupIndexEntry *) entry)->hash,
+				   SHA256_DIGEST_LENGTH);
+			chunked_file_run(cf, job);
+			continue;
+		}
+
+		job->len = entry->length;
+		job->data = pgut_malloc(job->len);
+
+		if (fseeko(in, (off_t) entry->offset, SEEK_SET) != 0 ||
+			fread(job->data, 1, job->len, in) != job->len)
+			elog(ERROR_CORRUPTED, _("can't read chunk %u of \"%s\""),
+				i, file->path);
+
+		INIT_CRC32(crc);
+		crc = checksum_update(checksum, crc, job->data, job->len);
+		FIN_CRC32(crc);
+		if (crc != entry->crc)
+			elog(ERROR_CORRUPTED, _("CRC of chunk %u of \"%s\" must be %X but %X"),
+				i, file->path, entry->crc, crc);
+
+		chunked_file_run(cf, job);
+	}
+
+	chunked_file_wait(cf, 1);
+	*nblocks = cf->nblocks;
+	*nkept = cf->nkept;
+	chunked_file_free(cf);
+	free(index);
+
+	return true;
+}
+
+/*
+ * Validate chunks of a deduplicated data file in the dedup store with the
+ * checksum algorithm of the backup. Only the existence of chunks is checked
+ * if size_only is true. Returns false after a warning if a chunk is missing
+ * or broken; files not deduplicated are valid here.
+ */
+bool
+validate_dedup_file(const char *path, ChecksumAlgorithm checksum,
+					bool size_only)
+{
+	FILE			   *in;
+	ChunkedFileHeader	header;
+	DedupIndexEntry	   *index;
+	uint32				nchunks;
+	uint32				i;
+	bool				ok = true;
+
+	in = storage_fopen(path, "r");
+	if (in == NULL)
+	{
+		elog(WARNING, _("can't open backup file \"%s\": %s"), path,
+			strerror(errno));
+		return false;
+	}
+	if (fread(&header, 1, sizeof(header), in) != sizeof(header) ||
+		memcmp(header.magic, DEDUP_FILE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fclose(in);
+		return true;
+	}
+
+	index = read_chunk_index(in, path, &header, sizeof(DedupIndexEntry),
+							 &nchunks, WARNING);
+	fclose(in);
+	if (index == NULL)
+		return false;
+
+	for (i = 0; ok && i < nchunks; i++)
+	{
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during validate"));
+
+		if (size_only)
+		{
+			if (!dedup_exists(index[i].hash))
+			{
+				elog(WARNING, _("chunk %u of \"%s\" is missing"), i, path);
+				ok = false;
+			}
+		}
+		else
+		{
+			char   *data = dedup_get(index[i].hash, index[i].chunk.length,
+									 index[i].chunk.crc, checksum, WARNING);
+
+			ok = (data != NULL);
+			free(data);
+		}
+	}
+	free(index);
+
+	return ok;
+}
+
+/*
+ * Find the first run of contiguous blocks from *blknum in the map. Returns
+ * false if no more blocks are in the map.
+ */
+static bool
+pagemap_next_run(const datapagemap_t *map, BlockNumber *blknum,
+				 BlockNumber *nblocks)
+{
+	BlockNumber	start = *blknum;
+	BlockNumber	end;
+	BlockNumber	last = (BlockNumber) map->bitmapsize * 8;
+
+	while (start < last && !datapagemap_is_set(map, start))
+		start++;
+	if (start >= last)
+		return false;
+
+	for (end = start + 1; end < last && datapagemap_is_set(map, end); end++)
+		;
+
+	*blknum = start;
+	*nblocks = end - start;
+	return true;
+}
+
 /*
  * Backup data file in the from_root directory to the to_root directory with
  * same relative path.
  * If lsn is not NULL, pages only which are modified after the lsn will be
  * copied.
+ * If pagemap is not NULL, pages only in the map are read.
+ * If compress is true, the file is compressed with the method at the level
+ * of the current backup, in chunked format. Pages are put into the dedup
+ * store if the current backup is deduplicated.
  */
 bool
 backup_data_file(const char *from_root, const char *to_root,
-				 pgFile *file, const XLogRecPtr *lsn, bool compress)
+				 pgFile *file, const XLogRecPtr *lsn,
+				 const datapagemap_t *pagemap, bool compress,
+				 CompressMethod method)
 {
 	char				to_path[MAXPGPATH];
-	FILE			   *in;
+	FileReader		   *in;
 	FILE			   *out;
 	BackupPageHeader	header;
 	DataPage			page;		/* used as read buffer */
+	const char		   *data;
 	BlockNumber			blknum;
+	BlockNumber			nrun = 0;	/* blocks left in the run of pagemap */
 	size_t				read_len;
 	int					errno_tmp;
 	pg_crc32			crc;
 	int					server_version;
-#ifdef HAVE_LIBZ
-	z_stream			z;
-	char				outbuf[zlibOutSize];
-#endif
+	ChunkedFile		   *cf = NULL;
+	ChunkJob		   *chunk = NULL;	/* chunk being filled */
 
 	INIT_CRC32(crc);
 
@@ -301,8 +1158,21 @@ backup_data_file(const char *from_root, const char *to_root,
 	file->read_size = 0;
 	file->write_size = 0;
 
+	/*
+	 * No page was modified in WAL since the last backup, so the file is
+	 * recorded as skipped as if its mtime were not changed.
+	 */
+	if (pagemap)
+	{
+		BlockNumber	first = 0;
+		BlockNumber	nblocks;
+
+		if (!pagemap_next_run(pagemap, &first, &nblocks))
+			return false;
+	}
+
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
+	in = file_reader_open(file->path, direct_io);
 	if (in == NULL)
 	{
 		FIN_CRC32(crc);
@@ -321,48 +1191,56 @@ backup_data_file(const char *from_root, const char *to_root,
 		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
 	else
 		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "w");
+	out = stream_fopen(to_path, FILE_PERMISSION);
 	if (out == NULL)
 	{
 		int errno_tmp = errno;
-		fclose(in);
+		file_reader_close(in);
 		elog(ERROR_SYSTEM, _("can't open backup file \"%s\": %s"),
 			to_path, strerror(errno_tmp));
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress)
+	/* deduplicated files are in chunked format, compressed or not */
+	if (compress || current.dedup)
 	{
-		z.zalloc = Z_NULL;
-		z.zfree = Z_NULL;
-		z.opaque = Z_NULL;
-
-		if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK)
+		cf = chunked_file_new(out, to_path, method, current.checksum);
+		if (current.dedup)
 		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't initialize compression library: %s"),
-				z.msg);
+			cf->dedup = true;
+			cf->compress = compress;
+			cf->chunk_pages = DEDUP_FILE_PAGES;
 		}
-
-		z.avail_in = 0;
-		z.next_out = (void *) outbuf;
-		z.avail_out = zlibOutSize;
 	}
-#endif
 
 	/* confirm server version */
 	server_version = get_server_version();
 
 	/* read each page and write the page excluding hole */
-	for (blknum = 0;
-		 (read_len = fread(&page, 1, sizeof(page), in)) == sizeof(page);
-		 ++blknum)
+	for (blknum = 0;; ++blknum)
 	{
 		XLogRecPtr	page_lsn;
 		int		upper_offset;
 		int		upper_length;
 
+		/* go to the next run of blocks in the map */
+		if (pagemap && nrun == 0)
+		{
+			if (!pagemap_next_run(pagemap, &blknum, &nrun))
+			{
+				read_len = 0;
+				break;
+			}
+			file_reader_seek(in, (off_t) blknum * BLCKSZ,
+							 (size_t) nrun * BLCKSZ);
+		}
+
+		read_len = file_reader_read(in, &data, sizeof(page));
+		if (read_len != sizeof(page))
+			break;
+		if (pagemap)
+			nrun--;
+
+		memcpy(&page, data, read_len);
 		header.block = blknum;
 
 		/*
@@ -373,11 +1251,20 @@ backup_data_file(const char *from_root, const char *to_root,
 						&header.hole_offset, &header.hole_length))
 		{
 			elog(LOG, "%s fall back to simple copy", file->path);
-			fclose(in);
+			if (cf)
+			{
+				chunked_file_free(cf);
+				if (chunk)
+				{
+					free(chunk->data);
+					free(chunk);
+				}
+			}
+			file_reader_close(in);
 			fclose(out);
 			file->is_datafile = false;
 			return copy_file(from_root, to_root, file,
-							 compress ? COMPRESSION : NO_COMPRESSION);
+							 compress ? COMPRESSION : NO_COMPRESSION, method);
 		}
 
 		file->read_size += read_len;
@@ -389,19 +1276,9 @@ backup_data_file(const char *from_root, const char *to_root,
 		upper_offset = header.hole_offset + header.hole_length;
 		upper_length = BLCKSZ - upper_offset;
 
-#ifdef HAVE_LIBZ
-		if (compress)
-		{
-			doDeflate(&z, sizeof(header), sizeof(outbuf), &header, outbuf, in,
-					  out, &crc, &file->write_size, Z_NO_FLUSH);
-			doDeflate(&z, header.hole_offset, sizeof(outbuf), page.data, outbuf,
-					  in, out, &crc, &file->write_size, Z_NO_FLUSH);
-			doDeflate(&z, upper_length, sizeof(outbuf),
-					  page.data + upper_offset, outbuf, in, out, &crc,
-					  &file->write_size, Z_NO_FLUSH);
-		}
+		if (cf)
+			chunk = chunk_add_page(cf, chunk, &header, page.data);
 		else
-#endif
 		{
 			/* write data page excluding hole */
 			if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
@@ -410,25 +1287,28 @@ backup_data_file(const char *from_root, const char *to_root,
 			{
 				int errno_tmp = errno;
 				/* oops */
-				fclose(in);
+				file_reader_close(in);
 				fclose(out);
 				elog(ERROR_SYSTEM, _("can't write at block %u of \"%s\": %s"),
 					blknum, to_path, strerror(errno_tmp));
 			}
 
 			/* update CRC */
-			COMP_CRC32(crc, &header, sizeof(header));
-			COMP_CRC32(crc, page.data, header.hole_offset);
-			COMP_CRC32(crc, page.data + upper_offset, upper_length);
+			crc = checksum_update(current.checksum, crc,
+								  &header, sizeof(header));
+			crc = checksum_update(current.checksum, crc,
+								  page.data, header.hole_offset);
+			crc = checksum_update(current.checksum, crc,
+								  page.data + upper_offset, upper_length);
 
 			file->write_size += sizeof(header) + read_len - header.hole_length;
 		}
 
 	}
-	errno_tmp = errno;
-	if (!feof(in))
+	errno_tmp = file_reader_error(in);
+	if (errno_tmp != 0)
 	{
-		fclose(in);
+		file_reader_close(in);
 		fclose(out);
 		elog(ERROR_SYSTEM, _("can't read backup mode file \"%s\": %s"),
 			file->path, strerror(errno_tmp));
@@ -439,6 +1319,33 @@ backup_data_file(const char *from_root, const char *to_root,
 	 * write whole of it.
 	 */
 	if (read_len > 0)
+		memcpy(&page, data, read_len);
+	if (read_len > 0 && cf)
+	{
+		/*
+		 * Chunks hold whole pages only. If the odd size page is the 1st page,
+		 * fallback to simple copy because the file is not a datafile.
+		 * Otherwise store the page with zero-filled tail as the hole, and
+		 * record its length in the chunk index to cut the tail on restore.
+		 */
+		if (blknum == 0)
+		{
+			chunked_file_free(cf);
+			file_reader_close(in);
+			fclose(out);
+			file->is_datafile = false;
+			return copy_file(from_root, to_root, file,
+							 compress ? COMPRESSION : NO_COMPRESSION, method);
+		}
+
+		header.block = blknum;
+		header.hole_offset = read_len;
+		header.hole_length = BLCKSZ - read_len;
+		chunk = chunk_add_page(cf, chunk, &header, page.data);
+		chunk->entry.tail_len = read_len;
+		file->read_size += read_len;
+	}
+	else if (read_len > 0)
 	{
 		/*
 		 * If the odd size page is the 1st page, fallback to simple copy because
@@ -453,105 +1360,75 @@ backup_data_file(const char *from_root, const char *to_root,
 			header.hole_offset = 0;
 			header.hole_length = 0;
 
-#ifdef HAVE_LIBZ
-			if (compress)
-			{
-				doDeflate(&z, sizeof(header), sizeof(outbuf), &header, outbuf,
-					in, out, &crc, &file->write_size, Z_NO_FLUSH);
-			}
-			else
-#endif
-			{
-				if (fwrite(&header, 1, sizeof(header), out) != sizeof(header))
-				{
-					int errno_tmp = errno;
-					/* oops */
-					fclose(in);
-					fclose(out);
-					elog(ERROR_SYSTEM,
-						 _("can't write at block %u of \"%s\": %s"),
-						 blknum, to_path, strerror(errno_tmp));
-				}
-				COMP_CRC32(crc, &header, sizeof(header));
-				file->write_size += sizeof(header);
-			}
-		}
-
-		/* write odd size page image */
-#ifdef HAVE_LIBZ
-		if (compress)
-		{
-			doDeflate(&z, read_len, sizeof(outbuf), page.data, outbuf, in, out,
-				&crc, &file->write_size, Z_NO_FLUSH);
-		}
-		else
-#endif
-		{
-			if (fwrite(page.data, 1, read_len, out) != read_len)
+			if (fwrite(&header, 1, sizeof(header), out) != sizeof(header))
 			{
 				int errno_tmp = errno;
 				/* oops */
-				fclose(in);
+				file_reader_close(in);
 				fclose(out);
-				elog(ERROR_SYSTEM, _("can't write at block %u of \"%s\": %s"),
-					blknum, to_path, strerror(errno_tmp));
+				elog(ERROR_SYSTEM,
+					 _("can't write at block %u of \"%s\": %s"),
+					 blknum, to_path, strerror(errno_tmp));
 			}
+			crc = checksum_update(current.checksum, crc,
+								  &header, sizeof(header));
+			file->write_size += sizeof(header);
+		}
 
-			COMP_CRC32(crc, page.data, read_len);
-			file->write_size += read_len;
+		/* write odd size page image */
+		if (fwrite(page.data, 1, read_len, out) != read_len)
+		{
+			int errno_tmp = errno;
+			/* oops */
+			file_reader_close(in);
+			fclose(out);
+			elog(ERROR_SYSTEM, _("can't write at block %u of \"%s\": %s"),
+				blknum, to_path, strerror(errno_tmp));
 		}
 
+		crc = checksum_update(current.checksum, crc, page.data, read_len);
+		file->write_size += read_len;
 		file->read_size += read_len;
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress)
+	if (cf)
 	{
-		if (file->read_size > 0)
-		{
-			while (doDeflate(&z, 0, sizeof(outbuf), NULL, outbuf, in, out, &crc,
-							 &file->write_size, Z_FINISH) != Z_STREAM_END)
-			{
-			}
-		}
-
-		if (deflateEnd(&z) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't close compression stream: %s"), z.msg);
-		}
+		chunked_file_finish(cf, chunk, &file->write_size);
+		crc = cf->crc;
+		chunked_file_free(cf);
 	}
-#endif
 
 	/*
 	 * update file permission
 	 * FIXME: Should set permission on open?
 	 */
-	if (!check && chmod(to_path, FILE_PERMISSION) == -1)
+	if (!check && stream_chmod(to_path, FILE_PERMISSION) == -1)
 	{
 		int errno_tmp = errno;
-		fclose(in);
+		file_reader_close(in);
 		fclose(out);
 		elog(ERROR_SYSTEM, _("can't change mode of \"%s\": %s"), file->path,
 			strerror(errno_tmp));
 	}
 
-	fclose(in);
+	file_reader_close(in);
 	fclose(out);
 
 	/* finish CRC calculation and store into pgFile */
 	FIN_CRC32(crc);
 	file->crc = crc;
 
-	/* Treat empty file as not-datafile */
-	if (file->read_size == 0)
+	/*
+	 * Treat empty file as not-datafile. With the pagemap, nothing read means
+	 * the modified pages are beyond the end of the file, not an empty file.
+	 */
+	if (file->read_size == 0 && pagemap == NULL)
 		file->is_datafile = false;
 
 	/* We do not backup if all pages skipped. */
-	if (file->write_size == 0 && file->read_size > 0)
+	if (file->write_size == 0 && (file->read_size > 0 || pagemap))
 	{
-		if (remove(to_path) == -1)
+		if (stream_remove(to_path) == -1)
 			elog(ERROR_SYSTEM, _("can't remove file \"%s\": %s"), to_path,
 				strerror(errno));
 		return false;
@@ -564,39 +1441,89 @@ backup_data_file(const char *from_root, const char *to_root,
 	return true;
 }
 
+/*
+ * Return whether the existing file at path has the same contents as the
+ * uncompressed whole copy of file, by its size and CRC.
+ */
+static bool
+restore_is_same_file(const char *path, const pgFile *file,
+					 ChecksumAlgorithm checksum)
+{
+	struct stat	st;
+	FILE	   *fp;
+	char		buf[8192];
+	size_t		len;
+	pg_crc32	crc;
+
+	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+		st.st_size != file->write_size ||
+		(fp = fopen(path, "r")) == NULL)
+		return false;
+
+	INIT_CRC32(crc);
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		crc = checksum_update(checksum, crc, buf, len);
+	FIN_CRC32(crc);
+	if (ferror(fp))
+		crc = ~file->crc;
+	fclose(fp);
+
+	return EQ_CRC32(crc, file->crc);
+}
+
 /*
  * Restore files in the from_root directory to the to_root directory with
- * same relative path.
+ * same relative path. If compress is true, the backup file is decompressed
+ * with the method. CRCs of chunks are computed with the checksum algorithm
+ * of the backup.
+ *
+ * If written is not NULL, blocks found in the map are not overwritten and
+ * blocks restored by this call are added to it.
+ *
+ * With --delta, the existing file is overwritten only where it differs.
+ * Returns the number of blocks in the backup of a data file, or 0 for other
+ * files, which are restored as a whole.
  */
-void
+BlockNumber
 restore_data_file(const char *from_root,
 				  const char *to_root,
 				  pgFile *file,
-				  bool compress)
+				  bool compress,
+				  CompressMethod method,
+				  ChecksumAlgorithm checksum,
+				  datapagemap_t *written)
 {
 	char				to_path[MAXPGPATH];
 	FILE			   *in;
 	FILE			   *out;
 	BackupPageHeader	header;
 	BlockNumber			blknum;
-#ifdef HAVE_LIBZ
-	z_stream			z;
-	int					status;
-	char				inbuf[zlibInSize];
-	pg_crc32			crc;
-	size_t				read_size;
-#endif
+	Decompressor	   *zp = NULL;
+	BlockWriter			bw;
+	size_t				read_size = 0;
+	BlockNumber			nkept = 0;
+
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
 
 	/* If the file is not a datafile, just copy it. */
 	if (!file->is_datafile)
 	{
+		if (delta && !compress &&
+			restore_is_same_file(to_path, file, checksum))
+		{
+			elog(LOG, _("\"%s\" is not changed"), to_path);
+			if (chmod(to_path, file->mode) == -1)
+				elog(ERROR_SYSTEM, _("can't change mode of \"%s\": %s"),
+					to_path, strerror(errno));
+			return 0;
+		}
 		copy_file(from_root, to_root, file,
-			compress ? DECOMPRESSION : NO_COMPRESSION);
-		return;
+			compress ? DECOMPRESSION : NO_COMPRESSION, method);
+		return 0;
 	}
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
+	in = storage_fopen(file->path, "r");
 	if (in == NULL)
 	{
 		elog(ERROR_SYSTEM, _("can't open backup file \"%s\": %s"), file->path,
@@ -608,7 +1535,6 @@ restore_data_file(const char *from_root,
 	 * modified pages for incremental restore. If the file is not exists,
 	 * re-open it with "w" to create an empty file.
 	 */
-	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
 	out = fopen(to_path, "r+");
 	if (out == NULL && errno == ENOENT)
 		out = fopen(to_path, "w");
@@ -620,48 +1546,37 @@ restore_data_file(const char *from_root,
 			to_path, strerror(errno_tmp));
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress)
-	{
-		z.zalloc = Z_NULL;
-		z.zfree = Z_NULL;
-		z.opaque = Z_NULL;
-		z.next_in = Z_NULL;
-		z.avail_in = 0;
+	/*
+	 * Chunks of a file are located with the index and restored in parallel.
+	 * Deduplicated files are in chunked format even if not compressed.
+	 */
+	if (restore_chunked_file(in, out, to_path, file, checksum, written,
+							 &blknum, &nkept))
+		goto restored;
 
-		if (inflateInit(&z) != Z_OK)
-			elog(ERROR_SYSTEM, _("can't initialize compression library: %s"),
-				z.msg);
-		INIT_CRC32(crc);
-		read_size = 0;
-	}
-#endif
+	/* backup file of older versions is one compressed stream */
+	if (compress)
+		zp = decompressor_open(method, in, &read_size);
+	block_writer_init(&bw, fileno(out), to_path);
 
 	for (blknum = 0; ; blknum++)
 	{
 		size_t		read_len;
-		DataPage	page;		/* used as read buffer */
+		DataPage	page;		/* used for skipped pages */
+		char	   *data;
 		int			upper_offset;
 		int			upper_length;
 
 		/* read BackupPageHeader */
-#ifdef HAVE_LIBZ
 		if (compress)
 		{
-			status = doInflate(&z, sizeof(inbuf), sizeof(header), inbuf,
-						&header, in, out, &crc, &read_size);
-			if (status == Z_STREAM_END)
-			{
-				if (z.avail_out != sizeof(header))
-					elog(ERROR_CORRUPTED, _("backup is broken header"));
-				break;
-			}
-			if (z.avail_out != 0)
-				elog(ERROR_SYSTEM, _("can't read block %u of \"%s\""),
-					blknum, file->path);
+			read_len = decompressor_read(zp, &header, sizeof(header));
+			if (read_len == 0)
+				break;		/* end of stream */
+			if (read_len != sizeof(header))
+				elog(ERROR_CORRUPTED, _("backup is broken header"));
 		}
 		else
-#endif
 		{
 			read_len = fread(&header, 1, sizeof(header), in);
 			if (read_len != sizeof(header))
@@ -690,62 +1605,56 @@ restore_data_file(const char *from_root,
 				blknum);
 		}
 
+		/*
+		 * Backup might have holes in incremental backups, so the page is
+		 * written at its block; contiguous pages are written at once. When
+		 * restoring a backup chain in newest-first order, pages already
+		 * written from a newer backup are kept.
+		 */
+		blknum = header.block;
+		if (written != NULL && datapagemap_is_set(written, blknum))
+			data = page.data;
+		else
+		{
+			data = block_writer_get(&bw, blknum);
+			if (written != NULL)
+				datapagemap_add(written, blknum);
+		}
+
 		upper_offset = header.hole_offset + header.hole_length;
 		upper_length = BLCKSZ - upper_offset;
 
-		/* read lower/upper into page.data and restore hole */
-		memset(page.data + header.hole_offset, 0, header.hole_length);
+		/* read lower/upper into the page and restore hole */
+		memset(data + header.hole_offset, 0, header.hole_length);
 
-#ifdef HAVE_LIBZ
 		if (compress)
 		{
-			elog(LOG, "\n%s() %s %d %d", __FUNCTION__, file->path, header.hole_offset, upper_length);
-			if (header.hole_offset > 0)
-			{
-				doInflate(&z, sizeof(inbuf), header.hole_offset, inbuf,
-					page.data, in, out, &crc, &read_size);
-				if (z.avail_out != 0)
-					elog(ERROR_SYSTEM, _("can't read block %u of \"%s\""),
-						blknum, file->path);
-			}
-
-			if (upper_length > 0)
-			{
-				doInflate(&z, sizeof(inbuf), upper_length, inbuf,
-					page.data + upper_offset, in, out, &crc, &read_size);
-				if (z.avail_out != 0)
-					elog(ERROR_SYSTEM, _("can't read block %u of \"%s\""),
-						blknum, file->path);
-			}
+			if (decompressor_read(zp, data, header.hole_offset) !=
+					header.hole_offset ||
+				decompressor_read(zp, data + upper_offset, upper_length) !=
+					upper_length)
+				elog(ERROR_SYSTEM, _("can't read block %u of \"%s\""),
+					blknum, file->path);
 		}
 		else
-#endif
 		{
-			if (fread(page.data, 1, header.hole_offset, in) != header.hole_offset ||
-				fread(page.data + upper_offset, 1, upper_length, in) != upper_length)
+			if (fread(data, 1, header.hole_offset, in) != header.hole_offset ||
+				fread(data + upper_offset, 1, upper_length, in) != upper_length)
 			{
 				elog(ERROR_SYSTEM, _("can't read block %u of \"%s\": %s"),
 					blknum, file->path, strerror(errno));
 			}
 		}
-
-		/*
-		 * Seek and write the restored page. Backup might have holes in
-		 * incremental backups.
-		 */
-		blknum = header.block;
-		if (fseek(out, blknum * BLCKSZ, SEEK_SET) < 0)
-			elog(ERROR_SYSTEM, _("can't seek block %u of \"%s\": %s"),
-				blknum, to_path, strerror(errno));
-		if (fwrite(page.data, 1, sizeof(page), out) != sizeof(page))
-			elog(ERROR_SYSTEM, _("can't write block %u of \"%s\": %s"),
-				blknum, file->path, strerror(errno));
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress && inflateEnd(&z) != Z_OK)
-		elog(ERROR_SYSTEM, _("can't close compression stream: %s"), z.msg);
-#endif
+	block_writer_term(&bw);
+	nkept = bw.nkept;
+	if (compress)
+		decompressor_close(zp);
+
+restored:
+	if (nkept > 0)
+		elog(LOG, _("%u pages of \"%s\" are not changed"), nkept, to_path);
 
 	/* update file permission */
 	if (chmod(to_path, file->mode) == -1)
@@ -767,13 +1676,182 @@ restore_data_file(const char *from_root,
 
 	fclose(in);
 	fclose(out);
+
+	return blknum;
+}
+
+static void copy_file_dest(char *to_path, const char *from_root,
+						   const char *to_root, const pgFile *file);
+static bool copy_file_part(pgFile *file, const char *to_path,
+						   CompressionMode mode, CompressMethod method,
+						   off_t limit);
+
+/* bytes copied and read back for the CRC at once by copy_file_zero() */
+#define ZERO_COPY_CHUNK_SIZE	(1024 * 1024)
+
+/*
+ * Copy a regular local file in the kernel for --zero-copy, sharing the
+ * extents with FICLONE if the file system supports it and the whole file is
+ * copied, or with copy_file_range() or sendfile(). The CRC is calculated
+ * from the copy read back in the same pass, so it matches the copy even if
+ * the source is being modified. Up to limit bytes are copied unless limit
+ * is negative. Returns false if none of them is available for the files, to
+ * copy through buffers.
+ */
+static bool
+copy_file_zero(FILE *in, FILE *out, pgFile *file, const char *to_path,
+			   off_t limit, pg_crc32 *crc)
+{
+#if defined(__linux__) && !defined(WIN32)
+	int			ifd = fileno(in);
+	int			ofd = fileno(out);
+	int			rfd;
+	struct stat	st;
+	off_t		offset;
+	bool		cloned = false;
+	bool		use_sendfile = false;
+	char	   *buf;
+
+	/* files of remote storage or in the backup stream are not descriptors */
+	if (ifd == -1 || ofd == -1 ||
+		fstat(ofd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		(rfd = open(to_path, O_RDONLY)) == -1)
+		return false;
+
+#ifdef FICLONE
+	if (limit < 0)
+		cloned = (ioctl(ofd, FICLONE, ifd) == 0);
+#endif
+
+	buf = pgut_malloc(ZERO_COPY_CHUNK_SIZE);
+	for (offset = 0; limit < 0 || offset < limit; )
+	{
+		ssize_t	len = ZERO_COPY_CHUNK_SIZE;
+
+		if (limit >= 0 && limit - offset < len)
+			len = limit - offset;
+
+		if (!cloned)
+		{
+			off_t	in_off = offset;
+
+#ifdef __NR_copy_file_range
+			if (!use_sendfile)
+				len = syscall(__NR_copy_file_range, ifd, &in_off, ofd, NULL,
+							  len, 0);
+			else
+#endif
+				len = sendfile(ofd, ifd, &in_off, len);
+
+			if (len == -1)
+			{
+				/* fall back to sendfile(), and then to copying with buffers */
+				if (offset == 0 &&
+					(errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+					 errno == EOPNOTSUPP))
+				{
+					if (!use_sendfile)
+					{
+						use_sendfile = true;
+						continue;
+					}
+					free(buf);
+					close(rfd);
+					return false;
+				}
+				elog(ERROR_SYSTEM, _("can't copy \"%s\" to \"%s\": %s"),
+					file->path, to_path, strerror(errno));
+			}
+			if (len == 0)
+				break;
+		}
+
+		len = pread(rfd, buf, len, offset);
+		if (len == -1)
+			elog(ERROR_SYSTEM, _("can't read \"%s\": %s"), to_path,
+				strerror(errno));
+		if (len == 0)
+			break;
+		throttle_io(len);
+		*crc = checksum_update(current.checksum, *crc, buf, len);
+		offset += len;
+	}
+	free(buf);
+	close(rfd);
+
+	file->read_size = offset;
+	file->write_size = offset;
+
+	/* stdio position of out is not moved by them */
+	if (fseeko(out, 0, SEEK_END) != 0)
+		elog(ERROR_SYSTEM, _("can't seek \"%s\": %s"), to_path,
+			strerror(errno));
+
+	return true;
+#else
+	return false;
+#endif
 }
 
+/*
+ * Copy a file in the from_root directory to the to_root directory with same
+ * relative path, compressing or decompressing it with the method.
+ */
 bool
 copy_file(const char *from_root, const char *to_root, pgFile *file,
-	CompressionMode mode)
+	CompressionMode mode, CompressMethod method)
+{
+	char	to_path[MAXPGPATH];
+
+	copy_file_dest(to_path, from_root, to_root, file);
+	return copy_file_part(file, to_path, mode, method, -1);
+}
+
+/*
+ * Copy a file to to_path, compressing or decompressing it with the method.
+ */
+bool
+copy_file_to(pgFile *file, const char *to_path, CompressionMode mode,
+	CompressMethod method)
+{
+	return copy_file_part(file, to_path, mode, method, -1);
+}
+
+/*
+ * Backup a WAL segment, copying only the used part of it. The rest is
+ * rebuilt on restore by xlog_pad_segment().
+ */
+bool
+copy_wal_file(const char *from_root, const char *to_root, pgFile *file,
+	CompressionMode mode, CompressMethod method, int server_version)
+{
+	char	to_path[MAXPGPATH];
+	size_t	used = xlog_used_size(file, server_version);
+
+	if (used < file->size)
+		elog(LOG, _("%lu bytes of \"%s\" are not used"),
+			(unsigned long) (file->size - used), file->path);
+	copy_file_dest(to_path, from_root, to_root, file);
+	return copy_file_part(file, to_path, mode, method,
+						  used < file->size ? (off_t) used : -1);
+}
+
+/* path in to_root to copy the file, or the temporary file in check mode */
+static void
+copy_file_dest(char *to_path, const char *from_root, const char *to_root,
+			   const pgFile *file)
+{
+	if (check)
+		snprintf(to_path, MAXPGPATH, "%s/tmp", backup_path);
+	else
+		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+}
+
+/* copy up to limit bytes of the file, or all if limit is negative */
+static bool
+copy_file_part(pgFile *file, const char *to_path, CompressionMode mode,
+	CompressMethod method, off_t limit)
 {
-	char		to_path[MAXPGPATH];
 	FILE	   *in;
 	FILE	   *out;
 	size_t		read_len = 0;
@@ -781,12 +1859,8 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 	char		buf[8192];
 	struct stat	st;
 	pg_crc32	crc;
-#ifdef HAVE_LIBZ
-	z_stream	z;
-	int			status;
-	char		outbuf[zlibOutSize];
-	char		inbuf[zlibInSize];
-#endif
+	Compressor	   *zp = NULL;
+	Decompressor   *dp = NULL;
 
 	INIT_CRC32(crc);
 
@@ -795,7 +1869,7 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 	file->write_size = 0;
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
+	in = storage_fopen(file->path, "r");
 	if (in == NULL)
 	{
 		FIN_CRC32(crc);
@@ -809,12 +1883,16 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 			strerror(errno));
 	}
 
+	/* stat source file to change mode of destination file */
+	if (storage_fstat(in, file->path, &st) == -1)
+	{
+		fclose(in);
+		elog(ERROR_SYSTEM, _("can't stat \"%s\": %s"), file->path,
+			strerror(errno));
+	}
+
 	/* open backup file for write  */
-	if (check)
-		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
-	else
-		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "w");
+	out = stream_fopen(to_path, st.st_mode);
 	if (out == NULL)
 	{
 		int errno_tmp = errno;
@@ -823,67 +1901,41 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 			to_path, strerror(errno_tmp));
 	}
 
-	/* stat source file to change mode of destination file */
-	if (fstat(fileno(in), &st) == -1)
-	{
-		fclose(in);
-		fclose(out);
-		elog(ERROR_SYSTEM, _("can't stat \"%s\": %s"), file->path,
-			strerror(errno));
-	}
-
-#ifdef HAVE_LIBZ
-	z.zalloc = Z_NULL;
-	z.zfree = Z_NULL;
-	z.opaque = Z_NULL;
+	/* copy in the kernel if requested */
+	if (mode == NO_COMPRESSION && zero_copy &&
+		copy_file_zero(in, out, file, to_path, limit, &crc))
+		goto copied;
 
 	if (mode == COMPRESSION)
-	{
-		if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't initialize compression library: %s"),
-				z.msg);
-		}
-
-		z.avail_in = 0;
-		z.next_out = (void *) outbuf;
-		z.avail_out = zlibOutSize;
-	}
+		zp = compressor_open(method, current.compress_level, out,
+							 current.checksum, &crc, &file->write_size);
 	else if (mode == DECOMPRESSION)
-	{
-		z.next_in = Z_NULL;
-		z.avail_in = 0;
-		if (inflateInit(&z) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't initialize compression library: %s"),
-				z.msg);
-		}
-	}
-#endif
+		dp = decompressor_open(method, in, &file->read_size);
 
 	/* copy content and calc CRC */
 	for (;;)
 	{
-#ifdef HAVE_LIBZ
+		size_t	want = sizeof(buf);
+
+		if (limit >= 0 && limit - (off_t) file->read_size < (off_t) want)
+			want = limit - file->read_size;
+
 		if (mode == COMPRESSION)
 		{
-			if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
+			if ((read_len = fread(buf, 1, want, in)) != sizeof(buf))
 				break;
+			throttle_io(read_len);
 
-			doDeflate(&z, read_len, sizeof(outbuf), buf, outbuf, in, out, &crc,
-					  &file->write_size, Z_NO_FLUSH);
+			compressor_write(zp, buf, read_len);
 			file->read_size += sizeof(buf);
 		}
 		else if (mode == DECOMPRESSION)
 		{
-			status = doInflate(&z, sizeof(inbuf), sizeof(outbuf), inbuf, outbuf,
-						in, out, &crc, &file->read_size);
-			if (fwrite(outbuf, 1, sizeof(outbuf) - z.avail_out, out) !=
-					sizeof(outbuf) - z.avail_out)
+			size_t	len = decompressor_read(dp, buf, sizeof(buf));
+
+			throttle_io(len);
+
+			if (fwrite(buf, 1, len, out) != len)
 			{
 				errno_tmp = errno;
 				/* oops */
@@ -892,16 +1944,18 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 				elog(ERROR_SYSTEM, _("can't write to \"%s\": %s"), to_path,
 					strerror(errno_tmp));
 			}
+			/* update CRC */
+			crc = checksum_update(current.checksum, crc, buf, len);
 
-			file->write_size += sizeof(outbuf) - z.avail_out;
-			if (status == Z_STREAM_END)
+			file->write_size += len;
+			if (len < sizeof(buf))
 				break;
 		}
 		else
-#endif
 		{
-			if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
+			if ((read_len = fread(buf, 1, want, in)) != sizeof(buf))
 				break;
+			throttle_io(read_len);
 
 			if (fwrite(buf, 1, read_len, out) != read_len)
 			{
@@ -913,14 +1967,18 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 					strerror(errno_tmp));
 			}
 			/* update CRC */
-			COMP_CRC32(crc, buf, read_len);
+			crc = checksum_update(current.checksum, crc, buf, read_len);
 
 			file->write_size += sizeof(buf);
 			file->read_size += sizeof(buf);
 		}
 	}
+	/*
+	 * The decompressor stops at the end of stream, and the others might stop
+	 * at the limit before the end of file.
+	 */
 	errno_tmp = errno;
-	if (!feof(in))
+	if (mode != DECOMPRESSION && ferror(in))
 	{
 		fclose(in);
 		fclose(out);
@@ -931,14 +1989,9 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 	/* copy odd part. */
 	if (read_len > 0)
 	{
-#ifdef HAVE_LIBZ
 		if (mode == COMPRESSION)
-		{
-			doDeflate(&z, read_len, sizeof(outbuf), buf, outbuf, in, out, &crc,
-					  &file->write_size, Z_NO_FLUSH);
-		}
+			compressor_write(zp, buf, read_len);
 		else
-#endif
 		{
 			if (fwrite(buf, 1, read_len, out) != read_len)
 			{
@@ -950,7 +2003,7 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 					strerror(errno_tmp));
 			}
 			/* update CRC */
-			COMP_CRC32(crc, buf, read_len);
+			crc = checksum_update(current.checksum, crc, buf, read_len);
 
 			file->write_size += read_len;
 		}
@@ -958,41 +2011,18 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 		file->read_size += read_len;
 	}
 
-#ifdef HAVE_LIBZ
 	if (mode == COMPRESSION)
-	{
-		if (file->read_size > 0)
-		{
-			while (doDeflate(&z, 0, sizeof(outbuf), NULL, outbuf, in, out, &crc,
-							 &file->write_size, Z_FINISH) != Z_STREAM_END)
-			{
-			}
-		}
-
-		if (deflateEnd(&z) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't close compression stream: %s"), z.msg);
-		}
-	}
+		compressor_close(zp);
 	else if (mode == DECOMPRESSION)
-	{
-		if (inflateEnd(&z) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			elog(ERROR_SYSTEM, _("can't close compression stream: %s"), z.msg);
-		}
-	}
+		decompressor_close(dp);
 
-#endif
+copied:
 	/* finish CRC calculation and store into pgFile */
 	FIN_CRC32(crc);
 	file->crc = crc;
 
 	/* update file permission */
-	if (chmod(to_path, st.st_mode) == -1)
+	if (stream_chmod(to_path, st.st_mode) == -1)
 	{
 		errno_tmp = errno;
 		fclose(in);
@@ -0,0 +1,68 @@
+/*-------------------------------------------------------------------------
+ *
+ * datapagemap.c: bitmap of block numbers in a relation file.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+/*
+ * Add a block to the bitmap. The bitmap is expanded if necessary.
+ */
+void
+datapagemap_add(datapagemap_t *map, BlockNumber blkno)
+{
+	int		offset = blkno / 8;
+	int		bitno = blkno % 8;
+
+	/* enlarge or create bitmap if needed */
+	if (map->bitmapsize <= offset)
+	{
+		int		oldsize = map->bitmapsize;
+		int		newsize;
+
+		/* double the size at least to avoid frequent reallocation */
+		newsize = offset + 1;
+		if (newsize < oldsize * 2)
+			newsize = oldsize * 2;
+
+		map->bitmap = pgut_realloc(map->bitmap, newsize);
+
+		/* zero out the newly allocated region */
+		memset(&map->bitmap[oldsize], 0, newsize - oldsize);
+
+		map->bitmapsize = newsize;
+	}
+
+	/* Set the bit */
+	map->bitmap[offset] |= (1 << bitno);
+}
+
+/*
+ * Return true if the block is in the bitmap.
+ */
+bool
+datapagemap_is_set(const datapagemap_t *map, BlockNumber blkno)
+{
+	int		offset = blkno / 8;
+	int		bitno = blkno % 8;
+
+	if (map->bitmapsize <= offset)
+		return false;
+
+	return (map->bitmap[offset] & (1 << bitno)) != 0;
+}
+
+/*
+ * Free the bitmap, but not the datapagemap_t itself.
+ */
+void
+datapagemap_clear(datapagemap_t *map)
+{
+	free(map->bitmap);
+	map->bitmap = NULL;
+	map->bitmapsize = 0;
+}
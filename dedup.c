@@ -0,0 +1,398 @@
+/*-------------------------------------------------------------------------
+ *
+ * dedup.c: content-addressed store of chunks of data pages.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pgut/pgut-pthread.h"
+
+/*
+ * Chunks of data files backed up with --dedup are stored once in
+ * $STORAGE_PATH/dedup/XX/<SHA-256 of the chunk>, where XX is the first byte
+ * of the hash, and data files hold only the hashes. A chunk is a run of
+ * BackupPageHeader and page images excluding holes, the same as chunks of
+ * compressed data files, so unchanged pages at the same blocks are shared
+ * by backups of any generation.
+ *
+ * Each backup lists the chunks it refers to in DEDUP_REFS_FILE, and chunks
+ * which no backup refers to are removed after backups are deleted. A chunk
+ * is created with rename (or with a single upload in object storage), so a
+ * chunk found in the store is always complete.
+ */
+#define DEDUP_CHUNK_MAGIC	"PGRMDCHK"
+
+typedef struct DedupChunkHeader
+{
+	char		magic[8];		/* DEDUP_CHUNK_MAGIC */
+	uint32		compressed;		/* pages are compressed with the method? */
+	uint32		method;			/* CompressMethod */
+	uint64		length;			/* size of pages before compression */
+} DedupChunkHeader;
+
+/* chunks referred to by the current backup */
+static pthread_mutex_t	dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static parray		   *dedup_refs = NULL;
+static int64			dedup_stored = 0;	/* bytes of chunks newly stored */
+static unsigned int		dedup_tmp_seq = 0;
+
+static void dedup_chunk_path(const unsigned char *hash, char *path,
+							 size_t len);
+static void hash_to_hex(const unsigned char *hash, char *hex);
+static int compare_hash(const void *l, const void *r);
+static int compare_hex(const void *l, const void *r);
+static bool read_refs(const pgBackup *backup, parray *refs);
+
+/*
+ * Store pages of a chunk unless the same chunk is in the store, and set the
+ * hash of it. Pages are compressed with the method if compress is true.
+ * Returns the number of bytes written into the store.
+ */
+size_t
+dedup_put(const char *data, size_t len, bool compress, CompressMethod method,
+		  unsigned char hash[SHA256_DIGEST_LENGTH])
+{
+	char				path[MAXPGPATH];
+	char				tmp[MAXPGPATH];
+	char			   *dir;
+	struct stat			st;
+	DedupChunkHeader	header;
+	FILE			   *out;
+	char			   *buf = NULL;
+	size_t				written = 0;
+	unsigned char	   *ref;
+	bool				remote;
+
+	sha256(data, len, hash);
+
+	ref = pgut_malloc(SHA256_DIGEST_LENGTH);
+	memcpy(ref, hash, SHA256_DIGEST_LENGTH);
+	pgut_mutex_lock(&dedup_lock);
+	if (dedup_refs == NULL)
+		dedup_refs = parray_new();
+	parray_append(dedup_refs, ref);
+	pthread_mutex_unlock(&dedup_lock);
+
+	dedup_chunk_path(hash, path, lengthof(path));
+	if (check || storage_stat(path, &st) == 0)
+		return 0;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DEDUP_CHUNK_MAGIC, sizeof(header.magic));
+	header.compressed = compress;
+	header.method = method;
+	header.length = len;
+
+	if (compress)
+	{
+		Compressor *zp;
+		pg_crc32	crc;
+
+		INIT_CRC32(crc);
+		zp = compressor_open_mem(method, current.compress_level, &buf,
+								 current.checksum, &crc, &written);
+		compressor_write(zp, data, len);
+		compressor_close(zp);
+		data = buf;
+		len = written;
+	}
+
+	/* object storage has no directories and uploads are atomic */
+	remote = storage_is_remote(path);
+	if (remote)
+		strlcpy(tmp, path, lengthof(tmp));
+	else
+	{
+		dir = pgut_strdup(path);
+		*strrchr(dir, '/') = '\0';
+		if (storage_mkdir(dir, DIR_PERMISSION) == -1 && errno != EEXIST)
+			elog(ERROR_SYSTEM, _("can't create directory \"%s\": %s"), dir,
+				strerror(errno));
+		free(dir);
+
+		pgut_mutex_lock(&dedup_lock);
+		snprintf(tmp, lengthof(tmp), "%s.%d.%u.tmp", path, (int) getpid(),
+				 dedup_tmp_seq++);
+		pthread_mutex_unlock(&dedup_lock);
+	}
+
+	out = storage_fopen(tmp, "w");
+	if (out == NULL)
+		elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), tmp, strerror(errno));
+	if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
+		fwrite(data, 1, len, out) != len)
+		elog(ERROR_SYSTEM, _("can't write \"%s\": %s"), tmp, strerror(errno));
+	if (fclose(out) != 0)
+		elog(ERROR_SYSTEM, _("can't write \"%s\": %s"), tmp, strerror(errno));
+	if (!remote && rename(tmp, path) == -1)
+		elog(ERROR_SYSTEM, _("can't rename \"%s\": %s"), tmp, strerror(errno));
+	free(buf);
+
+	written = sizeof(header) + len;
+	pgut_mutex_lock(&dedup_lock);
+	dedup_stored += written;
+	pthread_mutex_unlock(&dedup_lock);
+
+	return written;
+}
+
+/*
+ * Read pages of a chunk, which must be len bytes with the CRC computed with
+ * the checksum algorithm. Returns a malloc'd buffer, or NULL after a message
+ * at elevel if the chunk is missing or broken.
+ */
+char *
+dedup_get(const unsigned char *hash, size_t len, pg_crc32 crc,
+		  ChecksumAlgorithm checksum, int elevel)
+{
+	char				path[MAXPGPATH];
+	DedupChunkHeader	header;
+	FILE			   *in;
+	char			   *data;
+	size_t				read_len;
+	pg_crc32			crc_read;
+
+	dedup_chunk_path(hash, path, lengthof(path));
+	in = storage_fopen(path, "r");
+	if (in == NULL)
+	{
+		elog(elevel, _("can't open chunk \"%s\": %s"), path, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&header, 1, sizeof(header), in) != sizeof(header) ||
+		memcmp(header.magic, DEDUP_CHUNK_MAGIC, sizeof(header.magic)) != 0 ||
+		header.length != len ||
+		(header.compressed && !compress_method_supported(header.method)))
+	{
+		fclose(in);
+		elog(elevel, _("chunk \"%s\" is broken"), path);
+		return NULL;
+	}
+
+	data = pgut_malloc(Max(len, 1));
+	if (header.compressed)
+	{
+		size_t			read_size = 0;
+		Decompressor   *zp;
+
+		zp = decompressor_open((CompressMethod) header.method, in,
+							   &read_size);
+		read_len = decompressor_read(zp, data, len);
+		decompressor_close(zp);
+	}
+	else
+		read_len = fread(data, 1, len, in);
+	fclose(in);
+
+	INIT_CRC32(crc_read);
+	crc_read = checksum_update(checksum, crc_read, data, read_len);
+	FIN_CRC32(crc_read);
+	if (read_len != len || crc_read != crc)
+	{
+		free(data);
+		elog(elevel, _("CRC of chunk \"%s\" must be %X but %X"), path, crc,
+			crc_read);
+		return NULL;
+	}
+
+	return data;
+}
+
+/* true if the chunk is in the store */
+bool
+dedup_exists(const unsigned char *hash)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	dedup_chunk_path(hash, path, lengthof(path));
+	return storage_stat(path, &st) == 0;
+}
+
+/* bytes of chunks stored by the current backup */
+int64
+dedup_stored_bytes(void)
+{
+	return dedup_stored;
+}
+
+/*
+ * Write the list of chunks referred to by the current backup, which must be
+ * written before data files of the backup are used.
+ */
+void
+dedup_write_refs(const pgBackup *backup)
+{
+	char	path[MAXPGPATH];
+	char	hex[SHA256_DIGEST_LENGTH * 2 + 1];
+	FILE   *fp;
+	int		i;
+
+	pgBackupGetPath(backup, path, lengthof(path), DEDUP_REFS_FILE);
+	fp = storage_fopen(path, "w");
+	if (fp == NULL)
+		elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), path, strerror(errno));
+
+	if (dedup_refs != NULL)
+	{
+		parray_qsort(dedup_refs, compare_hash);
+		for (i = 0; i < parray_num(dedup_refs); i++)
+		{
+			if (i > 0 && memcmp(parray_get(dedup_refs, i - 1),
+								parray_get(dedup_refs, i),
+								SHA256_DIGEST_LENGTH) == 0)
+				continue;
+			hash_to_hex(parray_get(dedup_refs, i), hex);
+			fprintf(fp, "%s\n", hex);
+		}
+	}
+
+	if (fflush(fp) != 0 || ferror(fp))
+		elog(ERROR_SYSTEM, _("can't write \"%s\": %s"), path, strerror(errno));
+	if (fclose(fp) != 0)
+		elog(ERROR_SYSTEM, _("can't write \"%s\": %s"), path, strerror(errno));
+}
+
+/*
+ * Remove chunks which no backup refers to. Backups deleted or being deleted
+ * don't refer to chunks, nor do ones failed before the list of chunks is
+ * written. If the list of a backup can't be read, nothing is removed. The
+ * catalog lock must be held.
+ */
+void
+dedup_gc(void)
+{
+	char	root[MAXPGPATH];
+	parray *backups;
+	parray *refs;
+	parray *files;
+	int		i;
+	int		removed = 0;
+
+	backups = catalog_get_backup_list(NULL);
+	if (backups == NULL)
+		return;
+
+	refs = parray_new();
+	for (i = 0; i < parray_num(backups); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backups, i);
+		char		timestamp[100];
+
+		if (!backup->dedup || backup->status == BACKUP_STATUS_DELETED ||
+			backup->status == BACKUP_STATUS_DELETING)
+			continue;
+		if (read_refs(backup, refs))
+			continue;
+
+		/* failed backups might have no list */
+		if (backup->status == BACKUP_STATUS_RUNNING ||
+			backup->status == BACKUP_STATUS_ERROR)
+			continue;
+
+		time2iso(timestamp, lengthof(timestamp), backup->start_time);
+		elog(WARNING, _("can't read chunks referred to by backup %s, "
+						"unreferenced chunks are not removed"), timestamp);
+		parray_walk(refs, free);
+		parray_free(refs);
+		parray_walk(backups, pgBackupFree);
+		parray_free(backups);
+		return;
+	}
+	parray_qsort(refs, compare_hex);
+
+	join_path_components(root, BACKUP_ROOT, DEDUP_DIR);
+	files = parray_new();
+	storage_list_file(files, root);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		const char *name = last_dir_separator(file->path);
+
+		if (!S_ISREG(file->mode))
+			continue;
+		name = (name ? name + 1 : file->path);
+		if (parray_bsearch(refs, name, compare_hex) != NULL)
+			continue;
+
+		elog(LOG, _("remove unreferenced chunk \"%s\""), file->path);
+		if (!check && storage_remove(file->path) == -1)
+			elog(WARNING, _("can't remove \"%s\": %s"), file->path,
+				strerror(errno));
+		removed++;
+	}
+	if (verbose && removed > 0)
+		printf(_("%d unreferenced chunks removed\n"), removed);
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+	parray_walk(refs, free);
+	parray_free(refs);
+	parray_walk(backups, pgBackupFree);
+	parray_free(backups);
+}
+
+static void
+dedup_chunk_path(const unsigned char *hash, char *path, size_t len)
+{
+	char	hex[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	hash_to_hex(hash, hex);
+	snprintf(path, len, "%s/%s/%.2s/%s", BACKUP_ROOT, DEDUP_DIR, hex, hex);
+}
+
+static void
+hash_to_hex(const unsigned char *hash, char *hex)
+{
+	int		i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", hash[i]);
+}
+
+static int
+compare_hash(const void *l, const void *r)
+{
+	return memcmp(*(unsigned char **) l, *(unsigned char **) r,
+				  SHA256_DIGEST_LENGTH);
+}
+
+static int
+compare_hex(const void *l, const void *r)
+{
+	return strcmp(*(char **) l, *(char **) r);
+}
+
+/* add the chunks referred to by the backup into refs */
+static bool
+read_refs(const pgBackup *backup, parray *refs)
+{
+	char	path[MAXPGPATH];
+	char	buf[SHA256_DIGEST_LENGTH * 2 + 2];
+	FILE   *fp;
+
+	pgBackupGetPath(backup, path, lengthof(path), DEDUP_REFS_FILE);
+	fp = storage_fopen(path, "r");
+	if (fp == NULL)
+		return false;
+
+	while (fgets(buf, lengthof(buf), fp))
+	{
+		size_t	len = strcspn(buf, "\r\n");
+
+		buf[len] = '\0';
+		if (len == SHA256_DIGEST_LENGTH * 2)
+			parray_append(refs, pgut_strdup(buf));
+	}
+	fclose(fp);
+
+	return true;
+}
@@ -9,7 +9,25 @@
 
 #include "pg_rman.h"
 
+#include <unistd.h>
+
+#include "pgut/pgut-pthread.h"
+
+/* unlink mostly waits for the storage, so use more workers than -j */
+#define REMOVE_THREADS		8
+
+typedef struct RemoveJob
+{
+	void	(*routine)(struct RemoveJob *);
+	pgFile *file;
+} RemoveJob;
+
+static pthread_mutex_t	remove_lock = PTHREAD_MUTEX_INITIALIZER;
+static int				remove_failed;
+
 static int pgBackupDeleteFiles(pgBackup *backup);
+static int pgBackupMoveToTrash(pgBackup *backup);
+static void remove_file(RemoveJob *job);
 static bool checkIfDeletable(pgBackup *backup);
 
 int
@@ -21,6 +39,7 @@ do_delete(pgBackupRange *range, bool force)
 	parray *backup_list;
 	bool	do_delete;
 	bool	force_delete;
+	int		deleted = 0;
 
 	/* DATE are always required */
 	if (!pgBackupRangeIsValid(range))
@@ -58,19 +77,27 @@ do_delete(pgBackupRange *range, bool force)
 				elog(ERROR_INTERRUPTED, _("interrupted during delete backup"));
 
 			pgBackupDeleteFiles(backup);
+			deleted++;
 			continue;
 		}
 
 		/* find latest full backup. */
 		if (backup->backup_mode >= BACKUP_MODE_FULL &&
-			backup->status == BACKUP_STATUS_OK &&
+			BACKUP_IS_COMPLETED(backup) &&
 			backup->start_time <= range->begin)
 			do_delete = true;
 	}
 
+	/* remove chunks only the deleted backups referred to */
+	if (deleted > 0)
+		dedup_gc();
+
 	/* release catalog lock */
 	catalog_unlock();
 
+	/* remove the deleted backups without blocking other commands */
+	trash_purge();
+
 	/* cleanup */
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
@@ -88,6 +115,7 @@ pgBackupDelete(int keep_generations, int keep_days)
 	int		i;
 	parray *backup_list;
 	int		backup_num;
+	int		deleted = 0;
 	time_t	days_threshold = current.start_time - (keep_days * 60 * 60 * 24);
 
 
@@ -134,7 +162,7 @@ pgBackupDelete(int keep_generations, int keep_days)
 		 * that is older than it
 		 */
 		if (backup->backup_mode >= BACKUP_MODE_FULL &&
-			backup->status == BACKUP_STATUS_OK)
+			BACKUP_IS_COMPLETED(backup))
 			backup_num++;
 
 		/* do not include the latest full backup in a count. */
@@ -161,21 +189,106 @@ pgBackupDelete(int keep_generations, int keep_days)
 
 		/* delete backup and update status to DELETED */
 		pgBackupDeleteFiles(backup);
+		deleted++;
 	}
 
+	/* remove chunks only the deleted backups referred to */
+	if (deleted > 0)
+		dedup_gc();
+
 	/* cleanup */
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
 }
 
+/*
+ * Remove the files in the list with parallel workers, and then the
+ * directories from the leaves. Files removed by another one already are
+ * ignored. Returns the number of files which could not be removed.
+ */
+int
+remove_files(parray *files)
+{
+	JobQueue   *queue;
+	int			i;
+
+	remove_failed = 0;
+	queue = JobQueue_new(Max(num_threads, REMOVE_THREADS));
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		RemoveJob  *job;
+
+		if (S_ISDIR(file->mode))
+			continue;
+
+		job = pgut_new(RemoveJob);
+		job->routine = remove_file;
+		job->file = file;
+		JobQueue_push(queue, (Job *) job);
+	}
+	JobQueue_wait(queue);
+	JobQueue_free(queue);
+
+	parray_qsort(files, pgFileComparePathDesc);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+
+		if (!S_ISDIR(file->mode))
+			continue;
+		if (storage_remove(file->path) == -1 && errno != ENOENT)
+		{
+			elog(WARNING, _("can't remove \"%s\": %s"), file->path,
+				strerror(errno));
+			remove_failed++;
+		}
+	}
+
+	return remove_failed;
+}
+
+/*
+ * Remove the backups moved into TRASH_DIR. This runs after the catalog lock
+ * is released, so that the next command doesn't wait for the removal. Trash
+ * left by an interrupted purge is removed by the next one.
+ */
+void
+trash_purge(void)
+{
+	char		root[MAXPGPATH];
+	struct stat	st;
+	parray	   *files;
+
+	if (check || storage_is_remote(BACKUP_ROOT))
+		return;
+
+	join_path_components(root, BACKUP_ROOT, TRASH_DIR);
+	if (stat(root, &st) == -1)
+		return;
+
+	files = parray_new();
+	dir_list_file(files, root, NULL, true, false);
+	if (parray_num(files) > 0)
+	{
+		elog(LOG, _("remove %lu files in \"%s\""),
+			(unsigned long) parray_num(files), root);
+		remove_files(files);
+	}
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+}
+
 /*
  * Delete backup files of the backup and update the status of the backup to
- * BACKUP_STATUS_DELETED.
+ * BACKUP_STATUS_DELETED. The directories are only moved into the trash, and
+ * its files are removed by trash_purge() later. Object storage can't rename,
+ * so the files are removed here.
  */
 static int
 pgBackupDeleteFiles(pgBackup *backup)
 {
-	int		i;
 	char	path[MAXPGPATH];
 	char	timestamp[20];
 	parray *files;
@@ -201,55 +314,102 @@ pgBackupDeleteFiles(pgBackup *backup)
 		pgBackupWriteIni(backup);
 	}
 
-	/* list files to be deleted */
-	files = parray_new();
-	pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
-	dir_list_file(files, path, NULL, true, true);
-	pgBackupGetPath(backup, path, lengthof(path), ARCLOG_DIR);
-	dir_list_file(files, path, NULL, true, true);
-	pgBackupGetPath(backup, path, lengthof(path), SRVLOG_DIR);
-	dir_list_file(files, path, NULL, true, true);
-
-	/* delete leaf node first */
-	parray_qsort(files, pgFileComparePathDesc);
-	for (i = 0; i < parray_num(files); i++)
-	{
-		pgFile *file = (pgFile *) parray_get(files, i);
-
-		/* print progress */
-		elog(LOG, _("delete file(%d/%lu) \"%s\"\n"), i + 1,
-				(unsigned long) parray_num(files), file->path);
+	/* skip actual deletion in check mode */
+	if (check)
+		return 0;
 
-		/* skip actual deletion in check mode */
-		if (!check)
+	if (!storage_is_remote(BACKUP_ROOT))
+	{
+		if (pgBackupMoveToTrash(backup) != 0)
+			return 1;
+	}
+	else
+	{
+		/* list files to be deleted */
+		files = parray_new();
+		pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
+		storage_list_file(files, path);
+		pgBackupGetPath(backup, path, lengthof(path), ARCLOG_DIR);
+		storage_list_file(files, path);
+		pgBackupGetPath(backup, path, lengthof(path), SRVLOG_DIR);
+		storage_list_file(files, path);
+
+		elog(LOG, _("delete %lu files"), (unsigned long) parray_num(files));
+		if (remove_files(files) != 0)
 		{
-			if (remove(file->path))
-			{
-				elog(WARNING, _("can't remove \"%s\": %s"), file->path,
-					strerror(errno));
-				parray_walk(files, pgFileFree);
-				parray_free(files);
-				return 1;
-			}
+			parray_walk(files, pgFileFree);
+			parray_free(files);
+			return 1;
 		}
+		parray_walk(files, pgFileFree);
+		parray_free(files);
 	}
 
 	/*
 	 * After deleting all of the backup files, update STATUS to
 	 * BACKUP_STATUS_DELETED.
 	 */
-	if (!check)
+	backup->status = BACKUP_STATUS_DELETED;
+	pgBackupWriteIni(backup);
+
+	return 0;
+}
+
+/*
+ * Rename the directories of the backup into TRASH_DIR. The new names have
+ * the process ID in addition to the backup, so that they don't conflict with
+ * the trash of the backup left by an interrupted delete.
+ */
+static int
+pgBackupMoveToTrash(pgBackup *backup)
+{
+	static const char *const subdirs[] = { DATABASE_DIR, ARCLOG_DIR, SRVLOG_DIR };
+	char	root[MAXPGPATH];
+	char	datetime[20];
+	int		i;
+
+	join_path_components(root, BACKUP_ROOT, TRASH_DIR);
+	dir_create_dir(root, DIR_PERMISSION);
+	strftime(datetime, lengthof(datetime), "%Y%m%d%H%M%S",
+		localtime(&backup->start_time));
+
+	for (i = 0; i < lengthof(subdirs); i++)
 	{
-		backup->status = BACKUP_STATUS_DELETED;
-		pgBackupWriteIni(backup);
-	}
+		char		path[MAXPGPATH];
+		char		trash[MAXPGPATH];
+		struct stat	st;
 
-	parray_walk(files, pgFileFree);
-	parray_free(files);
+		pgBackupGetPath(backup, path, lengthof(path), subdirs[i]);
+		if (lstat(path, &st) == -1 && errno == ENOENT)
+			continue;
+
+		snprintf(trash, lengthof(trash), "%s/%s.%d.%s", root, datetime,
+			(int) getpid(), subdirs[i]);
+		elog(LOG, _("move \"%s\" to \"%s\""), path, trash);
+		if (rename(path, trash) == -1)
+		{
+			elog(WARNING, _("can't move \"%s\" to \"%s\": %s"), path, trash,
+				strerror(errno));
+			return 1;
+		}
+	}
 
 	return 0;
 }
 
+static void
+remove_file(RemoveJob *job)
+{
+	if (storage_remove(job->file->path) == -1 && errno != ENOENT)
+	{
+		elog(WARNING, _("can't remove \"%s\": %s"), job->file->path,
+			strerror(errno));
+		pthread_mutex_lock(&remove_lock);
+		remove_failed++;
+		pthread_mutex_unlock(&remove_lock);
+	}
+}
+
 bool
 checkIfDeletable(pgBackup *backup)
 {
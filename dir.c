@@ -9,6 +9,7 @@
 
 #include "pg_rman.h"
 
+#include <fcntl.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -17,6 +18,35 @@
 #include <time.h>
 
 #include "pgut/pgut-port.h"
+#include "pgut/pgut-pthread.h"
+
+/* open and stat directory entries relative to the directory if available */
+#if defined(AT_FDCWD) && defined(O_DIRECTORY) && !defined(WIN32)
+#define USE_OPENAT
+#else
+#define AT_FDCWD	(-100)		/* not used, only passed around */
+#endif
+
+/* directories up to the depth from the root are scanned by jobs */
+#define SCAN_PARALLEL_DEPTH		4
+
+typedef struct DirScan
+{
+	const char	  **exclude;
+	bool			omit_symlink;
+	JobQueue	   *queue;		/* NULL if scanning serially */
+	pthread_mutex_t	lock;		/* protects lists */
+	parray		   *lists;		/* lists of pgFile scanned by the jobs */
+} DirScan;
+
+/* a directory to be scanned by a worker thread */
+typedef struct ScanJob
+{
+	void	  (*routine)(struct ScanJob *);
+	DirScan	   *scan;
+	int			depth;
+	char		path[MAXPGPATH];
+} ScanJob;
 
 /* directory exclusion list for backup mode listing */
 const char *pgdata_exclude[] =
@@ -30,7 +60,14 @@ const char *pgdata_exclude[] =
 	NULL,			/* sentinel */
 };
 
-static pgFile *pgFileNew(const char *path, bool omit_symlink);
+static pgFile *pgFileNew(parray *files, int parent, const char *name,
+						 const char *path, bool omit_symlink);
+static void scan_entry(DirScan *scan, parray *files, int parent,
+					   const char *name, const char *path, bool add, int depth);
+static void scan_dir(DirScan *scan, parray *files, int parent,
+					 const char *name, const char *path, int depth);
+static void scan_job(ScanJob *job);
+static pg_crc32 get_remote_crc(pgFile *file, ChecksumAlgorithm checksum);
 
 /* create directory, also create parent directories if necessary */
 int
@@ -58,14 +95,26 @@ dir_create_dir(const char *dir, mode_t mode)
 	return 0;
 }
 
+/*
+ * Create a pgFile of the path in the arena of files, which owns the pgFile
+ * and frees it with the list. The file is the entry "name" in the directory
+ * parent, or AT_FDCWD if name is the path.
+ */
 static pgFile *
-pgFileNew(const char *path, bool omit_symlink)
+pgFileNew(parray *files, int parent, const char *name, const char *path,
+		  bool omit_symlink)
 {
 	struct stat		st;
 	pgFile		   *file;
+	int				rc;
 
 	/* stat the file */
-	if ((omit_symlink ? stat(path, &st) : lstat(path, &st)) == -1)
+#ifdef USE_OPENAT
+	rc = fstatat(parent, name, &st, omit_symlink ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	rc = omit_symlink ? stat(path, &st) : lstat(path, &st);
+#endif
+	if (rc == -1)
 	{
 		/* file not found is not an error case */
 		if (errno == ENOENT)
@@ -74,7 +123,7 @@ pgFileNew(const char *path, bool omit_symlink)
 			strerror(errno));
 	}
 
-	file = (pgFile *) pgut_malloc(offsetof(pgFile, path) + strlen(path) + 1);
+	file = (pgFile *) parray_alloc(files, offsetof(pgFile, path) + strlen(path) + 1);
 
 	file->mtime = st.st_mtime;
 	file->size = st.st_size;
@@ -83,6 +132,7 @@ pgFileNew(const char *path, bool omit_symlink)
 	file->mode = st.st_mode;
 	file->crc = 0;
 	file->is_datafile = false;
+	file->in_arena = true;
 	file->linked = NULL;
 	strcpy(file->path, path);		/* enough buffer size guaranteed */
 
@@ -121,37 +171,363 @@ delete_file:
 	}
 }
 
+/*
+ * Files are read sequentially in large buffers aligned to BLCKSZ, so the
+ * buffer can be used for O_DIRECT. The buffer is always filled from an
+ * offset of a multiple of BLCKSZ by a multiple of BLCKSZ, so a page never
+ * straddles two buffers except the odd size page at the end of file.
+ *
+ * After a full buffer is read, the next portion is read ahead into another
+ * buffer asynchronously, so reading the file overlaps with processing the
+ * pages read. Files which fit in one buffer are read synchronously.
+ */
+#define FILE_READER_BUFSIZE		(1024 * 1024)
+
+struct FileReader
+{
+	int			fd;
+	bool		direct;		/* opened with O_DIRECT? */
+	bool		drop_cache;	/* drop OS cache of portions read instead? */
+	bool		eof;
+	int			error;		/* errno of the failed read, or 0 */
+	off_t		offset;		/* file offset of the buffer */
+	size_t		avail;		/* number of bytes in the buffer */
+	size_t		pos;		/* number of bytes consumed in the buffer */
+	off_t		limit;		/* don't read ahead beyond this offset, or 0 */
+	char	   *buf;		/* aligned buffer */
+	char	   *unaligned;	/* buf before alignment, to be freed */
+	AsyncIO		ahead;		/* read ahead into ahead_buf */
+	char	   *ahead_buf;	/* aligned buffer to read ahead, or NULL */
+	char	   *ahead_unaligned;
+};
+
+static bool file_reader_fill(FileReader *self);
+static void file_reader_ahead(FileReader *self);
+static void file_reader_drop_cache(FileReader *self, off_t offset, size_t len);
+
+/*
+ * Open a file to read sequentially. If direct is true, the file is read
+ * bypassing the OS cache with O_DIRECT, or when the platform or the file
+ * system doesn't support it, the cache of the portions already read is
+ * dropped. Returns NULL and sets errno on failure as fopen() does.
+ */
+FileReader *
+file_reader_open(const char *path, bool direct)
+{
+	FileReader *self;
+	int			fd = -1;
+	bool		drop_cache = false;
+
+#ifdef O_DIRECT
+	if (direct)
+	{
+		fd = open(path, O_RDONLY | PG_BINARY | O_DIRECT, 0);
+		if (fd == -1 && errno != EINVAL)
+			return NULL;
+	}
+#endif
+	if (fd == -1)
+	{
+		fd = open(path, O_RDONLY | PG_BINARY, 0);
+		if (fd == -1)
+			return NULL;
+		drop_cache = direct;	/* fall back to dropping cache */
+		direct = false;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	self = pgut_new(FileReader);
+	self->fd = fd;
+	self->direct = direct;
+	self->drop_cache = drop_cache;
+	self->eof = false;
+	self->error = 0;
+	self->offset = 0;
+	self->avail = 0;
+	self->pos = 0;
+	self->limit = 0;
+	self->unaligned = pgut_malloc(FILE_READER_BUFSIZE + BLCKSZ);
+	self->buf = (char *) TYPEALIGN(BLCKSZ, self->unaligned);
+	self->ahead.pending = false;
+	self->ahead_buf = NULL;
+	self->ahead_unaligned = NULL;
+
+	return self;
+}
+
+/*
+ * Read next len bytes at most. *data points to the bytes in the buffer,
+ * which are valid until the next call. It returns fewer than len bytes at
+ * the end of the buffer or the file; 0 means the end of file or an error
+ * reported by file_reader_error().
+ */
+size_t
+file_reader_read(FileReader *self, const char **data, size_t len)
+{
+	if (self->pos >= self->avail && !file_reader_fill(self))
+		return 0;
+
+	if (len > self->avail - self->pos)
+		len = self->avail - self->pos;
+	*data = self->buf + self->pos;
+	self->pos += len;
+
+	return len;
+}
+
+/*
+ * Move to offset, which must be a multiple of BLCKSZ. len bytes from the
+ * offset are going to be read, so the reader doesn't read ahead beyond them
+ * until the next seek.
+ */
+void
+file_reader_seek(FileReader *self, off_t offset, size_t len)
+{
+	/* the offset is in the buffer */
+	if (offset >= self->offset && offset < self->offset + (off_t) self->avail)
+	{
+		self->pos = offset - self->offset;
+		self->limit = offset + TYPEALIGN(BLCKSZ, len);
+		return;
+	}
+
+	if (self->avail > 0)
+		file_reader_drop_cache(self, self->offset, self->avail);
+
+	/* the portion read ahead is useless unless it begins at the offset */
+	if (self->ahead.pending && self->ahead.offset != offset)
+		(void) async_io_wait(&self->ahead);
+
+	self->offset = offset;
+	self->avail = 0;
+	self->pos = 0;
+	self->limit = offset + TYPEALIGN(BLCKSZ, len);
+	if (self->error == 0)
+		self->eof = false;
+}
+
+/* errno of the read failed, or 0 if no error */
+int
+file_reader_error(FileReader *self)
+{
+	return self->error;
+}
+
+void
+file_reader_close(FileReader *self)
+{
+	if (self == NULL)
+		return;
+	if (self->ahead.pending)
+		(void) async_io_wait(&self->ahead);
+	/* the buffer and the portion read ahead, to the end of the file */
+	file_reader_drop_cache(self, self->offset, 0);
+	close(self->fd);
+	free(self->unaligned);
+	free(self->ahead_unaligned);
+	free(self);
+}
+
+/*
+ * Drop the OS cache of len bytes from offset, or to the end of the file if
+ * len is 0, if the reader was asked to bypass the cache but can't.
+ */
+static void
+file_reader_drop_cache(FileReader *self, off_t offset, size_t len)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (self->drop_cache)
+		(void) posix_fadvise(self->fd, offset, (off_t) len,
+							 POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* read the next portion of the file into the buffer */
+static bool
+file_reader_fill(FileReader *self)
+{
+	size_t			size = FILE_READER_BUFSIZE;
+	MetricsTimer	timer;
+
+	if (self->eof)
+		return false;
+
+	/* the OS cache of the buffer consumed is no longer needed */
+	if (self->avail > 0)
+		file_reader_drop_cache(self, self->offset, self->avail);
+
+	self->offset += self->avail;
+	self->avail = 0;
+	self->pos = 0;
+
+	if (self->limit > self->offset && self->limit - self->offset < (off_t) size)
+		size = self->limit - self->offset;
+
+	metrics_start(&timer, PHASE_READ);
+
+	/* take the portion read ahead, and read the rest of it if short */
+	if (self->ahead.pending)
+	{
+		ssize_t	rc = async_io_wait(&self->ahead);
+
+		if (self->ahead.offset == self->offset && rc > 0)
+		{
+			char   *buf = self->buf;
+
+			self->buf = self->ahead_buf;
+			self->ahead_buf = buf;
+			self->avail = Min((size_t) rc, size);
+			throttle_io(self->avail);
+
+			if (self->direct && self->avail % BLCKSZ != 0)
+				self->eof = true;
+		}
+	}
+
+	while (self->avail < size && !self->eof)
+	{
+		ssize_t	rc;
+
+		rc = pread(self->fd, self->buf + self->avail,
+				   size - self->avail,
+				   self->offset + self->avail);
+		if (rc < 0 && errno == EINTR)
+			continue;
+#ifdef O_DIRECT
+		/* some file systems refuse O_DIRECT reads only at read time */
+		if (rc < 0 && errno == EINVAL && self->direct)
+		{
+			int		flags = fcntl(self->fd, F_GETFL);
+
+			if (flags != -1 &&
+				fcntl(self->fd, F_SETFL, flags & ~O_DIRECT) != -1)
+			{
+				self->direct = false;
+				self->drop_cache = true;
+				continue;
+			}
+		}
+#endif
+		if (rc < 0)
+		{
+			self->error = errno;
+			self->eof = true;
+			break;
+		}
+		if (rc == 0)
+		{
+			self->eof = true;
+			break;
+		}
+		self->avail += rc;
+		throttle_io(rc);
+
+		/* O_DIRECT reads must continue at an aligned offset */
+		if (self->direct && self->avail % BLCKSZ != 0)
+		{
+			self->eof = true;
+			break;
+		}
+	}
+	metrics_stop(&timer, self->avail, 0);
+
+	if (self->avail == size && !self->eof && self->error == 0)
+		file_reader_ahead(self);
+
+	return self->avail > 0 && self->error == 0;
+}
+
+/* start reading the portion following the buffer into the other buffer */
+static void
+file_reader_ahead(FileReader *self)
+{
+	off_t	offset = self->offset + self->avail;
+	size_t	size = FILE_READER_BUFSIZE;
+
+	if (self->limit > 0)
+	{
+		if (self->limit <= offset)
+			return;
+		if (self->limit - offset < (off_t) size)
+			size = self->limit - offset;
+	}
+
+	if (self->ahead_buf == NULL)
+	{
+		self->ahead_unaligned = pgut_malloc(FILE_READER_BUFSIZE + BLCKSZ);
+		self->ahead_buf = (char *) TYPEALIGN(BLCKSZ, self->ahead_unaligned);
+	}
+	async_io_start(&self->ahead, self->fd, false, self->ahead_buf, size,
+				   offset);
+}
+
 pg_crc32
-pgFileGetCRC(pgFile *file)
+pgFileGetCRC(pgFile *file, ChecksumAlgorithm checksum)
 {
-	FILE	   *fp;
+	FileReader *reader;
 	pg_crc32	crc = 0;
-	char		buf[1024];
+	const char *buf;
 	size_t		len;
-	int			errno_tmp;
+
+	if (storage_is_remote(file->path))
+		return get_remote_crc(file, checksum);
 
 	/* open file in binary read mode */
-	fp = fopen(file->path, "r");
-	if (fp == NULL)
+	reader = file_reader_open(file->path, direct_io);
+	if (reader == NULL)
 		elog(ERROR_SYSTEM, _("can't open file \"%s\": %s"),
 			file->path, strerror(errno));
 
 	/* calc CRC of backup file */
 	INIT_CRC32(crc);
-	while ((len = fread(buf, 1, sizeof(buf), fp)) == sizeof(buf))
+	while ((len = file_reader_read(reader, &buf, FILE_READER_BUFSIZE)) > 0)
+	{
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during CRC calculation"));
+		crc = checksum_update(checksum, crc, buf, len);
+	}
+	if (file_reader_error(reader) != 0)
+		elog(WARNING, _("can't read \"%s\": %s"), file->path,
+			strerror(file_reader_error(reader)));
+	FIN_CRC32(crc);
+
+	file_reader_close(reader);
+
+	return crc;
+}
+
+/* CRC of a file in object storage, read without the file reader */
+static pg_crc32
+get_remote_crc(pgFile *file, ChecksumAlgorithm checksum)
+{
+	FILE	   *fp;
+	pg_crc32	crc;
+	char	   *buf;
+	size_t		len;
+
+	fp = storage_fopen(file->path, "r");
+	if (fp == NULL)
+		elog(ERROR_SYSTEM, _("can't open file \"%s\": %s"),
+			file->path, strerror(errno));
+
+	buf = pgut_malloc(FILE_READER_BUFSIZE);
+	INIT_CRC32(crc);
+	while ((len = fread(buf, 1, FILE_READER_BUFSIZE, fp)) > 0)
 	{
+		throttle_io(len);
 		if (interrupted)
 			elog(ERROR_INTERRUPTED, _("interrupted during CRC calculation"));
-		COMP_CRC32(crc, buf, len);
+		crc = checksum_update(checksum, crc, buf, len);
 	}
-	errno_tmp = errno;
-	if (!feof(fp))
+	if (ferror(fp))
 		elog(WARNING, _("can't read \"%s\": %s"), file->path,
-			strerror(errno_tmp));
-	if (len > 0)
-		COMP_CRC32(crc, buf, len);
+			strerror(errno));
 	FIN_CRC32(crc);
 
+	free(buf);
 	fclose(fp);
 
 	return crc;
@@ -160,7 +536,7 @@ pgFileGetCRC(pgFile *file)
 void
 pgFileFree(void *file)
 {
-	if (file == NULL)
+	if (file == NULL || ((pgFile *) file)->in_arena)
 		return;
 	free(((pgFile *)file)->linked);
 	free(file);
@@ -205,6 +581,28 @@ pgFileCompareMtimeDesc(const void *f1, const void *f2)
 	return -pgFileCompareMtime(f1, f2);
 }
 
+/* Compare two pgFile with their backed-up size. */
+int
+pgFileCompareSize(const void *f1, const void *f2)
+{
+	pgFile *f1p = *(pgFile **)f1;
+	pgFile *f2p = *(pgFile **)f2;
+
+	if (f1p->write_size > f2p->write_size)
+		return 1;
+	else if (f1p->write_size < f2p->write_size)
+		return -1;
+	else
+		return 0;
+}
+
+/* Compare two pgFile with their backed-up size in descending order. */
+int
+pgFileCompareSizeDesc(const void *f1, const void *f2)
+{
+	return -pgFileCompareSize(f1, f2);
+}
+
 /*
  * List files, symbolic links and directories in the directory "root" and add
  * pgFile objects to "files".  We add "root" to "files" if add_root is true.
@@ -214,17 +612,65 @@ pgFileCompareMtimeDesc(const void *f1, const void *f2)
  *
  * When omit_symlink is true, symbolic link is ignored and only file or
  * directory llnked to will be listed.
+ *
+ * With more than one thread, the directories near the root, which includes
+ * databases and tablespaces, are scanned in parallel.
  */
 void
 dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_symlink, bool add_root)
+{
+	DirScan		scan;
+	int			i;
+
+	scan.exclude = exclude;
+	scan.omit_symlink = omit_symlink;
+	scan.queue = NULL;
+	scan.lists = NULL;
+	if (num_threads > 1)
+	{
+		scan.queue = JobQueue_new(num_threads);
+		scan.lists = parray_new();
+		pthread_mutex_init(&scan.lock, NULL);
+	}
+
+	scan_entry(&scan, files, AT_FDCWD, root, root, add_root, 0);
+
+	if (scan.queue)
+	{
+		JobQueue_wait(scan.queue);
+		JobQueue_free(scan.queue);
+		pthread_mutex_destroy(&scan.lock);
+
+		for (i = 0; i < parray_num(scan.lists); i++)
+		{
+			parray *list = (parray *) parray_get(scan.lists, i);
+
+			parray_concat(files, list);
+			parray_free(list);
+		}
+		parray_free(scan.lists);
+	}
+
+	parray_qsort(files, pgFileComparePath);
+}
+
+/*
+ * Add a pgFile of the entry "name" in the directory parent, whose path is
+ * "path", and scan it if it is a directory.
+ */
+static void
+scan_entry(DirScan *scan, parray *files, int parent, const char *name,
+		   const char *path, bool add, int depth)
 {
 	pgFile *file;
+	int		i;
+	char   *leaf;
 
-	file = pgFileNew(root, omit_symlink);
+	file = pgFileNew(files, parent, name, path, scan->omit_symlink);
 	if (file == NULL)
 		return;
 
-	if (add_root)
+	if (add)
 		parray_append(files, file);
 
 	/* chase symbolic link chain and find regular file or directory */
@@ -240,7 +686,7 @@ dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_
 				strerror(errno));
 		}
 		linked[len] = '\0';
-		file->linked = pgut_strdup(linked);
+		file->linked = parray_strdup(files, linked);
 
 		/* make absolute path to read linked file */
 		if (linked[0] != '/')
@@ -252,104 +698,139 @@ dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_
 			strncpy(dname, file->path, lengthof(dname));
 			dnamep = dirname(dname);
 			join_path_components(absolute, dname, linked);
-			file = pgFileNew(absolute, omit_symlink);
+			file = pgFileNew(files, AT_FDCWD, absolute, absolute,
+							 scan->omit_symlink);
 		}
 		else
-			file = pgFileNew(file->linked, omit_symlink);
+			file = pgFileNew(files, AT_FDCWD, file->linked, file->linked,
+							 scan->omit_symlink);
 
 		/* linked file is not found, stop following link chain */
 		if (file == NULL)
 			return;
 
 		parray_append(files, file);
+
+		/* the linked directory is out of the parent directory */
+		parent = AT_FDCWD;
+		name = file->path;
 	}
 
+	if (!S_ISDIR(file->mode))
+		return;
+
+	/* skip entry which matches exclude list */
+	leaf = strrchr(file->path, '/');
+	if (leaf == NULL)
+		leaf = file->path;
+	else
+		leaf++;
+
 	/*
-	 * If the entry was a directory, add it to the list and add call this
-	 * function recursivelly.
-	 * If the directory name is in the exclude list, do not list the contents.
+	 * If the item in the exclude list starts with '/', compare to the
+	 * absolute path of the directory. Otherwise compare to the directory
+	 * name portion.
 	 */
-	while (S_ISDIR(file->mode))
+	for (i = 0; scan->exclude && scan->exclude[i]; i++)
 	{
-		int				i;
-		bool			skip = false;
-		DIR			    *dir;
-		struct dirent   *dent;
-		char		    *dirname;
-
-		/* skip entry which matches exclude list */
-	   	dirname = strrchr(file->path, '/');
-		if (dirname == NULL)
-			dirname = file->path;
-		else
-			dirname++;
-
-		/*
-		 * If the item in the exclude list starts with '/', compare to the
-		 * absolute path of the directory. Otherwise compare to the directory
-		 * name portion.
-		 */
-		for (i = 0; exclude && exclude[i]; i++)
+		if (scan->exclude[i][0] == '/')
 		{
-			if (exclude[i][0] == '/')
-			{
-				if (strcmp(file->path, exclude[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
-			else
-			{
-				if (strcmp(dirname, exclude[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
+			if (strcmp(file->path, scan->exclude[i]) == 0)
+				return;
 		}
-		if (skip)
-			break;
-
-		/* open directory and list contents */
-		dir = opendir(file->path);
-		if (dir == NULL)
+		else
 		{
-			if (errno == ENOENT)
-			{
-				/* maybe the direcotry was removed */
+			if (strcmp(leaf, scan->exclude[i]) == 0)
 				return;
-			}
-			elog(ERROR_SYSTEM, _("can't open directory \"%s\": %s"),
-				file->path, strerror(errno));
 		}
+	}
 
-		errno = 0;
-		while ((dent = readdir(dir)))
-		{
-			char child[MAXPGPATH];
+	if (scan->queue && depth > 0 && depth <= SCAN_PARALLEL_DEPTH)
+	{
+		ScanJob	   *job = pgut_new(ScanJob);
 
-			/* skip entries point current dir or parent dir */
-			if (strcmp(dent->d_name, ".") == 0 ||
-				strcmp(dent->d_name, "..") == 0)
-				continue;
+		job->routine = scan_job;
+		job->scan = scan;
+		job->depth = depth;
+		strlcpy(job->path, file->path, lengthof(job->path));
+		JobQueue_push(scan->queue, (Job *) job);
+	}
+	else
+		scan_dir(scan, files, parent, name, file->path, depth);
+}
 
-			join_path_components(child, file->path, dent->d_name);
-			dir_list_file(files, child, exclude, omit_symlink, true);
-		}
-		if (errno && errno != ENOENT)
+/* scan contents of the directory into the list of the job */
+static void
+scan_job(ScanJob *job)
+{
+	DirScan	   *scan = job->scan;
+	parray	   *files = parray_new();
+
+	scan_dir(scan, files, AT_FDCWD, job->path, job->path, job->depth);
+
+	pthread_mutex_lock(&scan->lock);
+	parray_append(scan->lists, files);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static void
+scan_dir(DirScan *scan, parray *files, int parent, const char *name,
+		 const char *path, int depth)
+{
+	DIR			   *dir;
+	struct dirent  *dent;
+
+	/* open directory and list contents */
+#ifdef USE_OPENAT
+	{
+		int		fd;
+
+		fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+		dir = (fd == -1 ? NULL : fdopendir(fd));
+		if (fd != -1 && dir == NULL)
+			close(fd);
+	}
+#else
+	dir = opendir(path);
+#endif
+	if (dir == NULL)
+	{
+		if (errno == ENOENT)
 		{
-			int errno_tmp = errno;
-			closedir(dir);
-			elog(ERROR_SYSTEM, _("can't read directory \"%s\": %s"),
-				file->path, strerror(errno_tmp));
+			/* maybe the direcotry was removed */
+			return;
 		}
-		closedir(dir);
-
-		break;	/* pseudo loop */
+		elog(ERROR_SYSTEM, _("can't open directory \"%s\": %s"),
+			path, strerror(errno));
 	}
 
-	parray_qsort(files, pgFileComparePath);
+	errno = 0;
+	while ((dent = readdir(dir)))
+	{
+		char child[MAXPGPATH];
+
+		/* skip entries point current dir or parent dir */
+		if (strcmp(dent->d_name, ".") == 0 ||
+			strcmp(dent->d_name, "..") == 0)
+			continue;
+
+		join_path_components(child, path, dent->d_name);
+#ifdef USE_OPENAT
+		scan_entry(scan, files, dirfd(dir), dent->d_name, child, true,
+				   depth + 1);
+#else
+		scan_entry(scan, files, AT_FDCWD, child, child, true, depth + 1);
+#endif
+		errno = 0;
+	}
+	if (errno && errno != ENOENT)
+	{
+		int errno_tmp = errno;
+		closedir(dir);
+		elog(ERROR_SYSTEM, _("can't read directory \"%s\": %s"),
+			path, strerror(errno_tmp));
+	}
+	closedir(dir);
 }
 
 /* print mkdirs.sh */
@@ -456,7 +937,11 @@ dir_read_file_list(const char *root, const char *file_txt)
 	parray *files;
 	char	buf[MAXPGPATH * 2];
 
-	fp = fopen(file_txt, "rt");
+	/* the binary manifest doesn't need to be parsed nor sorted */
+	if ((files = manifest_read_file_list(root, file_txt)) != NULL)
+		return files;
+
+	fp = storage_fopen(file_txt, "rt");
 	if (fp == NULL)
 		elog(errno == ENOENT ? ERROR_CORRUPTED : ERROR_SYSTEM,
 			_("can't open \"%s\": %s"), file_txt, strerror(errno));
@@ -489,7 +974,7 @@ dir_read_file_list(const char *root, const char *file_txt)
 		}
 		tm.tm_isdst = -1;
 
-		file = (pgFile *) pgut_malloc(offsetof(pgFile, path) +
+		file = (pgFile *) parray_alloc(files, offsetof(pgFile, path) +
 					(root ? strlen(root) + 1 : 0) + strlen(path) + 1);
 
 		tm.tm_year -= 1900;
@@ -503,6 +988,7 @@ dir_read_file_list(const char *root, const char *file_txt)
 		file->write_size = write_size;
 		file->crc = crc;
 		file->is_datafile = (type == 'F' ? true : false);
+		file->in_arena = true;
 		file->linked = NULL;
 		if (root)
 			sprintf(file->path, "%s/%s", root, path);
@@ -552,7 +1038,8 @@ dir_copy_files(const char *from_root, const char *to_root)
 				printf(_("copy \"%s\"\n"),
 					file->path + strlen(from_root) + 1);
 			if (!check)
-				copy_file(from_root, to_root, file, NO_COMPRESSION);
+				copy_file(from_root, to_root, file, NO_COMPRESSION,
+					current.compress_method);
 		}
 	}
 
@@ -0,0 +1,369 @@
+/*-------------------------------------------------------------------------
+ *
+ * fetch.c: fetch archived WAL from backups on demand of recovery.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <sys/file.h>
+#endif
+
+/*
+ * Segments following the requested one are read ahead by a background
+ * process into PREFETCH_DIR beside the destination, and renamed into place
+ * when the recovery requests them. Only one process reads ahead at a time;
+ * it holds a lock on PREFETCH_LOCK_FILE while running.
+ */
+#define PREFETCH_DIR		"pg_rman_prefetch"
+#define PREFETCH_LOCK_FILE	"prefetch.lock"
+#define PREFETCH_SEGMENTS	4
+
+static bool fetch_file(const char *fname, const char *to_path);
+static bool fetch_from_backups(const char *fname, const char *to_path);
+static bool fetch_copy(pgFile *file, const char *fname, const char *to_path,
+					   CompressionMode mode, CompressMethod method);
+static void next_segment(char *next, const char *fname);
+static void prefetch_start(const char *spool, const char *fname);
+static bool prefetch_running(const char *spool);
+static void prefetch_clear(const char *spool, const char *fname);
+
+/*
+ * Restore the WAL file fname to to_path, for restore_command of recovery.
+ * Files are searched in the timeline history directory, backups of archived
+ * WAL from the newest, and ARCLOG_PATH in this order. Returns
+ * ERROR_WAL_NOT_FOUND if the file is not found, which ends the recovery.
+ */
+int
+do_fetch_wal(const char *fname, const char *to_path)
+{
+	char	spool[MAXPGPATH];
+	char	spooled[MAXPGPATH];
+	char	path[MAXPGPATH];
+	char   *sep;
+	bool	segment;
+
+	if (fname == NULL || to_path == NULL)
+		elog(ERROR_ARGS, _("required arguments not specified: WAL file name and destination path"));
+	if (first_dir_separator(fname) != NULL)
+		elog(ERROR_ARGS, _("invalid WAL file name \"%s\""), fname);
+
+	/* the spool must be in the file system of the destination to rename */
+	strlcpy(path, to_path, lengthof(path));
+	if ((sep = last_dir_separator(path)) != NULL)
+		*sep = '\0';
+	else
+		path[0] = '\0';
+	join_path_components(spool, path, PREFETCH_DIR);
+
+	segment = xlog_is_segment_name(fname);
+	if (segment)
+	{
+		join_path_components(spooled, spool, fname);
+		snprintf(path, lengthof(path), "%s.tmp", spooled);
+
+		/* wait for the segment being read ahead */
+		while (access(path, F_OK) == 0 && prefetch_running(spool))
+		{
+			if (interrupted)
+				elog(ERROR_INTERRUPTED, _("interrupted during fetch WAL"));
+			usleep(100000);
+		}
+
+		if (rename(spooled, to_path) == 0)
+		{
+			elog(LOG, _("fetched WAL \"%s\" read ahead"), fname);
+			prefetch_clear(spool, fname);
+			prefetch_start(spool, fname);
+			return 0;
+		}
+	}
+
+	if (!fetch_file(fname, to_path))
+	{
+		/* the end of archive; nothing remains to be read ahead */
+		if (segment)
+			prefetch_clear(spool, NULL);
+		elog(LOG, _("WAL \"%s\" is not found"), fname);
+		return ERROR_WAL_NOT_FOUND;
+	}
+
+	if (segment)
+	{
+		prefetch_clear(spool, fname);
+		prefetch_start(spool, fname);
+	}
+
+	return 0;
+}
+
+/* restore fname to to_path from the first place which has it */
+static bool
+fetch_file(const char *fname, const char *to_path)
+{
+	char	path[MAXPGPATH];
+	pgFile *file;
+	bool	fetched;
+
+	/* timeline history files are copied from the catalog by backup */
+	if (strstr(fname, ".history") != NULL)
+	{
+		join_path_components(path, backup_path, TIMELINE_HISTORY_DIR);
+		join_path_components(path, path, fname);
+		file = storage_file_new(path, FILE_PERMISSION, 0, 0);
+		fetched = fetch_copy(file, fname, to_path, NO_COMPRESSION,
+							 current.compress_method);
+		pgFileFree(file);
+		if (fetched)
+			return true;
+	}
+
+	if (fetch_from_backups(fname, to_path))
+		return true;
+
+	/* WAL archived after the last backup */
+	if (arclog_path)
+	{
+		join_path_components(path, arclog_path, fname);
+		file = storage_file_new(path, FILE_PERMISSION, 0, 0);
+		fetched = fetch_copy(file, fname, to_path, NO_COMPRESSION,
+							 current.compress_method);
+		pgFileFree(file);
+		if (fetched)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Restore fname from the newest backup which has it. Uncompressed files are
+ * validated with their CRC; a corrupted file is skipped to try older ones.
+ */
+static bool
+fetch_from_backups(const char *fname, const char *to_path)
+{
+	parray *backups;
+	bool	fetched = false;
+	int		i;
+
+	backups = catalog_get_backup_list(NULL);
+	if (backups == NULL)
+		return false;
+
+	for (i = 0; i < parray_num(backups) && !fetched; i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backups, i);
+		char		base_path[MAXPGPATH];
+		char		list_path[MAXPGPATH];
+		char		path[MAXPGPATH];
+		parray	   *files;
+		int			j;
+
+		if (backup->status != BACKUP_STATUS_OK || !HAVE_ARCLOG(backup) ||
+			backup->stream)
+			continue;
+
+		pgBackupGetPath(backup, base_path, lengthof(base_path), ARCLOG_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path), ARCLOG_FILE_LIST);
+		join_path_components(path, base_path, fname);
+		files = dir_read_file_list(base_path, list_path);
+
+		for (j = 0; j < parray_num(files); j++)
+		{
+			pgFile	   *file = (pgFile *) parray_get(files, j);
+			size_t		write_size = file->write_size;
+			pg_crc32	crc = file->crc;
+
+			if (strcmp(file->path, path) != 0)
+				continue;
+			if (write_size == BYTES_INVALID)
+				break;
+
+			if (backup->compress_data &&
+				!compress_method_supported(backup->compress_method))
+				elog(EXIT_NOT_SUPPORTED,
+					_("can't restore from compressed backup (compress-method %s not supported in this installation)"),
+					compress_method_name(backup->compress_method));
+
+			current.checksum = backup->checksum;
+			if (!fetch_copy(file, fname, to_path,
+							backup->compress_data ? DECOMPRESSION : NO_COMPRESSION,
+							backup->compress_method))
+				break;
+
+			if (!backup->compress_data &&
+				(file->write_size != write_size || !EQ_CRC32(file->crc, crc)))
+			{
+				elog(WARNING, _("backup of WAL \"%s\" is corrupted"), file->path);
+				break;
+			}
+
+			elog(LOG, _("fetched WAL \"%s\""), file->path);
+			fetched = true;
+			break;
+		}
+
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+	}
+
+	parray_walk(backups, pgBackupFree);
+	parray_free(backups);
+
+	return fetched;
+}
+
+/* copy the file to to_path, and pad it if it is a segment backed up as used */
+static bool
+fetch_copy(pgFile *file, const char *fname, const char *to_path,
+		   CompressionMode mode, CompressMethod method)
+{
+	if (!copy_file_to(file, to_path, mode, method))
+		return false;
+	xlog_pad_segment(to_path, fname);
+	return true;
+}
+
+/* name of the segment following fname */
+static void
+next_segment(char *next, const char *fname)
+{
+	uint32	tli;
+	uint32	log;
+	uint32	seg;
+
+	sscanf(fname, "%08X%08X%08X", &tli, &log, &seg);
+	NextLogSeg(log, seg);
+	XLogFileName(next, tli, log, seg);
+}
+
+/*
+ * Read ahead the segments following fname into the spool in a background
+ * process, unless another one is running. The recovery doesn't wait for the
+ * process since the command returns soon.
+ */
+static void
+prefetch_start(const char *spool, const char *fname)
+{
+#ifndef WIN32
+	char	path[MAXPGPATH];
+	char	next[MAXFNAMELEN];
+	pid_t	pid;
+	int		fd;
+	int		i;
+
+	if (mkdir(spool, DIR_PERMISSION) == -1 && errno != EEXIST)
+	{
+		elog(WARNING, _("can't create directory \"%s\": %s"), spool,
+			strerror(errno));
+		return;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	if ((pid = fork()) != 0)
+	{
+		if (pid == -1)
+			elog(WARNING, _("can't read ahead WAL: %s"), strerror(errno));
+		return;
+	}
+
+	/* in the background process */
+	join_path_components(path, spool, PREFETCH_LOCK_FILE);
+	if ((fd = open(path, O_RDWR | O_CREAT, FILE_PERMISSION)) == -1 ||
+		flock(fd, LOCK_EX | LOCK_NB) == -1)
+		_exit(0);
+
+	strlcpy(next, fname, lengthof(next));
+	for (i = 0; i < PREFETCH_SEGMENTS; i++)
+	{
+		char	spooled[MAXPGPATH];
+		char	tmp[MAXPGPATH];
+
+		next_segment(next, next);
+		join_path_components(spooled, spool, next);
+		if (access(spooled, F_OK) == 0)
+			continue;
+
+		snprintf(tmp, lengthof(tmp), "%s.tmp", spooled);
+		if (!fetch_file(next, tmp))
+		{
+			unlink(tmp);
+			break;
+		}
+		if (rename(tmp, spooled) == -1)
+		{
+			elog(WARNING, _("can't rename \"%s\" to \"%s\": %s"), tmp,
+				spooled, strerror(errno));
+			unlink(tmp);
+			break;
+		}
+	}
+
+	/* don't run the exit handlers of the parent */
+	close(fd);
+	_exit(0);
+#endif
+}
+
+/* return whether a background process is reading ahead into the spool */
+static bool
+prefetch_running(const char *spool)
+{
+#ifndef WIN32
+	char	path[MAXPGPATH];
+	int		fd;
+	bool	running;
+
+	join_path_components(path, spool, PREFETCH_LOCK_FILE);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return false;
+	running = (flock(fd, LOCK_SH | LOCK_NB) == -1);
+	close(fd);
+	return running;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Remove segments before fname from the spool, which the recovery doesn't
+ * request any more, with temporary files left by failed reads of them. All
+ * of the spool is removed if fname is NULL.
+ */
+static void
+prefetch_clear(const char *spool, const char *fname)
+{
+	DIR			   *dir;
+	struct dirent  *ent;
+	char			path[MAXPGPATH];
+
+	if ((dir = opendir(spool)) == NULL)
+		return;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if (fname != NULL &&
+			(strspn(ent->d_name, "0123456789ABCDEF") != 24 ||
+			 strncmp(ent->d_name, fname, 24) >= 0))
+			continue;
+
+		join_path_components(path, spool, ent->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+
+	if (fname == NULL)
+		rmdir(spool);
+}
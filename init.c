@@ -60,6 +60,20 @@ do_init(void)
 	join_path_components(path, backup_path, TIMELINE_HISTORY_DIR);
 	dir_create_dir(path, DIR_PERMISSION);
 
+	/* prepare the storage of backups if it's not the backup catalog */
+	if (storage_path && storage_is_remote(storage_path))
+	{
+		parray *entries = storage_list_dir(storage_path);
+
+		if (entries == NULL)
+			elog(ERROR_SYSTEM, _("can't access storage \"%s\": %s"),
+				storage_path, strerror(errno));
+		parray_walk(entries, pgFileFree);
+		parray_free(entries);
+	}
+	else if (storage_path)
+		dir_create_dir(storage_path, DIR_PERMISSION);
+
 	/* read postgresql.conf */
 	if (pgdata)
 	{
@@ -144,6 +158,8 @@ do_init(void)
 		fprintf(fp, "SRVLOG_PATH='%s'\n", srvlog_path);
 		elog(INFO, "SRVLOG_PATH is set to '%s'", srvlog_path);
 	}
+	if (storage_path)
+		fprintf(fp, "STORAGE_PATH='%s'\n", storage_path);
 
 	fprintf(fp, "\n");
 	fclose(fp);
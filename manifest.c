@@ -0,0 +1,459 @@
+/*-------------------------------------------------------------------------
+ *
+ * manifest.c: file lists to find files by relative path.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+/*
+ * A binary manifest is written next to each file list, with ".bin" instead
+ * of ".txt". It has fixed-width records sorted by path and a string table of
+ * the paths, so it can be mapped and searched without parsing. The size and
+ * CRC of the text list are recorded to detect the list rewritten after the
+ * manifest, even within the same second; then the text list is read.
+ */
+#define MANIFEST_MAGIC		0x4D46524D	/* "MRFM" */
+#define MANIFEST_VERSION	2
+
+typedef struct ManifestHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		nfiles;
+	uint32		strsize;	/* size of the string table */
+	int64		txt_size;	/* size of the text list */
+	pg_crc32	txt_crc;	/* CRC of the text list */
+	uint32		padding;
+} ManifestHeader;
+
+typedef struct ManifestRecord
+{
+	int64		mtime;
+	uint64		write_size;
+	uint32		path;		/* offset in the string table */
+	uint32		mode;		/* including the file type */
+	pg_crc32	crc;
+	uint32		is_datafile;
+} ManifestRecord;
+
+/*
+ * A file list is a mapped binary manifest, or files hashed with open
+ * addressing by the path relative to the root, so files listed under another
+ * root can be found with the same key. The number of buckets is a power of 2
+ * and at least twice the files.
+ */
+struct Manifest
+{
+	/* mapped binary manifest */
+	char				   *map;
+	size_t					mapsize;
+	const ManifestRecord   *records;
+	uint32					nfiles;
+	const char			   *strings;
+
+	/* or hashed list of pgFile, owned by the manifest */
+	parray	   *files;
+	size_t		rootlen;	/* length of the root prefix of the paths */
+	size_t		nbuckets;
+	pgFile	  **buckets;
+};
+
+static bool map_manifest(Manifest *self, const char *file_txt);
+static bool text_list_crc(const char *file_txt, pg_crc32 *crc);
+static void record_to_file(const ManifestRecord *rec, pgFile *file);
+static void manifest_path(char *path, size_t len, const char *file_txt);
+static uint32 hash_path(const char *path);
+
+/*
+ * Build a manifest from the file list returned by dir_read_file_list() with
+ * the root. The manifest owns the list and frees it.
+ */
+Manifest *
+manifest_new(parray *files, const char *root)
+{
+	Manifest   *self;
+	size_t		i;
+
+	self = pgut_new(Manifest);
+	memset(self, 0, sizeof(Manifest));
+	self->files = files;
+	self->rootlen = (root ? strlen(root) + 1 : 0);
+	for (self->nbuckets = 16;
+		 self->nbuckets < parray_num(files) * 2;
+		 self->nbuckets *= 2)
+		;
+	self->buckets = pgut_malloc(sizeof(pgFile *) * self->nbuckets);
+	memset(self->buckets, 0, sizeof(pgFile *) * self->nbuckets);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		const char *key = file->path + self->rootlen;
+		size_t		b;
+
+		for (b = hash_path(key) & (self->nbuckets - 1);
+			 self->buckets[b] != NULL;
+			 b = (b + 1) & (self->nbuckets - 1))
+		{
+			/* keep the first one of duplicated paths */
+			if (strcmp(self->buckets[b]->path + self->rootlen, key) == 0)
+				break;
+		}
+		if (self->buckets[b] == NULL)
+			self->buckets[b] = file;
+	}
+
+	return self;
+}
+
+/*
+ * Open the file list file_txt, using the binary manifest if available.
+ */
+Manifest *
+manifest_open(const char *file_txt)
+{
+	Manifest   *self;
+
+	self = pgut_new(Manifest);
+	memset(self, 0, sizeof(Manifest));
+	if (map_manifest(self, file_txt))
+		return self;
+	free(self);
+
+	return manifest_new(dir_read_file_list(NULL, file_txt), NULL);
+}
+
+/*
+ * Find a file by the path relative to the root. If found, the attributes
+ * except the path are copied into *file.
+ */
+bool
+manifest_find(const Manifest *self, const char *path, pgFile *file)
+{
+	if (self->map)
+	{
+		uint32	lo = 0;
+		uint32	hi = self->nfiles;
+
+		while (lo < hi)
+		{
+			uint32	mid = lo + (hi - lo) / 2;
+			int		cmp;
+
+			cmp = strcmp(self->strings + self->records[mid].path, path);
+			if (cmp == 0)
+			{
+				record_to_file(&self->records[mid], file);
+				return true;
+			}
+			else if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+	else
+	{
+		size_t	b;
+
+		for (b = hash_path(path) & (self->nbuckets - 1);
+			 self->buckets[b] != NULL;
+			 b = (b + 1) & (self->nbuckets - 1))
+		{
+			if (strcmp(self->buckets[b]->path + self->rootlen, path) == 0)
+			{
+				memcpy(file, self->buckets[b], offsetof(pgFile, path));
+				file->linked = NULL;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void
+manifest_free(Manifest *self)
+{
+	if (self == NULL)
+		return;
+#ifndef WIN32
+	if (self->map)
+		munmap(self->map, self->mapsize);
+#endif
+	if (self->files)
+	{
+		parray_walk(self->files, pgFileFree);
+		parray_free(self->files);
+	}
+	free(self->buckets);
+	free(self);
+}
+
+/*
+ * Construct parray of pgFile from the binary manifest of file_txt as
+ * dir_read_file_list() does. Returns NULL if the manifest is not available.
+ */
+parray *
+manifest_read_file_list(const char *root, const char *file_txt)
+{
+	Manifest	m;
+	parray	   *files;
+	uint32		i;
+
+	memset(&m, 0, sizeof(m));
+	if (!map_manifest(&m, file_txt))
+		return NULL;
+
+	files = parray_new();
+	parray_expand(files, m.nfiles);
+	for (i = 0; i < m.nfiles; i++)
+	{
+		const char *path = m.strings + m.records[i].path;
+		pgFile	   *file;
+
+		file = (pgFile *) parray_alloc(files, offsetof(pgFile, path) +
+					(root ? strlen(root) + 1 : 0) + strlen(path) + 1);
+		record_to_file(&m.records[i], file);
+		file->in_arena = true;
+		if (root)
+			sprintf(file->path, "%s/%s", root, path);
+		else
+			strcpy(file->path, path);
+		parray_append(files, file);
+	}
+
+#ifndef WIN32
+	munmap(m.map, m.mapsize);
+#endif
+
+	return files;
+}
+
+/*
+ * Write the binary manifest of the text list file_txt, which must be
+ * completed. The manifest is not essential, so failures are just warned.
+ * Lists in object storage have no manifest because they can't be mapped.
+ */
+void
+manifest_write(const char *file_txt)
+{
+	parray		   *files;
+	ManifestHeader	header;
+	struct stat		st;
+	char			path[MAXPGPATH];
+	char			tmp[MAXPGPATH];
+	FILE		   *fp;
+	uint32			offset;
+	size_t			i;
+	bool			ok;
+
+	if (storage_is_remote(file_txt))
+		return;
+
+	if (stat(file_txt, &st) == -1)
+	{
+		elog(WARNING, _("can't stat \"%s\": %s"), file_txt, strerror(errno));
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	if (!text_list_crc(file_txt, &header.txt_crc))
+	{
+		elog(WARNING, _("can't read \"%s\": %s"), file_txt, strerror(errno));
+		return;
+	}
+
+	/* read the text list in the same way as the readers */
+	files = dir_read_file_list(NULL, file_txt);
+
+	manifest_path(path, lengthof(path), file_txt);
+	snprintf(tmp, lengthof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+	{
+		elog(WARNING, _("can't open \"%s\": %s"), tmp, strerror(errno));
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+		return;
+	}
+
+	/* the string table starts with an empty string */
+	header.magic = MANIFEST_MAGIC;
+	header.version = MANIFEST_VERSION;
+	header.nfiles = parray_num(files);
+	header.strsize = 1;
+	for (i = 0; i < parray_num(files); i++)
+		header.strsize += strlen(((pgFile *) parray_get(files, i))->path) + 1;
+	header.txt_size = st.st_size;
+	ok = (fwrite(&header, 1, sizeof(header), fp) == sizeof(header));
+
+	for (offset = 1, i = 0; ok && i < parray_num(files); i++)
+	{
+		pgFile		   *file = (pgFile *) parray_get(files, i);
+		ManifestRecord	rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.mtime = file->mtime;
+		rec.write_size = file->write_size;
+		rec.path = offset;
+		rec.mode = file->mode;
+		rec.crc = file->crc;
+		rec.is_datafile = file->is_datafile;
+		ok = (fwrite(&rec, 1, sizeof(rec), fp) == sizeof(rec));
+		offset += strlen(file->path) + 1;
+	}
+
+	ok = ok && (fputc('\0', fp) != EOF);
+	for (i = 0; ok && i < parray_num(files); i++)
+	{
+		const char *p = ((pgFile *) parray_get(files, i))->path;
+
+		ok = (fwrite(p, 1, strlen(p) + 1, fp) == strlen(p) + 1);
+	}
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1)
+	{
+		elog(WARNING, _("can't write \"%s\": %s"), path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/*
+ * Map the binary manifest of file_txt into self. Returns false if it is
+ * missing, invalid, or older than the text list.
+ */
+static bool
+map_manifest(Manifest *self, const char *file_txt)
+{
+#ifndef WIN32
+	char			path[MAXPGPATH];
+	struct stat		st_txt;
+	struct stat		st;
+	ManifestHeader	header;
+	pg_crc32		crc;
+	int				fd;
+	char		   *map;
+
+	manifest_path(path, lengthof(path), file_txt);
+	if (stat(file_txt, &st_txt) == -1 || (fd = open(path, O_RDONLY, 0)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(header) ||
+		read(fd, &header, sizeof(header)) != sizeof(header))
+	{
+		close(fd);
+		return false;
+	}
+
+	if (header.magic != MANIFEST_MAGIC ||
+		header.version != MANIFEST_VERSION ||
+		header.txt_size != (int64) st_txt.st_size ||
+		header.strsize == 0 ||
+		(uint64) st.st_size != sizeof(header) +
+			(uint64) header.nfiles * sizeof(ManifestRecord) + header.strsize ||
+		!text_list_crc(file_txt, &crc) || crc != header.txt_crc)
+	{
+		elog(LOG, _("ignore binary manifest \"%s\""), path);
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	self->map = map;
+	self->mapsize = st.st_size;
+	self->records = (const ManifestRecord *) (map + sizeof(header));
+	self->nfiles = header.nfiles;
+	self->strings = map + sizeof(header) +
+		(size_t) header.nfiles * sizeof(ManifestRecord);
+
+	/* every string must be terminated in the table */
+	if (self->strings[header.strsize - 1] != '\0')
+	{
+		munmap(map, st.st_size);
+		self->map = NULL;
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* CRC of the whole text list, which is much cheaper than parsing it */
+static bool
+text_list_crc(const char *file_txt, pg_crc32 *crc)
+{
+	char	buf[64 * 1024];
+	ssize_t	len;
+	int		fd;
+
+	if ((fd = open(file_txt, O_RDONLY | PG_BINARY, 0)) == -1)
+		return false;
+
+	INIT_CRC32(*crc);
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		*crc = checksum_update(CHECKSUM_CRC32C, *crc, buf, len);
+	FIN_CRC32(*crc);
+	close(fd);
+
+	return len == 0;
+}
+
+static void
+record_to_file(const ManifestRecord *rec, pgFile *file)
+{
+	file->mtime = (time_t) rec->mtime;
+	file->mode = rec->mode;
+	file->size = 0;
+	file->read_size = 0;
+	file->write_size = rec->write_size;
+	file->crc = rec->crc;
+	file->is_datafile = (rec->is_datafile != 0);
+	file->in_arena = false;
+	file->linked = NULL;
+}
+
+/* path of the binary manifest, "file_xxx.txt" -> "file_xxx.bin" */
+static void
+manifest_path(char *path, size_t len, const char *file_txt)
+{
+	size_t	n = strlen(file_txt);
+
+	if (n > 4 && strcmp(file_txt + n - 4, ".txt") == 0)
+		n -= 4;
+	snprintf(path, len, "%.*s.bin", (int) n, file_txt);
+}
+
+/* FNV-1a */
+static uint32
+hash_path(const char *path)
+{
+	uint32	hash = 2166136261U;
+
+	for (; *path; path++)
+	{
+		hash ^= (unsigned char) *path;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
@@ -0,0 +1,556 @@
+/*-------------------------------------------------------------------------
+ *
+ * merge.c: merge incremental backups into a full backup in the catalog.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Files of the merged backup are written into MERGE_DIR in the target
+ * backup, which replaces DATABASE_DIR at the end. A file merged from several
+ * backups is restored into MERGE_WORK_DIR and backed up again from there, so
+ * at most one restored file per job occupies extra space at a time.
+ */
+#define MERGE_DIR			"database.merge"
+#define MERGE_WORK_DIR		"database.merge.tmp"
+#define MERGE_OLD_DIR		"database.merge.old"
+
+/* a file to be merged, possibly by a worker thread */
+typedef struct MergeJob
+{
+	void		  (*routine)(struct MergeJob *);
+	parray		   *sources;	/* list of RestoreSource */
+	pgFile		   *file;		/* in the file list of the target */
+	const char	   *from_root;	/* database directory of the target */
+	const char	   *work_root;
+	const char	   *to_root;
+	bool			link;		/* the only source can be linked as is */
+	char			progress[MAXPGPATH + 32];	/* for verbose mode */
+} MergeJob;
+
+static parray *merge_get_chain(parray *backups, const pgBackupRange *range);
+static int merge_server_version(parray *chain, char **roots, parray **lists,
+								pgFile *key, const char *work_root);
+static bool merge_can_link(const parray *sources, const char *full_root);
+static void merge_file(MergeJob *job);
+static void merge_remove_dir(const char *path);
+
+/*
+ * Merge the incremental backup at DATE, or the latest one, and the backups
+ * it is based on into a new full backup which replaces the incremental one.
+ * The server is not needed, since the files are made from the catalog.
+ */
+int
+do_merge(pgBackupRange *range)
+{
+	parray	   *backups;
+	parray	   *chain;
+	pgBackup   *target;
+	int			nbackups;
+	char	  **roots;
+	parray	  **lists;
+	parray	   *files;
+	pgFile	   *key;
+	char		timestamp[100];
+	char		list_path[MAXPGPATH];
+	char		to_root[MAXPGPATH];
+	char		work_root[MAXPGPATH];
+	char		old_root[MAXPGPATH];
+	int64		old_bytes = 0;
+	int64		new_bytes = 0;
+	int			linked = 0;
+	int			merged = 0;
+	int			ret;
+	int			i;
+	int			k;
+	JobQueue   *queue = NULL;
+
+	/* files are linked and renamed in the catalog */
+	if (storage_is_remote(BACKUP_ROOT))
+		elog(ERROR_ARGS, _("merge can't be used with object storage"));
+
+	/* get exclusive lock of backup catalog */
+	ret = catalog_lock();
+	if (ret == -1)
+		elog(ERROR_SYSTEM, _("can't lock backup catalog."));
+	else if (ret == 1)
+		elog(ERROR_ALREADY_RUNNING,
+			_("another pg_rman is running, stop merge."));
+
+	backups = catalog_get_backup_list(NULL);
+	if (!backups)
+		elog(ERROR_SYSTEM, _("can't process any more."));
+
+	chain = merge_get_chain(backups, range);
+	nbackups = parray_num(chain);
+	target = (pgBackup *) parray_get(chain, nbackups - 1);
+
+	time2iso(timestamp, lengthof(timestamp), target->start_time);
+	if (verbose)
+	{
+		printf(_("----------------------------------------\n"));
+		printf(_("merging %d backups up to %s into a full backup.\n"),
+			nbackups, timestamp);
+	}
+
+	/* validate all backups and read their file lists */
+	roots = pgut_newarray(char *, nbackups);
+	lists = pgut_newarray(parray *, nbackups);
+	for (k = 0; k < nbackups; k++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(chain, k);
+		char		backup_time[100];
+
+		check_block_size(backup);
+		pgBackupValidate(backup, backup->checksum != CHECKSUM_CRC32C,
+						 false, true);
+		if (!check && backup->status != BACKUP_STATUS_OK)
+		{
+			time2iso(backup_time, lengthof(backup_time), backup->start_time);
+			elog(ERROR_CORRUPTED, _("backup %s is corrupted, can't merge"),
+				backup_time);
+		}
+
+		roots[k] = pgut_malloc(MAXPGPATH);
+		pgBackupGetPath(backup, roots[k], MAXPGPATH, DATABASE_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path),
+			DATABASE_FILE_LIST);
+		lists[k] = dir_read_file_list(roots[k], list_path);
+	}
+
+	if (check)
+		goto cleanup;
+
+	/* remove files left by an interrupted merge */
+	pgBackupGetPath(target, to_root, lengthof(to_root), MERGE_DIR);
+	pgBackupGetPath(target, work_root, lengthof(work_root), MERGE_WORK_DIR);
+	pgBackupGetPath(target, old_root, lengthof(old_root), MERGE_OLD_DIR);
+	merge_remove_dir(to_root);
+	merge_remove_dir(work_root);
+	merge_remove_dir(old_root);
+
+	/* the newest backup knows all of directories */
+	files = lists[nbackups - 1];
+	dir_create_dir(to_root, DIR_PERMISSION);
+	dir_create_dir(work_root, DIR_PERMISSION);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+		char	path[MAXPGPATH];
+
+		if (!S_ISDIR(file->mode))
+			continue;
+		join_path_components(path, to_root,
+							 file->path + strlen(roots[nbackups - 1]) + 1);
+		dir_create_dir(path, DIR_PERMISSION);
+		join_path_components(path, work_root,
+							 file->path + strlen(roots[nbackups - 1]) + 1);
+		dir_create_dir(path, DIR_PERMISSION);
+	}
+
+	/* key to search a file in the lists of older backups */
+	key = pgut_malloc(offsetof(pgFile, path) + MAXPGPATH);
+
+	/* pages are parsed as of the backed-up server */
+	set_server_version(merge_server_version(chain, roots, lists, key,
+											work_root));
+
+	/* files are written in the format of the target */
+	current.compress_data = target->compress_data;
+	current.compress_method = target->compress_method;
+	current.checksum = target->checksum;
+	current.dedup = false;
+
+	if (num_threads > 1)
+		queue = JobQueue_new(num_threads);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		MergeJob	job;
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during merge"));
+
+		if (!S_ISREG(file->mode))
+			continue;
+		if (file->write_size != BYTES_INVALID)
+			old_bytes += file->write_size;
+
+		/* prepare progress message */
+		job.progress[0] = '\0';
+		if (verbose)
+			snprintf(job.progress, lengthof(job.progress), _("(%d/%lu) %s "),
+				i + 1, (unsigned long) parray_num(files),
+				file->path + strlen(roots[nbackups - 1]) + 1);
+
+		job.sources = restore_chain_sources(chain, roots, lists, file, key);
+		if (parray_num(job.sources) == 0)
+		{
+			if (verbose)
+				printf(_("%snot backed up, skip\n"), job.progress);
+			file->write_size = BYTES_INVALID;
+			parray_free(job.sources);
+			continue;
+		}
+
+		job.routine = merge_file;
+		job.file = file;
+		job.from_root = roots[nbackups - 1];
+		job.work_root = work_root;
+		job.to_root = to_root;
+		job.link = merge_can_link(job.sources, roots[0]);
+		if (job.link)
+			linked++;
+		else
+			merged++;
+
+		if (queue)
+		{
+			MergeJob   *qjob = pgut_new(MergeJob);
+
+			memcpy(qjob, &job, sizeof(MergeJob));
+			JobQueue_push(queue, (Job *) qjob);
+		}
+		else
+			merge_file(&job);
+	}
+
+	/* wait for all files merged by the workers */
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
+	}
+	free(key);
+	merge_remove_dir(work_root);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+
+		if (S_ISREG(file->mode) && file->write_size != BYTES_INVALID)
+			new_bytes += file->write_size;
+	}
+
+	/*
+	 * Replace the database directory and its file list. The backup is not
+	 * available while they are replaced, so it becomes an error if the merge
+	 * stops here.
+	 */
+	target->status = BACKUP_STATUS_RUNNING;
+	pgBackupWriteIni(target);
+
+	if (rename(roots[nbackups - 1], old_root) == -1)
+		elog(ERROR_SYSTEM, _("can't rename \"%s\" to \"%s\": %s"),
+			roots[nbackups - 1], old_root, strerror(errno));
+	if (rename(to_root, roots[nbackups - 1]) == -1)
+		elog(ERROR_SYSTEM, _("can't rename \"%s\" to \"%s\": %s"),
+			to_root, roots[nbackups - 1], strerror(errno));
+
+	pgBackupGetPath(target, list_path, lengthof(list_path), DATABASE_FILE_LIST);
+	{
+		FILE   *fp = storage_fopen(list_path, "wt");
+
+		if (fp == NULL)
+			elog(ERROR_SYSTEM, _("can't open file list \"%s\": %s"), list_path,
+				strerror(errno));
+		dir_print_file_list(fp, files, roots[nbackups - 1], NULL);
+		fclose(fp);
+	}
+	manifest_write(list_path);
+
+	target->backup_mode = BACKUP_MODE_FULL;
+	target->status = BACKUP_STATUS_DONE;
+	target->write_bytes += new_bytes - old_bytes;
+	pgBackupWriteIni(target);
+
+	merge_remove_dir(old_root);
+
+	/*
+	 * Validate the merged backup before the catalog is unlocked. Until it is
+	 * OK, restore would skip it and apply newer incremental backups based on
+	 * it onto the older ones, which lacks pages modified only in it.
+	 */
+	pgBackupValidate(target, false, false, true);
+	if (target->status != BACKUP_STATUS_OK)
+		elog(ERROR_CORRUPTED, _("merged backup %s is corrupted"), timestamp);
+
+	if (verbose)
+		printf(_("merge completed(linked: %d merged: %d write: " INT64_FORMAT ")\n"),
+			linked, merged, new_bytes);
+	elog(INFO, _("backup %s is merged into a full backup"), timestamp);
+
+cleanup:
+	for (k = 0; k < nbackups; k++)
+	{
+		parray_walk(lists[k], pgFileFree);
+		parray_free(lists[k]);
+		free(roots[k]);
+	}
+	free(lists);
+	free(roots);
+	parray_free(chain);
+
+	/* stop the workers of compression */
+	chunk_queue_free();
+
+	/* release catalog lock */
+	catalog_unlock();
+
+	parray_walk(backups, pgBackupFree);
+	parray_free(backups);
+
+	return 0;
+}
+
+/*
+ * Find the incremental backup to be merged and the backups it is based on:
+ * the last full backup before it and the incremental backups between them
+ * on the same timeline, which are what restore uses. The chain is in order
+ * of backup, so the last one is the target.
+ */
+static parray *
+merge_get_chain(parray *backups, const pgBackupRange *range)
+{
+	parray	   *chain;
+	pgBackup   *target = NULL;
+	int			target_index = -1;
+	int			full_index = -1;
+	int			i;
+
+	/* the newest incremental backup at or before DATE */
+	for (i = 0; i < parray_num(backups); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		if (pgBackupRangeIsValid(range) && backup->start_time > range->end)
+			continue;
+		if (backup->status != BACKUP_STATUS_OK ||
+			!HAVE_DATABASE(backup))
+			continue;
+		if (backup->backup_mode == BACKUP_MODE_FULL)
+			elog(ERROR_NO_BACKUP,
+				_("the latest database backup is a full backup, nothing to merge."));
+		target = backup;
+		target_index = i;
+		break;
+	}
+	if (target == NULL)
+		elog(ERROR_NO_BACKUP, _("no incremental backup found, can't merge."));
+
+	for (i = target_index + 1; i < parray_num(backups); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		if (backup->status == BACKUP_STATUS_OK &&
+			backup->backup_mode == BACKUP_MODE_FULL &&
+			backup->tli == target->tli)
+		{
+			full_index = i;
+			break;
+		}
+	}
+	if (full_index < 0)
+		elog(ERROR_NO_BACKUP, _("no full backup found, can't merge."));
+
+	chain = parray_new();
+	for (i = full_index; i >= target_index; i--)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		if (i < full_index &&
+			(backup->status != BACKUP_STATUS_OK ||
+			 backup->backup_mode != BACKUP_MODE_INCREMENTAL ||
+			 backup->tli != target->tli))
+			continue;
+
+		/* pages must be read from the catalog */
+		if (backup->dedup)
+			elog(ERROR_ARGS, _("can't merge deduplicated backups"));
+		if (backup->stream)
+			elog(ERROR_ARGS, _("can't merge backups in a stream"));
+		if (backup->compress_data &&
+			!compress_method_supported(backup->compress_method))
+			elog(EXIT_NOT_SUPPORTED,
+				_("can't merge compressed backup (compress-method %s not supported in this installation)"),
+				compress_method_name(backup->compress_method));
+
+		parray_append(chain, backup);
+	}
+
+	return chain;
+}
+
+/*
+ * Get the server version from PG_VERSION restored from the chain, which is
+ * needed to parse pages as backup does.
+ */
+static int
+merge_server_version(parray *chain, char **roots, parray **lists,
+					 pgFile *key, const char *work_root)
+{
+	int			nbackups = parray_num(chain);
+	pgFile	  **found;
+	parray	   *sources;
+	pgFile	   *src;
+	size_t		write_size;
+	pg_crc32	crc;
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	int			major = 0;
+	int			minor = 0;
+
+	join_path_components(key->path, roots[nbackups - 1], "PG_VERSION");
+	found = (pgFile **) parray_bsearch(lists[nbackups - 1], key,
+		pgFileComparePath);
+	if (found == NULL)
+		elog(ERROR_CORRUPTED, _("PG_VERSION is not found in the backup"));
+
+	sources = restore_chain_sources(chain, roots, lists, *found, key);
+	if (parray_num(sources) == 0)
+		elog(ERROR_CORRUPTED, _("PG_VERSION is not backed up"));
+
+	/* the copy is restored as a whole, which overwrites its sizes */
+	src = ((RestoreSource *) parray_get(sources, 0))->file;
+	write_size = src->write_size;
+	crc = src->crc;
+	restore_chain_apply(sources, work_root);
+	src->write_size = write_size;
+	src->crc = crc;
+	parray_walk(sources, free);
+	parray_free(sources);
+
+	join_path_components(path, work_root, "PG_VERSION");
+	if ((fp = fopen(path, "r")) == NULL)
+		elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), path, strerror(errno));
+	if (fscanf(fp, "%d.%d", &major, &minor) < 1 || major < 8)
+		elog(ERROR_CORRUPTED, _("invalid PG_VERSION in the backup"));
+	fclose(fp);
+	unlink(path);
+
+	return major * 10000 + minor * 100;
+}
+
+/*
+ * The backed-up file can be linked into the merged backup without restoring
+ * if it is a complete copy in the format of the merged backup: a whole copy
+ * of the file, or any file of the full backup.
+ */
+static bool
+merge_can_link(const parray *sources, const char *full_root)
+{
+	RestoreSource *source;
+
+	if (parray_num(sources) != 1)
+		return false;
+
+	source = (RestoreSource *) parray_get(sources, 0);
+	if (source->file->is_datafile && source->from_root != full_root)
+		return false;
+
+	return source->compress == current.compress_data &&
+		   (!source->compress || source->method == current.compress_method) &&
+		   source->checksum == current.checksum;
+}
+
+/*
+ * Make a file of the merged backup. This is called in a worker thread when
+ * the merge runs with multiple jobs.
+ */
+static void
+merge_file(MergeJob *job)
+{
+	pgFile	   *file = job->file;
+	const char *rel_path = file->path + strlen(job->from_root) + 1;
+	char		path[MAXPGPATH];
+	struct stat	st;
+	pgFile	   *work;
+	bool		copied;
+
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during merge"));
+
+	if (job->link)
+	{
+		RestoreSource *source = (RestoreSource *) parray_get(job->sources, 0);
+
+		join_path_components(path, job->to_root, rel_path);
+		if (link(source->file->path, path) == 0)
+		{
+			file->write_size = source->file->write_size;
+			file->crc = source->file->crc;
+			file->is_datafile = source->file->is_datafile;
+			if (verbose)
+				printf(_("%slinked\n"), job->progress);
+			goto done;
+		}
+
+		/* backups in different file systems are merged by copying */
+		if (errno != EXDEV)
+			elog(ERROR_SYSTEM, _("can't link \"%s\" to \"%s\": %s"),
+				source->file->path, path, strerror(errno));
+	}
+
+	/* restore the file, and back it up again in the merged backup */
+	restore_chain_apply(job->sources, job->work_root);
+
+	join_path_components(path, job->work_root, rel_path);
+	if (stat(path, &st) == -1)
+		elog(ERROR_SYSTEM, _("can't stat \"%s\": %s"), path, strerror(errno));
+	work = storage_file_new(path, file->mode, st.st_size, file->mtime);
+	work->is_datafile = file->is_datafile;
+
+	copied = work->is_datafile
+		? backup_data_file(job->work_root, job->to_root, work, NULL, NULL,
+						   current.compress_data, current.compress_method)
+		: copy_file(job->work_root, job->to_root, work,
+					current.compress_data ? COMPRESSION : NO_COMPRESSION,
+					current.compress_method);
+	if (!copied)
+		elog(ERROR_SYSTEM, _("can't merge \"%s\""), rel_path);
+
+	file->write_size = work->write_size;
+	file->crc = work->crc;
+	file->is_datafile = work->is_datafile;
+	pgFileFree(work);
+
+	if (unlink(path) == -1)
+		elog(ERROR_SYSTEM, _("can't remove \"%s\": %s"), path, strerror(errno));
+
+	if (verbose)
+		printf(_("%smerged from %lu backups\n"), job->progress,
+			(unsigned long) parray_num(job->sources));
+
+done:
+	parray_walk(job->sources, free);
+	parray_free(job->sources);
+}
+
+/* remove a directory and all of its contents if it exists */
+static void
+merge_remove_dir(const char *path)
+{
+	parray *files;
+	int		i;
+
+	if (access(path, F_OK) == -1)
+		return;
+
+	files = parray_new();
+	dir_list_file(files, path, NULL, true, true);
+	parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
+	for (i = 0; i < parray_num(files); i++)
+		pgFileDelete((pgFile *) parray_get(files, i));
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+}
@@ -0,0 +1,197 @@
+/*-------------------------------------------------------------------------
+ *
+ * metrics.c: time and throughput of the phases of commands.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "pgut/pgut-pthread.h"
+
+typedef struct PhaseMetrics
+{
+	double		wall;		/* elapsed seconds */
+	double		cpu;		/* user and system CPU seconds */
+	int64		bytes;
+	int64		files;
+	int64		count;		/* number of times measured */
+} PhaseMetrics;
+
+/*
+ * PHASE_READ and the later phases run in worker threads. Their times are
+ * summed over the threads, and their CPU time is of the thread. CPU time of
+ * the other phases is of the whole process, including the workers they run.
+ */
+static const char *const phase_names[NUM_PHASES] =
+{
+	"start_backup",
+	"list_files",
+	"copy_database",
+	"stop_backup",
+	"wait_archive",
+	"copy_arclog",
+	"copy_srvlog",
+	"clear_pgdata",
+	"restore_database",
+	"restore_arclog",
+	"validate",
+	"read",
+	"compress",
+	"decompress",
+};
+
+static pthread_mutex_t	metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static PhaseMetrics		metrics[NUM_PHASES];
+
+static double metrics_cpu(MetricsPhase phase);
+
+void
+metrics_start(MetricsTimer *timer, MetricsPhase phase)
+{
+	timer->phase = phase;
+	gettimeofday(&timer->wall, NULL);
+	timer->cpu = metrics_cpu(phase);
+}
+
+/*
+ * Add the time since metrics_start() to the phase, with bytes and files
+ * processed in the time.
+ */
+void
+metrics_stop(MetricsTimer *timer, int64 bytes, int64 files)
+{
+	struct timeval	now;
+	double			cpu;
+	PhaseMetrics   *m = &metrics[timer->phase];
+
+	gettimeofday(&now, NULL);
+	cpu = metrics_cpu(timer->phase);
+
+	pthread_mutex_lock(&metrics_lock);
+	m->wall += (now.tv_sec - timer->wall.tv_sec) +
+			   (now.tv_usec - timer->wall.tv_usec) / 1000000.0;
+	m->cpu += cpu - timer->cpu;
+	m->bytes += bytes;
+	m->files += files;
+	m->count++;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * Write the phases measured into METRICS_FILE of the command in the backup
+ * directory, one phase in a line.
+ */
+void
+metrics_write(const pgBackup *backup, const char *command)
+{
+	char	name[MAXPGPATH];
+	char	path[MAXPGPATH];
+	FILE   *fp;
+	int		i;
+
+	snprintf(name, lengthof(name), METRICS_FILE, command);
+	pgBackupGetPath(backup, path, lengthof(path), name);
+	fp = storage_fopen(path, "wt");
+	if (fp == NULL)
+	{
+		/* metrics are not worth failing the command */
+		elog(WARNING, _("can't open metrics file \"%s\": %s"), path,
+			strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "# PHASE WALL_SEC CPU_SEC BYTES FILES\n");
+	pthread_mutex_lock(&metrics_lock);
+	for (i = 0; i < NUM_PHASES; i++)
+	{
+		if (metrics[i].count == 0)
+			continue;
+		fprintf(fp, "%s %.6f %.6f " INT64_FORMAT " " INT64_FORMAT "\n",
+			phase_names[i], metrics[i].wall, metrics[i].cpu,
+			metrics[i].bytes, metrics[i].files);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	if (fclose(fp) != 0)
+		elog(WARNING, _("can't write metrics file \"%s\": %s"), path,
+			strerror(errno));
+}
+
+/*
+ * Print the metrics of backup, restore and validate of the backup with the
+ * throughput of each phase.
+ */
+void
+metrics_show(FILE *out, const pgBackup *backup)
+{
+	static const char *const commands[] = { "backup", "restore", "validate" };
+	int		i;
+
+	for (i = 0; i < lengthof(commands); i++)
+	{
+		char	name[MAXPGPATH];
+		char	path[MAXPGPATH];
+		char	buf[1024];
+		FILE   *fp;
+
+		snprintf(name, lengthof(name), METRICS_FILE, commands[i]);
+		pgBackupGetPath(backup, path, lengthof(path), name);
+		if ((fp = storage_fopen(path, "rt")) == NULL)
+			continue;
+
+		fprintf(out, "# metrics of last %s\n", commands[i]);
+		fprintf(out, "# %-16s %10s %10s %14s %8s %10s\n",
+			"PHASE", "WALL(s)", "CPU(s)", "BYTES", "FILES", "MB/s");
+		while (fgets(buf, lengthof(buf), fp))
+		{
+			char	phase[64];
+			char	bytes_str[32];
+			char	files_str[32];
+			double	wall;
+			double	cpu;
+			int64	bytes;
+			int64	files;
+
+			if (buf[0] == '#' ||
+				sscanf(buf, "%63s %lf %lf " INT64_FORMAT " " INT64_FORMAT,
+					   phase, &wall, &cpu, &bytes, &files) != 5)
+				continue;
+			snprintf(bytes_str, lengthof(bytes_str), INT64_FORMAT, bytes);
+			snprintf(files_str, lengthof(files_str), INT64_FORMAT, files);
+			fprintf(out, "  %-16s %10.3f %10.3f %14s %8s %10.1f\n",
+				phase, wall, cpu, bytes_str, files_str,
+				wall > 0 ? bytes / wall / (1024 * 1024) : 0);
+		}
+		fclose(fp);
+	}
+}
+
+/* CPU seconds of the thread for phases in workers, or of the process */
+static double
+metrics_cpu(MetricsPhase phase)
+{
+	struct rusage	ru;
+
+	if (phase >= PHASE_READ)
+	{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+		struct timespec	ts;
+
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+			return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+		return 0;	/* CPU time of threads is not available */
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+		   ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
@@ -9,12 +9,29 @@
 
 #include "pg_rman.h"
 
+/*
+ * Blocks of the arena. Elements are bump-allocated from the head block, and
+ * all blocks are freed at once by parray_free().
+ */
+typedef struct ArenaBlock
+{
+	struct ArenaBlock  *next;
+	size_t				used;
+	size_t				size;
+} ArenaBlock;
+
+/* blocks grow from the minimum, not to waste memory for small lists */
+#define ARENA_MIN_BLOCK_SIZE	(4 * 1024)
+#define ARENA_BLOCK_SIZE		(64 * 1024)
+#define ArenaBlockData(block)	((char *) (block) + MAXALIGN(sizeof(ArenaBlock)))
+
 /* members of struct parray are hidden from client. */
 struct parray
 {
 	void **data;		/* poiter array, expanded if necessary */
 	size_t alloced;		/* number of elements allocated */
 	size_t used;		/* number of elements in use */
+	ArenaBlock *arena;	/* memory of elements, freed with the array */
 };
 
 /*
@@ -29,6 +46,7 @@ parray_new(void)
 	a->data = NULL;
 	a->used = 0;
 	a->alloced = 0;
+	a->arena = NULL;
 
 	parray_expand(a, 1024);
 
@@ -61,12 +79,70 @@ parray_expand(parray *array, size_t newsize)
 void
 parray_free(parray *array)
 {
+	ArenaBlock *block;
+
 	if (array == NULL)
 		return;
+	while ((block = array->arena) != NULL)
+	{
+		array->arena = block->next;
+		free(block);
+	}
 	free(array->data);
 	free(array);
 }
 
+/*
+ * Allocate memory for an element from the arena of the array. The memory
+ * is valid until parray_free() of the array, and must not be freed alone.
+ * Never returns NULL.
+ */
+void *
+parray_alloc(parray *array, size_t size)
+{
+	ArenaBlock *block = array->arena;
+	void	   *p;
+
+	size = MAXALIGN(size);
+	if (block == NULL || block->size - block->used < size)
+	{
+		size_t	block_size;
+
+		block_size = (block ? Min(block->size * 2, ARENA_BLOCK_SIZE)
+							: ARENA_MIN_BLOCK_SIZE);
+		block_size = Max(size, block_size);
+
+		block = pgut_malloc(MAXALIGN(sizeof(ArenaBlock)) + block_size);
+		block->used = 0;
+		block->size = block_size;
+
+		/* a large element doesn't waste the rest of the current block */
+		if (block_size > ARENA_BLOCK_SIZE && array->arena != NULL)
+		{
+			block->next = array->arena->next;
+			array->arena->next = block;
+		}
+		else
+		{
+			block->next = array->arena;
+			array->arena = block;
+		}
+	}
+
+	p = ArenaBlockData(block) + block->used;
+	block->used += size;
+
+	return p;
+}
+
+char *
+parray_strdup(parray *array, const char *str)
+{
+	size_t	len = strlen(str) + 1;
+
+	return memcpy(parray_alloc(array, len), str, len);
+}
+
 void
 parray_append(parray *array, void *elem)
 {
@@ -96,9 +172,10 @@ parray_insert(parray *array, size_t index, void *elem)
 /*
  * Concatinate two parray.
  * parray_concat() appends the copy of the content of src to the end of dest.
+ * The arena of src is moved to dest, so src can be freed after that.
  */
 parray *
-parray_concat(parray *dest, const parray *src)
+parray_concat(parray *dest, parray *src)
 {
 	/* expand head array */
 	parray_expand(dest, dest->used + src->used);
@@ -107,6 +184,23 @@ parray_concat(parray *dest, const parray *src)
 	memcpy(dest->data + dest->used, src->data, src->used * sizeof(void *));
 	dest->used += parray_num(src);
 
+	/* move blocks after the head of dest to keep allocating from it */
+	if (src->arena != NULL)
+	{
+		ArenaBlock *tail = src->arena;
+
+		while (tail->next != NULL)
+			tail = tail->next;
+		if (dest->arena != NULL)
+		{
+			tail->next = dest->arena->next;
+			dest->arena->next = src->arena;
+		}
+		else
+			dest->arena = src->arena;
+		src->arena = NULL;
+	}
+
 	return dest;
 }
 
@@ -175,6 +269,14 @@ parray_num(const parray *array)
 	return array->used;
 }
 
+/* drop the elements after the first num ones, without freeing them */
+void
+parray_shrink(parray *array, size_t num)
+{
+	if (num < array->used)
+		array->used = num;
+}
+
 void
 parray_qsort(parray *array, int(*compare)(const void *, const void *))
 {
@@ -22,16 +22,29 @@ char *backup_path;
 char *pgdata;
 char *arclog_path;
 char *srvlog_path;
+char *storage_path;
 
 /* common configuration */
 bool verbose = false;
 bool check = false;
+int num_threads = 1;
+int max_rate = 0;
+int max_iops = 0;
+bool zero_copy = false;
+static char *stream;
+
+/* full path of this program, for restore_command */
+char pg_rman_path[MAXPGPATH];
 
 /* directory configuration */
 pgBackup	current;
 
 /* backup configuration */
 static bool		smooth_checkpoint;
+bool			direct_io = false;
+bool			wal_pagemap = false;
+char		   *standby_host = NULL;
+char		   *standby_port = NULL;
 static int		keep_arclog_files = KEEP_INFINITE;
 static int		keep_arclog_days = KEEP_INFINITE;
 static int		keep_srvlog_files = KEEP_INFINITE;
@@ -44,6 +57,12 @@ static char		   *target_time;
 static char		   *target_xid;
 static char		   *target_inclusive;
 static TimeLineID	target_tli;
+static bool			single_pass = false;
+static bool			wal_on_demand = false;
+bool				delta = false;
+
+/* validate configuration */
+static bool		all_errors = false;
 
 /* delete configuration */
 static bool		force;
@@ -52,6 +71,7 @@ static bool		force;
 static bool			show_all = false;
 
 static void opt_backup_mode(pgut_option *opt, const char *arg);
+static void opt_compress_method(pgut_option *opt, const char *arg);
 static void parse_range(pgBackupRange *range, const char *arg1, const char *arg2);
 
 static pgut_option options[] =
@@ -61,14 +81,25 @@ static pgut_option options[] =
 	{ 's', 'A', "arclog-path"	, &arclog_path	, SOURCE_ENV },
 	{ 's', 'B', "backup-path"	, &backup_path	, SOURCE_ENV },
 	{ 's', 'S', "srvlog-path"	, &srvlog_path	, SOURCE_ENV },
+	{ 's', 18, "storage-path"	, &storage_path	, SOURCE_ENV },
 	/* common options */
 	{ 'b', 'v', "verbose"		, &verbose },
 	{ 'b', 'c', "check"			, &check },
+	{ 'i', 'j', "jobs"			, &num_threads	, SOURCE_ENV },
+	{ 's', 17, "stream"			, &stream },
+	{ 'i', 20, "max-rate"		, &max_rate		, SOURCE_ENV },
+	{ 'i', 21, "max-iops"		, &max_iops		, SOURCE_ENV },
+	{ 'b', 22, "zero-copy"		, &zero_copy	, SOURCE_ENV },
 	/* backup options */
 	{ 'f', 'b', "backup-mode"		, opt_backup_mode			, SOURCE_ENV },
 	{ 'b', 's', "with-serverlog"	, &current.with_serverlog	, SOURCE_ENV },
 	{ 'b', 'Z', "compress-data"		, &current.compress_data	, SOURCE_ENV },
 	{ 'b', 'C', "smooth-checkpoint"	, &smooth_checkpoint		, SOURCE_ENV },
+	{ 'b', 14, "direct-io"			, &direct_io				, SOURCE_ENV },
+	{ 'b', 16, "wal-pagemap"		, &wal_pagemap				, SOURCE_ENV },
+	{ 'b', 19, "dedup"				, &current.dedup			, SOURCE_ENV },
+	{ 's', 25, "standby-host"		, &standby_host				, SOURCE_ENV },
+	{ 's', 26, "standby-port"		, &standby_port				, SOURCE_ENV },
 	/* delete options */
 	{ 'b', 'f', "force"	, &force		, SOURCE_ENV },
 	/* options with only long name (keep-xxx) */
@@ -83,6 +114,14 @@ static pgut_option options[] =
 	{ 's',  8, "recovery-target-xid"		, &target_xid		, SOURCE_ENV },
 	{ 's',  9, "recovery-target-inclusive"	, &target_inclusive	, SOURCE_ENV },
 	{ 'u', 10, "recovery-target-timeline"	, &target_tli		, SOURCE_ENV },
+	{ 'b', 11, "single-pass"				, &single_pass		, SOURCE_ENV },
+	{ 'b', 23, "wal-on-demand"				, &wal_on_demand	, SOURCE_ENV },
+	{ 'b', 24, "delta"						, &delta			, SOURCE_ENV },
+	/* compression options */
+	{ 'f', 12, "compress-method"	, opt_compress_method		, SOURCE_ENV },
+	{ 'i', 13, "compress-level"		, &current.compress_level	, SOURCE_ENV },
+	/* validate options */
+	{ 'b', 15, "all-errors"			, &all_errors				, SOURCE_ENV },
 	/* catalog options */
 	{ 'b', 'a', "show-all"		, &show_all },
 	{ 0 }
@@ -132,8 +171,10 @@ main(int argc, char *argv[])
 		return HELP;
 	}
 
-	/* get object range argument if any */
-	if (range1 && range2)
+	/* get object range argument if any; fetch-wal takes file names instead */
+	if (pg_strcasecmp(cmd, "fetch-wal") == 0)
+		range.begin = range.end = 0;
+	else if (range1 && range2)
 		parse_range(&range, range1, range2);
 	else if (range1)
 		parse_range(&range, range1, "");
@@ -169,6 +210,30 @@ main(int argc, char *argv[])
 		elog(ERROR_ARGS, "-A, --arclog-path must be an absolute path");
 	if (srvlog_path != NULL && !is_absolute_path(srvlog_path))
 		elog(ERROR_ARGS, "-S, --srvlog-path must be an absolute path");
+	if (storage_path != NULL && !storage_is_remote(storage_path) &&
+		!is_absolute_path(storage_path))
+		elog(ERROR_ARGS, "--storage-path must be an absolute path or a URL");
+	if (storage_path != NULL)
+	{
+		size_t	len = strlen(storage_path);
+
+		while (len > 1 && storage_path[len - 1] == '/')
+			storage_path[--len] = '\0';
+		if (stream && storage_is_remote(storage_path))
+			elog(ERROR_ARGS, "--stream can't be used with object storage");
+	}
+
+	if (num_threads < 1)
+		elog(ERROR_ARGS, "-j, --jobs must be 1 or more");
+	if (max_rate < 0)
+		elog(ERROR_ARGS, "--max-rate must be 0 or more");
+	if (max_iops < 0)
+		elog(ERROR_ARGS, "--max-iops must be 0 or more");
+	if (current.compress_level < 0 ||
+		current.compress_level > compress_max_level(current.compress_method))
+		elog(ERROR_ARGS, "--compress-level must be 0 to %d for %s",
+			compress_max_level(current.compress_method),
+			compress_method_name(current.compress_method));
 
 	/* setup exclusion list for file search */
 	for (i = 0; pgdata_exclude[i]; i++)		/* find first empty slot */
@@ -178,6 +243,8 @@ main(int argc, char *argv[])
 	if (srvlog_path)
 		pgdata_exclude[i++] = srvlog_path;
 
+	throttle_init();
+
 	/* do actual operation */
 	if (pg_strcasecmp(cmd, "init") == 0)
 		return do_init();
@@ -185,17 +252,24 @@ main(int argc, char *argv[])
 		return do_backup(smooth_checkpoint,
 						 keep_arclog_files, keep_arclog_days,
 						 keep_srvlog_files, keep_srvlog_days,
-						 keep_data_generations, keep_data_days);
+						 keep_data_generations, keep_data_days, stream);
 	else if (pg_strcasecmp(cmd, "restore") == 0){
-		return do_restore(target_time, target_xid, target_inclusive, target_tli);
+		if (wal_on_demand && find_my_exec(argv[0], pg_rman_path) < 0)
+			strlcpy(pg_rman_path, PROGRAM_NAME, lengthof(pg_rman_path));
+		return do_restore(target_time, target_xid, target_inclusive, target_tli,
+						  single_pass, wal_on_demand, stream);
 	}
+	else if (pg_strcasecmp(cmd, "fetch-wal") == 0)
+		return do_fetch_wal(range1, range2);
 	else if (pg_strcasecmp(cmd, "show") == 0)
 		return do_show(&range, show_timeline, show_all);
 	else if (pg_strcasecmp(cmd, "validate") == 0)
-		return do_validate(&range);
+		return do_validate(&range, all_errors);
 	else if (pg_strcasecmp(cmd, "delete") == 0)
 //		return do_delete(&range);
 		return do_delete(&range, force);
+	else if (pg_strcasecmp(cmd, "merge") == 0)
+		return do_merge(&range);
 	else
 		elog(ERROR_ARGS, "invalid command \"%s\"", cmd);
 
@@ -214,6 +288,8 @@ pgut_help(bool details)
 	printf(_("  %s OPTION show timeline [DATE]\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION validate [DATE]\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION delete DATE\n"), PROGRAM_NAME);
+	printf(_("  %s OPTION merge [DATE]\n"), PROGRAM_NAME);
+	printf(_("  %s OPTION fetch-wal WAL PATH\n"), PROGRAM_NAME);
 
 	if (!details)
 		return;
@@ -223,12 +299,25 @@ pgut_help(bool details)
 	printf(_("  -A, --arclog-path=PATH    location of archive WAL storage area\n"));
 	printf(_("  -S, --srvlog-path=PATH    location of server log storage area\n"));
 	printf(_("  -B, --backup-path=PATH    location of the backup storage area\n"));
+	printf(_("  --storage-path=PATH       location of backups if not in backup path, or URL like s3://bucket/prefix\n"));
 	printf(_("  -c, --check               show what would have been done\n"));
+	printf(_("  -j, --jobs=NUM            number of files processed in parallel\n"));
+	printf(_("  --stream=COMMAND          write backup to or restore from stream of COMMAND, - for stdout/stdin\n"));
+	printf(_("  --max-rate=MB             limit reading files to MB megabytes per second\n"));
+	printf(_("  --max-iops=NUM            limit reading files to NUM reads per second\n"));
+	printf(_("  --zero-copy               copy uncompressed files by reflink or in the kernel\n"));
 	printf(_("\nBackup options:\n"));
 	printf(_("  -b, --backup-mode=MODE    full, incremental, or archive\n"));
 	printf(_("  -s, --with-serverlog      also backup server log files\n"));
-	printf(_("  -Z, --compress-data       compress data backup with zlib\n"));
+	printf(_("  -Z, --compress-data       compress data backup\n"));
+	printf(_("  --compress-method=METHOD  zlib, lz4, or zstd (default: zlib)\n"));
+	printf(_("  --compress-level=LEVEL    compression level, 0 for default of the method\n"));
 	printf(_("  -C, --smooth-checkpoint   do smooth checkpoint before backup\n"));
+	printf(_("  --direct-io               read files bypassing the OS cache\n"));
+	printf(_("  --wal-pagemap             read only pages modified in WAL in incremental backup\n"));
+	printf(_("  --dedup                   store pages shared with other backups only once\n"));
+	printf(_("  --standby-host=HOSTNAME   backup PGDATA of the standby on the host, with -h of the primary\n"));
+	printf(_("  --standby-port=PORT       port of the standby server\n"));
 	printf(_("  --keep-data-generations=N keep GENERATION of full data backup\n"));
 	printf(_("  --keep-data-days=DAY      keep enough data backup to recover to DAY days age\n"));
 	printf(_("  --keep-arclog-files=NUM   keep NUM of archived WAL\n"));
@@ -240,6 +329,11 @@ pgut_help(bool details)
 	printf(_("  --recovery-target-xid     transaction ID up to which recovery will proceed\n"));
 	printf(_("  --recovery-target-inclusive whether we stop just after the recovery target\n"));
 	printf(_("  --recovery-target-timeline  recovering into a particular timeline\n"));
+	printf(_("  --single-pass             restore incremental backups with the full backup at once\n"));
+	printf(_("  --wal-on-demand           restore archived WAL by fetch-wal when recovery requests it\n"));
+	printf(_("  --delta                   rewrite only files and pages which differ from PGDATA\n"));
+	printf(_("\nValidate options:\n"));
+	printf(_("  --all-errors              report all corrupted files, not only the first\n"));
 	printf(_("\nCatalog options:\n"));
 	printf(_("  -a, --show-all            show deleted backup too\n"));
 }
@@ -325,3 +419,9 @@ opt_backup_mode(pgut_option *opt, const char *arg)
 {
 	current.backup_mode = parse_backup_mode(arg, ERROR_ARGS);
 }
+
+static void
+opt_compress_method(pgut_option *opt, const char *arg)
+{
+	current.compress_method = parse_compress_method(arg, ERROR_ARGS);
+}
@@ -12,10 +12,13 @@
 #include "postgres_fe.h"
 
 #include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "libpq-fe.h"
 
 #include "pgut/pgut.h"
 #include "access/xlogdefs.h"
+#include "storage/block.h"
 #include "utils/pg_crc.h"
 #include "parray.h"
 
@@ -40,11 +43,19 @@
 #define TIMELINE_HISTORY_DIR	"timeline_history"
 #define BACKUP_INI_FILE			"backup.ini"
 #define PG_RMAN_INI_FILE		"pg_rman.ini"
+#define CATALOG_INDEX_FILE		"catalog_index.txt"
+#define CATALOG_INDEX_DIRTY_FILE	"catalog_index.dirty"
 #define MKDIRS_SH_FILE			"mkdirs.sh"
 #define DATABASE_FILE_LIST		"file_database.txt"
 #define ARCLOG_FILE_LIST		"file_arclog.txt"
 #define SRVLOG_FILE_LIST		"file_srvlog.txt"
+#define VALIDATE_CHECKPOINT_FILE	"file_validated.txt"
 #define SNAPSHOT_SCRIPT_FILE	"snapshot_script"
+#define DEDUP_DIR				"dedup"
+#define DEDUP_REFS_FILE			"file_dedup.txt"
+#define TRASH_DIR				"trash"
+#define THROTTLE_INI_FILE		"pg_rman_throttle.ini"
+#define METRICS_FILE			"metrics_%s.txt"	/* %s is the command */
 
 /* Snapshot script command */
 #define SNAPSHOT_FREEZE			"freeze"
@@ -66,6 +77,8 @@
 #define ERROR_PG_INCOMPATIBLE	24	/* block size is not compatible */
 #define ERROR_PG_RUNNING		25	/* PostgreSQL server is running */
 #define ERROR_PID_BROKEN		26	/* postmaster.pid file is broken */
+#define ERROR_WAL_NOT_FOUND		27	/* WAL file was not found by fetch-wal */
+#define EXIT_NOT_SUPPORTED		28	/* compression of backup is not supported */
 
 /* backup mode file */
 typedef struct pgFile
@@ -81,6 +94,8 @@ typedef struct pgFile
 	pg_crc32 crc;			/* CRC value of the file, regular file only */
 	char   *linked;			/* path of the linked file */
 	bool	is_datafile;	/* true if the file is PostgreSQL data file */
+	bool	in_arena;		/* true if allocated by parray_alloc() of the list,
+							   so pgFileFree() doesn't free it */
 	char	path[1]; 		/* path of the file */
 } pgFile;
 
@@ -125,8 +140,22 @@ typedef enum BackupMode
 	BACKUP_MODE_FULL			/* full backup */
 } BackupMode;
 
+typedef enum CompressMethod
+{
+	COMPRESS_METHOD_ZLIB,		/* default, and used by older versions */
+	COMPRESS_METHOD_LZ4,
+	COMPRESS_METHOD_ZSTD
+} CompressMethod;
+
+typedef enum ChecksumAlgorithm
+{
+	CHECKSUM_CRC32,				/* used by older versions */
+	CHECKSUM_CRC32C				/* default */
+} ChecksumAlgorithm;
+
 /*
- * pg_rman takes backup into the directroy $BACKUP_PATH/<date>/<time>.
+ * pg_rman takes backup into the directroy $BACKUP_PATH/<date>/<time>, or
+ * $STORAGE_PATH/<date>/<time> if STORAGE_PATH is set.
  *
  * status == -1 indicates the pgBackup is invalid.
  */
@@ -136,6 +165,11 @@ typedef struct pgBackup
 	BackupMode	backup_mode;
 	bool		with_serverlog;
 	bool		compress_data;
+	CompressMethod	compress_method;
+	int			compress_level;		/* not recorded in backup.ini */
+	ChecksumAlgorithm	checksum;	/* of the files in the file lists */
+	bool		stream;			/* files are in a stream, not in the catalog */
+	bool		dedup;			/* pages of data files are in the dedup store */
 
 	/* Status - one of BACKUP_STATUS_xxx */
 	BackupStatus	status;
@@ -168,6 +202,10 @@ typedef struct pgBackup
 
 #define HAVE_DATABASE(backup)	((backup)->backup_mode >= BACKUP_MODE_INCREMENTAL)
 #define HAVE_ARCLOG(backup)		((backup)->backup_mode >= BACKUP_MODE_ARCHIVE)
+/* streamed backups can't be validated in the catalog, so they stay DONE */
+#define BACKUP_IS_COMPLETED(backup) \
+	((backup)->status == BACKUP_STATUS_OK || \
+	 ((backup)->stream && (backup)->status == BACKUP_STATUS_DONE))
 #define TOTAL_READ_SIZE(backup)	\
 	((HAVE_DATABASE((backup)) ? (backup)->read_data_bytes : 0) + \
 	 (HAVE_ARCLOG((backup)) ? (backup)->read_arclog_bytes : 0) + \
@@ -179,6 +217,14 @@ typedef struct pgTimeLine
 	XLogRecPtr	end;
 } pgTimeLine;
 
+/* WAL segment named with its timeline, in an index of xlog_index_dir() */
+typedef struct WalSegment
+{
+	TimeLineID	tli;
+	uint32		log;
+	uint32		seg;
+} WalSegment;
+
 typedef struct pgRecoveryTarget
 {
 	bool		time_specified;
@@ -195,6 +241,91 @@ typedef enum CompressionMode
 	DECOMPRESSION,
 } CompressionMode;
 
+typedef struct Compressor Compressor;
+typedef struct Decompressor Decompressor;
+
+/*
+ * Bitmap of blocks in a relation file. Bit N is set if the block N is
+ * in the map.
+ */
+typedef struct datapagemap
+{
+	char	   *bitmap;
+	int			bitmapsize;		/* in bytes */
+} datapagemap_t;
+
+/*
+ * Job executed by a worker thread of JobQueue. Each job type must start
+ * with the routine pointer so that it can be casted to Job.
+ */
+typedef struct Job Job;
+typedef void (*JobRoutine)(Job *job);
+struct Job
+{
+	JobRoutine	routine;
+};
+
+typedef struct JobQueue JobQueue;
+
+/* phases of commands measured, in metrics.c */
+typedef enum MetricsPhase
+{
+	PHASE_START_BACKUP,		/* pg_start_backup() with the checkpoint */
+	PHASE_LIST_FILES,
+	PHASE_COPY_DATABASE,
+	PHASE_STOP_BACKUP,
+	PHASE_WAIT_ARCHIVE,		/* waiting for the last WAL to be archived */
+	PHASE_COPY_ARCLOG,
+	PHASE_COPY_SRVLOG,
+	PHASE_CLEAR_PGDATA,
+	PHASE_RESTORE_DATABASE,
+	PHASE_RESTORE_ARCLOG,
+	PHASE_VALIDATE,
+	/* phases in worker threads */
+	PHASE_READ,
+	PHASE_COMPRESS,
+	PHASE_DECOMPRESS,
+	NUM_PHASES
+} MetricsPhase;
+
+typedef struct MetricsTimer
+{
+	MetricsPhase	phase;
+	struct timeval	wall;
+	double			cpu;
+} MetricsTimer;
+
+/* sequential file reader with large aligned buffers, in dir.c */
+typedef struct FileReader FileReader;
+
+/* an asynchronous read or write of a local file, in aio.c */
+typedef struct AsyncIO
+{
+	int			fd;
+	bool		write;
+	char	   *buf;
+	size_t		len;
+	off_t		offset;
+	bool		pending;	/* started and not waited for yet */
+	bool		done;		/* completed, but maybe not waited for */
+	ssize_t		result;		/* bytes transferred, or -1 */
+	int			error;		/* errno if result is -1 */
+	void	   *ring;		/* io_uring it is submitted to, or NULL */
+} AsyncIO;
+
+/* file list to find files by relative path, in manifest.c */
+typedef struct Manifest Manifest;
+
+/* a backed-up copy of a file in one of the backups of a chain */
+typedef struct RestoreSource
+{
+	const char	   *from_root;
+	pgFile		   *file;
+	bool			compress;
+	CompressMethod	method;
+	ChecksumAlgorithm checksum;
+} RestoreSource;
+
 /*
  * return pointer that exceeds the length of prefix from character string.
  * ex. str="/xxx/yyy/zzz", prefix="/xxx/yyy", return="zzz".
@@ -207,10 +338,24 @@ extern char *backup_path;
 extern char *pgdata;
 extern char *arclog_path;
 extern char *srvlog_path;
+extern char *storage_path;
+
+/* backup directories are in STORAGE_PATH if set, otherwise in BACKUP_PATH */
+#define BACKUP_ROOT		(storage_path ? storage_path : backup_path)
 
 /* common configuration */
 extern bool verbose;
 extern bool check;
+extern int num_threads;
+extern bool direct_io;
+extern bool wal_pagemap;
+extern char *standby_host;
+extern char *standby_port;
+extern int max_rate;
+extern int max_iops;
+extern bool zero_copy;
+extern bool delta;
+extern char pg_rman_path[MAXPGPATH];
 
 /* current settings */
 extern pgBackup current;
@@ -225,15 +370,31 @@ extern int do_backup(bool smooth_checkpoint,
 					 int keep_srvlog_files,
 					 int keep_srvlog_days,
 					 int keep_data_generations,
-					 int keep_data_days);
+					 int keep_data_days,
+					 const char *stream);
 extern BackupMode parse_backup_mode(const char *value, int elevel);
 extern int get_server_version(void);
+extern void set_server_version(int version);
 
 /* in restore.c */
 extern int do_restore(const char *target_time,
 					  const char *target_xid,
 					  const char *target_inclusive,
-					  TimeLineID target_tli);
+					  TimeLineID target_tli,
+					  bool single_pass,
+					  bool wal_on_demand,
+					  const char *stream);
+extern parray *restore_chain_sources(parray *chain, char **roots,
+									 parray **lists, pgFile *file,
+									 pgFile *key);
+extern void restore_chain_apply(parray *sources, const char *to_root);
+extern void check_block_size(const pgBackup *backup);
+
+/* in merge.c */
+extern int do_merge(pgBackupRange *range);
+
+/* in fetch.c */
+extern int do_fetch_wal(const char *fname, const char *to_path);
 
 /* in init.c */
 extern int do_init(void);
@@ -245,9 +406,11 @@ extern int do_show(pgBackupRange *range, bool show_timeline, bool show_all);
 //extern int do_delete(pgBackupRange *range);
 extern int do_delete(pgBackupRange *range, bool force);
 extern void pgBackupDelete(int keep_generations, int keep_days);
+extern int remove_files(parray *files);
+extern void trash_purge(void);
 
 /* in validate.c */
-extern int do_validate(pgBackupRange *range);
+extern int do_validate(pgBackupRange *range, bool all_errors);
 extern void pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool with_database);
 
 /* in catalog.c */
@@ -282,24 +445,166 @@ extern void dir_copy_files(const char *from_root, const char *to_root);
 
 extern void pgFileDelete(pgFile *file);
 extern void pgFileFree(void *file);
-extern pg_crc32 pgFileGetCRC(pgFile *file);
+extern pg_crc32 pgFileGetCRC(pgFile *file, ChecksumAlgorithm checksum);
+extern FileReader *file_reader_open(const char *path, bool direct);
+extern size_t file_reader_read(FileReader *self, const char **data, size_t len);
+extern void file_reader_seek(FileReader *self, off_t offset, size_t len);
+extern int file_reader_error(FileReader *self);
+extern void file_reader_close(FileReader *self);
 extern int pgFileComparePath(const void *f1, const void *f2);
 extern int pgFileComparePathDesc(const void *f1, const void *f2);
 extern int pgFileCompareMtime(const void *f1, const void *f2);
 extern int pgFileCompareMtimeDesc(const void *f1, const void *f2);
+extern int pgFileCompareSize(const void *f1, const void *f2);
+extern int pgFileCompareSizeDesc(const void *f1, const void *f2);
 
 /* in xlog.c */
 extern bool xlog_is_complete_wal(const pgFile *file, int server_version);
+extern bool xlog_is_segment_name(const char *path);
+extern size_t xlog_used_size(const pgFile *file, int server_version);
+extern void xlog_pad_segment(const char *path, const char *name);
 extern bool xlog_logfname2lsn(const char *logfname, XLogRecPtr *lsn);
 extern void xlog_fname(char *fname, size_t len, TimeLineID tli, XLogRecPtr *lsn);
+extern bool xlog_parse_segment_name(const char *path, WalSegment *segment);
+extern parray *xlog_index_dir(const char *path);
+extern bool xlog_index_has(parray *index, TimeLineID tli, uint32 log,
+						   uint32 seg);
+extern void xlog_index_free(parray *index);
+extern parray *xlog_read_pagemap(TimeLineID tli, XLogRecPtr from,
+								 XLogRecPtr to, int server_version);
+extern bool xlog_get_file_pagemap(parray *pagemap, const char *path,
+								  datapagemap_t *map);
+extern void xlog_free_pagemap(parray *pagemap);
+
+/* in checksum.c */
+extern ChecksumAlgorithm parse_checksum(const char *value, int elevel);
+extern const char *checksum_name(ChecksumAlgorithm checksum);
+extern pg_crc32 checksum_update(ChecksumAlgorithm checksum, pg_crc32 crc,
+								const void *data, size_t len);
+#ifndef SHA256_DIGEST_LENGTH
+#define SHA256_DIGEST_LENGTH	32
+#endif
+extern void sha256(const void *data, size_t len,
+				   unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+/* in compress.c */
+extern CompressMethod parse_compress_method(const char *value, int elevel);
+extern const char *compress_method_name(CompressMethod method);
+extern bool compress_method_supported(CompressMethod method);
+extern int compress_max_level(CompressMethod method);
+extern Compressor *compressor_open(CompressMethod method, int level,
+								   FILE *out, ChecksumAlgorithm checksum,
+								   pg_crc32 *crc, size_t *write_size);
+extern Compressor *compressor_open_mem(CompressMethod method, int level,
+									   char **out, ChecksumAlgorithm checksum,
+									   pg_crc32 *crc, size_t *write_size);
+extern void compressor_write(Compressor *self, const void *buf, size_t len);
+extern void compressor_close(Compressor *self);
+extern Decompressor *decompressor_open(CompressMethod method, FILE *in,
+									   size_t *read_size);
+extern Decompressor *decompressor_open_mem(CompressMethod method,
+										   const char *data, size_t len,
+										   size_t *read_size);
+extern size_t decompressor_read(Decompressor *self, void *buf, size_t len);
+extern void decompressor_close(Decompressor *self);
 
 /* in data.c */
+extern void chunk_queue_free(void);
 extern bool backup_data_file(const char *from_root, const char *to_root,
-							 pgFile *file, const XLogRecPtr *lsn, bool compress);
-extern void restore_data_file(const char *from_root, const char *to_root,
-							  pgFile *file, bool compress);
+							 pgFile *file, const XLogRecPtr *lsn,
+							 const datapagemap_t *pagemap, bool compress,
+							 CompressMethod method);
+extern BlockNumber restore_data_file(const char *from_root,
+									 const char *to_root, pgFile *file,
+									 bool compress, CompressMethod method,
+									 ChecksumAlgorithm checksum,
+									 datapagemap_t *written);
 extern bool copy_file(const char *from_root, const char *to_root,
-					  pgFile *file, CompressionMode compress);
+					  pgFile *file, CompressionMode compress,
+					  CompressMethod method);
+extern bool copy_file_to(pgFile *file, const char *to_path,
+						 CompressionMode compress, CompressMethod method);
+extern bool copy_wal_file(const char *from_root, const char *to_root,
+						  pgFile *file, CompressionMode compress,
+						  CompressMethod method, int server_version);
+extern bool validate_dedup_file(const char *path, ChecksumAlgorithm checksum,
+								bool size_only);
+
+/* in dedup.c */
+extern size_t dedup_put(const char *data, size_t len, bool compress,
+						CompressMethod method,
+						unsigned char hash[SHA256_DIGEST_LENGTH]);
+extern char *dedup_get(const unsigned char *hash, size_t len, pg_crc32 crc,
+					   ChecksumAlgorithm checksum, int elevel);
+extern bool dedup_exists(const unsigned char *hash);
+extern int64 dedup_stored_bytes(void);
+extern void dedup_write_refs(const pgBackup *backup);
+extern void dedup_gc(void);
+
+/* in metrics.c */
+extern void metrics_start(MetricsTimer *timer, MetricsPhase phase);
+extern void metrics_stop(MetricsTimer *timer, int64 bytes, int64 files);
+extern void metrics_write(const pgBackup *backup, const char *command);
+extern void metrics_show(FILE *out, const pgBackup *backup);
+
+/* in aio.c */
+extern void async_io_start(AsyncIO *io, int fd, bool write, char *buf,
+						   size_t len, off_t offset);
+extern ssize_t async_io_wait(AsyncIO *io);
+
+/* in throttle.c */
+extern void throttle_init(void);
+extern void throttle_io(size_t len);
+
+/* in manifest.c */
+extern Manifest *manifest_new(parray *files, const char *root);
+extern Manifest *manifest_open(const char *file_txt);
+extern bool manifest_find(const Manifest *self, const char *path,
+						  pgFile *file);
+extern void manifest_free(Manifest *self);
+extern parray *manifest_read_file_list(const char *root, const char *file_txt);
+extern void manifest_write(const char *file_txt);
+
+/* in stream.c */
+extern void stream_open_writer(const char *dest);
+extern void stream_begin_backup(const pgBackup *backup);
+extern bool stream_close_writer(void);
+extern FILE *stream_fopen(const char *path, mode_t mode);
+extern int stream_chmod(const char *path, mode_t mode);
+extern int stream_remove(const char *path);
+extern int stream_mkdir(const char *path, mode_t mode);
+extern time_t stream_extract(const char *src);
+
+/* in storage.c */
+extern bool storage_is_remote(const char *path);
+extern FILE *storage_fopen(const char *path, const char *mode);
+extern int storage_stat(const char *path, struct stat *st);
+extern int storage_fstat(FILE *fp, const char *path, struct stat *st);
+extern int storage_remove(const char *path);
+extern int storage_mkdir(const char *path, mode_t mode);
+extern int storage_chmod(const char *path, mode_t mode);
+extern parray *storage_list_dir(const char *path);
+extern void storage_list_file(parray *files, const char *root);
+extern pgFile *storage_file_new(const char *path, mode_t mode, size_t size,
+								time_t mtime);
+
+/* in s3.c */
+extern FILE *s3_fopen(const char *path, const char *mode);
+extern int s3_stat(const char *path, struct stat *st);
+extern int s3_remove(const char *path);
+extern parray *s3_list_dir(const char *path);
+extern void s3_list_file(parray *files, const char *root);
+
+/* in datapagemap.c */
+extern void datapagemap_add(datapagemap_t *map, BlockNumber blkno);
+extern bool datapagemap_is_set(const datapagemap_t *map, BlockNumber blkno);
+extern void datapagemap_clear(datapagemap_t *map);
+
+/* in queue.c */
+extern JobQueue *JobQueue_new(int nthreads);
+extern void JobQueue_push(JobQueue *queue, Job *job);
+extern void JobQueue_wait(JobQueue *queue);
+extern void JobQueue_free(JobQueue *queue);
 
 /* in util.c */
 extern void time2iso(char *buf, size_t len, time_t time);
@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgut-pthread.c
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres_fe.h"
+
+#include "pgut.h"
+#include "pgut-pthread.h"
+
+void
+pgut_mutex_lock(pthread_mutex_t *mutex)
+{
+	int		rc;
+
+	if ((rc = pthread_mutex_lock(mutex)) != 0)
+		elog(ERROR_SYSTEM, "pthread_mutex_lock: %s", strerror(rc));
+}
+
+void
+pgut_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	int		rc;
+
+	if ((rc = pthread_cond_wait(cond, mutex)) != 0)
+		elog(ERROR_SYSTEM, "pthread_cond_wait: %s", strerror(rc));
+}
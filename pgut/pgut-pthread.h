@@ -0,0 +1,18 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgut-pthread.h
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PGUT_PTHREAD_H
+#define PGUT_PTHREAD_H
+
+#include <pthread.h>
+
+extern void pgut_mutex_lock(pthread_mutex_t *mutex);
+extern void pgut_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+
+#endif   /* PGUT_PTHREAD_H */
@@ -13,6 +13,7 @@
 
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -664,9 +665,6 @@ void
 pgut_readopt(const char *path, pgut_option options[], int elevel)
 {
 	FILE   *fp;
-	char	buf[1024];
-	char	key[1024];
-	char	value[1024];
 
 	if (!options)
 		return;
@@ -674,6 +672,24 @@ pgut_readopt(const char *path, pgut_option options[], int elevel)
 	if ((fp = pgut_fopen(path, "rt", true)) == NULL)
 		return;
 
+	pgut_readopt_file(fp, options, elevel);
+
+	fclose(fp);
+}
+
+/*
+ * Get configuration from an opened configuration file.
+ */
+void
+pgut_readopt_file(FILE *fp, pgut_option options[], int elevel)
+{
+	char	buf[1024];
+	char	key[1024];
+	char	value[1024];
+
+	if (!options)
+		return;
+
 	while (fgets(buf, lengthof(buf), fp))
 	{
 		size_t		i;
@@ -701,8 +717,6 @@ pgut_readopt(const char *path, pgut_option options[], int elevel)
 				elog(elevel, "invalid option \"%s\"", key);
 		}
 	}
-
-	fclose(fp);
 }
 
 static const char *
@@ -1341,6 +1355,21 @@ on_cleanup(void)
 static void
 exit_or_abort(int exitcode)
 {
+	static pthread_mutex_t	exit_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static pthread_t		exit_thread;
+	static volatile bool	exiting = false;
+
+	/*
+	 * Only one thread runs the exit processing. Errors raised by other
+	 * threads in the meantime are blocked here until the process exits.
+	 */
+	if (!exiting || !pthread_equal(exit_thread, pthread_self()))
+	{
+		pthread_mutex_lock(&exit_mutex);
+		exit_thread = pthread_self();
+		exiting = true;
+	}
+
 	if (in_cleanup)
 	{
 		/* oops, error in cleanup*/
@@ -15,8 +15,9 @@ struct JobQueue
 	pthread_mutex_t		mutex;		/* protects the queue data */
 	pthread_cond_t		anyjobs;	/* fired if any jobs */
 	pthread_cond_t		nojobs;		/* fired if no jobs */
-	List			   *threads;	/* list of worker thread handles */
-	List			   *jobs;		/* pending jobs */
+	parray			   *threads;	/* array of worker thread handles */
+	parray			   *jobs;		/* pending jobs */
+	size_t				next;		/* index of the next job to run */
 	volatile int		maximum;	/* maximum allowed threads */
 	volatile int		idle;		/* number of idle threads */
 	volatile bool		terminated;	/* in termination? */
@@ -35,8 +36,9 @@ JobQueue_new(int nthreads)
 	pthread_mutex_init(&queue->mutex, NULL);
 	pthread_cond_init(&queue->anyjobs, NULL);
 	pthread_cond_init(&queue->nojobs, NULL);
-	queue->threads = NIL;
-	queue->jobs = NIL;
+	queue->threads = parray_new();
+	queue->jobs = parray_new();
+	queue->next = 0;
 	queue->maximum = nthreads;
 	queue->idle = 0;
 	queue->terminated = false;
@@ -57,21 +59,20 @@ JobQueue_push(JobQueue *queue, Job *job)
 	Assert(job->routine);
 
 	pgut_mutex_lock(&queue->mutex);
-	queue->jobs = lappend(queue->jobs, job);
+	parray_append(queue->jobs, job);
 
 	if (queue->idle > 0)
 		pthread_cond_signal(&queue->anyjobs);
-	else if (list_length(queue->threads) < queue->maximum)
+	else if (parray_num(queue->threads) < queue->maximum)
 	{
-		pthread_t	th;
+		pthread_t  *th = pgut_new(pthread_t);
+		int			rc;
 
-		if (pthread_create(&th, NULL, worker_thread, queue))
-			ereport(ERROR,
-				(errcode_errno(),
-				 errmsg("could not create thread: ")));
+		if ((rc = pthread_create(th, NULL, worker_thread, queue)) != 0)
+			elog(ERROR_SYSTEM, _("could not create thread: %s"), strerror(rc));
 
-		queue->threads = lappend(queue->threads, (void *) th);
-		Assert(list_length(queue->threads) <= queue->maximum);
+		parray_append(queue->threads, th);
+		Assert(parray_num(queue->threads) <= queue->maximum);
 	}
 
 	pthread_mutex_unlock(&queue->mutex);
@@ -85,7 +86,8 @@ JobQueue_wait(JobQueue *queue)
 	Assert(!queue->terminated);
 
 	pgut_mutex_lock(&queue->mutex);
-	while (queue->jobs || queue->idle < list_length(queue->threads))
+	while (queue->next < parray_num(queue->jobs) ||
+		   queue->idle < parray_num(queue->threads))
 		pgut_cond_wait(&queue->nojobs, &queue->mutex);
 	pthread_mutex_unlock(&queue->mutex);
 }
@@ -94,7 +96,7 @@ JobQueue_wait(JobQueue *queue)
 void
 JobQueue_free(JobQueue *queue)
 {
-	ListCell *cell;
+	int		i;
 
 	if (queue == NULL)
 		return;
@@ -111,16 +113,19 @@ JobQueue_free(JobQueue *queue)
 	 * Wait for all threads.
 	 * XXX: cancel thread for long running jobs?
 	 */
-	foreach(cell, queue->threads)
+	for (i = 0; i < parray_num(queue->threads); i++)
 	{
-		pthread_t	th = (pthread_t) lfirst(cell);
+		pthread_t  *th = (pthread_t *) parray_get(queue->threads, i);
 
-		pthread_join(th, NULL);
+		pthread_join(*th, NULL);
 	}
-	list_free(queue->threads);
+	parray_walk(queue->threads, free);
+	parray_free(queue->threads);
 
 	/* Free all pending jobs, though it must be avoided. */
-	list_free_deep(queue->jobs);
+	for (i = queue->next; i < parray_num(queue->jobs); i++)
+		free(parray_get(queue->jobs, i));
+	parray_free(queue->jobs);
 
 	pthread_cond_destroy(&queue->nojobs);
 	pthread_cond_destroy(&queue->anyjobs);
@@ -138,12 +143,12 @@ worker_thread(void *arg)
 	{
 		Job *job;
 
-		if (queue->jobs == NIL)
+		if (queue->next >= parray_num(queue->jobs))
 		{
 			queue->idle++;
 
 			/* notify if done all jobs */
-			if (queue->idle >= list_length(queue->threads))
+			if (queue->idle >= parray_num(queue->threads))
 				pthread_cond_broadcast(&queue->nojobs);
 
 			pgut_cond_wait(&queue->anyjobs, &queue->mutex);
@@ -153,11 +158,20 @@ worker_thread(void *arg)
 				break;
 		}
 
-		if (queue->jobs == NIL)
+		if (queue->next >= parray_num(queue->jobs))
 			continue;	/* job might have done by another worker */
 
-		job = linitial(queue->jobs);
-		queue->jobs = list_delete_first(queue->jobs);
+		/*
+		 * Jobs are taken in FIFO order. Slots of taken jobs are recycled
+		 * when the queue becomes empty.
+		 */
+		job = (Job *) parray_get(queue->jobs, queue->next++);
+		if (queue->next >= parray_num(queue->jobs))
+		{
+			parray_free(queue->jobs);
+			queue->jobs = parray_new();
+			queue->next = 0;
+		}
 
 		pthread_mutex_unlock(&queue->mutex);
 		job->routine(job);
@@ -11,19 +11,51 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "catalog/pg_control.h"
 
+/* a file to be restored, possibly by a worker thread */
+typedef struct RestoreJob
+{
+	void		  (*routine)(struct RestoreJob *);
+	const char	   *from_root;
+	const char	   *to_root;
+	pgFile		   *file;
+	bool			compress;
+	CompressMethod	method;
+	ChecksumAlgorithm checksum;
+	char			progress[MAXPGPATH + 32];	/* for verbose mode */
+} RestoreJob;
+
+/* a file to be restored from a chain of backups, newest source first */
+typedef struct RestoreChainJob
+{
+	void		  (*routine)(struct RestoreChainJob *);
+	parray		   *sources;	/* list of RestoreSource */
+	const char	   *to_root;
+	char			progress[MAXPGPATH + 32];	/* for verbose mode */
+} RestoreChainJob;
+
 static void backup_online_files(bool re_recovery);
 static void restore_online_files(void);
+static void extract_stream(const char *src);
 static void restore_database(pgBackup *backup);
+static void restore_database_chain(parray *chain);
+static void create_database_dirs(pgBackup *backup);
+static int run_remote_script(const char *path);
+static void delete_unlisted_files(const char *list_path);
+static void truncate_restored_file(const char *from_root, const char *to_root,
+								   const pgFile *file, BlockNumber nblocks);
+static void remove_postmaster_pid(void);
 static void restore_archive_logs(pgBackup *backup);
 static void create_recovery_conf(const char *target_time,
 								 const char *target_xid,
 								 const char *target_inclusive,
-								 TimeLineID target_tli);
+								 TimeLineID target_tli,
+								 bool wal_on_demand);
 static pgRecoveryTarget *checkIfCreateRecoveryConf(const char *target_time,
 								 const char *target_xid,
 								 const char *target_inclusive);
@@ -34,12 +66,20 @@ static TimeLineID get_current_timeline(void);
 static TimeLineID get_fullbackup_timeline(parray *backups, const pgRecoveryTarget *rt);
 static void print_backup_id(const pgBackup *backup);
 static void search_next_wal(const char *path, uint32 *needId, uint32 *needSeg, parray *timelines);
+static void restore_file(RestoreJob *job);
+static void restore_wal_file(RestoreJob *job);
+static void restore_chain_file(RestoreChainJob *job);
+static void print_throughput(const char *what, int64 bytes,
+							 const struct timeval *start);
 
 int
 do_restore(const char *target_time,
 		   const char *target_xid,
 		   const char *target_inclusive,
-		   TimeLineID target_tli)
+		   TimeLineID target_tli,
+		   bool single_pass,
+		   bool wal_on_demand,
+		   const char *stream)
 {
 	int i;
 	int base_index;				/* index of base (full) backup */
@@ -48,6 +88,7 @@ do_restore(const char *target_time,
 	TimeLineID	cur_tli;
 	TimeLineID	backup_tli;
 	parray *backups;
+	parray *chain = NULL;
 	pgBackup *base_backup = NULL;
 	parray *files;
 	parray *timelines;
@@ -55,6 +96,7 @@ do_restore(const char *target_time,
 	uint32 needId = 0;
 	uint32 needSeg = 0;
 	pgRecoveryTarget *rt = NULL;
+	MetricsTimer timer;
 
 	/* PGDATA and ARCLOG_PATH are always required */
 	if (pgdata == NULL)
@@ -90,12 +132,28 @@ do_restore(const char *target_time,
 		elog(ERROR_ARGS, _("can't create recovery.conf. specified args are invalid."));
 	}
 
+	/* the backup in the stream is restored as well as backups in catalog */
+	if (stream)
+		extract_stream(stream);
+
 	/* get list of backups. (index == 0) is the last backup */
 	backups = catalog_get_backup_list(NULL);
 	if(!backups){
 		elog(ERROR_SYSTEM, _("can't process any more."));
 	}
 
+	/* files of streamed backups not extracted are not in the catalog */
+	for (i = parray_num(backups) - 1; i >= 0; i--)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		if (backup->stream)
+		{
+			parray_remove(backups, i);
+			pgBackupFree(backup);
+		}
+	}
+
 	cur_tli = get_current_timeline();
 	backup_tli = get_fullbackup_timeline(backups, rt);
 
@@ -116,25 +174,49 @@ do_restore(const char *target_time,
 	/*
 	 * Clear restore destination, but don't remove $PGDATA.
 	 * To remove symbolic link, get file list with "omit_symlink = false".
+	 *
+	 * With --delta, files to be compared with the backup are kept, and only
+	 * contents of the excluded directories like pg_xlog are removed. Files
+	 * not in the backup are removed after restore.
 	 */
 	if (!check)
 	{
+		parray *kept = NULL;
+		int		removed = 0;
+
 		if (verbose)
 		{
 			printf(_("----------------------------------------\n"));
 			printf(_("clearing restore destination\n"));
 		}
+		metrics_start(&timer, PHASE_CLEAR_PGDATA);
 		files = parray_new();
 		dir_list_file(files, pgdata, NULL, false, false);
 		parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
+		if (delta)
+		{
+			kept = parray_new();
+			dir_list_file(kept, pgdata, pgdata_exclude, false, false);
+			parray_qsort(kept, pgFileComparePathDesc);
+		}
 
 		for (i = 0; i < parray_num(files); i++)
 		{
 			pgFile *file = (pgFile *) parray_get(files, i);
+
+			if (kept && parray_bsearch(kept, file, pgFileComparePathDesc))
+				continue;
 			pgFileDelete(file);
+			removed++;
 		}
+		metrics_stop(&timer, 0, removed);
 		parray_walk(files, pgFileFree);
 		parray_free(files);
+		if (kept)
+		{
+			parray_walk(kept, pgFileFree);
+			parray_free(kept);
+		}
 	}
 
 	/*
@@ -158,15 +240,15 @@ do_restore(const char *target_time,
 			base_backup->status != BACKUP_STATUS_OK)
 			continue;
 
-#ifndef HAVE_LIBZ
 		/* Make sure we won't need decompression we haven't got */
 		if (base_backup->compress_data &&
+			!compress_method_supported(base_backup->compress_method) &&
 			(HAVE_DATABASE(base_backup) || HAVE_ARCLOG(base_backup)))
 		{
 			elog(EXIT_NOT_SUPPORTED,
-				_("can't restore from compressed backup (compression not supported in this installation)"));
+				_("can't restore from compressed backup (compress-method %s not supported in this installation)"),
+				compress_method_name(base_backup->compress_method));
 		}
-#endif
 		if (satisfy_timeline(timelines, base_backup) && satisfy_recovery_target(base_backup, rt))
 			goto base_backup_found;
 	}
@@ -179,8 +261,21 @@ base_backup_found:
 	if (verbose)
 		print_backup_id(base_backup);
 
-	/* restore base backup */
-	restore_database(base_backup);
+	/*
+	 * restore base backup. In single-pass mode, the base backup and the
+	 * following incremental backups are collected into a chain and restored
+	 * at once. --delta always restores in single pass, so that every file is
+	 * truncated to its blocks in all the backups, not only in the base one.
+	 */
+	if (delta)
+		single_pass = true;
+	if (single_pass)
+	{
+		chain = parray_new();
+		parray_append(chain, base_backup);
+	}
+	else
+		restore_database(base_backup);
 
 	last_restored_index = base_index;
 
@@ -207,10 +302,19 @@ base_backup_found:
 		if (verbose)
 			print_backup_id(backup);
 
-		restore_database(backup);
+		if (single_pass)
+			parray_append(chain, backup);
+		else
+			restore_database(backup);
 		last_restored_index = i;
 	}
 
+	if (single_pass)
+	{
+		restore_database_chain(chain);
+		parray_free(chain);
+	}
+
 	/*
 	 * Restore archived WAL which backed up with or after last restored backup.
 	 * We don't check the backup->tli because a backup of arhived WAL
@@ -242,7 +346,9 @@ base_backup_found:
 		if (!satisfy_timeline(timelines, backup))
 			continue;
 
-		restore_archive_logs(backup);
+		/* WAL is restored by fetch-wal when recovery requests it */
+		if (!wal_on_demand)
+			restore_archive_logs(backup);
 
 		if (check)
 		{
@@ -275,7 +381,16 @@ base_backup_found:
 	}
 
 	/* create recovery.conf */
-	create_recovery_conf(target_time, target_xid, target_inclusive, target_tli);
+	create_recovery_conf(target_time, target_xid, target_inclusive, target_tli,
+						 wal_on_demand);
+
+	/* metrics are recorded in the last backup restored */
+	if (!check)
+		metrics_write((pgBackup *) parray_get(backups, last_restored_index),
+					  "restore");
+
+	/* stop the workers of decompression */
+	chunk_queue_free();
 
 	/* release catalog lock */
 	catalog_unlock();
@@ -296,6 +411,32 @@ base_backup_found:
 	return 0;
 }	
 
+/*
+ * Extract the backup in the stream into the catalog. Files are checked with
+ * their CRC in the stream, so the sizes are validated here and the CRC of the
+ * file lists is validated when restored.
+ */
+static void
+extract_stream(const char *src)
+{
+	time_t		id;
+	pgBackup   *backup;
+
+	id = stream_extract(src);
+	if (check)
+		return;
+
+	backup = catalog_get_backup(id);
+	if (backup == NULL)
+		elog(ERROR_CORRUPTED, _("backup stream has no %s"), BACKUP_INI_FILE);
+
+	backup->stream = false;
+	backup->status = BACKUP_STATUS_DONE;
+	pgBackupWriteIni(backup);
+	pgBackupValidate(backup, true, false, HAVE_DATABASE(backup));
+	pgBackupFree(backup);
+}
+
 /*
  * Validate and restore backup.
  */
@@ -305,19 +446,16 @@ restore_database(pgBackup *backup)
 	char	timestamp[100];
 	char	path[MAXPGPATH];
 	char	list_path[MAXPGPATH];
-	int		ret;
+	char	from_root[MAXPGPATH];
 	parray *files;
 	int		i;
+	JobQueue	   *queue = NULL;
+	struct timeval	start;
+	int64			restore_bytes = 0;
+	int64			restore_files = 0;
+	MetricsTimer	timer;
 
-	/* confirm block size compatibility */
-	if (backup->block_size != BLCKSZ)
-		elog(ERROR_PG_INCOMPATIBLE,
-			_("BLCKSZ(%d) is not compatible(%d expected)"),
-			backup->block_size, BLCKSZ);
-	if (backup->wal_block_size != XLOG_BLCKSZ)
-		elog(ERROR_PG_INCOMPATIBLE,
-			_("XLOG_BLCKSZ(%d) is not compatible(%d expected)"),
-			backup->wal_block_size, XLOG_BLCKSZ);
+	check_block_size(backup);
 
 	time2iso(timestamp, lengthof(timestamp), backup->start_time);
 	if (verbose && !check)
@@ -327,41 +465,15 @@ restore_database(pgBackup *backup)
 	}
 
 	/*
-	 * Validate backup files with its size, because load of CRC calculation is
-	 * not right.
+	 * Validate backup files with CRC32C, or with their size if the backup is
+	 * checksummed with the legacy CRC32, because load of its calculation is
+	 * not light.
 	 */
-	pgBackupValidate(backup, true, false, true);
+	pgBackupValidate(backup, backup->checksum != CHECKSUM_CRC32C, false, true);
 
 	/* make direcotries and symbolic links */
-	pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
 	if (!check)
-	{
-		char pwd[MAXPGPATH];
-
-		/* keep orginal directory */
-		if (getcwd(pwd, sizeof(pwd)) == NULL)
-			elog(ERROR_SYSTEM, _("can't get current working directory: %s"),
-				strerror(errno));
-
-		/* create pgdata directory */
-		dir_create_dir(pgdata, DIR_PERMISSION);
-
-		/* change directory to pgdata */
-		if (chdir(pgdata))
-			elog(ERROR_SYSTEM, _("can't change directory: %s"),
-				strerror(errno));
-
-		/* Execute mkdirs.sh */
-		ret = system(path);
-		if (ret != 0)
-			elog(ERROR_SYSTEM, _("can't execute mkdirs.sh: %s"),
-				strerror(errno));
-
-		/* go back to original directory */
-		if (chdir(pwd))
-			elog(ERROR_SYSTEM, _("can't change directory: %s"),
-				strerror(errno));
-	}
+		create_database_dirs(backup);
 
 	/*
 	 * get list of files which need to be restored.
@@ -378,28 +490,41 @@ restore_database(pgBackup *backup)
 			pgFileFree(parray_remove(files, i));
 	}
 
-	/* restore files into $PGDATA */
+	/*
+	 * Restore files into $PGDATA. With multiple jobs, larger files are
+	 * handed to the workers first so that a few big relations don't run
+	 * alone at the end.
+	 */
+	if (num_threads > 1 && !check)
+	{
+		queue = JobQueue_new(num_threads);
+		parray_qsort(files, pgFileCompareSizeDesc);
+	}
+	gettimeofday(&start, NULL);
+	metrics_start(&timer, PHASE_RESTORE_DATABASE);
+
+	pgBackupGetPath(backup, from_root, lengthof(from_root), DATABASE_DIR);
 	for (i = 0; i < parray_num(files); i++)
 	{
-		char from_root[MAXPGPATH];
+		RestoreJob	job;
 		pgFile *file = (pgFile *) parray_get(files, i);
 
-		pgBackupGetPath(backup, from_root, lengthof(from_root), DATABASE_DIR);
-
 		/* check for interrupt */
 		if (interrupted)
 			elog(ERROR_INTERRUPTED, _("interrupted during restore database"));
 
-		/* print progress */
+		/* prepare progress message */
+		job.progress[0] = '\0';
 		if (verbose && !check)
-			printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files),
+			snprintf(job.progress, lengthof(job.progress), _("(%d/%lu) %s "),
+				i + 1, (unsigned long) parray_num(files),
 				file->path + strlen(from_root) + 1);
 
 		/* directories are created with mkdirs.sh */
 		if (S_ISDIR(file->mode))
 		{
 			if (verbose && !check)
-				printf(_("directory, skip\n"));
+				printf(_("%sdirectory, skip\n"), job.progress);
 			continue;
 		}
 
@@ -407,68 +532,486 @@ restore_database(pgBackup *backup)
 		if (file->write_size == BYTES_INVALID)
 		{
 			if (verbose && !check)
-				printf(_("not backed up, skip\n"));
+				printf(_("%snot backed up, skip\n"), job.progress);
 			continue;
 		}
 
 		/* restore file */
-		if (!check)
-			restore_data_file(from_root, pgdata, file, backup->compress_data);
+		if (check)
+			continue;
 
-		/* print size of restored file */
-		if (verbose && !check)
-			printf(_("restored %lu\n"), (unsigned long) file->write_size);
+		restore_bytes += file->write_size;
+		restore_files++;
+		job.routine = restore_file;
+		job.from_root = from_root;
+		job.to_root = pgdata;
+		job.file = file;
+		job.compress = backup->compress_data;
+		job.method = backup->compress_method;
+		job.checksum = backup->checksum;
+
+		if (queue)
+		{
+			RestoreJob *qjob = pgut_new(RestoreJob);
+
+			memcpy(qjob, &job, sizeof(RestoreJob));
+			JobQueue_push(queue, (Job *) qjob);
+		}
+		else
+			restore_file(&job);
+	}
+
+	/* wait for all files restored by the workers */
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
 	}
+	metrics_stop(&timer, restore_bytes, restore_files);
+
+	if (verbose && !check)
+		print_throughput("database", restore_bytes, &start);
 
 	/* Delete files which are not in file list. */
 	if (!check)
+		delete_unlisted_files(list_path);
+
+	remove_postmaster_pid();
+
+	/* cleanup */
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+
+	if (verbose && !check)
+		printf(_("restore backup completed\n"));
+}
+
+/*
+ * Validate and restore a full backup and the following incremental backups
+ * in a single pass. The chain is in order of backup, so the last one is the
+ * newest. Every file is written only once: the newest backed-up copy of each
+ * block is restored and older backups only fill blocks not written yet.
+ */
+static void
+restore_database_chain(parray *chain)
+{
+	int			nbackups = parray_num(chain);
+	pgBackup   *newest = (pgBackup *) parray_get(chain, nbackups - 1);
+	char		timestamp[100];
+	char		list_path[MAXPGPATH];
+	char	  **roots;
+	parray	  **lists;
+	parray	   *files;
+	pgFile	   *key;
+	int			i;
+	int			k;
+	JobQueue	   *queue = NULL;
+	struct timeval	start;
+	int64			restore_bytes = 0;
+	int64			restore_files = 0;
+	MetricsTimer	timer;
+
+	time2iso(timestamp, lengthof(timestamp), newest->start_time);
+	if (verbose && !check)
+	{
+		printf(_("----------------------------------------\n"));
+		printf(_("restoring database from %d backups up to %s in single pass.\n"),
+			nbackups, timestamp);
+	}
+
+	/* validate all backups and read their file lists */
+	roots = pgut_newarray(char *, nbackups);
+	lists = pgut_newarray(parray *, nbackups);
+	for (k = 0; k < nbackups; k++)
 	{
-		parray *files_now;
+		pgBackup *backup = (pgBackup *) parray_get(chain, k);
 
-		parray_walk(files, pgFileFree);
-		parray_free(files);
+		check_block_size(backup);
+		pgBackupValidate(backup, backup->checksum != CHECKSUM_CRC32C,
+						 false, true);
+
+		roots[k] = pgut_malloc(MAXPGPATH);
+		pgBackupGetPath(backup, roots[k], MAXPGPATH, DATABASE_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path),
+			DATABASE_FILE_LIST);
+		lists[k] = dir_read_file_list(roots[k], list_path);
+	}
+
+	/* the newest backup knows all of directories and symbolic links */
+	if (!check)
+		create_database_dirs(newest);
 
-		/* re-read file list to change base path to $PGDATA */
-		files = dir_read_file_list(pgdata, list_path);
-		parray_qsort(files, pgFileComparePathDesc);
+	if (num_threads > 1 && !check)
+		queue = JobQueue_new(num_threads);
+	gettimeofday(&start, NULL);
+	metrics_start(&timer, PHASE_RESTORE_DATABASE);
 
-		/* get list of files restored to pgdata */
-		files_now = parray_new();
-		dir_list_file(files_now, pgdata, pgdata_exclude, true, false);
-		/* to delete from leaf, sort in reversed order */
-		parray_qsort(files_now, pgFileComparePathDesc);
+	/* key to search a file in the lists of older backups */
+	key = pgut_malloc(offsetof(pgFile, path) + MAXPGPATH);
+
+	files = lists[nbackups - 1];
+	for (i = 0; i < parray_num(files); i++)
+	{
+		RestoreChainJob	job;
+		pgFile		   *file = (pgFile *) parray_get(files, i);
+		const char	   *rel_path = file->path + strlen(roots[nbackups - 1]) + 1;
 
-		for (i = 0; i < parray_num(files_now); i++)
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during restore database"));
+
+		/* prepare progress message */
+		job.progress[0] = '\0';
+		if (verbose && !check)
+			snprintf(job.progress, lengthof(job.progress), _("(%d/%lu) %s "),
+				i + 1, (unsigned long) parray_num(files), rel_path);
+
+		/* directories are created with mkdirs.sh */
+		if (S_ISDIR(file->mode))
 		{
-			pgFile *file = (pgFile *) parray_get(files_now, i);
+			if (verbose && !check)
+				printf(_("%sdirectory, skip\n"), job.progress);
+			continue;
+		}
 
-			/* If the file is not in the file list, delete it */
-			if (parray_bsearch(files, file, pgFileComparePathDesc) == NULL)
-			{
-				if (verbose)
-					printf(_("  delete %s\n"), file->path + strlen(pgdata) + 1);
-				pgFileDelete(file);
-			}
+		job.sources = restore_chain_sources(chain, roots, lists, file, key);
+		for (k = 0; k < parray_num(job.sources); k++)
+			restore_bytes += ((RestoreSource *)
+				parray_get(job.sources, k))->file->write_size;
+
+		/* not backed up, or restore file */
+		if (parray_num(job.sources) == 0 || check)
+		{
+			if (verbose && !check)
+				printf(_("%snot backed up, skip\n"), job.progress);
+			parray_walk(job.sources, free);
+			parray_free(job.sources);
+			continue;
 		}
 
-		parray_walk(files_now, pgFileFree);
-		parray_free(files_now);
+		restore_files++;
+		job.routine = restore_chain_file;
+		job.to_root = pgdata;
+
+		if (queue)
+		{
+			RestoreChainJob *qjob = pgut_new(RestoreChainJob);
+
+			memcpy(qjob, &job, sizeof(RestoreChainJob));
+			JobQueue_push(queue, (Job *) qjob);
+		}
+		else
+			restore_chain_file(&job);
 	}
 
-	/* remove postmaster.pid */
-	snprintf(path, lengthof(path), "%s/postmaster.pid", pgdata);
-	if (remove(path) == -1 && errno != ENOENT)
-		elog(ERROR_SYSTEM, _("can't remove postmaster.pid: %s"),
-			strerror(errno));
+	/* wait for all files restored by the workers */
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
+	}
+	metrics_stop(&timer, restore_bytes, restore_files);
+
+	if (verbose && !check)
+		print_throughput("database", restore_bytes, &start);
+
+	/* Delete files which are not in file list of the newest backup. */
+	if (!check)
+		delete_unlisted_files(list_path);
+
+	remove_postmaster_pid();
 
 	/* cleanup */
-	parray_walk(files, pgFileFree);
-	parray_free(files);
+	free(key);
+	for (k = 0; k < nbackups; k++)
+	{
+		parray_walk(lists[k], pgFileFree);
+		parray_free(lists[k]);
+		free(roots[k]);
+	}
+	free(lists);
+	free(roots);
 
 	if (verbose && !check)
 		printf(_("restore backup completed\n"));
 }
 
+/*
+ * Collect backed-up copies of file, which is in the list of the newest
+ * backup of chain, from newer to older. roots and lists are the database
+ * directories and the file lists of the backups in chain, and key is a work
+ * area to search the lists. A whole copy of the file ends the search because
+ * older backups can't add anything to it.
+ */
+parray *
+restore_chain_sources(parray *chain, char **roots, parray **lists,
+					  pgFile *file, pgFile *key)
+{
+	int			nbackups = parray_num(chain);
+	const char *rel_path = file->path + strlen(roots[nbackups - 1]) + 1;
+	parray	   *sources = parray_new();
+	int			k;
+
+	for (k = nbackups - 1; k >= 0; k--)
+	{
+		pgBackup	   *backup = (pgBackup *) parray_get(chain, k);
+		pgFile		   *src = file;
+		RestoreSource  *source;
+
+		if (k < nbackups - 1)
+		{
+			pgFile	  **found;
+
+			join_path_components(key->path, roots[k], rel_path);
+			found = (pgFile **) parray_bsearch(lists[k], key,
+				pgFileComparePath);
+
+			/* the file was created after the older backup */
+			if (found == NULL ||
+				((*found)->mode & S_IFMT) != (file->mode & S_IFMT))
+				break;
+			src = *found;
+		}
+
+		/* not modified since the previous backup */
+		if (src->write_size == BYTES_INVALID)
+			continue;
+
+		source = pgut_new(RestoreSource);
+		source->from_root = roots[k];
+		source->file = src;
+		source->compress = backup->compress_data;
+		source->method = backup->compress_method;
+		source->checksum = backup->checksum;
+		parray_append(sources, source);
+
+		if (!src->is_datafile)
+			break;
+	}
+
+	return sources;
+}
+
+/*
+ * Restore a file into to_root from sources collected by
+ * restore_chain_sources(). Sources are applied from newest to oldest with a
+ * map of blocks already restored, so every block is written only once.
+ */
+void
+restore_chain_apply(parray *sources, const char *to_root)
+{
+	datapagemap_t	written = { NULL, 0 };
+	RestoreSource  *newest;
+	RestoreSource  *oldest;
+	char			to_path[MAXPGPATH];
+	int				nsources = parray_num(sources);
+	BlockNumber		nblocks = 0;
+	bool			whole;
+	int				i;
+
+	/*
+	 * A whole copy of the file truncates the target, so it must be restored
+	 * before pages of newer backups.
+	 */
+	oldest = (RestoreSource *) parray_get(sources, nsources - 1);
+	whole = !oldest->file->is_datafile;
+	if (whole)
+	{
+		restore_data_file(oldest->from_root, to_root, oldest->file,
+			oldest->compress, oldest->method, oldest->checksum, NULL);
+		nsources--;
+	}
+
+	for (i = 0; i < nsources; i++)
+	{
+		RestoreSource *source = (RestoreSource *) parray_get(sources, i);
+
+		nblocks = Max(nblocks,
+			restore_data_file(source->from_root, to_root, source->file,
+				source->compress, source->method, source->checksum, &written));
+	}
+	datapagemap_clear(&written);
+
+	/* file mode follows the newest backup */
+	newest = (RestoreSource *) parray_get(sources, 0);
+	if (delta && !whole)
+		truncate_restored_file(newest->from_root, to_root, newest->file,
+							   nblocks);
+	join_path_components(to_path, to_root,
+		newest->file->path + strlen(newest->from_root) + 1);
+	if (chmod(to_path, newest->file->mode) == -1)
+		elog(ERROR_SYSTEM, _("can't change mode of \"%s\": %s"), to_path,
+			strerror(errno));
+}
+
+/*
+ * Confirm block size compatibility.
+ */
+void
+check_block_size(const pgBackup *backup)
+{
+	if (backup->block_size != BLCKSZ)
+		elog(ERROR_PG_INCOMPATIBLE,
+			_("BLCKSZ(%d) is not compatible(%d expected)"),
+			backup->block_size, BLCKSZ);
+	if (backup->wal_block_size != XLOG_BLCKSZ)
+		elog(ERROR_PG_INCOMPATIBLE,
+			_("XLOG_BLCKSZ(%d) is not compatible(%d expected)"),
+			backup->wal_block_size, XLOG_BLCKSZ);
+}
+
+/*
+ * Make directories and symbolic links in $PGDATA with mkdirs.sh of the
+ * backup.
+ */
+static void
+create_database_dirs(pgBackup *backup)
+{
+	char	path[MAXPGPATH];
+	char	pwd[MAXPGPATH];
+	int		ret;
+
+	pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
+
+	/* keep orginal directory */
+	if (getcwd(pwd, sizeof(pwd)) == NULL)
+		elog(ERROR_SYSTEM, _("can't get current working directory: %s"),
+			strerror(errno));
+
+	/* create pgdata directory */
+	dir_create_dir(pgdata, DIR_PERMISSION);
+
+	/* change directory to pgdata */
+	if (chdir(pgdata))
+		elog(ERROR_SYSTEM, _("can't change directory: %s"),
+			strerror(errno));
+
+	/* Execute mkdirs.sh, or feed it to the shell if in object storage */
+	if (storage_is_remote(path))
+		ret = run_remote_script(path);
+	else
+		ret = system(path);
+	if (ret != 0)
+		elog(ERROR_SYSTEM, _("can't execute mkdirs.sh: %s"),
+			strerror(errno));
+
+	/* go back to original directory */
+	if (chdir(pwd))
+		elog(ERROR_SYSTEM, _("can't change directory: %s"),
+			strerror(errno));
+}
+
+/*
+ * Run a script in object storage by piping it to the shell, since it can't
+ * be executed in place. Returns the exit status as system() does.
+ */
+static int
+run_remote_script(const char *path)
+{
+	FILE   *in;
+	FILE   *sh;
+	char	buf[8192];
+	size_t	len;
+
+	if ((in = storage_fopen(path, "r")) == NULL)
+		elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), path, strerror(errno));
+	if ((sh = popen("sh", "w")) == NULL)
+		elog(ERROR_SYSTEM, _("can't execute sh: %s"), strerror(errno));
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+	{
+		if (fwrite(buf, 1, len, sh) != len)
+			break;
+	}
+	if (ferror(in))
+		elog(ERROR_SYSTEM, _("can't read \"%s\": %s"), path, strerror(errno));
+	fclose(in);
+
+	return pclose(sh);
+}
+
+/*
+ * Delete files in $PGDATA which are not in the file list.
+ */
+static void
+delete_unlisted_files(const char *list_path)
+{
+	parray *files;
+	parray *files_now;
+	int		i;
+	int		j;
+
+	/* read file list with $PGDATA as base path */
+	files = dir_read_file_list(pgdata, list_path);
+	parray_qsort(files, pgFileComparePathDesc);
+
+	/* get list of files restored to pgdata */
+	files_now = parray_new();
+	dir_list_file(files_now, pgdata, pgdata_exclude, true, false);
+	/* to delete from leaf, sort in reversed order */
+	parray_qsort(files_now, pgFileComparePathDesc);
+
+	/* both lists are in the same order, so they are walked at once */
+	for (i = 0, j = 0; i < parray_num(files_now); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files_now, i);
+		int		cmp = 1;
+
+		for (; j < parray_num(files); j++)
+		{
+			pgFile *listed = (pgFile *) parray_get(files, j);
+
+			if ((cmp = pgFileComparePathDesc(&listed, &file)) >= 0)
+				break;
+		}
+
+		/* If the file is not in the file list, delete it */
+		if (cmp != 0)
+		{
+			if (verbose)
+				printf(_("  delete %s\n"), file->path + strlen(pgdata) + 1);
+			pgFileDelete(file);
+		}
+	}
+
+	parray_walk(files_now, pgFileFree);
+	parray_free(files_now);
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+}
+
+/*
+ * Cut blocks of the existing file beyond nblocks for --delta, which the file
+ * restored into an empty directory wouldn't have.
+ */
+static void
+truncate_restored_file(const char *from_root, const char *to_root,
+					   const pgFile *file, BlockNumber nblocks)
+{
+	char		to_path[MAXPGPATH];
+	struct stat	st;
+
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	if (stat(to_path, &st) == 0 && st.st_size > (off_t) nblocks * BLCKSZ &&
+		truncate(to_path, (off_t) nblocks * BLCKSZ) == -1)
+		elog(ERROR_SYSTEM, _("can't truncate \"%s\": %s"), to_path,
+			strerror(errno));
+}
+
+/*
+ * Remove postmaster.pid restored from the backup.
+ */
+static void
+remove_postmaster_pid(void)
+{
+	char	path[MAXPGPATH];
+
+	snprintf(path, lengthof(path), "%s/postmaster.pid", pgdata);
+	if (remove(path) == -1 && errno != ENOENT)
+		elog(ERROR_SYSTEM, _("can't remove postmaster.pid: %s"),
+			strerror(errno));
+}
+
 /*
  * Restore archived WAL by creating symbolic link which linked to backup WAL in
  * archive directory.
@@ -482,6 +1025,11 @@ restore_archive_logs(pgBackup *backup)
 	char path[MAXPGPATH];
 	char list_path[MAXPGPATH];
 	char base_path[MAXPGPATH];
+	JobQueue	   *queue = NULL;
+	struct timeval	start;
+	int64			restore_bytes = 0;
+	int64			restore_files = 0;
+	MetricsTimer	timer;
 
 	time2iso(timestamp, lengthof(timestamp), backup->start_time);
 	if (verbose && !check)
@@ -491,33 +1039,44 @@ restore_archive_logs(pgBackup *backup)
 	}
 
 	/*
-	 * Validate backup files with its size, because load of CRC calculation is
+	 * Validate backup files with CRC32C, or with their size if the backup is
+	 * checksummed with the legacy CRC32, because load of its calculation is
 	 * not light.
 	 */
-	pgBackupValidate(backup, true, false, false);
+	pgBackupValidate(backup, backup->checksum != CHECKSUM_CRC32C, false, false);
 
 	pgBackupGetPath(backup, list_path, lengthof(list_path), ARCLOG_FILE_LIST);
 	pgBackupGetPath(backup, base_path, lengthof(list_path), ARCLOG_DIR);
 	files = dir_read_file_list(base_path, list_path);
+
+	/* decompress WAL with multiple jobs if requested */
+	if (backup->compress_data && num_threads > 1 && !check)
+		queue = JobQueue_new(num_threads);
+	gettimeofday(&start, NULL);
+	metrics_start(&timer, PHASE_RESTORE_ARCLOG);
+
 	for (i = 0; i < parray_num(files); i++)
 	{
+		RestoreJob	job;
 		pgFile *file = (pgFile *) parray_get(files, i);
 
 		/* check for interrupt */
 		if (interrupted)
 			elog(ERROR_INTERRUPTED, _("interrupted during restore WAL"));
 
-		/* print progress */
+		/* prepare progress message */
 		join_path_components(path, arclog_path, file->path + strlen(base_path) + 1);
+		job.progress[0] = '\0';
 		if (verbose && !check)
-			printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files),
+			snprintf(job.progress, lengthof(job.progress), _("(%d/%lu) %s "),
+				i + 1, (unsigned long) parray_num(files),
 				file->path + strlen(base_path) + 1);
 
 		/* skip files which are not in backup */
 		if (file->write_size == BYTES_INVALID)
 		{
 			if (verbose && !check)
-				printf(_("skip(not backed up)\n"));
+				printf(_("%sskip(not backed up)\n"), job.progress);
 			continue;
 		}
 
@@ -529,17 +1088,33 @@ restore_archive_logs(pgBackup *backup)
 				file->path + strlen(file->path) - strlen(".history"))
 		{
 			if (verbose && !check)
-				printf(_("skip(timeline history)\n"));
+				printf(_("%sskip(timeline history)\n"), job.progress);
 			continue;
 		}
 
 		if (!check)
 		{
+			restore_files++;
 			if (backup->compress_data)
 			{
-				copy_file(base_path, arclog_path, file, DECOMPRESSION);
-				if (verbose)
-					printf(_("decompressed\n"));
+				restore_bytes += file->write_size;
+				job.routine = restore_wal_file;
+				job.from_root = base_path;
+				job.to_root = arclog_path;
+				job.file = file;
+				job.compress = true;
+				job.method = backup->compress_method;
+				job.checksum = backup->checksum;
+
+				if (queue)
+				{
+					RestoreJob *qjob = pgut_new(RestoreJob);
+
+					memcpy(qjob, &job, sizeof(RestoreJob));
+					JobQueue_push(queue, (Job *) qjob);
+				}
+				else
+					restore_wal_file(&job);
 
 				continue;
 			}
@@ -549,24 +1124,133 @@ restore_archive_logs(pgBackup *backup)
 				elog(ERROR_SYSTEM, _("can't remove file \"%s\": %s"), path,
 					strerror(errno));
 
+			/*
+			 * A reflink costs as little as a link, and is independent. A
+			 * segment backed up without the unused part is copied to pad it.
+			 */
+			if (zero_copy ||
+				(xlog_is_segment_name(file->path) &&
+				 file->write_size < XLogSegSize))
+			{
+				copy_file(base_path, arclog_path, file, NO_COMPRESSION,
+					backup->compress_method);
+				xlog_pad_segment(path, file->path);
+				restore_bytes += file->write_size;
+				if (verbose)
+					printf(_("%scopied\n"), job.progress);
+				continue;
+			}
+
 			if ((symlink(file->path, path) == -1))
 				elog(ERROR_SYSTEM, _("can't create link to \"%s\": %s"),
 					file->path, strerror(errno));
 
 			if (verbose)
-				printf(_("linked\n"));
+				printf(_("%slinked\n"), job.progress);
 		}
 	}
 
+	/* wait for all WAL decompressed by the workers */
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
+	}
+	metrics_stop(&timer, restore_bytes, restore_files);
+
+	if (verbose && !check && (backup->compress_data || zero_copy))
+		print_throughput("WAL", restore_bytes, &start);
+
 	parray_walk(files, pgFileFree);
 	parray_free(files);
 }
 
+/*
+ * Restore a file of database backup. This is called in a worker thread when
+ * the restore runs with multiple jobs.
+ */
+static void
+restore_file(RestoreJob *job)
+{
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during restore database"));
+
+	restore_data_file(job->from_root, job->to_root, job->file,
+		job->compress, job->method, job->checksum, NULL);
+
+	/* print size of restored file */
+	if (verbose)
+		printf(_("%srestored %lu\n"), job->progress,
+			(unsigned long) job->file->write_size);
+}
+
+/*
+ * Decompress a backed-up WAL into the archive directory.
+ */
+static void
+restore_wal_file(RestoreJob *job)
+{
+	char	path[MAXPGPATH];
+
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during restore WAL"));
+
+	copy_file(job->from_root, job->to_root, job->file, DECOMPRESSION,
+		job->method);
+	join_path_components(path, job->to_root,
+						 job->file->path + strlen(job->from_root) + 1);
+	xlog_pad_segment(path, job->file->path);
+	if (verbose)
+		printf(_("%sdecompressed\n"), job->progress);
+}
+
+/*
+ * Restore a file from backed-up copies in a chain of backups. This is called
+ * in a worker thread when the restore runs with multiple jobs.
+ */
+static void
+restore_chain_file(RestoreChainJob *job)
+{
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during restore database"));
+
+	restore_chain_apply(job->sources, job->to_root);
+
+	if (verbose)
+		printf(_("%srestored from %lu backups\n"), job->progress,
+			(unsigned long) parray_num(job->sources));
+
+	parray_walk(job->sources, free);
+	parray_free(job->sources);
+}
+
+/*
+ * Print total size of backup files read by restore and its throughput.
+ */
+static void
+print_throughput(const char *what, int64 bytes, const struct timeval *start)
+{
+	struct timeval	now;
+	double			elapsed;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start->tv_sec) +
+			  (now.tv_usec - start->tv_usec) / 1000000.0;
+
+	printf(_("%s restore read " INT64_FORMAT " bytes in %.2f sec (%.2f MB/s, %d jobs)\n"),
+		what, bytes, elapsed,
+		elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0, num_threads);
+}
+
 static void
 create_recovery_conf(const char *target_time,
 					 const char *target_xid,
 					 const char *target_inclusive,
-					 TimeLineID target_tli)
+					 TimeLineID target_tli,
+					 bool wal_on_demand)
 {
 	char path[MAXPGPATH];
 	FILE *fp;
@@ -587,7 +1271,16 @@ create_recovery_conf(const char *target_time,
 
 		fprintf(fp, "# recovery.conf generated by pg_rman %s\n",
 			PROGRAM_VERSION);
-		fprintf(fp, "restore_command = 'cp %s/%%f %%p'\n", arclog_path);
+		if (wal_on_demand)
+		{
+			fprintf(fp, "restore_command = '\"%s\" fetch-wal -B \"%s\" -A \"%s\"",
+				pg_rman_path, backup_path, arclog_path);
+			if (storage_path)
+				fprintf(fp, " --storage-path=\"%s\"", storage_path);
+			fprintf(fp, " %%f \"%%p\"'\n");
+		}
+		else
+			fprintf(fp, "restore_command = 'cp %s/%%f %%p'\n", arclog_path);
 		if (target_time)
 			fprintf(fp, "recovery_target_time = '%s'\n", target_time);
 		if (target_xid)
@@ -692,7 +1385,8 @@ restore_online_files(void)
 				printf(_("restore \"%s\"\n"),
 					file->path + strlen(root_backup) + 1);
 			if (!check)
-				copy_file(root_backup, to_root, file, NO_COMPRESSION);
+				copy_file(root_backup, to_root, file, NO_COMPRESSION,
+					current.compress_method);
 		}
 	}
 
@@ -964,6 +1658,11 @@ print_backup_id(const pgBackup *backup)
 		backup->stop_lsn.xrecoff);
 }
 
+/*
+ * Print the continuous WAL segments in the directory from the needed one,
+ * and advance the needed segment to the first missing one. The directory is
+ * read once into an index instead of stat() of each segment.
+ */
 static void
 search_next_wal(const char *path, uint32 *needId, uint32 *needSeg, parray *timelines)
 {
@@ -972,9 +1671,9 @@ search_next_wal(const char *path, uint32 *needId, uint32 *needSeg, parray *timel
 	int		count;
 	char	xlogfname[MAXFNAMELEN];
 	char	pre_xlogfname[MAXFNAMELEN];
-	char	xlogpath[MAXPGPATH];
-	struct stat	st;
+	parray *index;
 
+	index = xlog_index_dir(path);
 	count = 0;
 	for (;;)
 	{
@@ -983,9 +1682,7 @@ search_next_wal(const char *path, uint32 *needId, uint32 *needSeg, parray *timel
 			pgTimeLine *timeline = (pgTimeLine *) parray_get(timelines, i);
 
 			XLogFileName(xlogfname, timeline->tli, *needId, *needSeg);
-			join_path_components(xlogpath, path, xlogfname);
-
-			if (stat(xlogpath, &st) == 0)
+			if (xlog_index_has(index, timeline->tli, *needId, *needSeg))
 				break;
 		}
 
@@ -997,6 +1694,7 @@ search_next_wal(const char *path, uint32 *needId, uint32 *needSeg, parray *timel
 			else if (count > 1)
 				printf(_(" - %s\n"), pre_xlogfname);
 
+			xlog_index_free(index);
 			return;
 		}
 
@@ -0,0 +1,1308 @@
+/*-------------------------------------------------------------------------
+ *
+ * s3.c: storage backend of S3 compatible object storage.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#ifdef HAVE_LIBCURL
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <curl/curl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "pgut/pgut-pthread.h"
+
+/*
+ * Objects are accessed with path-style URLs, ENDPOINT/bucket/key, signed with
+ * AWS Signature Version 4. The endpoint, the region and the credentials are
+ * taken from AWS_ENDPOINT_URL, AWS_REGION (or AWS_DEFAULT_REGION),
+ * AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN.
+ *
+ * A file being written is buffered in parts. A file larger than a part is
+ * uploaded with multipart upload; a part filled is uploaded by the worker
+ * threads while the next one is being filled. A file being read is fetched
+ * with range GETs, and the next range is prefetched while the current one is
+ * consumed. At most S3_MAX_INFLIGHT buffers are uploaded or prefetched at
+ * once, so the writers wait when the storage is slower than the backup.
+ */
+#define S3_SCHEME			"s3://"
+#define S3_PART_SIZE		(8 * 1024 * 1024)
+#define S3_MAX_PARTS		10000
+#define S3_RANGE_SIZE		(4 * 1024 * 1024)
+#define S3_MAX_INFLIGHT		8
+#define S3_MAX_RETRIES		3
+#define S3_DEFAULT_REGION	"us-east-1"
+
+typedef struct S3Config
+{
+	char	   *endpoint;	/* scheme://host[:port] */
+	char	   *host;		/* host[:port] of the endpoint */
+	char	   *region;
+	char	   *access_key;
+	char	   *secret_key;
+	char	   *token;		/* session token, or NULL */
+} S3Config;
+
+typedef struct S3Request
+{
+	const char *method;
+	const char *path;		/* s3://bucket/key */
+	const char *query;		/* canonical query string, or NULL */
+	const char *range;		/* value of Range header, or NULL */
+	const char *data;		/* request body */
+	size_t		data_len;
+	size_t		sent;
+
+	long		status;		/* HTTP status, or 0 on transport error */
+	char	   *buf;		/* buffer of the caller for the response */
+	size_t		bufsize;
+	size_t		len;		/* bytes received into buf */
+	StringInfoData body;	/* response body if buf is NULL */
+	char		etag[256];
+	int64		content_length;
+	time_t		last_modified;
+	char		error[CURL_ERROR_SIZE];
+} S3Request;
+
+/* a file being written */
+typedef struct S3Writer
+{
+	char			path[MAXPGPATH];
+	char		   *buf;		/* part being filled */
+	size_t			len;
+	int				nparts;		/* parts uploaded or being uploaded */
+	char		   *upload_id;	/* of multipart upload, or NULL */
+	char		  **etags;		/* ETag of each part */
+	int				pending;	/* parts being uploaded */
+	bool			failed;		/* error raised, the rest is discarded */
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;
+} S3Writer;
+
+typedef struct S3PartJob
+{
+	JobRoutine	routine;
+	S3Writer   *writer;
+	int			number;		/* part number, from 1 */
+	char	   *data;
+	size_t		len;
+} S3PartJob;
+
+/* a range of a file being read */
+typedef struct S3Range
+{
+	char	   *data;
+	int64		offset;
+	size_t		len;
+} S3Range;
+
+typedef struct S3Reader
+{
+	char			path[MAXPGPATH];
+	int64			size;
+	int64			pos;
+	S3Range			cur;
+	S3Range			next;		/* prefetched */
+	bool			prefetching;
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;
+} S3Reader;
+
+typedef struct S3RangeJob
+{
+	JobRoutine	routine;
+	S3Reader   *reader;
+} S3RangeJob;
+
+static S3Config			s3;
+static pthread_once_t	s3_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	s3_handle_key;
+
+/* worker threads and buffers in flight shared by all files */
+static pthread_mutex_t	s3_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	s3_slot_freed = PTHREAD_COND_INITIALIZER;
+static int				s3_inflight = 0;
+static JobQueue		   *s3_queue = NULL;
+
+static void s3_init(void);
+static CURL *s3_handle(void);
+static const char *s3_split(const char *path, char *bucket, size_t len);
+static void uri_encode(StringInfo buf, const char *str, bool keep_slash);
+static void sha256_hex(const void *data, size_t len, char *hex);
+static struct curl_slist *s3_sign(const S3Request *req, const char *uri);
+static void s3_request_init(S3Request *req, const char *method,
+							const char *path);
+static void s3_request_free(S3Request *req);
+static bool s3_perform(S3Request *req);
+static const char *s3_error(S3Request *req);
+static int s3_errno(const S3Request *req);
+static bool s3_list(const char *path, bool recursive, parray *files);
+static const char *xml_find(const char *p, const char *end, const char *tag,
+							char *value, size_t len);
+static void s3_push(Job *job);
+static void s3_release(void);
+
+static void s3_writer_flush(S3Writer *w);
+static void s3_upload_part(S3PartJob *job);
+static void s3_abort_upload(S3Writer *w);
+static void s3_fetch(S3Reader *r, S3Range *range, int64 offset);
+static void s3_prefetch(S3RangeJob *job);
+static void s3_reader_wait(S3Reader *r);
+
+static ssize_t s3_writer_write(void *cookie, const char *buf, size_t size);
+static int s3_writer_close(void *cookie);
+static ssize_t s3_reader_read(void *cookie, char *buf, size_t size);
+static int s3_reader_seek(void *cookie, int64 *offset, int whence);
+static int s3_reader_close(void *cookie);
+static FILE *s3_cookie_fopen(void *cookie, bool write);
+
+/*
+ * Open an object to read, write or append. Written contents are stored when
+ * the file is closed.
+ */
+FILE *
+s3_fopen(const char *path, const char *mode)
+{
+	if (mode[0] == 'r')
+	{
+		S3Reader   *r;
+		struct stat	st;
+
+		if (s3_stat(path, &st) == -1)
+			return NULL;
+
+		r = pgut_new(S3Reader);
+		memset(r, 0, sizeof(S3Reader));
+		strlcpy(r->path, path, lengthof(r->path));
+		r->size = st.st_size;
+		pthread_mutex_init(&r->lock, NULL);
+		pthread_cond_init(&r->done, NULL);
+
+		return s3_cookie_fopen(r, false);
+	}
+	else if (mode[0] == 'w' || mode[0] == 'a')
+	{
+		S3Writer   *w;
+		FILE	   *fp;
+
+		w = pgut_new(S3Writer);
+		memset(w, 0, sizeof(S3Writer));
+		strlcpy(w->path, path, lengthof(w->path));
+		w->buf = pgut_malloc(S3_PART_SIZE);
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->done, NULL);
+		fp = s3_cookie_fopen(w, true);
+
+		/* objects can't be appended, so the contents are rewritten */
+		if (mode[0] == 'a')
+		{
+			FILE   *in = s3_fopen(path, "r");
+			char	buf[8192];
+			size_t	len;
+
+			if (in == NULL && errno != ENOENT)
+			{
+				w->failed = true;
+				elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), path,
+					strerror(errno));
+			}
+			while (in && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+				fwrite(buf, 1, len, fp);
+			if (in)
+				fclose(in);
+		}
+
+		return fp;
+	}
+
+	errno = EINVAL;
+	return NULL;
+}
+
+int
+s3_stat(const char *path, struct stat *st)
+{
+	S3Request	req;
+
+	s3_request_init(&req, "HEAD", path);
+	if (!s3_perform(&req) || req.status != 200)
+	{
+		errno = s3_errno(&req);
+		s3_request_free(&req);
+		return -1;
+	}
+
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFREG | FILE_PERMISSION;
+	st->st_size = req.content_length;
+	st->st_mtime = req.last_modified;
+	s3_request_free(&req);
+
+	return 0;
+}
+
+int
+s3_remove(const char *path)
+{
+	S3Request	req;
+
+	s3_request_init(&req, "DELETE", path);
+	if (!s3_perform(&req) || (req.status != 204 && req.status != 200))
+	{
+		errno = s3_errno(&req);
+		s3_request_free(&req);
+		return -1;
+	}
+	s3_request_free(&req);
+
+	return 0;
+}
+
+/* common prefixes under the path are listed as directories */
+parray *
+s3_list_dir(const char *path)
+{
+	parray *entries = parray_new();
+
+	if (!s3_list(path, false, entries))
+	{
+		int		errno_tmp = errno;
+
+		parray_walk(entries, pgFileFree);
+		parray_free(entries);
+		errno = errno_tmp;
+		return NULL;
+	}
+
+	return entries;
+}
+
+void
+s3_list_file(parray *files, const char *root)
+{
+	if (!s3_list(root, true, files))
+		elog(ERROR_SYSTEM, _("can't list \"%s\": %s"), root, strerror(errno));
+}
+
+static void
+s3_init(void)
+{
+	const char *env;
+	char	   *p;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	pthread_key_create(&s3_handle_key, (void (*)(void *)) curl_easy_cleanup);
+
+	if ((env = getenv("AWS_REGION")) == NULL &&
+		(env = getenv("AWS_DEFAULT_REGION")) == NULL)
+		env = S3_DEFAULT_REGION;
+	s3.region = pgut_strdup(env);
+
+	if ((env = getenv("AWS_ENDPOINT_URL")) != NULL)
+		s3.endpoint = pgut_strdup(env);
+	else
+	{
+		s3.endpoint = pgut_malloc(strlen(s3.region) + 32);
+		sprintf(s3.endpoint, "https://s3.%s.amazonaws.com", s3.region);
+	}
+	for (p = s3.endpoint + strlen(s3.endpoint);
+		 p > s3.endpoint && p[-1] == '/'; p--)
+		p[-1] = '\0';
+	if ((p = strstr(s3.endpoint, "://")) == NULL)
+		elog(ERROR_ARGS, _("invalid AWS_ENDPOINT_URL \"%s\""), s3.endpoint);
+	s3.host = pgut_strdup(p + 3);
+	if ((p = strchr(s3.host, '/')) != NULL)
+		*p = '\0';
+
+	if ((env = getenv("AWS_ACCESS_KEY_ID")) == NULL)
+		elog(ERROR_ARGS, _("AWS_ACCESS_KEY_ID is required for object storage"));
+	s3.access_key = pgut_strdup(env);
+	if ((env = getenv("AWS_SECRET_ACCESS_KEY")) == NULL)
+		elog(ERROR_ARGS, _("AWS_SECRET_ACCESS_KEY is required for object storage"));
+	s3.secret_key = pgut_strdup(env);
+	if ((env = getenv("AWS_SESSION_TOKEN")) != NULL && env[0])
+		s3.token = pgut_strdup(env);
+}
+
+/* each thread keeps its handle to reuse the connections */
+static CURL *
+s3_handle(void)
+{
+	CURL   *curl;
+
+	pthread_once(&s3_once, s3_init);
+	if ((curl = pthread_getspecific(s3_handle_key)) == NULL)
+	{
+		if ((curl = curl_easy_init()) == NULL)
+			elog(ERROR_SYSTEM, _("can't initialize libcurl"));
+		pthread_setspecific(s3_handle_key, curl);
+	}
+
+	return curl;
+}
+
+/* split "s3://bucket/key" into the bucket and the key */
+static const char *
+s3_split(const char *path, char *bucket, size_t len)
+{
+	const char *name = path + strlen(S3_SCHEME);
+	const char *slash = strchr(name, '/');
+	size_t		n = (slash ? (size_t) (slash - name) : strlen(name));
+
+	if (n == 0 || n >= len)
+		elog(ERROR_ARGS, _("invalid object storage path \"%s\""), path);
+	memcpy(bucket, name, n);
+	bucket[n] = '\0';
+
+	return slash ? slash + 1 : "";
+}
+
+/* URI encoding of SigV4, all but the unreserved characters are encoded */
+static void
+uri_encode(StringInfo buf, const char *str, bool keep_slash)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) str; *p; p++)
+	{
+		if ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') ||
+			(*p >= '0' && *p <= '9') || strchr("-_.~", *p) ||
+			(keep_slash && *p == '/'))
+			appendStringInfoChar(buf, *p);
+		else
+			appendStringInfo(buf, "%%%02X", *p);
+	}
+}
+
+static void
+hex_encode(const unsigned char *src, size_t len, char *hex)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++)
+		sprintf(hex + i * 2, "%02x", src[i]);
+}
+
+static void
+sha256_hex(const void *data, size_t len, char *hex)
+{
+	unsigned char	md[EVP_MAX_MD_SIZE];
+	unsigned int	mdlen;
+
+	EVP_Digest(data, len, md, &mdlen, EVP_sha256(), NULL);
+	hex_encode(md, mdlen, hex);
+}
+
+static void
+hmac_sha256(const void *key, size_t keylen, const char *data,
+			unsigned char *md, unsigned int *mdlen)
+{
+	HMAC(EVP_sha256(), key, keylen, (const unsigned char *) data,
+		 strlen(data), md, mdlen);
+}
+
+/*
+ * Make the headers of the request with the signature.
+ */
+static struct curl_slist *
+s3_sign(const S3Request *req, const char *uri)
+{
+	struct curl_slist  *headers = NULL;
+	StringInfoData		buf;
+	time_t				now = time(NULL);
+	struct tm			tm;
+	char				date[16];
+	char				amzdate[32];
+	char				payload_hash[65];
+	char				request_hash[65];
+	char				signature[65];
+	const char		   *signed_headers;
+	unsigned char		key[EVP_MAX_MD_SIZE];
+	unsigned int		keylen;
+
+	gmtime_r(&now, &tm);
+	strftime(date, lengthof(date), "%Y%m%d", &tm);
+	strftime(amzdate, lengthof(amzdate), "%Y%m%dT%H%M%SZ", &tm);
+	sha256_hex(req->data ? req->data : "", req->data_len, payload_hash);
+	signed_headers = (s3.token ?
+		"host;x-amz-content-sha256;x-amz-date;x-amz-security-token" :
+		"host;x-amz-content-sha256;x-amz-date");
+
+	/* canonical request */
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%s\n%s\n%s\n", req->method, uri,
+					 req->query ? req->query : "");
+	appendStringInfo(&buf, "host:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n",
+					 s3.host, payload_hash, amzdate);
+	if (s3.token)
+		appendStringInfo(&buf, "x-amz-security-token:%s\n", s3.token);
+	appendStringInfo(&buf, "\n%s\n%s", signed_headers, payload_hash);
+	sha256_hex(buf.data, buf.len, request_hash);
+
+	/* string to sign */
+	resetStringInfo(&buf);
+	appendStringInfo(&buf, "AWS4-HMAC-SHA256\n%s\n%s/%s/s3/aws4_request\n%s",
+					 amzdate, date, s3.region, request_hash);
+
+	/* signing key */
+	{
+		char   *secret = pgut_malloc(strlen(s3.secret_key) + 5);
+
+		sprintf(secret, "AWS4%s", s3.secret_key);
+		hmac_sha256(secret, strlen(secret), date, key, &keylen);
+		free(secret);
+	}
+	hmac_sha256(key, keylen, s3.region, key, &keylen);
+	hmac_sha256(key, keylen, "s3", key, &keylen);
+	hmac_sha256(key, keylen, "aws4_request", key, &keylen);
+	hmac_sha256(key, keylen, buf.data, key, &keylen);
+	hex_encode(key, keylen, signature);
+
+	resetStringInfo(&buf);
+	appendStringInfo(&buf, "Authorization: AWS4-HMAC-SHA256 "
+					 "Credential=%s/%s/%s/s3/aws4_request, "
+					 "SignedHeaders=%s, Signature=%s",
+					 s3.access_key, date, s3.region, signed_headers, signature);
+	headers = curl_slist_append(headers, buf.data);
+	resetStringInfo(&buf);
+	appendStringInfo(&buf, "Host: %s", s3.host);
+	headers = curl_slist_append(headers, buf.data);
+	resetStringInfo(&buf);
+	appendStringInfo(&buf, "x-amz-content-sha256: %s", payload_hash);
+	headers = curl_slist_append(headers, buf.data);
+	resetStringInfo(&buf);
+	appendStringInfo(&buf, "x-amz-date: %s", amzdate);
+	headers = curl_slist_append(headers, buf.data);
+	if (s3.token)
+	{
+		resetStringInfo(&buf);
+		appendStringInfo(&buf, "x-amz-security-token: %s", s3.token);
+		headers = curl_slist_append(headers, buf.data);
+	}
+	termStringInfo(&buf);
+
+	return headers;
+}
+
+static void
+s3_request_init(S3Request *req, const char *method, const char *path)
+{
+	memset(req, 0, sizeof(S3Request));
+	req->method = method;
+	req->path = path;
+	initStringInfo(&req->body);
+}
+
+static void
+s3_request_free(S3Request *req)
+{
+	termStringInfo(&req->body);
+}
+
+static size_t
+s3_read_callback(char *ptr, size_t size, size_t nmemb, void *arg)
+{
+	S3Request  *req = (S3Request *) arg;
+	size_t		len = Min(size * nmemb, req->data_len - req->sent);
+
+	memcpy(ptr, req->data + req->sent, len);
+	req->sent += len;
+
+	return len;
+}
+
+static size_t
+s3_write_callback(char *ptr, size_t size, size_t nmemb, void *arg)
+{
+	S3Request  *req = (S3Request *) arg;
+	size_t		len = size * nmemb;
+
+	if (req->buf == NULL)
+		appendBinaryStringInfo(&req->body, ptr, len);
+	else if (req->len + len <= req->bufsize)
+	{
+		memcpy(req->buf + req->len, ptr, len);
+		req->len += len;
+	}
+	else
+		return 0;	/* more than requested */
+
+	return len;
+}
+
+static size_t
+s3_header_callback(char *ptr, size_t size, size_t nmemb, void *arg)
+{
+	S3Request  *req = (S3Request *) arg;
+	size_t		len = size * nmemb;
+	char		line[1024];
+	char	   *value;
+
+	if (len >= lengthof(line))
+		return len;
+	memcpy(line, ptr, len);
+	line[len] = '\0';
+	while (len > 0 && IsSpace(line[len - 1]))
+		line[--len] = '\0';
+	if ((value = strchr(line, ':')) == NULL)
+		return size * nmemb;
+	*value++ = '\0';
+	while (IsSpace(*value))
+		value++;
+
+	if (pg_strcasecmp(line, "ETag") == 0)
+		strlcpy(req->etag, value, lengthof(req->etag));
+	else if (pg_strcasecmp(line, "Content-Length") == 0)
+		parse_int64(value, &req->content_length);
+	else if (pg_strcasecmp(line, "Last-Modified") == 0)
+		req->last_modified = curl_getdate(value, NULL);
+
+	return size * nmemb;
+}
+
+/*
+ * Send the request. Transport errors and server errors are retried. Returns
+ * false on transport error, otherwise the response is in the request.
+ */
+static bool
+s3_perform(S3Request *req)
+{
+	CURL		   *curl = s3_handle();
+	char			bucket[MAXPGPATH];
+	const char	   *key;
+	StringInfoData	uri;
+	StringInfoData	url;
+	CURLcode		rc;
+	int				retry;
+
+	key = s3_split(req->path, bucket, lengthof(bucket));
+	initStringInfo(&uri);
+	appendStringInfoChar(&uri, '/');
+	uri_encode(&uri, bucket, false);
+	appendStringInfoChar(&uri, '/');
+	uri_encode(&uri, key, true);
+	initStringInfo(&url);
+	appendStringInfo(&url, "%s%s", s3.endpoint, uri.data);
+	if (req->query)
+		appendStringInfo(&url, "?%s", req->query);
+
+	for (retry = 0; ; retry++)
+	{
+		struct curl_slist  *headers;
+
+		headers = s3_sign(req, uri.data);
+		headers = curl_slist_append(headers, "Expect:");
+		if (req->range)
+		{
+			char	range[128];
+
+			snprintf(range, lengthof(range), "Range: %s", req->range);
+			headers = curl_slist_append(headers, range);
+		}
+
+		curl_easy_reset(curl);
+		curl_easy_setopt(curl, CURLOPT_URL, url.data);
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, PROGRAM_NAME);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->error);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, s3_write_callback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, s3_header_callback);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, req);
+		if (strcmp(req->method, "HEAD") == 0)
+			curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+		else if (strcmp(req->method, "PUT") == 0)
+		{
+			curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+			curl_easy_setopt(curl, CURLOPT_READFUNCTION, s3_read_callback);
+			curl_easy_setopt(curl, CURLOPT_READDATA, req);
+			curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE,
+							 (curl_off_t) req->data_len);
+		}
+		else if (strcmp(req->method, "POST") == 0)
+		{
+			curl_easy_setopt(curl, CURLOPT_POST, 1L);
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS,
+							 req->data ? req->data : "");
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+							 (curl_off_t) req->data_len);
+		}
+		else if (strcmp(req->method, "GET") != 0)
+			curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, req->method);
+
+		req->sent = 0;
+		req->status = 0;
+		req->len = 0;
+		resetStringInfo(&req->body);
+		req->etag[0] = '\0';
+		req->content_length = -1;
+		req->last_modified = 0;
+		req->error[0] = '\0';
+
+		rc = curl_easy_perform(curl);
+		curl_slist_free_all(headers);
+		if (rc == CURLE_OK)
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &req->status);
+		else if (req->error[0] == '\0')
+			strlcpy(req->error, curl_easy_strerror(rc), lengthof(req->error));
+
+		if ((rc == CURLE_OK && req->status < 500 && req->status != 429) ||
+			retry >= S3_MAX_RETRIES)
+			break;
+
+		elog(LOG, _("retry %s \"%s\": %s"), req->method, req->path,
+			s3_error(req));
+		sleep(1 << retry);
+	}
+
+	termStringInfo(&url);
+	termStringInfo(&uri);
+
+	return rc == CURLE_OK;
+}
+
+/* message of the error of the request */
+static const char *
+s3_error(S3Request *req)
+{
+	char	code[256];
+
+	if (req->status == 0)
+		return req->error;
+
+	if (req->buf == NULL &&
+		xml_find(req->body.data, NULL, "Code", code, lengthof(code)))
+		snprintf(req->error, lengthof(req->error), "HTTP status %ld, %s",
+				 req->status, code);
+	else
+		snprintf(req->error, lengthof(req->error), "HTTP status %ld",
+				 req->status);
+
+	return req->error;
+}
+
+static int
+s3_errno(const S3Request *req)
+{
+	switch (req->status)
+	{
+		case 404:
+			return ENOENT;
+		case 401:
+		case 403:
+			return EACCES;
+		default:
+			return EIO;
+	}
+}
+
+/*
+ * List objects under the path into files. If not recursive, common prefixes
+ * of the next level are listed as directories.
+ */
+static bool
+s3_list(const char *path, bool recursive, parray *files)
+{
+	char			bucket[MAXPGPATH];
+	char			root[MAXPGPATH];
+	char			token[1024] = "";
+	const char	   *key;
+	StringInfoData	prefix;
+	StringInfoData	query;
+	bool			truncated;
+	bool			ok = true;
+
+	key = s3_split(path, bucket, lengthof(bucket));
+	snprintf(root, lengthof(root), S3_SCHEME "%s", bucket);
+	initStringInfo(&prefix);
+	if (key[0])
+		appendStringInfo(&prefix, "%s/", key);
+	initStringInfo(&query);
+
+	do
+	{
+		S3Request	req;
+		const char *p;
+		const char *end;
+		char		name[MAXPGPATH];
+		char		child[MAXPGPATH];
+		char		value[64];
+
+		/* parameters are sorted by the name */
+		resetStringInfo(&query);
+		if (token[0])
+		{
+			appendStringInfoString(&query, "continuation-token=");
+			uri_encode(&query, token, false);
+			appendStringInfoChar(&query, '&');
+		}
+		if (!recursive)
+			appendStringInfoString(&query, "delimiter=%2F&");
+		appendStringInfoString(&query, "list-type=2&prefix=");
+		uri_encode(&query, prefix.data, false);
+
+		s3_request_init(&req, "GET", root);
+		req.query = query.data;
+		if (!s3_perform(&req) || req.status != 200)
+		{
+			elog(LOG, _("can't list \"%s\": %s"), path, s3_error(&req));
+			errno = s3_errno(&req);
+			s3_request_free(&req);
+			ok = false;
+			break;
+		}
+
+		for (p = req.body.data; (p = strstr(p, "<Contents>")) != NULL; p = end)
+		{
+			size_t	size = 0;
+
+			if ((end = strstr(p, "</Contents>")) == NULL)
+				break;
+			if (!xml_find(p, end, "Key", name, lengthof(name)) ||
+				name[0] == '\0' || name[strlen(name) - 1] == '/')
+				continue;
+			if (xml_find(p, end, "Size", value, lengthof(value)))
+				size = (size_t) strtoul(value, NULL, 10);
+			snprintf(child, lengthof(child), "%s/%s", root, name);
+			parray_append(files, storage_file_new(child,
+				S_IFREG | FILE_PERMISSION, size, 0));
+		}
+
+		for (p = req.body.data;
+			 (p = strstr(p, "<CommonPrefixes>")) != NULL; p = end)
+		{
+			size_t	len;
+
+			if ((end = strstr(p, "</CommonPrefixes>")) == NULL)
+				break;
+			if (!xml_find(p, end, "Prefix", name, lengthof(name)))
+				continue;
+			len = strlen(name);
+			if (len > 0 && name[len - 1] == '/')
+				name[len - 1] = '\0';
+			snprintf(child, lengthof(child), "%s/%s", root, name);
+			parray_append(files, storage_file_new(child,
+				S_IFDIR | DIR_PERMISSION, 0, 0));
+		}
+
+		truncated = (strstr(req.body.data, "<IsTruncated>true</IsTruncated>") &&
+					 xml_find(req.body.data, NULL, "NextContinuationToken",
+							  token, lengthof(token)));
+		s3_request_free(&req);
+	} while (truncated);
+
+	termStringInfo(&query);
+	termStringInfo(&prefix);
+
+	return ok;
+}
+
+/*
+ * Find the element <tag>value</tag> from p, before end if not NULL, and copy
+ * its unescaped value. Returns the position after the element, or NULL.
+ */
+static const char *
+xml_find(const char *p, const char *end, const char *tag, char *value,
+		 size_t len)
+{
+	char		open[64];
+	char		close[64];
+	const char *begin;
+	const char *last;
+	size_t		n = 0;
+
+	snprintf(open, lengthof(open), "<%s>", tag);
+	snprintf(close, lengthof(close), "</%s>", tag);
+	if ((begin = strstr(p, open)) == NULL ||
+		(last = strstr(begin, close)) == NULL ||
+		(end != NULL && last > end))
+		return NULL;
+
+	for (begin += strlen(open); begin < last && n + 1 < len; n++)
+	{
+		static const struct { const char *ref; char c; } refs[] =
+		{
+			{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+			{ "&quot;", '"' }, { "&apos;", '\'' }, { NULL, 0 }
+		};
+		int		i;
+
+		for (i = 0; *begin == '&' && refs[i].ref; i++)
+		{
+			if (strncmp(begin, refs[i].ref, strlen(refs[i].ref)) == 0)
+				break;
+		}
+		if (*begin == '&' && refs[i].ref)
+		{
+			value[n] = refs[i].c;
+			begin += strlen(refs[i].ref);
+		}
+		else
+			value[n] = *begin++;
+	}
+	value[n] = '\0';
+
+	return last + strlen(close);
+}
+
+/*
+ * Run the job with the worker threads after a buffer in flight is available.
+ * The job must call s3_release() when finished.
+ */
+static void
+s3_push(Job *job)
+{
+	pgut_mutex_lock(&s3_lock);
+	while (s3_inflight >= S3_MAX_INFLIGHT)
+		pgut_cond_wait(&s3_slot_freed, &s3_lock);
+	s3_inflight++;
+	if (s3_queue == NULL)
+		s3_queue = JobQueue_new(S3_MAX_INFLIGHT);
+	pthread_mutex_unlock(&s3_lock);
+
+	JobQueue_push(s3_queue, job);
+}
+
+static void
+s3_release(void)
+{
+	pgut_mutex_lock(&s3_lock);
+	s3_inflight--;
+	pthread_cond_signal(&s3_slot_freed);
+	pthread_mutex_unlock(&s3_lock);
+}
+
+/* upload the part filled, starting multipart upload at the first part */
+static void
+s3_writer_flush(S3Writer *w)
+{
+	S3PartJob  *job;
+
+	if (w->upload_id == NULL)
+	{
+		S3Request	req;
+		char		upload_id[1024];
+
+		s3_request_init(&req, "POST", w->path);
+		req.query = "uploads=";
+		if (!s3_perform(&req) || req.status != 200 ||
+			!xml_find(req.body.data, NULL, "UploadId", upload_id,
+					  lengthof(upload_id)))
+		{
+			w->failed = true;
+			elog(ERROR_SYSTEM, _("can't start upload of \"%s\": %s"),
+				w->path, s3_error(&req));
+		}
+		w->upload_id = pgut_strdup(upload_id);
+		s3_request_free(&req);
+	}
+
+	if (w->nparts >= S3_MAX_PARTS)
+	{
+		w->failed = true;
+		s3_abort_upload(w);
+		elog(ERROR_SYSTEM, _("\"%s\" is too large to upload"), w->path);
+	}
+
+	pgut_mutex_lock(&w->lock);
+	w->etags = pgut_realloc(w->etags, sizeof(char *) * (w->nparts + 1));
+	w->etags[w->nparts] = NULL;
+	w->nparts++;
+	w->pending++;
+	pthread_mutex_unlock(&w->lock);
+
+	job = pgut_new(S3PartJob);
+	job->routine = (JobRoutine) s3_upload_part;
+	job->writer = w;
+	job->number = w->nparts;
+	job->data = w->buf;
+	job->len = w->len;
+	s3_push((Job *) job);
+
+	w->buf = pgut_malloc(S3_PART_SIZE);
+	w->len = 0;
+}
+
+static void
+s3_upload_part(S3PartJob *job)
+{
+	S3Writer	   *w = job->writer;
+	S3Request		req;
+	StringInfoData	query;
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "partNumber=%d&uploadId=", job->number);
+	uri_encode(&query, w->upload_id, false);
+
+	s3_request_init(&req, "PUT", w->path);
+	req.query = query.data;
+	req.data = job->data;
+	req.data_len = job->len;
+	if (!s3_perform(&req) || req.status != 200 || req.etag[0] == '\0')
+	{
+		w->failed = true;
+		s3_abort_upload(w);
+		elog(ERROR_SYSTEM, _("can't upload part %d of \"%s\": %s"),
+			job->number, w->path, s3_error(&req));
+	}
+
+	pgut_mutex_lock(&w->lock);
+	w->etags[job->number - 1] = pgut_strdup(req.etag);
+	w->pending--;
+	pthread_cond_signal(&w->done);
+	pthread_mutex_unlock(&w->lock);
+
+	s3_request_free(&req);
+	termStringInfo(&query);
+	free(job->data);
+	s3_release();
+}
+
+static void
+s3_abort_upload(S3Writer *w)
+{
+	S3Request		req;
+	StringInfoData	query;
+
+	initStringInfo(&query);
+	appendStringInfoString(&query, "uploadId=");
+	uri_encode(&query, w->upload_id, false);
+	s3_request_init(&req, "DELETE", w->path);
+	req.query = query.data;
+	s3_perform(&req);
+	s3_request_free(&req);
+	termStringInfo(&query);
+}
+
+/* fetch the range from the offset */
+static void
+s3_fetch(S3Reader *r, S3Range *range, int64 offset)
+{
+	S3Request	req;
+	char		value[128];
+
+	if (range->data == NULL)
+		range->data = pgut_malloc(S3_RANGE_SIZE);
+	range->offset = offset;
+	range->len = (size_t) Min((int64) S3_RANGE_SIZE, r->size - offset);
+
+	snprintf(value, lengthof(value), "bytes=" INT64_FORMAT "-" INT64_FORMAT,
+			 offset, offset + (int64) range->len - 1);
+	s3_request_init(&req, "GET", r->path);
+	req.range = value;
+	req.buf = range->data;
+	req.bufsize = range->len;
+	if (!s3_perform(&req) ||
+		(req.status != 206 && (req.status != 200 || offset != 0)) ||
+		req.len != range->len)
+		elog(ERROR_SYSTEM, _("can't read \"%s\": %s"), r->path,
+			req.status == 206 ? _("unexpected end of object") : s3_error(&req));
+	s3_request_free(&req);
+}
+
+static void
+s3_prefetch(S3RangeJob *job)
+{
+	S3Reader   *r = job->reader;
+
+	s3_fetch(r, &r->next, r->next.offset);
+
+	pgut_mutex_lock(&r->lock);
+	r->prefetching = false;
+	pthread_cond_signal(&r->done);
+	pthread_mutex_unlock(&r->lock);
+
+	s3_release();
+}
+
+static void
+s3_reader_wait(S3Reader *r)
+{
+	pgut_mutex_lock(&r->lock);
+	while (r->prefetching)
+		pgut_cond_wait(&r->done, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static ssize_t
+s3_writer_write(void *cookie, const char *buf, size_t size)
+{
+	S3Writer   *w = (S3Writer *) cookie;
+	size_t		done = 0;
+
+	/* exit() after an error flushes the stream again */
+	if (w->failed)
+		return size;
+
+	while (done < size)
+	{
+		size_t	n = Min(size - done, S3_PART_SIZE - w->len);
+
+		memcpy(w->buf + w->len, buf + done, n);
+		w->len += n;
+		done += n;
+		if (w->len == S3_PART_SIZE)
+			s3_writer_flush(w);
+	}
+
+	return size;
+}
+
+static int
+s3_writer_close(void *cookie)
+{
+	S3Writer   *w = (S3Writer *) cookie;
+	S3Request	req;
+	int			i;
+
+	if (w->failed)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	if (w->upload_id == NULL)
+	{
+		/* the file in one part is put at once */
+		s3_request_init(&req, "PUT", w->path);
+		req.data = w->buf;
+		req.data_len = w->len;
+		if (!s3_perform(&req) || req.status != 200)
+		{
+			w->failed = true;
+			elog(ERROR_SYSTEM, _("can't upload \"%s\": %s"), w->path,
+				s3_error(&req));
+		}
+		s3_request_free(&req);
+	}
+	else
+	{
+		StringInfoData	query;
+		StringInfoData	parts;
+
+		if (w->len > 0)
+			s3_writer_flush(w);
+
+		pgut_mutex_lock(&w->lock);
+		while (w->pending > 0)
+			pgut_cond_wait(&w->done, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+
+		initStringInfo(&parts);
+		appendStringInfoString(&parts, "<CompleteMultipartUpload>");
+		for (i = 0; i < w->nparts; i++)
+			appendStringInfo(&parts,
+				"<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+				i + 1, w->etags[i]);
+		appendStringInfoString(&parts, "</CompleteMultipartUpload>");
+
+		initStringInfo(&query);
+		appendStringInfoString(&query, "uploadId=");
+		uri_encode(&query, w->upload_id, false);
+
+		/* the error can be reported after the status 200 */
+		s3_request_init(&req, "POST", w->path);
+		req.query = query.data;
+		req.data = parts.data;
+		req.data_len = parts.len;
+		if (!s3_perform(&req) || req.status != 200 ||
+			strstr(req.body.data, "<Error>") != NULL)
+		{
+			w->failed = true;
+			s3_abort_upload(w);
+			elog(ERROR_SYSTEM, _("can't complete upload of \"%s\": %s"),
+				w->path, s3_error(&req));
+		}
+		s3_request_free(&req);
+		termStringInfo(&query);
+		termStringInfo(&parts);
+
+		for (i = 0; i < w->nparts; i++)
+			free(w->etags[i]);
+		free(w->etags);
+		free(w->upload_id);
+	}
+
+	pthread_cond_destroy(&w->done);
+	pthread_mutex_destroy(&w->lock);
+	free(w->buf);
+	free(w);
+
+	return 0;
+}
+
+static ssize_t
+s3_reader_read(void *cookie, char *buf, size_t size)
+{
+	S3Reader   *r = (S3Reader *) cookie;
+	size_t		n;
+
+	if (r->pos >= r->size)
+		return 0;
+
+	if (r->pos < r->cur.offset ||
+		r->pos >= r->cur.offset + (int64) r->cur.len)
+	{
+		s3_reader_wait(r);
+		if (r->next.len > 0 && r->pos >= r->next.offset &&
+			r->pos < r->next.offset + (int64) r->next.len)
+		{
+			S3Range	tmp = r->cur;
+
+			r->cur = r->next;
+			r->next = tmp;
+		}
+		else
+			s3_fetch(r, &r->cur, r->pos);
+		r->next.len = 0;
+
+		/* prefetch the following range */
+		if (r->cur.offset + (int64) r->cur.len < r->size)
+		{
+			S3RangeJob *job = pgut_new(S3RangeJob);
+
+			job->routine = (JobRoutine) s3_prefetch;
+			job->reader = r;
+			r->next.offset = r->cur.offset + r->cur.len;
+			r->prefetching = true;
+			s3_push((Job *) job);
+		}
+	}
+
+	n = (size_t) Min((int64) size, r->cur.offset + (int64) r->cur.len - r->pos);
+	memcpy(buf, r->cur.data + (r->pos - r->cur.offset), n);
+	r->pos += n;
+
+	return n;
+}
+
+static int
+s3_reader_seek(void *cookie, int64 *offset, int whence)
+{
+	S3Reader   *r = (S3Reader *) cookie;
+	int64		pos;
+
+	switch (whence)
+	{
+		case SEEK_SET:
+			pos = *offset;
+			break;
+		case SEEK_CUR:
+			pos = r->pos + *offset;
+			break;
+		case SEEK_END:
+			pos = r->size + *offset;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	if (pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->pos = pos;
+	*offset = pos;
+	return 0;
+}
+
+static int
+s3_reader_close(void *cookie)
+{
+	S3Reader   *r = (S3Reader *) cookie;
+
+	s3_reader_wait(r);
+	pthread_cond_destroy(&r->done);
+	pthread_mutex_destroy(&r->lock);
+	free(r->cur.data);
+	free(r->next.data);
+	free(r);
+
+	return 0;
+}
+
+#if defined(__GLIBC__)
+
+static int
+s3_reader_seek_glibc(void *cookie, off64_t *offset, int whence)
+{
+	int64	pos = *offset;
+	int		rc = s3_reader_seek(cookie, &pos, whence);
+
+	*offset = pos;
+	return rc;
+}
+
+static FILE *
+s3_cookie_fopen(void *cookie, bool write)
+{
+	cookie_io_functions_t	writer_funcs =
+		{ NULL, s3_writer_write, NULL, s3_writer_close };
+	cookie_io_functions_t	reader_funcs =
+		{ s3_reader_read, NULL, s3_reader_seek_glibc, s3_reader_close };
+
+	return write ? fopencookie(cookie, "w", writer_funcs) :
+				   fopencookie(cookie, "r", reader_funcs);
+}
+
+#elif defined(__APPLE__) || defined(__FreeBSD__) || \
+	  defined(__NetBSD__) || defined(__OpenBSD__)
+
+static int
+s3_writer_write_bsd(void *cookie, const char *buf, int len)
+{
+	return (int) s3_writer_write(cookie, buf, (size_t) len);
+}
+
+static int
+s3_reader_read_bsd(void *cookie, char *buf, int len)
+{
+	return (int) s3_reader_read(cookie, buf, (size_t) len);
+}
+
+static fpos_t
+s3_reader_seek_bsd(void *cookie, fpos_t offset, int whence)
+{
+	int64	pos = offset;
+
+	if (s3_reader_seek(cookie, &pos, whence) == -1)
+		return -1;
+	return (fpos_t) pos;
+}
+
+static FILE *
+s3_cookie_fopen(void *cookie, bool write)
+{
+	return write ?
+		funopen(cookie, NULL, s3_writer_write_bsd, NULL, s3_writer_close) :
+		funopen(cookie, s3_reader_read_bsd, NULL, s3_reader_seek_bsd,
+				s3_reader_close);
+}
+
+#else
+
+static FILE *
+s3_cookie_fopen(void *cookie, bool write)
+{
+	elog(ERROR_ARGS, _("object storage is not supported on this platform"));
+	return NULL;
+}
+
+#endif
+
+#endif   /* HAVE_LIBCURL */
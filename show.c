@@ -253,4 +253,5 @@ show_backup_detail(FILE *out, pgBackup *backup)
 {
 	pgBackupWriteConfigSection(out, backup);
 	pgBackupWriteResultSection(out, backup);
+	metrics_show(out, backup);
 }
@@ -132,7 +132,7 @@ pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench
 echo "incremental database backup"
 psql -p $TEST_PGPORT postgres -c "checkpoint"
 #pg_rman -p $TEST_PGPORT backup -b i --verbose -d postgres > $BASE_PATH/results/log_incr1 2>&1
-pg_rman -w -p $TEST_PGPORT backup -b i --verbose -d postgres > $BASE_PATH/results/log_incr1 2>&1
+pg_rman -w -p $TEST_PGPORT backup -b i --compress-method=zlib --compress-level=1 --verbose -d postgres > $BASE_PATH/results/log_incr1 2>&1
 
 # validate all backup
 pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate1 2>&1
@@ -141,7 +141,7 @@ pg_dumpall > $BASE_PATH/results/dump_before_rtx.sql
 target_xid=`psql -p $TEST_PGPORT pgbench -tAq -c "INSERT INTO pgbench_history VALUES (1) RETURNING(xmin);"`
 psql -p $TEST_PGPORT postgres -c "checkpoint"
 #pg_rman -p $TEST_PGPORT backup -b i --verbose -d postgres > $BASE_PATH/results/log_incr2 2>&1
-pg_rman -w -p $TEST_PGPORT backup -b i --verbose -d postgres > $BASE_PATH/results/log_incr2 2>&1
+pg_rman -w -p $TEST_PGPORT backup -b i -j 4 --verbose -d postgres > $BASE_PATH/results/log_incr2 2>&1
 
 pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench.log 2>&1
 echo "archived WAL and serverlog backup"
@@ -170,7 +170,7 @@ pg_rman restore -! --verbose --check > $BASE_PATH/results/log_restore_check_1 2>
 
 # restore with pg_rman
 CUR_TLI=`pg_controldata | grep TimeLineID | awk '{print $4}'`
-pg_rman restore -! --verbose > $BASE_PATH/results/log_restore1_1 2>&1
+pg_rman restore -! --single-pass --verbose > $BASE_PATH/results/log_restore1_1 2>&1
 CUR_TLI_R=`grep "current timeline ID = " $BASE_PATH/results/log_restore1_1 | awk '{print $5}'`
 TARGET_TLI=`grep "target timeline ID = " $BASE_PATH/results/log_restore1_1 | awk '{print $5}'`
 if [ "$CUR_TLI" != "$CUR_TLI_R" -o "$CUR_TLI" != "$CUR_TLI_R" ]; then
@@ -193,7 +193,7 @@ pg_ctl stop -m immediate > /dev/null 2>&1
 pg_rman restore -! --verbose --check > $BASE_PATH/results/log_restore_check_2 2>&1
 
 CUR_TLI=`pg_controldata | grep TimeLineID | awk '{print $4}'`
-pg_rman restore -! --verbose > $BASE_PATH/results/log_restore1_2 2>&1
+pg_rman restore -! -j 4 --verbose > $BASE_PATH/results/log_restore1_2 2>&1
 CUR_TLI_R=`grep "current timeline ID = " $BASE_PATH/results/log_restore1_2 | awk '{print $5}'`
 TARGET_TLI=`grep "target timeline ID = " $BASE_PATH/results/log_restore1_2 | awk '{print $5}'`
 if [ "$CUR_TLI" != "$CUR_TLI_R" -o "$CUR_TLI" != "$CUR_TLI_R" ]; then
@@ -276,6 +276,131 @@ echo "# of deleted backups"
 grep -c DELETED $BASE_PATH/results/log_show2
 pg_rman -p $TEST_PGPORT show timeline `date +%Y` -a --verbose -d postgres > $BASE_PATH/results/log_show_timeline_4 2>&1
 
+# incremental backup reading only pages modified in WAL. Relations not
+# modified must be kept, not truncated, by both ways of restore.
+echo "incremental database backup with WAL pagemap"
+psql -p $TEST_PGPORT pgbench -c "CREATE TABLE pagemap_unchanged AS SELECT generate_series(1, 10000) AS i"
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --verbose -d postgres > $BASE_PATH/results/log_full_pagemap 2>&1
+pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench.log 2>&1
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b i --wal-pagemap --verbose -d postgres > $BASE_PATH/results/log_incr_pagemap 2>&1
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_pagemap 2>&1
+pg_dumpall > $BASE_PATH/results/dump_before_pagemap.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -! --verbose > $BASE_PATH/results/log_restore_pagemap_1 2>&1
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_pagemap_1.sql
+diff $BASE_PATH/results/dump_before_pagemap.sql $BASE_PATH/results/dump_after_pagemap_1.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -! --single-pass --verbose > $BASE_PATH/results/log_restore_pagemap_2 2>&1
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_pagemap_2.sql
+diff $BASE_PATH/results/dump_before_pagemap.sql $BASE_PATH/results/dump_after_pagemap_2.sql
+
+# backup into a stream and restore from it. Restore from a broken stream
+# must fail with the CRC check of the files.
+echo "full database backup into stream"
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --stream=- --verbose -d postgres > $BASE_PATH/results/backup.stream 2> $BASE_PATH/results/log_full_stream
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_stream 2>&1
+pg_dumpall > $BASE_PATH/results/dump_before_stream.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+cp $BASE_PATH/results/backup.stream $BASE_PATH/results/backup_broken.stream
+STREAM_SIZE=`wc -c < $BASE_PATH/results/backup.stream`
+printf 'broken pg_rman!!' | dd of=$BASE_PATH/results/backup_broken.stream bs=1 seek=`expr $STREAM_SIZE / 2` conv=notrunc > /dev/null 2>&1
+echo "restore from broken stream"
+pg_rman restore -! --stream=- --verbose < $BASE_PATH/results/backup_broken.stream > $BASE_PATH/results/log_restore_stream_broken 2>&1
+echo $?
+pg_rman restore -! --stream=- --verbose < $BASE_PATH/results/backup.stream > $BASE_PATH/results/log_restore_stream 2>&1
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_stream.sql
+diff $BASE_PATH/results/dump_before_stream.sql $BASE_PATH/results/dump_after_stream.sql
+
+# deduplicated backups. Chunks only the deleted backup referred to must be
+# removed, and the other one must still be restored.
+echo "deduplicated full database backups"
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --dedup --verbose -d postgres > $BASE_PATH/results/log_full_dedup_1 2>&1
+pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench.log 2>&1
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --dedup --verbose -d postgres > $BASE_PATH/results/log_full_dedup_2 2>&1
+DEDUP_CHUNKS=`find $BACKUP_PATH/dedup -type f | wc -l`
+pg_rman -p $TEST_PGPORT delete `date "+%Y-%m-%d %T"` --verbose -d postgres > $BASE_PATH/results/log_delete_dedup 2>&1
+if [ `find $BACKUP_PATH/dedup -type f | wc -l` -ge $DEDUP_CHUNKS ]; then
+	echo "failed: unreferenced chunks are not removed"
+fi
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_dedup 2>&1
+pg_dumpall > $BASE_PATH/results/dump_before_dedup.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -! --verbose > $BASE_PATH/results/log_restore_dedup 2>&1
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_dedup.sql
+diff $BASE_PATH/results/dump_before_dedup.sql $BASE_PATH/results/dump_after_dedup.sql
+
+# merge of full and incremental backups. The merged backup must be restored
+# after the full backup it was based on is deleted.
+echo "merge incremental backup into full backup"
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --verbose -d postgres > $BASE_PATH/results/log_full_merge 2>&1
+pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench.log 2>&1
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b i --verbose -d postgres > $BASE_PATH/results/log_incr_merge 2>&1
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_merge_1 2>&1
+pg_rman merge -j 4 --verbose > $BASE_PATH/results/log_merge 2>&1
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_merge_2 2>&1
+pg_rman -p $TEST_PGPORT delete `date "+%Y-%m-%d %T"` --verbose -d postgres > $BASE_PATH/results/log_delete_merge 2>&1
+pg_dumpall > $BASE_PATH/results/dump_before_merge.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -! --verbose > $BASE_PATH/results/log_restore_merge 2>&1
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_merge.sql
+diff $BASE_PATH/results/dump_before_merge.sql $BASE_PATH/results/dump_after_merge.sql
+
+# restore with --delta onto the database cluster modified after backup. The
+# broken page and the blocks beyond the backup must be restored, also for the
+# relation created after the full backup, and files not in the backup must be
+# removed.
+echo "delta restore onto modified database cluster"
+psql -p $TEST_PGPORT postgres -c "CREATE TABLE delta_truncated AS SELECT generate_series(1, 10000) AS i"
+DELTA_REL=`psql -p $TEST_PGPORT postgres -tAq -c "SELECT pg_relation_filepath('delta_truncated')"`
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --verbose -d postgres > $BASE_PATH/results/log_full_delta 2>&1
+psql -p $TEST_PGPORT postgres -c "CREATE TABLE delta_created AS SELECT generate_series(1, 10000) AS i"
+DELTA_NEW_REL=`psql -p $TEST_PGPORT postgres -tAq -c "SELECT pg_relation_filepath('delta_created')"`
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b i --verbose -d postgres > $BASE_PATH/results/log_incr_delta 2>&1
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_delta 2>&1
+pg_dumpall > $BASE_PATH/results/dump_before_delta.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+dd if=/dev/urandom of=$PGDATA/$DELTA_REL bs=8192 count=1 conv=notrunc > /dev/null 2>&1
+dd if=/dev/urandom bs=8192 count=10 >> $PGDATA/$DELTA_REL 2> /dev/null
+dd if=/dev/urandom bs=8192 count=10 >> $PGDATA/$DELTA_NEW_REL 2> /dev/null
+touch $PGDATA/delta_extra $PGDATA/global/delta_extra
+pg_rman restore -! --delta --verbose > $BASE_PATH/results/log_restore_delta 2>&1
+echo "# of files not in backup"
+ls $PGDATA/delta_extra $PGDATA/global/delta_extra 2> /dev/null | wc -l
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_delta.sql
+diff $BASE_PATH/results/dump_before_delta.sql $BASE_PATH/results/dump_after_delta.sql
+
+# restore with archived WAL fetched by fetch-wal when recovery requests it
+echo "restore with WAL fetched on demand"
+psql -p $TEST_PGPORT postgres -c "checkpoint"
+pg_rman -w -p $TEST_PGPORT backup -b f --verbose -d postgres > $BASE_PATH/results/log_full_fetch 2>&1
+pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench.log 2>&1
+pg_rman -w -p $TEST_PGPORT backup -b a --verbose -d postgres > $BASE_PATH/results/log_arclog_fetch 2>&1
+pgbench -p $TEST_PGPORT -T $DURATION -c 10 pgbench >> $BASE_PATH/results/pgbench.log 2>&1
+pg_rman validate `date +%Y` --verbose > $BASE_PATH/results/log_validate_fetch 2>&1
+pg_dumpall > $BASE_PATH/results/dump_before_fetch.sql
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -! --wal-on-demand --verbose > $BASE_PATH/results/log_restore_fetch 2>&1
+echo "# of fetch-wal in recovery.conf"
+grep -c "fetch-wal" $PGDATA/recovery.conf
+pg_ctl start -w -t 3600 > /dev/null 2>&1
+pg_dumpall > $BASE_PATH/results/dump_after_fetch.sql
+diff $BASE_PATH/results/dump_before_fetch.sql $BASE_PATH/results/dump_after_fetch.sql
+
 # cleanup
 pg_ctl stop -m immediate > /dev/null 2>&1
 
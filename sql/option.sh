@@ -42,6 +42,9 @@ pg_rman backup --verbose -B $BACKUP_PATH -b a
 
 # bad arguments check
 pg_rman backup --verbose -B $BACKUP_PATH -b bad
+pg_rman backup --verbose -B $BACKUP_PATH -b f -j 0
+pg_rman backup --verbose -B $BACKUP_PATH -b f --compress-method=bad
+pg_rman backup --verbose -B $BACKUP_PATH -b f --compress-method=zlib --compress-level=10
 
 # delete or validate requires DATE
 pg_rman delete -B $BACKUP_PATH
@@ -0,0 +1,216 @@
+/*-------------------------------------------------------------------------
+ *
+ * storage.c: files of backups in a local directory or in object storage.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Backup directories are under STORAGE_PATH, or under BACKUP_PATH if not set.
+ * A path in the form of URL, like "s3://bucket/prefix/...", is handled by the
+ * backend of the scheme, and other paths are local files. Object storage has
+ * no directories nor permissions, so mkdir and chmod of the backend can be
+ * NULL to do nothing.
+ */
+typedef struct StorageBackend
+{
+	const char *scheme;
+	FILE	   *(*fopen)(const char *path, const char *mode);
+	int			(*stat)(const char *path, struct stat *st);
+	int			(*remove)(const char *path);
+	int			(*mkdir)(const char *path, mode_t mode);
+	int			(*chmod)(const char *path, mode_t mode);
+	parray	   *(*list_dir)(const char *path);
+	void		(*list_file)(parray *files, const char *root);
+} StorageBackend;
+
+static parray *local_list_dir(const char *path);
+static void local_list_file(parray *files, const char *root);
+
+static const StorageBackend local_backend =
+{
+	NULL, fopen, stat, remove, dir_create_dir, chmod,
+	local_list_dir, local_list_file
+};
+
+static const StorageBackend remote_backends[] =
+{
+#ifdef HAVE_LIBCURL
+	{ "s3://", s3_fopen, s3_stat, s3_remove, NULL, NULL,
+	  s3_list_dir, s3_list_file },
+#endif
+	{ NULL }
+};
+
+static const StorageBackend *storage_backend(const char *path);
+
+/* true if the path is a URL of object storage */
+bool
+storage_is_remote(const char *path)
+{
+	return strstr(path, "://") != NULL;
+}
+
+/*
+ * Open a file as fopen() does. Files in object storage can be opened only for
+ * read ("r"), write ("w") or append ("a").
+ */
+FILE *
+storage_fopen(const char *path, const char *mode)
+{
+	return storage_backend(path)->fopen(path, mode);
+}
+
+int
+storage_stat(const char *path, struct stat *st)
+{
+	return storage_backend(path)->stat(path, st);
+}
+
+/* stat a file opened by storage_fopen() */
+int
+storage_fstat(FILE *fp, const char *path, struct stat *st)
+{
+	if (storage_is_remote(path))
+		return storage_stat(path, st);
+	return fstat(fileno(fp), st);
+}
+
+int
+storage_remove(const char *path)
+{
+	return storage_backend(path)->remove(path);
+}
+
+/* create a directory with the parents */
+int
+storage_mkdir(const char *path, mode_t mode)
+{
+	const StorageBackend *backend = storage_backend(path);
+
+	return backend->mkdir ? backend->mkdir(path, mode) : 0;
+}
+
+int
+storage_chmod(const char *path, mode_t mode)
+{
+	const StorageBackend *backend = storage_backend(path);
+
+	return backend->chmod ? backend->chmod(path, mode) : 0;
+}
+
+/*
+ * List the entries in the directory, not recursively. Each entry is a pgFile
+ * with its full path and the file type in the mode. Returns NULL and sets
+ * errno on failure.
+ */
+parray *
+storage_list_dir(const char *path)
+{
+	return storage_backend(path)->list_dir(path);
+}
+
+/*
+ * Add all files under the root into the list, as dir_list_file() does with
+ * the root itself. Object storage has only regular files.
+ */
+void
+storage_list_file(parray *files, const char *root)
+{
+	storage_backend(root)->list_file(files, root);
+}
+
+/* create a pgFile of the path with the attributes */
+pgFile *
+storage_file_new(const char *path, mode_t mode, size_t size, time_t mtime)
+{
+	pgFile	   *file;
+
+	file = (pgFile *) pgut_malloc(offsetof(pgFile, path) + strlen(path) + 1);
+	file->mtime = mtime;
+	file->mode = mode;
+	file->size = size;
+	file->read_size = 0;
+	file->write_size = 0;
+	file->crc = 0;
+	file->is_datafile = false;
+	file->in_arena = false;
+	file->linked = NULL;
+	strcpy(file->path, path);
+
+	return file;
+}
+
+static const StorageBackend *
+storage_backend(const char *path)
+{
+	int		i;
+
+	if (!storage_is_remote(path))
+		return &local_backend;
+
+	for (i = 0; remote_backends[i].scheme; i++)
+	{
+		if (strncmp(path, remote_backends[i].scheme,
+					strlen(remote_backends[i].scheme)) == 0)
+			return &remote_backends[i];
+	}
+
+	elog(ERROR_ARGS, _("storage \"%s\" is not supported by this build"), path);
+	return NULL;
+}
+
+static parray *
+local_list_dir(const char *path)
+{
+	DIR			   *dir;
+	struct dirent  *ent;
+	parray		   *entries;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return NULL;
+
+	entries = parray_new();
+	for (errno = 0; (ent = readdir(dir)) != NULL; errno = 0)
+	{
+		char		child[MAXPGPATH];
+		struct stat	st;
+
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		join_path_components(child, path, ent->d_name);
+		if (stat(child, &st) == -1)
+			continue;	/* removed after listed */
+		parray_append(entries,
+			storage_file_new(child, st.st_mode, st.st_size, st.st_mtime));
+	}
+	if (errno != 0)
+	{
+		int		errno_tmp = errno;
+
+		closedir(dir);
+		parray_walk(entries, pgFileFree);
+		parray_free(entries);
+		errno = errno_tmp;
+		return NULL;
+	}
+	closedir(dir);
+
+	return entries;
+}
+
+static void
+local_list_file(parray *files, const char *root)
+{
+	dir_list_file(files, root, NULL, true, true);
+}
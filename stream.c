@@ -0,0 +1,685 @@
+/*-------------------------------------------------------------------------
+ *
+ * stream.c: backup into a stream and extract it.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "pgut/pgut-pthread.h"
+
+/*
+ * A backup stream is a sequence of records of the operations on the files in
+ * the backup directory, so that files written by parallel jobs can be put in
+ * the stream as they are written. Each file is written with BEGIN, DATA and
+ * END records sharing the id of the file. The files in the top of the backup
+ * directory, backup.ini and the file lists, are put at the end and the stream
+ * ends with FINISH. Integers are in the native byte order.
+ */
+#define STREAM_MAGIC		0x5352474D	/* "MGRS" */
+#define STREAM_VERSION		1
+#define STREAM_CHUNK_SIZE	(256 * 1024)
+
+typedef enum StreamRecordType
+{
+	STREAM_HEADER = 1,	/* StreamHeader */
+	STREAM_BEGIN,		/* StreamFile and path, open a file */
+	STREAM_DATA,		/* data of the file */
+	STREAM_END,			/* StreamEnd, close the file */
+	STREAM_MKDIR,		/* StreamFile and path */
+	STREAM_CHMOD,		/* StreamFile and path */
+	STREAM_REMOVE,		/* StreamFile and path */
+	STREAM_FINISH		/* end of the stream */
+} StreamRecordType;
+
+typedef struct StreamRecord
+{
+	uint32		magic;
+	uint32		type;
+	uint32		id;			/* id of the file, or 0 */
+	uint32		len;		/* length of the payload */
+} StreamRecord;
+
+typedef struct StreamHeader
+{
+	uint32		version;
+	uint32		pad;
+	int64		start_time;	/* ID of the backup */
+} StreamHeader;
+
+typedef struct StreamFile
+{
+	uint32		mode;
+	uint32		pad;
+	int64		mtime;		/* 0 means the time of extraction */
+} StreamFile;
+
+typedef struct StreamEnd
+{
+	uint64		size;
+	pg_crc32	crc;		/* CRC32C of the data */
+	uint32		pad;
+} StreamEnd;
+
+/* the stream being written */
+typedef struct StreamWriter
+{
+	FILE		   *out;
+	bool			is_pipe;
+	char			root[MAXPGPATH];	/* backup directory */
+	size_t			rootlen;
+	uint32			next_id;
+	pthread_mutex_t	lock;
+} StreamWriter;
+
+/* a file being written into the stream */
+typedef struct StreamEntry
+{
+	uint32		id;
+	pg_crc32	crc;
+	uint64		size;
+	size_t		len;	/* bytes in buf */
+	char		buf[STREAM_CHUNK_SIZE];
+} StreamEntry;
+
+/* a file being extracted from the stream */
+typedef struct ExtractEntry
+{
+	uint32		id;
+	int			fd;
+	pg_crc32	crc;
+	uint64		size;
+	time_t		mtime;
+	char		path[MAXPGPATH];
+} ExtractEntry;
+
+static StreamWriter *writer = NULL;
+
+static const char *stream_name(const char *path);
+static void stream_put(uint32 type, uint32 id, const void *data1, size_t len1,
+					   const void *data2, size_t len2);
+static void stream_put_file_op(uint32 type, uint32 id, const char *name,
+							   mode_t mode, time_t mtime);
+static void stream_put_local_file(const char *path, const char *name);
+static void entry_flush(StreamEntry *entry);
+static FILE *entry_fopen(StreamEntry *entry);
+static bool read_record(FILE *in, StreamRecord *rec, char *buf, size_t size);
+static bool stream_path_is_valid(const char *name);
+
+/*
+ * Open the stream to write a backup. If dest is "-", the stream is written to
+ * stdout and messages for stdout go to stderr. Otherwise dest is a shell
+ * command which reads the stream from stdin.
+ */
+void
+stream_open_writer(const char *dest)
+{
+	writer = pgut_new(StreamWriter);
+	memset(writer, 0, sizeof(StreamWriter));
+	writer->next_id = 1;
+	pthread_mutex_init(&writer->lock, NULL);
+
+	if (strcmp(dest, "-") == 0)
+	{
+		int		fd;
+
+		fflush(stdout);
+		if ((fd = dup(STDOUT_FILENO)) == -1 ||
+			dup2(STDERR_FILENO, STDOUT_FILENO) == -1 ||
+			(writer->out = fdopen(fd, "w")) == NULL)
+			elog(ERROR_SYSTEM, _("can't open backup stream: %s"),
+				strerror(errno));
+	}
+	else
+	{
+		fflush(NULL);
+		if ((writer->out = popen(dest, "w")) == NULL)
+			elog(ERROR_SYSTEM, _("can't run stream command \"%s\": %s"),
+				dest, strerror(errno));
+		writer->is_pipe = true;
+	}
+
+	/* report the error of write instead of being killed */
+	pqsignal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * Start the stream of the backup. Files written in the backup directory go
+ * into the stream after that.
+ */
+void
+stream_begin_backup(const pgBackup *backup)
+{
+	StreamHeader	header;
+
+	pgBackupGetPath(backup, writer->root, lengthof(writer->root), NULL);
+	writer->rootlen = strlen(writer->root);
+
+	memset(&header, 0, sizeof(header));
+	header.version = STREAM_VERSION;
+	header.start_time = backup->start_time;
+	stream_put(STREAM_HEADER, 0, &header, sizeof(header), NULL, 0);
+}
+
+/*
+ * Put the files in the top of the backup directory into the stream and finish
+ * it. Returns false if the stream was not accepted.
+ */
+bool
+stream_close_writer(void)
+{
+	DIR			   *dir;
+	struct dirent  *ent;
+	int				rc;
+
+	dir = opendir(writer->root);
+	if (dir == NULL)
+		elog(ERROR_SYSTEM, _("can't open directory \"%s\": %s"),
+			writer->root, strerror(errno));
+	while ((ent = readdir(dir)) != NULL)
+	{
+		char		path[MAXPGPATH];
+		struct stat	st;
+
+		join_path_components(path, writer->root, ent->d_name);
+		if (ent->d_name[0] == '.' || stat(path, &st) == -1 ||
+			!S_ISREG(st.st_mode))
+			continue;
+		stream_put_local_file(path, ent->d_name);
+	}
+	closedir(dir);
+
+	stream_put(STREAM_FINISH, 0, NULL, 0, NULL, 0);
+
+	if (writer->is_pipe)
+	{
+		rc = pclose(writer->out);
+		if (rc != 0)
+			elog(WARNING, _("stream command failed with exit code %d"),
+				WIFEXITED(rc) ? WEXITSTATUS(rc) : rc);
+	}
+	else
+	{
+		rc = fclose(writer->out);
+		if (rc != 0)
+			elog(WARNING, _("can't close backup stream: %s"), strerror(errno));
+	}
+
+	pthread_mutex_destroy(&writer->lock);
+	free(writer);
+	writer = NULL;
+
+	return rc == 0;
+}
+
+/*
+ * Open a backup file for write. The file goes into the stream if it is in
+ * the backup directory being streamed.
+ */
+FILE *
+stream_fopen(const char *path, mode_t mode)
+{
+	const char *name = stream_name(path);
+	StreamEntry *entry;
+
+	if (name == NULL)
+		return storage_fopen(path, "w");
+
+	entry = pgut_new(StreamEntry);
+	entry->size = 0;
+	entry->len = 0;
+	INIT_CRC32(entry->crc);
+
+	pgut_mutex_lock(&writer->lock);
+	entry->id = writer->next_id++;
+	pthread_mutex_unlock(&writer->lock);
+
+	stream_put_file_op(STREAM_BEGIN, entry->id, name, mode, 0);
+
+	return entry_fopen(entry);
+}
+
+int
+stream_chmod(const char *path, mode_t mode)
+{
+	const char *name = stream_name(path);
+
+	if (name == NULL)
+		return storage_chmod(path, mode);
+
+	stream_put_file_op(STREAM_CHMOD, 0, name, mode, 0);
+	return 0;
+}
+
+int
+stream_remove(const char *path)
+{
+	const char *name = stream_name(path);
+
+	if (name == NULL)
+		return storage_remove(path);
+
+	stream_put_file_op(STREAM_REMOVE, 0, name, 0, 0);
+	return 0;
+}
+
+int
+stream_mkdir(const char *path, mode_t mode)
+{
+	const char *name = stream_name(path);
+
+	if (name == NULL)
+		return storage_mkdir(path, mode);
+
+	stream_put_file_op(STREAM_MKDIR, 0, name, mode, 0);
+	return 0;
+}
+
+/*
+ * Extract the backup in the stream into the backup catalog. If src is "-",
+ * the stream is read from stdin. Otherwise src is a shell command which
+ * writes the stream to stdout. Returns ID of the backup extracted.
+ */
+time_t
+stream_extract(const char *src)
+{
+	FILE		   *in;
+	bool			is_pipe = false;
+	StreamRecord	rec;
+	char		   *buf;
+	parray		   *entries = parray_new();
+	pgBackup		tmp;
+	char			root[MAXPGPATH] = "";
+	bool			finished = false;
+	int				i;
+
+	if (strcmp(src, "-") == 0)
+		in = stdin;
+	else
+	{
+		fflush(NULL);
+		if ((in = popen(src, "r")) == NULL)
+			elog(ERROR_SYSTEM, _("can't run stream command \"%s\": %s"),
+				src, strerror(errno));
+		is_pipe = true;
+	}
+
+	buf = pgut_malloc(STREAM_CHUNK_SIZE + MAXPGPATH);
+	memset(&tmp, 0, sizeof(tmp));
+
+	while (!finished)
+	{
+		StreamFile		fileop;
+		StreamEnd		end;
+		ExtractEntry   *entry = NULL;
+		char			path[MAXPGPATH];
+		const char	   *name = buf + sizeof(StreamFile);
+
+		if (!read_record(in, &rec, buf, STREAM_CHUNK_SIZE + MAXPGPATH))
+			elog(ERROR_CORRUPTED, _("backup stream is truncated or broken"));
+
+		/* the header must come first */
+		if ((rec.type == STREAM_HEADER) != (root[0] == '\0'))
+			elog(ERROR_CORRUPTED, _("invalid header of backup stream"));
+
+		/* find the file the record belongs to */
+		if (rec.type == STREAM_DATA || rec.type == STREAM_END)
+		{
+			for (i = 0; i < parray_num(entries); i++)
+			{
+				entry = (ExtractEntry *) parray_get(entries, i);
+				if (entry->id == rec.id)
+					break;
+			}
+			if (i == parray_num(entries))
+				elog(ERROR_CORRUPTED, _("unknown file %u in backup stream"),
+					rec.id);
+		}
+
+		/* operations on a path */
+		if (rec.type == STREAM_BEGIN || rec.type == STREAM_MKDIR ||
+			rec.type == STREAM_CHMOD || rec.type == STREAM_REMOVE)
+		{
+			if (rec.len < sizeof(StreamFile) + 1 ||
+				rec.len - sizeof(StreamFile) >= MAXPGPATH)
+				elog(ERROR_CORRUPTED, _("invalid record in backup stream"));
+			memcpy(&fileop, buf, sizeof(fileop));
+			buf[rec.len] = '\0';
+			if (!stream_path_is_valid(name))
+				elog(ERROR_CORRUPTED, _("invalid path \"%s\" in backup stream"),
+					name);
+			join_path_components(path, root, name);
+		}
+
+		switch (rec.type)
+		{
+			case STREAM_HEADER:
+			{
+				StreamHeader	header;
+
+				if (rec.len != sizeof(header))
+					elog(ERROR_CORRUPTED, _("invalid header of backup stream"));
+				memcpy(&header, buf, sizeof(header));
+				if (header.version != STREAM_VERSION)
+					elog(ERROR_CORRUPTED,
+						_("unsupported version %u of backup stream"),
+						header.version);
+				tmp.start_time = (time_t) header.start_time;
+				pgBackupGetPath(&tmp, root, lengthof(root), NULL);
+				if (verbose)
+				{
+					char	timestamp[20];
+
+					time2iso(timestamp, lengthof(timestamp), tmp.start_time);
+					printf(_("extracting backup %s from stream\n"), timestamp);
+				}
+				if (!check)
+					pgBackupCreateDir(&tmp);
+				break;
+			}
+			case STREAM_BEGIN:
+				entry = pgut_new(ExtractEntry);
+				entry->id = rec.id;
+				entry->size = 0;
+				entry->mtime = (time_t) fileop.mtime;
+				INIT_CRC32(entry->crc);
+				strlcpy(entry->path, path, lengthof(entry->path));
+				entry->fd = -1;
+				if (!check &&
+					(entry->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+									  fileop.mode & (S_IRWXU | S_IRWXG | S_IRWXO))) == -1)
+					elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), path,
+						strerror(errno));
+				parray_append(entries, entry);
+				break;
+			case STREAM_DATA:
+				if (entry->fd != -1 &&
+					write(entry->fd, buf, rec.len) != rec.len)
+					elog(ERROR_SYSTEM, _("can't write \"%s\": %s"),
+						entry->path, strerror(errno ? errno : ENOSPC));
+				entry->crc = checksum_update(CHECKSUM_CRC32C, entry->crc,
+											 buf, rec.len);
+				entry->size += rec.len;
+				break;
+			case STREAM_END:
+				if (rec.len != sizeof(end))
+					elog(ERROR_CORRUPTED, _("invalid record in backup stream"));
+				memcpy(&end, buf, sizeof(end));
+				FIN_CRC32(entry->crc);
+				if (end.size != entry->size || end.crc != entry->crc)
+					elog(ERROR_CORRUPTED,
+						_("file \"%s\" in backup stream is corrupted"),
+						entry->path);
+				if (entry->fd != -1)
+				{
+					if (close(entry->fd) != 0)
+						elog(ERROR_SYSTEM, _("can't write \"%s\": %s"),
+							entry->path, strerror(errno));
+					if (entry->mtime != 0)
+					{
+						struct utimbuf	times;
+
+						times.actime = times.modtime = entry->mtime;
+						utime(entry->path, &times);
+					}
+				}
+				parray_remove(entries, i);
+				free(entry);
+				break;
+			case STREAM_MKDIR:
+				if (!check)
+					dir_create_dir(path, fileop.mode);
+				break;
+			case STREAM_CHMOD:
+				if (!check && chmod(path, fileop.mode) == -1)
+					elog(ERROR_SYSTEM, _("can't change mode of \"%s\": %s"),
+						path, strerror(errno));
+				break;
+			case STREAM_REMOVE:
+				if (!check && remove(path) == -1 && errno != ENOENT)
+					elog(ERROR_SYSTEM, _("can't remove \"%s\": %s"), path,
+						strerror(errno));
+				break;
+			case STREAM_FINISH:
+				if (parray_num(entries) > 0)
+					elog(ERROR_CORRUPTED, _("backup stream is truncated or broken"));
+				finished = true;
+				break;
+			default:
+				elog(ERROR_CORRUPTED, _("invalid record in backup stream"));
+		}
+	}
+
+	if (is_pipe)
+	{
+		int		rc = pclose(in);
+
+		if (rc != 0)
+			elog(ERROR_SYSTEM, _("stream command failed with exit code %d"),
+				WIFEXITED(rc) ? WEXITSTATUS(rc) : rc);
+	}
+
+	free(buf);
+	parray_free(entries);
+
+	return tmp.start_time;
+}
+
+/*
+ * Returns the path relative to the backup directory if the file goes into the
+ * stream, or NULL.
+ */
+static const char *
+stream_name(const char *path)
+{
+	if (writer == NULL || writer->rootlen == 0 ||
+		strncmp(path, writer->root, writer->rootlen) != 0 ||
+		path[writer->rootlen] != '/')
+		return NULL;
+
+	return path + writer->rootlen + 1;
+}
+
+/* write a record with two parts of payload */
+static void
+stream_put(uint32 type, uint32 id, const void *data1, size_t len1,
+		   const void *data2, size_t len2)
+{
+	StreamRecord	rec;
+
+	rec.magic = STREAM_MAGIC;
+	rec.type = type;
+	rec.id = id;
+	rec.len = len1 + len2;
+
+	pgut_mutex_lock(&writer->lock);
+	if (fwrite(&rec, 1, sizeof(rec), writer->out) != sizeof(rec) ||
+		fwrite(data1, 1, len1, writer->out) != len1 ||
+		fwrite(data2, 1, len2, writer->out) != len2)
+	{
+		int errno_tmp = errno;
+
+		pthread_mutex_unlock(&writer->lock);
+		elog(ERROR_SYSTEM, _("can't write backup stream: %s"),
+			strerror(errno_tmp));
+	}
+	pthread_mutex_unlock(&writer->lock);
+}
+
+static void
+stream_put_file_op(uint32 type, uint32 id, const char *name, mode_t mode,
+				   time_t mtime)
+{
+	StreamFile	fileop;
+
+	memset(&fileop, 0, sizeof(fileop));
+	fileop.mode = mode;
+	fileop.mtime = mtime;
+	stream_put(type, id, &fileop, sizeof(fileop), name, strlen(name));
+}
+
+/* put a local file with its mode and mtime */
+static void
+stream_put_local_file(const char *path, const char *name)
+{
+	FILE	   *in;
+	struct stat	st;
+	StreamEntry *entry;
+	StreamEnd	end;
+	size_t		len;
+
+	in = fopen(path, "r");
+	if (in == NULL || fstat(fileno(in), &st) == -1)
+		elog(ERROR_SYSTEM, _("can't open \"%s\": %s"), path, strerror(errno));
+
+	entry = pgut_new(StreamEntry);
+	entry->id = writer->next_id++;
+	entry->size = 0;
+	entry->len = 0;
+	INIT_CRC32(entry->crc);
+	stream_put_file_op(STREAM_BEGIN, entry->id, name, st.st_mode, st.st_mtime);
+
+	while ((len = fread(entry->buf, 1, sizeof(entry->buf), in)) > 0)
+	{
+		entry->len = len;
+		entry_flush(entry);
+	}
+	if (ferror(in))
+		elog(ERROR_SYSTEM, _("can't read \"%s\": %s"), path, strerror(errno));
+	fclose(in);
+
+	FIN_CRC32(entry->crc);
+	memset(&end, 0, sizeof(end));
+	end.size = entry->size;
+	end.crc = entry->crc;
+	stream_put(STREAM_END, entry->id, &end, sizeof(end), NULL, 0);
+	free(entry);
+}
+
+/* put the data buffered in the entry */
+static void
+entry_flush(StreamEntry *entry)
+{
+	if (entry->len == 0)
+		return;
+
+	stream_put(STREAM_DATA, entry->id, entry->buf, entry->len, NULL, 0);
+	entry->crc = checksum_update(CHECKSUM_CRC32C, entry->crc,
+								 entry->buf, entry->len);
+	entry->size += entry->len;
+	entry->len = 0;
+}
+
+static ssize_t
+entry_write(void *cookie, const char *buf, size_t len)
+{
+	StreamEntry *entry = (StreamEntry *) cookie;
+	size_t		done = 0;
+
+	while (done < len)
+	{
+		size_t	n = Min(len - done, sizeof(entry->buf) - entry->len);
+
+		memcpy(entry->buf + entry->len, buf + done, n);
+		entry->len += n;
+		done += n;
+		if (entry->len == sizeof(entry->buf))
+			entry_flush(entry);
+	}
+
+	return len;
+}
+
+static int
+entry_close(void *cookie)
+{
+	StreamEntry *entry = (StreamEntry *) cookie;
+	StreamEnd	end;
+
+	entry_flush(entry);
+	FIN_CRC32(entry->crc);
+	memset(&end, 0, sizeof(end));
+	end.size = entry->size;
+	end.crc = entry->crc;
+	stream_put(STREAM_END, entry->id, &end, sizeof(end), NULL, 0);
+	free(entry);
+
+	return 0;
+}
+
+#if defined(__GLIBC__)
+
+static FILE *
+entry_fopen(StreamEntry *entry)
+{
+	cookie_io_functions_t	funcs = { NULL, entry_write, NULL, entry_close };
+
+	return fopencookie(entry, "w", funcs);
+}
+
+#elif defined(__APPLE__) || defined(__FreeBSD__) || \
+	  defined(__NetBSD__) || defined(__OpenBSD__)
+
+static int
+entry_write_bsd(void *cookie, const char *buf, int len)
+{
+	return (int) entry_write(cookie, buf, (size_t) len);
+}
+
+static FILE *
+entry_fopen(StreamEntry *entry)
+{
+	return funopen(entry, NULL, entry_write_bsd, NULL, entry_close);
+}
+
+#else
+
+static FILE *
+entry_fopen(StreamEntry *entry)
+{
+	elog(ERROR_ARGS, _("--stream is not supported on this platform"));
+	return NULL;
+}
+
+#endif
+
+/* read a record into buf */
+static bool
+read_record(FILE *in, StreamRecord *rec, char *buf, size_t size)
+{
+	if (fread(rec, 1, sizeof(*rec), in) != sizeof(*rec) ||
+		rec->magic != STREAM_MAGIC || rec->len >= size)
+		return false;
+
+	return fread(buf, 1, rec->len, in) == rec->len;
+}
+
+/* the path must be relative and must not go up */
+static bool
+stream_path_is_valid(const char *name)
+{
+	const char *p;
+
+	if (name[0] == '\0' || name[0] == '/')
+		return false;
+
+	for (p = name; p; p = strchr(p, '/'))
+	{
+		if (*p == '/')
+			p++;
+		if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,156 @@
+/*-------------------------------------------------------------------------
+ *
+ * throttle.c: limit the rate of file I/O.
+ *
+ * Copyright (c) 2009-2011, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libpq/pqsignal.h"
+#include "pgut/pgut-pthread.h"
+
+/*
+ * Bytes and calls of the reads are limited by token buckets shared by all
+ * threads. Each bucket is a clock of the time until which the I/O done so
+ * far is allowed; an I/O advances the clock by its cost and waits until the
+ * clock if it is ahead of the current time. The clock never lags behind the
+ * current time by more than THROTTLE_BURST seconds, so I/O after idle time
+ * doesn't run unlimited.
+ */
+#define THROTTLE_BURST		0.1
+
+static pthread_mutex_t	throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static double			rate_clock = 0;
+static double			iops_clock = 0;
+
+/* set by SIGHUP to re-read the limits from THROTTLE_INI_FILE */
+static volatile sig_atomic_t	throttle_reload = false;
+
+static void throttle_read_limits(void);
+static double throttle_take(double *clock, double now, double cost);
+static void handle_sighup(SIGNAL_ARGS);
+
+/*
+ * Start to accept SIGHUP, which re-reads MAX_RATE and MAX_IOPS from
+ * THROTTLE_INI_FILE in BACKUP_PATH, to change the limits during a run.
+ */
+void
+throttle_init(void)
+{
+	pqsignal(SIGHUP, handle_sighup);
+
+	if (max_rate > 0 || max_iops > 0)
+		elog(LOG, "I/O is limited to %d MB/s, %d IOPS (0 is unlimited)",
+			max_rate, max_iops);
+}
+
+/*
+ * Account an I/O of len bytes, and sleep if it exceeds the limits.
+ */
+void
+throttle_io(size_t len)
+{
+	struct timeval	tv;
+	double			now;
+	double			wait = 0;
+
+	if (throttle_reload)
+		throttle_read_limits();
+
+	if (max_rate <= 0 && max_iops <= 0)
+		return;
+
+	pthread_mutex_lock(&throttle_lock);
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec + tv.tv_usec / 1000000.0;
+	if (max_rate > 0)
+		wait = throttle_take(&rate_clock, now,
+							 (double) len / ((double) max_rate * 1024 * 1024));
+	if (max_iops > 0)
+	{
+		double	wait_iops = throttle_take(&iops_clock, now, 1.0 / max_iops);
+
+		wait = Max(wait, wait_iops);
+	}
+	pthread_mutex_unlock(&throttle_lock);
+
+	if (wait > 0)
+		usleep((useconds_t) (wait * 1000000));
+}
+
+static void
+throttle_read_limits(void)
+{
+	char	path[MAXPGPATH];
+	char   *rate = NULL;
+	char   *iops = NULL;
+	int		value;
+	pgut_option throttle_options[] =
+	{
+		{ 's', 0, "max-rate", &rate, SOURCE_FILE },
+		{ 's', 0, "max-iops", &iops, SOURCE_FILE },
+		{ 0 }
+	};
+
+	pthread_mutex_lock(&throttle_lock);
+	if (!throttle_reload)
+	{
+		/* another thread has read them */
+		pthread_mutex_unlock(&throttle_lock);
+		return;
+	}
+	throttle_reload = false;
+
+	join_path_components(path, backup_path, THROTTLE_INI_FILE);
+	pgut_readopt(path, throttle_options, WARNING);
+
+	/* keep the current limit if it is not valid */
+	if (rate != NULL)
+	{
+		if (parse_int32(rate, &value) && value >= 0)
+			max_rate = value;
+		else
+			elog(WARNING, _("MAX_RATE in \"%s\" should be 0 or more: '%s'"),
+				path, rate);
+	}
+	if (iops != NULL)
+	{
+		if (parse_int32(iops, &value) && value >= 0)
+			max_iops = value;
+		else
+			elog(WARNING, _("MAX_IOPS in \"%s\" should be 0 or more: '%s'"),
+				path, iops);
+	}
+	rate_clock = iops_clock = 0;
+	pthread_mutex_unlock(&throttle_lock);
+
+	elog(INFO, _("I/O is limited to %d MB/s, %d IOPS (0 is unlimited)"),
+		max_rate, max_iops);
+
+	free(rate);
+	free(iops);
+}
+
+/* advance the clock by cost seconds, and return seconds to wait */
+static double
+throttle_take(double *clock, double now, double cost)
+{
+	if (*clock < now - THROTTLE_BURST)
+		*clock = now - THROTTLE_BURST;
+	*clock += cost;
+
+	return *clock - now;
+}
+
+static void
+handle_sighup(SIGNAL_ARGS)
+{
+	throttle_reload = true;
+}
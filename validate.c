@@ -11,19 +11,71 @@
 
 #include <sys/stat.h>
 
-static bool pgBackupValidateFiles(parray *files, const char *root, bool size_only);
+#include "pgut/pgut-pthread.h"
+
+/*
+ * A backup being validated. Files of the backup are validated by jobs, in
+ * parallel with files of other backups when validating with multiple jobs.
+ */
+typedef struct ValidateBackup
+{
+	pgBackup	   *backup;
+	bool			size_only;
+	bool			all_errors;	/* report all corrupted files? */
+	char			timestamp[100];
+	char			path[MAXPGPATH];	/* backup directory */
+	parray		   *lists;		/* file lists to be freed at the end */
+	parray		   *roots;		/* directories of the file lists */
+	pthread_mutex_t	lock;		/* protects fields below */
+	bool			corrupted;
+	int64			bytes;		/* size of files validated */
+	int64			files;		/* number of files validated */
+	parray		   *validated;	/* files validated by interrupted validate */
+	FILE		   *checkpoint;	/* records files validated, or NULL */
+} ValidateBackup;
+
+/* a file to be validated, possibly by a worker thread */
+typedef struct ValidateJob
+{
+	void		  (*routine)(struct ValidateJob *);
+	ValidateBackup *vb;
+	pgFile		   *file;
+	const char	   *root;		/* directory of the file list */
+	int				index;		/* for progress message */
+	size_t			total;
+} ValidateJob;
+
+static ValidateBackup *validate_begin(pgBackup *backup, bool size_only,
+									  bool for_get_timeline,
+									  bool with_database, bool all_errors,
+									  JobQueue *queue);
+static void validate_end(ValidateBackup *vb, int64 *bytes, int64 *files);
+static void validate_file_list(ValidateBackup *vb, const char *subdir,
+							   const char *file_list, JobQueue *queue);
+static void validate_file(ValidateJob *job);
+static void read_checkpoint(ValidateBackup *vb);
+static int compare_path(const void *p1, const void *p2);
 
 /*
  * Validate files in the backup and update its status to OK.
  * If any of files are corrupted, update its stutus to CORRUPT.
+ *
+ * If all_errors is true, all corrupted files are reported instead of
+ * stopping at the first one. Files validated are recorded in a checkpoint
+ * file of the backup, so validate interrupted resumes from there.
  */
 int
-do_validate(pgBackupRange *range)
+do_validate(pgBackupRange *range, bool all_errors)
 {
 	int		i;
 	parray *backup_list;
+	parray *validating;
+	JobQueue *queue = NULL;
 	int ret;
 	bool another_pg_rman = false;
+	MetricsTimer timer;
+	int64 bytes = 0;
+	int64 files = 0;
 
 	ret = catalog_lock();
 	if (ret == 1)
@@ -35,6 +87,16 @@ do_validate(pgBackupRange *range)
 		elog(ERROR_SYSTEM, _("can't process any more."));
 	}
 	parray_qsort(backup_list, pgBackupCompareId);
+
+	/*
+	 * Files of all backups are validated with the same workers, so their
+	 * metrics are of the whole validate and are written into each of them.
+	 */
+	metrics_start(&timer, PHASE_VALIDATE);
+	if (num_threads > 1)
+		queue = JobQueue_new(num_threads);
+
+	validating = parray_new();
 	for (i = 0; i < parray_num(backup_list); i++)
 	{
 		pgBackup *backup = (pgBackup *)parray_get(backup_list, i);
@@ -50,9 +112,45 @@ do_validate(pgBackupRange *range)
 		if (backup->status != BACKUP_STATUS_DONE)
 			continue;
 
+		/*
+		 * Files of a streamed backup are not in the catalog, so it can't be
+		 * validated here and is left DONE. It is validated when extracted,
+		 * and is used as the base of incremental backups and counted for
+		 * retention as DONE.
+		 */
+		if (backup->stream)
+		{
+			char	timestamp[20];
+
+			time2iso(timestamp, lengthof(timestamp), backup->start_time);
+			elog(INFO, _("validate: %s files are in the stream, skipped"),
+				timestamp);
+			continue;
+		}
+
 		/* validate with CRC value and update status to OK */
-		pgBackupValidate(backup, false, false, (HAVE_DATABASE(backup)));
+		parray_append(validating,
+			validate_begin(backup, false, false, (HAVE_DATABASE(backup)),
+						   all_errors, queue));
+	}
+
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
+	}
+	for (i = 0; i < parray_num(validating); i++)
+	{
+		ValidateBackup *vb = (ValidateBackup *) parray_get(validating, i);
+
+		/* the backup is kept in the list to write the metrics */
+		parray_set(validating, i, vb->backup);
+		validate_end(vb, &bytes, &files);
 	}
+	metrics_stop(&timer, bytes, files);
+	for (i = 0; i < parray_num(validating) && !check; i++)
+		metrics_write((pgBackup *) parray_get(validating, i), "validate");
+	parray_free(validating);
 
 	/* cleanup */
 	parray_walk(backup_list, pgBackupFree);
@@ -69,72 +167,142 @@ do_validate(pgBackupRange *range)
 void
 pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool with_database)
 {
-	char	timestamp[100];
-	char	base_path[MAXPGPATH];
-	char	path[MAXPGPATH];
-	parray *files;
-	bool	corrupted = false;
+	JobQueue	   *queue = NULL;
+	ValidateBackup *vb;
+	MetricsTimer	timer;
+	int64			bytes = 0;
+	int64			files = 0;
+
+	metrics_start(&timer, PHASE_VALIDATE);
+	if (num_threads > 1)
+		queue = JobQueue_new(num_threads);
+
+	vb = validate_begin(backup, size_only, for_get_timeline, with_database,
+						false, queue);
+
+	if (queue)
+	{
+		JobQueue_wait(queue);
+		JobQueue_free(queue);
+	}
+	validate_end(vb, &bytes, &files);
+	metrics_stop(&timer, bytes, files);
+}
+
+/*
+ * Start validating files in the backup. Jobs are pushed into queue, or run
+ * in the current thread if queue is NULL.
+ */
+static ValidateBackup *
+validate_begin(pgBackup *backup, bool size_only, bool for_get_timeline,
+			   bool with_database, bool all_errors, JobQueue *queue)
+{
+	ValidateBackup *vb;
+
+	vb = pgut_new(ValidateBackup);
+	memset(vb, 0, sizeof(ValidateBackup));
+	vb->backup = backup;
+	vb->size_only = size_only;
+	vb->all_errors = all_errors;
+	vb->lists = parray_new();
+	vb->roots = parray_new();
+	pthread_mutex_init(&vb->lock, NULL);
+	pgBackupGetPath(backup, vb->path, lengthof(vb->path), NULL);
 
-	time2iso(timestamp, lengthof(timestamp), backup->start_time);
+	time2iso(vb->timestamp, lengthof(vb->timestamp), backup->start_time);
 	if(!for_get_timeline){
 		if (with_database)
-			elog(INFO, "validate: %s backup and archive log files by %s", timestamp, (size_only ? "SIZE" : "CRC"));
+			elog(INFO, "validate: %s backup and archive log files by %s", vb->timestamp, (size_only ? "SIZE" : "CRC"));
 		else{
 			if (backup->backup_mode == BACKUP_MODE_ARCHIVE)
-				elog(INFO, "validate: %s archive log files by %s", timestamp, (size_only ? "SIZE" : "CRC"));
+				elog(INFO, "validate: %s archive log files by %s", vb->timestamp, (size_only ? "SIZE" : "CRC"));
 			else if (backup->with_serverlog)
-				elog(INFO, "validate: %s server log files by %s", timestamp, (size_only ? "SIZE" : "CRC"));
+				elog(INFO, "validate: %s server log files by %s", vb->timestamp, (size_only ? "SIZE" : "CRC"));
 		}
 	}
 
-	if(!check){
-		if (HAVE_DATABASE(backup))
-		{
-			elog(LOG, "database files...");
-			pgBackupGetPath(backup, base_path, lengthof(base_path), DATABASE_DIR);
-			pgBackupGetPath(backup, path, lengthof(path),
-				DATABASE_FILE_LIST);
-			files = dir_read_file_list(base_path, path);
-			if (!pgBackupValidateFiles(files, base_path, size_only))
-				corrupted = true;
-			parray_walk(files, pgFileFree);
-			parray_free(files);
-		}
-		if (HAVE_ARCLOG(backup))
-		{
-			elog(LOG, "archive WAL files...");
-			pgBackupGetPath(backup, base_path, lengthof(base_path), ARCLOG_DIR);
-			pgBackupGetPath(backup, path, lengthof(path), ARCLOG_FILE_LIST);
-			files = dir_read_file_list(base_path, path);
-			if (!pgBackupValidateFiles(files, base_path, size_only))
-				corrupted = true;
-			parray_walk(files, pgFileFree);
-			parray_free(files);
-		}
-		if (backup->with_serverlog)
-		{
-			elog(LOG, "server log files...");
-			pgBackupGetPath(backup, base_path, lengthof(base_path), SRVLOG_DIR);
-			pgBackupGetPath(backup, path, lengthof(path), SRVLOG_FILE_LIST);
-			files = dir_read_file_list(base_path, path);
-			if (!pgBackupValidateFiles(files, base_path, size_only))
-				corrupted = true;
-			parray_walk(files, pgFileFree);
-			parray_free(files);
-		}
+	if (check)
+		return vb;
+
+	/* CRC calculation of a interrupted validate is resumed */
+	if (!size_only)
+		read_checkpoint(vb);
+
+	if (HAVE_DATABASE(backup))
+	{
+		elog(LOG, "database files...");
+		validate_file_list(vb, DATABASE_DIR, DATABASE_FILE_LIST, queue);
+	}
+	if (HAVE_ARCLOG(backup))
+	{
+		elog(LOG, "archive WAL files...");
+		validate_file_list(vb, ARCLOG_DIR, ARCLOG_FILE_LIST, queue);
+	}
+	if (backup->with_serverlog)
+	{
+		elog(LOG, "server log files...");
+		validate_file_list(vb, SRVLOG_DIR, SRVLOG_FILE_LIST, queue);
+	}
+
+	return vb;
+}
+
+/*
+ * Finish validating the backup after all of its jobs, and update its status.
+ * Size and number of files validated are added to bytes and files.
+ */
+static void
+validate_end(ValidateBackup *vb, int64 *bytes, int64 *files)
+{
+	int		i;
 
+	*bytes += vb->bytes;
+	*files += vb->files;
+
+	if (!check)
+	{
 		/* update status to OK */
-		if (corrupted)
-			backup->status = BACKUP_STATUS_CORRUPT;
+		if (vb->corrupted)
+			vb->backup->status = BACKUP_STATUS_CORRUPT;
 		else
-			backup->status = BACKUP_STATUS_OK;
-		pgBackupWriteIni(backup);
+			vb->backup->status = BACKUP_STATUS_OK;
+		pgBackupWriteIni(vb->backup);
 
-		if (corrupted)
-			elog(WARNING, "backup %s is corrupted", timestamp);
+		if (vb->corrupted)
+			elog(WARNING, "backup %s is corrupted", vb->timestamp);
 		else
-			elog(LOG, "backup %s is valid", timestamp);
+			elog(LOG, "backup %s is valid", vb->timestamp);
+	}
+
+	/* validate completed, so the next one starts from scratch */
+	if (vb->checkpoint)
+	{
+		char	path[MAXPGPATH];
+
+		fclose(vb->checkpoint);
+		pgBackupGetPath(vb->backup, path, lengthof(path),
+			VALIDATE_CHECKPOINT_FILE);
+		if (storage_remove(path) == -1 && errno != ENOENT)
+			elog(WARNING, _("can't remove \"%s\": %s"), path, strerror(errno));
+	}
+
+	for (i = 0; i < parray_num(vb->lists); i++)
+	{
+		parray *files = (parray *) parray_get(vb->lists, i);
+
+		parray_walk(files, pgFileFree);
+		parray_free(files);
 	}
+	parray_free(vb->lists);
+	parray_walk(vb->roots, free);
+	parray_free(vb->roots);
+	if (vb->validated)
+	{
+		parray_walk(vb->validated, free);
+		parray_free(vb->validated);
+	}
+	pthread_mutex_destroy(&vb->lock);
+	free(vb);
 }
 
 static const char *
@@ -148,63 +316,189 @@ get_relative_path(const char *path, const char *root)
 }
 
 /*
- * Validate files in the backup with size or CRC.
+ * Push jobs to validate files in a file list of the backup.
  */
-static bool
-pgBackupValidateFiles(parray *files, const char *root, bool size_only)
+static void
+validate_file_list(ValidateBackup *vb, const char *subdir,
+				   const char *file_list, JobQueue *queue)
 {
+	char	base_path[MAXPGPATH];
+	char	path[MAXPGPATH];
+	parray *files;
+	char   *root;
 	int		i;
 
+	pgBackupGetPath(vb->backup, base_path, lengthof(base_path), subdir);
+	pgBackupGetPath(vb->backup, path, lengthof(path), file_list);
+	files = dir_read_file_list(base_path, path);
+	parray_append(vb->lists, files);
+
+	/* the root is kept with the file list for messages of jobs */
+	root = pgut_strdup(base_path);
+	parray_append(vb->roots, root);
+
 	for (i = 0; i < parray_num(files); i++)
 	{
-		struct stat st;
-
+		ValidateJob *job;
 		pgFile *file = (pgFile *) parray_get(files, i);
 
-		if (interrupted)
-			elog(ERROR_INTERRUPTED, _("interrupted during validate"));
-
 		/* skipped backup while incremental backup */
 		if (file->write_size == BYTES_INVALID || !S_ISREG(file->mode))
 			continue;
 
-		/* print progress */
-		elog(LOG, _("(%d/%lu) %s"), i + 1, (unsigned long) parray_num(files),
-			get_relative_path(file->path, root));
+		job = pgut_new(ValidateJob);
+		job->routine = validate_file;
+		job->vb = vb;
+		job->file = file;
+		job->root = root;
+		job->index = i;
+		job->total = parray_num(files);
 
-		/* always validate file size */
-		if (stat(file->path, &st) == -1)
+		if (queue)
+			JobQueue_push(queue, (Job *) job);
+		else
 		{
-			if (errno == ENOENT)
-				elog(WARNING, _("backup file \"%s\" vanished"), file->path);
-			else
-				elog(ERROR_SYSTEM, _("can't stat backup file \"%s\": %s"),
-					get_relative_path(file->path, root), strerror(errno));
-			return false;
+			validate_file(job);
+			free(job);
 		}
-		if (file->write_size != st.st_size)
+	}
+}
+
+/*
+ * Validate a file with size or CRC.
+ */
+static void
+validate_file(ValidateJob *job)
+{
+	ValidateBackup *vb = job->vb;
+	pgFile		   *file = job->file;
+	const char	   *path = get_relative_path(file->path, job->root);
+	const char	   *key = get_relative_path(file->path, vb->path);
+	struct stat		st;
+	bool			skip;
+
+	if (interrupted)
+		elog(ERROR_INTERRUPTED, _("interrupted during validate"));
+
+	/*
+	 * Stop at the first corrupted file unless all of them are reported, and
+	 * skip files validated before interrupted.
+	 */
+	pgut_mutex_lock(&vb->lock);
+	skip = (vb->corrupted && !vb->all_errors) ||
+		(vb->validated != NULL &&
+		 parray_bsearch(vb->validated, key, compare_path) != NULL);
+	pthread_mutex_unlock(&vb->lock);
+	if (skip)
+		return;
+
+	/* print progress */
+	elog(LOG, _("(%d/%lu) %s"), job->index + 1, (unsigned long) job->total,
+		path);
+
+	/* always validate file size */
+	if (storage_stat(file->path, &st) == -1)
+	{
+		if (errno == ENOENT)
+			elog(WARNING, _("backup file \"%s\" vanished"), file->path);
+		else
+			elog(ERROR_SYSTEM, _("can't stat backup file \"%s\": %s"),
+				path, strerror(errno));
+		goto corrupted;
+	}
+	if (file->write_size != st.st_size)
+	{
+		elog(WARNING, _("size of backup file \"%s\" must be %lu but %lu"),
+			path, (unsigned long) file->write_size,
+			(unsigned long) st.st_size);
+		goto corrupted;
+	}
+
+	/* validate CRC too */
+	if (!vb->size_only)
+	{
+		pg_crc32	crc;
+
+		crc = pgFileGetCRC(file, vb->backup->checksum);
+		if (crc != file->crc)
 		{
-			elog(WARNING, _("size of backup file \"%s\" must be %lu but %lu"),
-				get_relative_path(file->path, root),
-				(unsigned long) file->write_size,
-				(unsigned long) st.st_size);
-			return false;
+			elog(WARNING, _("CRC of backup file \"%s\" must be %X but %X"),
+				path, file->crc, crc);
+			goto corrupted;
 		}
+	}
+
+	/* pages of deduplicated data files are in the dedup store */
+	if (vb->backup->dedup && file->is_datafile &&
+		!validate_dedup_file(file->path, vb->backup->checksum, vb->size_only))
+		goto corrupted;
+
+	/* record the file validated, to resume from here when interrupted */
+	pgut_mutex_lock(&vb->lock);
+	vb->bytes += file->write_size;
+	vb->files++;
+	if (vb->checkpoint &&
+		(fprintf(vb->checkpoint, "%s\n", key) < 0 ||
+		 fflush(vb->checkpoint) != 0))
+		elog(WARNING, _("can't write checkpoint of validate: %s"),
+			strerror(errno));
+	pthread_mutex_unlock(&vb->lock);
+	return;
+
+corrupted:
+	pgut_mutex_lock(&vb->lock);
+	vb->corrupted = true;
+	pthread_mutex_unlock(&vb->lock);
+}
+
+/*
+ * Read files validated by the last validate interrupted, and open the
+ * checkpoint file to append files validated by this one.
+ */
+static void
+read_checkpoint(ValidateBackup *vb)
+{
+	char	path[MAXPGPATH];
+	char	buf[MAXPGPATH + 1];
+	FILE   *fp;
+
+	pgBackupGetPath(vb->backup, path, lengthof(path), VALIDATE_CHECKPOINT_FILE);
 
-		/* validate CRC too */
-		if (!size_only)
+	fp = storage_fopen(path, "r");
+	if (fp != NULL)
+	{
+		vb->validated = parray_new();
+		while (fgets(buf, lengthof(buf), fp))
 		{
-			pg_crc32	crc;
-
-			crc = pgFileGetCRC(file);
-			if (crc != file->crc)
-			{
-				elog(WARNING, _("CRC of backup file \"%s\" must be %X but %X"),
-					get_relative_path(file->path, root), file->crc, crc);
-				return false;
-			}
+			size_t	len = strlen(buf);
+
+			/* a line written partially is ignored */
+			if (len == 0 || buf[len - 1] != '\n')
+				continue;
+			buf[len - 1] = '\0';
+			parray_append(vb->validated, pgut_strdup(buf));
 		}
+		fclose(fp);
+		parray_qsort(vb->validated, compare_path);
+
+		if (parray_num(vb->validated) > 0)
+			elog(INFO, _("validate: resume %s skipping %lu files validated"),
+				vb->timestamp, (unsigned long) parray_num(vb->validated));
 	}
+	else if (errno != ENOENT)
+		elog(WARNING, _("can't open \"%s\": %s"), path, strerror(errno));
+
+	/* objects can't be appended, so the checkpoint is not updated */
+	if (storage_is_remote(path))
+		return;
 
-	return true;
+	vb->checkpoint = fopen(path, "a");
+	if (vb->checkpoint == NULL)
+		elog(WARNING, _("can't open \"%s\": %s"), path, strerror(errno));
+}
+
+static int
+compare_path(const void *p1, const void *p2)
+{
+	return strcmp(*(const char **) p1, *(const char **) p2);
 }
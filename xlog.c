@@ -9,6 +9,7 @@
 
 #include "pg_rman.h"
 
+#include <dirent.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -40,6 +41,30 @@ typedef union XLogPage
 	char					data[XLOG_BLCKSZ];
 } XLogPage;
 
+/* xlog_page_magic of the server version, or 0 if not supported */
+static uint16
+get_xlog_page_magic(int server_version)
+{
+	if (server_version < 80000)
+		return 0;	/* never happen */
+	else if (server_version < 80100)
+		return XLOG_PAGE_MAGIC_v80;
+	else if (server_version < 80200)
+		return XLOG_PAGE_MAGIC_v81;
+	else if (server_version < 80300)
+		return XLOG_PAGE_MAGIC_v82;
+	else if (server_version < 80400)
+		return XLOG_PAGE_MAGIC_v83;
+	else if (server_version < 90000)
+		return XLOG_PAGE_MAGIC_v84;
+	else if (server_version < 90100)
+		return XLOG_PAGE_MAGIC_v90;
+	else if (server_version < 90200)
+		return XLOG_PAGE_MAGIC_v91;
+	else
+		return 0;	/* not supported */
+}
+
 /*
  * Return whether the file is a WAL segment or not.
  * based on ValidXLOGHeader() in src/backend/access/transam/xlog.c.
@@ -62,23 +87,8 @@ xlog_is_complete_wal(const pgFile *file, int server_version)
 	fclose(fp);
 
 	/* xlog_page_magic from server version */
-	if (server_version < 80000)
-		return false;	/* never happen */
-	else if (server_version < 80100)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v80;
-	else if (server_version < 80200)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v81;
-	else if (server_version < 80300)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v82;
-	else if (server_version < 80400)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v83;
-	else if (server_version < 90000)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v84;
-	else if (server_version < 90100)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v90;
-	else if (server_version < 90200)
-		xlog_page_magic = XLOG_PAGE_MAGIC_v91;
-	else
+	xlog_page_magic = get_xlog_page_magic(server_version);
+	if (xlog_page_magic == 0)
 		return false;	/* not supported */
 
 	/* check header */
@@ -103,6 +113,93 @@ xlog_is_complete_wal(const pgFile *file, int server_version)
 	return true;
 }
 
+/* return whether the last component of path is a name of WAL segment */
+bool
+xlog_is_segment_name(const char *path)
+{
+	const char *fname = last_dir_separator(path);
+
+	fname = fname ? fname + 1 : path;
+	return strlen(fname) == 24 && strspn(fname, "0123456789ABCDEF") == 24;
+}
+
+/*
+ * Return the size of the used part of a WAL segment, which is followed by
+ * pages with invalid headers: pages recycled from an old segment or never
+ * written after a switch record. Recovery stops or skips to the next
+ * segment at the first invalid page, so only the used part is backed up and
+ * the rest is rebuilt with zeros by xlog_pad_segment(). Returns the size of
+ * the file if it is not a complete WAL segment.
+ */
+size_t
+xlog_used_size(const pgFile *file, int server_version)
+{
+	FILE		   *fp;
+	XLogPageHeaderData page;
+	XLogRecPtr		pageaddr;
+	uint32			tli;
+	TimeLineID		last_tli = 0;
+	uint16			xlog_page_magic;
+	size_t			offset;
+	const char	   *fname;
+
+	if (file->size != XLogSegSize || !xlog_is_segment_name(file->path) ||
+		!xlog_is_complete_wal(file, server_version))
+		return file->size;
+
+	fname = last_dir_separator(file->path);
+	fname = fname ? fname + 1 : file->path;
+	if (sscanf(fname, "%08X", &tli) != 1 || !xlog_logfname2lsn(fname, &pageaddr))
+		return file->size;
+	xlog_page_magic = get_xlog_page_magic(server_version);
+
+	if ((fp = fopen(file->path, "r")) == NULL)
+		return file->size;
+
+	/*
+	 * The first page is checked by xlog_is_complete_wal(). Pages before a
+	 * timeline switch, copied from the previous timeline, have older ones.
+	 */
+	for (offset = XLOG_BLCKSZ; offset < XLogSegSize; offset += XLOG_BLCKSZ)
+	{
+		if (fseeko(fp, offset, SEEK_SET) != 0 ||
+			fread(&page, 1, sizeof(page), fp) != sizeof(page))
+			break;
+		if (page.xlp_magic != xlog_page_magic ||
+			(page.xlp_info & ~XLP_ALL_FLAGS) != 0 ||
+			(page.xlp_info & XLP_LONG_HEADER) != 0 ||
+			page.xlp_tli > tli || page.xlp_tli < last_tli ||
+			page.xlp_pageaddr.xlogid != pageaddr.xlogid ||
+			page.xlp_pageaddr.xrecoff != pageaddr.xrecoff + offset)
+			break;
+		last_tli = page.xlp_tli;
+	}
+	/* copy the whole segment if it can't be read here */
+	if (ferror(fp))
+		offset = file->size;
+	fclose(fp);
+
+	return offset;
+}
+
+/*
+ * Extend a WAL segment restored from the used part to path with zeros to the
+ * size of segment. name is of the WAL file; other files are not changed.
+ */
+void
+xlog_pad_segment(const char *path, const char *name)
+{
+	struct stat	st;
+
+	if (!xlog_is_segment_name(name) || stat(path, &st) == -1 ||
+		!S_ISREG(st.st_mode) || st.st_size >= XLogSegSize)
+		return;
+
+	if (truncate(path, XLogSegSize) == -1)
+		elog(ERROR_SYSTEM, _("can't extend WAL segment \"%s\": %s"), path,
+			strerror(errno));
+}
+
 bool
 xlog_logfname2lsn(const char *logfname, XLogRecPtr *lsn)
 {
@@ -125,3 +222,1014 @@ xlog_fname(char *fname, size_t len, TimeLineID tli, XLogRecPtr *lsn)
 	snprintf(fname, len, "%08X%08X%08X", tli,
 		lsn->xlogid, lsn->xrecoff / XLogSegSize);
 }
+
+static int xlog_segment_compare(const void *s1, const void *s2);
+static void xlog_index_add(parray *index, const WalSegment *segment);
+
+/* parse the last component of path into segment if it is a WAL segment */
+bool
+xlog_parse_segment_name(const char *path, WalSegment *segment)
+{
+	const char *fname = last_dir_separator(path);
+
+	if (!xlog_is_segment_name(path))
+		return false;
+
+	fname = fname ? fname + 1 : path;
+	return sscanf(fname, "%08X%08X%08X",
+				  &segment->tli, &segment->log, &segment->seg) == 3;
+}
+
+/* compare two WalSegment in order of timeline, log and seg */
+static int
+xlog_segment_compare(const void *s1, const void *s2)
+{
+	const WalSegment *s1p = *(const WalSegment **) s1;
+	const WalSegment *s2p = *(const WalSegment **) s2;
+
+	if (s1p->tli != s2p->tli)
+		return s1p->tli < s2p->tli ? -1 : 1;
+	if (s1p->log != s2p->log)
+		return s1p->log < s2p->log ? -1 : 1;
+	if (s1p->seg != s2p->seg)
+		return s1p->seg < s2p->seg ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Build the index of WAL segments in the directory, sorted with
+ * xlog_segment_compare(). Only the names of the entries are read, so a
+ * local directory is read with readdir() without stat() of each file.
+ * A missing directory has no segments.
+ */
+parray *
+xlog_index_dir(const char *path)
+{
+	parray	   *index = parray_new();
+	WalSegment	segment;
+
+	if (storage_is_remote(path))
+	{
+		parray *entries = storage_list_dir(path);
+		int		i;
+
+		if (entries == NULL)
+			return index;
+		for (i = 0; i < parray_num(entries); i++)
+		{
+			pgFile *file = (pgFile *) parray_get(entries, i);
+
+			if (xlog_parse_segment_name(file->path, &segment))
+				xlog_index_add(index, &segment);
+		}
+		parray_walk(entries, pgFileFree);
+		parray_free(entries);
+	}
+	else
+	{
+		DIR			   *dir;
+		struct dirent  *ent;
+
+		if ((dir = opendir(path)) == NULL)
+		{
+			if (errno != ENOENT)
+				elog(WARNING, _("can't open directory \"%s\": %s"), path,
+					strerror(errno));
+			return index;
+		}
+		while ((ent = readdir(dir)) != NULL)
+		{
+			if (xlog_parse_segment_name(ent->d_name, &segment))
+				xlog_index_add(index, &segment);
+		}
+		closedir(dir);
+	}
+
+	parray_qsort(index, xlog_segment_compare);
+	return index;
+}
+
+static void
+xlog_index_add(parray *index, const WalSegment *segment)
+{
+	WalSegment *entry = pgut_new(WalSegment);
+
+	*entry = *segment;
+	parray_append(index, entry);
+}
+
+/* return whether the index has the segment */
+bool
+xlog_index_has(parray *index, TimeLineID tli, uint32 log, uint32 seg)
+{
+	WalSegment	key;
+
+	key.tli = tli;
+	key.log = log;
+	key.seg = seg;
+	return parray_bsearch(index, &key, xlog_segment_compare) != NULL;
+}
+
+void
+xlog_index_free(parray *index)
+{
+	parray_walk(index, free);
+	parray_free(index);
+}
+
+/*
+ * Pages modified in a range of WAL are collected from the records to take
+ * incremental backup without reading whole data files. Every first change
+ * of a page after a checkpoint is logged as a full-page image since the
+ * range begins with the redo pointer of the checkpoint of a backup, so the
+ * blocks of the images and the blocks changed by the records which are
+ * logged without full-page images are collected. Relations changed by the
+ * records of indexes are too complicated to collect the blocks, so they are
+ * scanned whole.
+ *
+ * Layouts of WAL records are not changed from 8.2 to 9.1 except the fork
+ * number added in 8.4, so the structures are defined here.
+ */
+typedef struct RelFileNode_v82
+{
+	Oid			spcNode;
+	Oid			dbNode;
+	Oid			relNode;
+} RelFileNode_v82;
+
+typedef struct ItemPointerData_v82
+{
+	uint16		bi_hi;
+	uint16		bi_lo;
+	uint16		ip_posid;
+} ItemPointerData_v82;
+
+#define ItemPointerGetBlockNumber_v82(tid) \
+	((BlockNumber) (((tid)->bi_hi << 16) | (tid)->bi_lo))
+
+typedef struct XLogRecord_v82
+{
+	pg_crc32		xl_crc;
+	XLogRecPtr		xl_prev;
+	TransactionId	xl_xid;
+	uint32			xl_tot_len;
+	uint32			xl_len;
+	uint8			xl_info;
+	uint8			xl_rmid;
+} XLogRecord_v82;
+
+#define SizeOfXLogRecord_v82	MAXALIGN(sizeof(XLogRecord_v82))
+#define SizeOfXLogContRecord_v82	sizeof(uint32)	/* xl_rem_len */
+#define MAXLOGRECSZ_v82			(16 * 1024 * 1024)
+
+#define XLR_INFO_MASK_v82		0x0F
+#define XLR_MAX_BKP_BLOCKS_v82	3
+#define XLR_SET_BKP_BLOCK_v82(iblk)	(0x08 >> (iblk))
+
+/* 80200 <= PG_VERSION_NUM < 80400 */
+typedef struct BkpBlock_v82
+{
+	RelFileNode_v82	node;
+	BlockNumber		block;
+	uint16			hole_offset;
+	uint16			hole_length;
+} BkpBlock_v82;
+
+/* 80400 <= PG_VERSION_NUM */
+typedef struct BkpBlock_v84
+{
+	RelFileNode_v82	node;
+	int32			fork;
+	BlockNumber		block;
+	uint16			hole_offset;
+	uint16			hole_length;
+} BkpBlock_v84;
+
+/* resource managers */
+#define RM_XLOG_ID_v82			0
+#define RM_SMGR_ID_v82			2
+#define RM_DBASE_ID_v82			4
+#define RM_HEAP2_ID_v82			9
+#define RM_HEAP_ID_v82			10
+#define RM_BTREE_ID_v82			11
+#define RM_HASH_ID_v82			12
+#define RM_GIN_ID_v82			13
+#define RM_GIST_ID_v82			14
+#define RM_SEQ_ID_v82			15
+
+#define XLOG_SWITCH_v82			0x40
+
+#define XLOG_SMGR_CREATE_v82	0x10
+#define XLOG_SMGR_TRUNCATE_v82	0x20
+
+#define XLOG_DBASE_CREATE_v82	0x00
+#define XLOG_DBASE_DROP_v82		0x10
+
+#define XLOG_HEAP_OPMASK_v82	0x70
+#define XLOG_HEAP_INSERT_v82	0x00
+#define XLOG_HEAP_DELETE_v82	0x10
+#define XLOG_HEAP_UPDATE_v82	0x20
+#define XLOG_HEAP_MOVE_v82		0x30	/* - 8.4 */
+#define XLOG_HEAP_HOT_UPDATE_v83	0x40	/* 8.3 - */
+#define XLOG_HEAP_CLEAN_v82		0x40	/* 8.2 */
+#define XLOG_HEAP_NEWPAGE_v82	0x50
+#define XLOG_HEAP_LOCK_v82		0x60
+#define XLOG_HEAP_INPLACE_v82	0x70
+
+#define XLOG_HEAP2_FREEZE_v82	0x00
+#define XLOG_HEAP2_CLEAN_v83	0x10	/* 8.3 - */
+#define XLOG_HEAP2_CLEAN_MOVE_v83	0x20	/* 8.3 - 8.4 */
+#define XLOG_HEAP2_CLEANUP_INFO_v90	0x30	/* 9.0 - */
+
+#define XLOG_BTREE_INSERT_LEAF_v82	0x10
+
+/*
+ * Records of heap start with xl_heaptid, and xl_heap_update has newtid after
+ * it. The rest is omitted when the page is logged as a full-page image.
+ */
+typedef struct xl_heaptid_v82
+{
+	RelFileNode_v82		node;
+	ItemPointerData_v82	tid;
+} xl_heaptid_v82;
+
+#define SizeOfHeapTid_v82	(offsetof(xl_heaptid_v82, tid) + sizeof(ItemPointerData_v82))
+
+typedef struct xl_heap_update_v82
+{
+	xl_heaptid_v82		target;
+	ItemPointerData_v82	newtid;
+} xl_heap_update_v82;
+
+#define SizeOfHeapUpdate_v82	(offsetof(xl_heap_update_v82, newtid) + sizeof(ItemPointerData_v82))
+
+/* also used for xl_heap_newpage before 8.4 and xl_heap_freeze/clean */
+typedef struct xl_heap_block_v82
+{
+	RelFileNode_v82	node;
+	BlockNumber		block;
+} xl_heap_block_v82;
+
+typedef struct xl_heap_newpage_v84
+{
+	RelFileNode_v82	node;
+	int32			forknum;
+	BlockNumber		blkno;
+} xl_heap_newpage_v84;
+
+typedef struct xl_smgr_truncate_v82
+{
+	BlockNumber		blkno;
+	RelFileNode_v82	rnode;
+} xl_smgr_truncate_v82;
+
+typedef struct xl_dbase_create_rec_v82
+{
+	Oid			db_id;
+	Oid			tablespace_id;
+	Oid			src_db_id;
+	Oid			src_tablespace_id;
+} xl_dbase_create_rec_v82;
+
+#define MAIN_FORKNUM_v84		0
+#define DEFAULT_TABLESPACE_OID	1663
+#define GLOBAL_TABLESPACE_OID	1664
+
+/*
+ * Modified blocks of a relation. relnode is InvalidOid for all relations of
+ * a database.
+ */
+typedef struct RelPageMap
+{
+	Oid				spcnode;
+	Oid				dbnode;
+	Oid				relnode;
+	bool			all;	/* true if the whole relation must be read */
+	datapagemap_t	pages;	/* modified blocks of the main fork */
+} RelPageMap;
+
+typedef struct XLogScan
+{
+	TimeLineID	tli;
+	int			server_version;
+	uint16		magic;
+	uint64		segno;		/* segment in segbuf */
+	bool		loaded;		/* true if segbuf is valid */
+	char	   *segbuf;		/* whole of the segment */
+	char	   *record;		/* record assembled from the pages */
+	size_t		recsize;	/* allocated size of record */
+	parray	   *pagemap;	/* sorted array of RelPageMap */
+} XLogScan;
+
+/* position in WAL as an integer */
+#define XLogRecPtrGetPos(ptr) \
+	((uint64) (ptr).xlogid * XLogFileSize + (ptr).xrecoff)
+#define XLogPosGetPtr(ptr, pos) \
+	((ptr).xlogid = (uint32) ((pos) / XLogFileSize), \
+	 (ptr).xrecoff = (uint32) ((pos) % XLogFileSize))
+
+static bool load_segment(XLogScan *scan, uint64 segno);
+static const XLogPageHeaderData *read_page(XLogScan *scan, uint64 pagepos);
+static const XLogRecord_v82 *read_record(XLogScan *scan, uint64 *pos,
+										 uint64 *prev);
+static bool decode_record(XLogScan *scan, const XLogRecord_v82 *record);
+static RelPageMap *get_relpagemap(parray *pagemap, Oid spcnode, Oid dbnode,
+								  Oid relnode);
+static RelPageMap *find_relpagemap(parray *pagemap, Oid spcnode, Oid dbnode,
+								   Oid relnode);
+static bool parse_number(const char **str, uint32 *value);
+
+/*
+ * Read WAL records from from to to, and returns modified pages of relations
+ * to be given to xlog_get_file_pagemap(). Segments are read from arclog_path,
+ * or pg_xlog in $PGDATA if not archived yet. Returns NULL if any segment is
+ * missing or any record can't be read, so the data files must be scanned.
+ */
+parray *
+xlog_read_pagemap(TimeLineID tli, XLogRecPtr from, XLogRecPtr to,
+				  int server_version)
+{
+	XLogScan	scan;
+	uint64		pos = XLogRecPtrGetPos(from);
+	uint64		end = XLogRecPtrGetPos(to);
+	uint64		prev = 0;
+	bool		ok = true;
+
+	scan.tli = tli;
+	scan.server_version = server_version;
+	scan.magic = get_xlog_page_magic(server_version);
+	scan.segno = 0;
+	scan.loaded = false;
+	scan.segbuf = NULL;
+	scan.record = NULL;
+	scan.recsize = 0;
+	scan.pagemap = parray_new();
+
+	if (scan.magic == 0 || server_version < 80200)
+	{
+		elog(LOG, _("can't read WAL of server version %d"), server_version);
+		ok = false;
+	}
+
+	while (ok && pos < end)
+	{
+		const XLogRecord_v82 *record;
+
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR_INTERRUPTED, _("interrupted during reading WAL"));
+
+		record = read_record(&scan, &pos, &prev);
+		if (record == NULL || !decode_record(&scan, record))
+			ok = false;
+	}
+
+	free(scan.segbuf);
+	free(scan.record);
+
+	if (!ok)
+	{
+		xlog_free_pagemap(scan.pagemap);
+		return NULL;
+	}
+
+	elog(LOG, _("%lu relations modified from %X/%08X to %X/%08X"),
+		(unsigned long) parray_num(scan.pagemap),
+		from.xlogid, from.xrecoff, to.xlogid, to.xrecoff);
+
+	return scan.pagemap;
+}
+
+/*
+ * Get modified blocks of a data file from the pagemap returned by
+ * xlog_read_pagemap(). path is relative to $PGDATA. Returns false if the
+ * whole file must be read; otherwise the blocks in the file are added to map.
+ */
+bool
+xlog_get_file_pagemap(parray *pagemap, const char *path, datapagemap_t *map)
+{
+	const char *p = path;
+	Oid			spcnode;
+	Oid			dbnode;
+	Oid			relnode;
+	uint32		segno = 0;
+	RelPageMap *rel;
+	BlockNumber	blknum;
+	BlockNumber	nblocks;
+
+	/* global/REL, base/DB/REL, or pg_tblspc/SPC/[PG_VERSION_CATVERSION/]DB/REL */
+	if (strncmp(p, "global/", 7) == 0)
+	{
+		p += 7;
+		spcnode = GLOBAL_TABLESPACE_OID;
+		dbnode = InvalidOid;
+	}
+	else if (strncmp(p, "base/", 5) == 0)
+	{
+		p += 5;
+		spcnode = DEFAULT_TABLESPACE_OID;
+		if (!parse_number(&p, &dbnode) || *p++ != '/')
+			return false;
+	}
+	else if (strncmp(p, PG_TBLSPC_DIR "/", strlen(PG_TBLSPC_DIR) + 1) == 0)
+	{
+		p += strlen(PG_TBLSPC_DIR) + 1;
+		if (!parse_number(&p, &spcnode) || *p++ != '/')
+			return false;
+		if (strncmp(p, "PG_", 3) == 0)
+		{
+			p = strchr(p, '/');
+			if (p == NULL)
+				return false;
+			p++;
+		}
+		if (!parse_number(&p, &dbnode) || *p++ != '/')
+			return false;
+	}
+	else
+		return false;
+
+	/* the main fork only; other forks are not logged or logged rarely */
+	if (!parse_number(&p, &relnode))
+		return false;
+	if (*p == '.')
+	{
+		p++;
+		if (!parse_number(&p, &segno))
+			return false;
+	}
+	if (*p != '\0')
+		return false;
+
+	if ((rel = find_relpagemap(pagemap, spcnode, dbnode, InvalidOid)) != NULL ||
+		(rel = find_relpagemap(pagemap, spcnode, dbnode, relnode)) != NULL)
+	{
+		if (rel->all)
+			return false;
+
+		/* copy the blocks in the segment */
+		nblocks = rel->pages.bitmapsize * 8;
+		for (blknum = segno * RELSEG_SIZE;
+			 blknum < (segno + 1) * RELSEG_SIZE && blknum < nblocks;
+			 blknum++)
+		{
+			if (datapagemap_is_set(&rel->pages, blknum))
+				datapagemap_add(map, blknum - segno * RELSEG_SIZE);
+		}
+	}
+
+	return true;
+}
+
+static void
+relpagemap_free(void *rel)
+{
+	datapagemap_clear(&((RelPageMap *) rel)->pages);
+	free(rel);
+}
+
+void
+xlog_free_pagemap(parray *pagemap)
+{
+	if (pagemap == NULL)
+		return;
+	parray_walk(pagemap, relpagemap_free);
+	parray_free(pagemap);
+}
+
+/* read a whole segment into the buffer */
+static bool
+load_segment(XLogScan *scan, uint64 segno)
+{
+	char		fname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	FileReader *in;
+	const char *data;
+	size_t		len;
+	size_t		total = 0;
+
+	XLogFileName(fname, scan->tli, (uint32) (segno / XLogSegsPerFile),
+		(uint32) (segno % XLogSegsPerFile));
+
+	/* the last segments might not be archived yet */
+	join_path_components(path, arclog_path, fname);
+	in = file_reader_open(path, direct_io);
+	if (in == NULL && errno == ENOENT)
+	{
+		snprintf(path, lengthof(path), "%s/%s/%s", pgdata, PG_XLOG_DIR, fname);
+		in = file_reader_open(path, direct_io);
+	}
+	if (in == NULL)
+	{
+		elog(LOG, _("can't open WAL segment \"%s\": %s"), fname,
+			strerror(errno));
+		return false;
+	}
+
+	if (scan->segbuf == NULL)
+		scan->segbuf = pgut_malloc(XLogSegSize);
+	while (total < XLogSegSize &&
+		   (len = file_reader_read(in, &data, XLogSegSize - total)) > 0)
+	{
+		memcpy(scan->segbuf + total, data, len);
+		total += len;
+	}
+	if (file_reader_error(in) != 0 || total != XLogSegSize)
+	{
+		elog(LOG, _("can't read WAL segment \"%s\": %s"), path,
+			file_reader_error(in) != 0 ? strerror(file_reader_error(in))
+									   : "unexpected end of file");
+		file_reader_close(in);
+		scan->loaded = false;
+		return false;
+	}
+	file_reader_close(in);
+
+	scan->segno = segno;
+	scan->loaded = true;
+	return true;
+}
+
+/*
+ * Return the page at pagepos after validating the header. The header is
+ * checked as ValidXLOGHeader() in src/backend/access/transam/xlog.c does.
+ */
+static const XLogPageHeaderData *
+read_page(XLogScan *scan, uint64 pagepos)
+{
+	uint64		segno = pagepos / XLogSegSize;
+	const XLogPageHeaderData *page;
+	XLogRecPtr	pageaddr;
+
+	if ((!scan->loaded || scan->segno != segno) && !load_segment(scan, segno))
+		return NULL;
+
+	page = (const XLogPageHeaderData *)
+		(scan->segbuf + pagepos % XLogSegSize);
+	XLogPosGetPtr(pageaddr, pagepos);
+
+	if (page->xlp_magic != scan->magic ||
+		(page->xlp_info & ~XLP_ALL_FLAGS) != 0 ||
+		page->xlp_tli != scan->tli ||
+		!XLByteEQ(page->xlp_pageaddr, pageaddr))
+	{
+		elog(LOG, _("invalid WAL page header at %X/%08X"),
+			pageaddr.xlogid, pageaddr.xrecoff);
+		return NULL;
+	}
+
+	return page;
+}
+
+#define XLogPageHeaderSize_v82(page) \
+	(((page)->xlp_info & XLP_LONG_HEADER) ? SizeOfXLogLongPHD : SizeOfXLogShortPHD)
+
+/*
+ * Read the record at *pos, which is assembled in scan->record when the
+ * record continues to the next pages. *pos is advanced to the next record,
+ * and *prev is set to the position of the record. Based on ReadRecord() in
+ * src/backend/access/transam/xlog.c.
+ */
+static const XLogRecord_v82 *
+read_record(XLogScan *scan, uint64 *pos, uint64 *prev)
+{
+	uint64		recpos = *pos;
+	uint64		pagepos;
+	const XLogPageHeaderData *page;
+	XLogRecord_v82 *record;
+	XLogRecPtr	ptr;
+	uint32		offset;
+	uint32		total_len;
+	uint32		len;
+	uint32		got;
+	pg_crc32	crc;
+
+	for (;;)
+	{
+		offset = recpos % XLOG_BLCKSZ;
+		pagepos = recpos - offset;
+		if ((page = read_page(scan, pagepos)) == NULL)
+			return NULL;
+
+		/* a record starts after the page header */
+		if (offset < XLogPageHeaderSize_v82(page))
+		{
+			if (page->xlp_info & XLP_FIRST_IS_CONTRECORD)
+				goto invalid;
+			offset = XLogPageHeaderSize_v82(page);
+			recpos = pagepos + offset;
+		}
+
+		/* the header of a record is never split into pages */
+		if (XLOG_BLCKSZ - offset >= SizeOfXLogRecord_v82)
+			break;
+		recpos = pagepos + XLOG_BLCKSZ;
+	}
+
+	if (scan->recsize < SizeOfXLogRecord_v82)
+	{
+		scan->recsize = XLOG_BLCKSZ;
+		scan->record = pgut_realloc(scan->record, scan->recsize);
+	}
+	record = (XLogRecord_v82 *) scan->record;
+	memcpy(record, (const char *) page + offset, SizeOfXLogRecord_v82);
+
+	total_len = record->xl_tot_len;
+	if (total_len < SizeOfXLogRecord_v82 ||
+		total_len > SizeOfXLogRecord_v82 + MAXLOGRECSZ_v82 +
+			XLR_MAX_BKP_BLOCKS_v82 * (sizeof(BkpBlock_v84) + BLCKSZ) ||
+		record->xl_len > total_len - SizeOfXLogRecord_v82 ||
+		(*prev != 0 && XLogRecPtrGetPos(record->xl_prev) != *prev))
+		goto invalid;
+
+	if (scan->recsize < total_len)
+	{
+		scan->recsize = total_len;
+		scan->record = pgut_realloc(scan->record, scan->recsize);
+		record = (XLogRecord_v82 *) scan->record;
+	}
+
+	/* copy the record from the first page and the continuation pages */
+	len = Min(total_len, XLOG_BLCKSZ - offset);
+	memcpy(scan->record, (const char *) page + offset, len);
+	got = len;
+	offset += len;
+	while (got < total_len)
+	{
+		uint32		rem_len;
+		uint32		hdrsize;
+
+		pagepos += XLOG_BLCKSZ;
+		if ((page = read_page(scan, pagepos)) == NULL)
+			return NULL;
+		if (!(page->xlp_info & XLP_FIRST_IS_CONTRECORD))
+			goto invalid;
+
+		hdrsize = XLogPageHeaderSize_v82(page);
+		memcpy(&rem_len, (const char *) page + hdrsize, sizeof(rem_len));
+		if (rem_len != total_len - got)
+			goto invalid;
+
+		offset = hdrsize + SizeOfXLogContRecord_v82;
+		len = Min(rem_len, XLOG_BLCKSZ - offset);
+		memcpy(scan->record + got, (const char *) page + offset, len);
+		got += len;
+		offset += len;
+	}
+
+	/* the data, the backup blocks, and the header except the CRC */
+	INIT_CRC32(crc);
+	COMP_CRC32(crc, scan->record + SizeOfXLogRecord_v82,
+			   total_len - SizeOfXLogRecord_v82);
+	COMP_CRC32(crc, scan->record + sizeof(pg_crc32),
+			   SizeOfXLogRecord_v82 - sizeof(pg_crc32));
+	FIN_CRC32(crc);
+	if (!EQ_CRC32(crc, record->xl_crc))
+		goto invalid;
+
+	*prev = recpos;
+
+	/* the rest of the segment is not used after a switch record */
+	if (record->xl_rmid == RM_XLOG_ID_v82 &&
+		(record->xl_info & ~XLR_INFO_MASK_v82) == XLOG_SWITCH_v82)
+		*pos = (pagepos / XLogSegSize + 1) * XLogSegSize;
+	else
+		*pos = pagepos + MAXALIGN(offset);
+
+	return record;
+
+invalid:
+	XLogPosGetPtr(ptr, recpos);
+	elog(LOG, _("invalid WAL record at %X/%08X"), ptr.xlogid, ptr.xrecoff);
+	return NULL;
+}
+
+/* add a modified block to the pagemap */
+static void
+add_block(XLogScan *scan, const RelFileNode_v82 *node, BlockNumber blknum)
+{
+	RelPageMap *rel;
+
+	rel = get_relpagemap(scan->pagemap, node->spcNode, node->dbNode,
+						 node->relNode);
+	if (!rel->all)
+		datapagemap_add(&rel->pages, blknum);
+}
+
+/* the whole relation must be read */
+static void
+add_relation(XLogScan *scan, Oid spcnode, Oid dbnode, Oid relnode)
+{
+	RelPageMap *rel;
+
+	rel = get_relpagemap(scan->pagemap, spcnode, dbnode, relnode);
+	rel->all = true;
+	datapagemap_clear(&rel->pages);
+}
+
+/* copy size bytes of the data of the record to var if the data has them */
+#define RecordGetData(record, var, size) \
+	((record)->xl_len >= (size) && \
+	 (memcpy(&(var), (const char *) (record) + SizeOfXLogRecord_v82, \
+			 (size)), true))
+
+/*
+ * Collect blocks modified by the record. Returns false for unknown records,
+ * which might modify blocks not collected.
+ */
+static bool
+decode_record(XLogScan *scan, const XLogRecord_v82 *record)
+{
+	const char *blk;
+	uint8		info = record->xl_info & ~XLR_INFO_MASK_v82;
+	int			i;
+
+	/* full-page images follow the data */
+	blk = (const char *) record + SizeOfXLogRecord_v82 + record->xl_len;
+	for (i = 0; i < XLR_MAX_BKP_BLOCKS_v82; i++)
+	{
+		RelFileNode_v82	node;
+		BlockNumber		block;
+		uint16			hole_length;
+		int				fork = MAIN_FORKNUM_v84;
+		size_t			size;
+
+		if (!(record->xl_info & XLR_SET_BKP_BLOCK_v82(i)))
+			continue;
+
+		if (scan->server_version >= 80400)
+		{
+			BkpBlock_v84	bkpb;
+
+			if (blk + sizeof(bkpb) > (const char *) record + record->xl_tot_len)
+				return false;
+			memcpy(&bkpb, blk, sizeof(bkpb));
+			node = bkpb.node;
+			fork = bkpb.fork;
+			block = bkpb.block;
+			hole_length = bkpb.hole_length;
+			size = sizeof(bkpb);
+		}
+		else
+		{
+			BkpBlock_v82	bkpb;
+
+			if (blk + sizeof(bkpb) > (const char *) record + record->xl_tot_len)
+				return false;
+			memcpy(&bkpb, blk, sizeof(bkpb));
+			node = bkpb.node;
+			block = bkpb.block;
+			hole_length = bkpb.hole_length;
+			size = sizeof(bkpb);
+		}
+
+		if (hole_length > BLCKSZ)
+			return false;
+		if (fork == MAIN_FORKNUM_v84)
+			add_block(scan, &node, block);
+		blk += size + BLCKSZ - hole_length;
+	}
+
+	switch (record->xl_rmid)
+	{
+		case RM_SMGR_ID_v82:
+		{
+			/* created or truncated relation */
+			RelFileNode_v82			create;
+			xl_smgr_truncate_v82	truncate;
+
+			if (info == XLOG_SMGR_CREATE_v82 &&
+				RecordGetData(record, create, sizeof(create)))
+				add_relation(scan, create.spcNode, create.dbNode, create.relNode);
+			else if (info == XLOG_SMGR_TRUNCATE_v82 &&
+					 RecordGetData(record, truncate, sizeof(truncate)))
+				add_relation(scan, truncate.rnode.spcNode,
+							 truncate.rnode.dbNode, truncate.rnode.relNode);
+			else
+				return false;
+			break;
+		}
+		case RM_DBASE_ID_v82:
+		{
+			/* database is copied from the template without WAL */
+			xl_dbase_create_rec_v82	create;
+
+			if (info == XLOG_DBASE_CREATE_v82 &&
+				RecordGetData(record, create, sizeof(create)))
+				add_relation(scan, create.tablespace_id, create.db_id,
+							 InvalidOid);
+			else if (info != XLOG_DBASE_DROP_v82)
+				return false;
+			break;
+		}
+		case RM_HEAP_ID_v82:
+		{
+			xl_heap_update_v82	update;
+			xl_heap_block_v82	newpage;
+			xl_heap_newpage_v84	newpage_v84;
+
+			/* CLEAN of 8.2 has the same value as HOT_UPDATE of 8.3 or later */
+			if (scan->server_version < 80300 &&
+				(info & XLOG_HEAP_OPMASK_v82) == XLOG_HEAP_CLEAN_v82)
+			{
+				if (!RecordGetData(record, newpage, sizeof(newpage)))
+					return false;
+				add_block(scan, &newpage.node, newpage.block);
+				break;
+			}
+
+			switch (info & XLOG_HEAP_OPMASK_v82)
+			{
+				case XLOG_HEAP_INSERT_v82:
+				case XLOG_HEAP_DELETE_v82:
+				case XLOG_HEAP_LOCK_v82:
+				case XLOG_HEAP_INPLACE_v82:
+					/* the page is not logged when initialized */
+					if (!RecordGetData(record, update.target, SizeOfHeapTid_v82))
+						return false;
+					add_block(scan, &update.target.node,
+						ItemPointerGetBlockNumber_v82(&update.target.tid));
+					break;
+				case XLOG_HEAP_UPDATE_v82:
+				case XLOG_HEAP_MOVE_v82:
+				case XLOG_HEAP_HOT_UPDATE_v83:
+					if (!RecordGetData(record, update, SizeOfHeapUpdate_v82))
+						return false;
+					add_block(scan, &update.target.node,
+						ItemPointerGetBlockNumber_v82(&update.target.tid));
+					add_block(scan, &update.target.node,
+						ItemPointerGetBlockNumber_v82(&update.newtid));
+					break;
+				case XLOG_HEAP_NEWPAGE_v82:
+					/* whole page is logged as the data */
+					if (scan->server_version >= 80400)
+					{
+						if (!RecordGetData(record, newpage_v84,
+										   sizeof(newpage_v84)))
+							return false;
+						if (newpage_v84.forknum == MAIN_FORKNUM_v84)
+							add_block(scan, &newpage_v84.node, newpage_v84.blkno);
+					}
+					else
+					{
+						if (!RecordGetData(record, newpage, sizeof(newpage)))
+							return false;
+						add_block(scan, &newpage.node, newpage.block);
+					}
+					break;
+			}
+			break;
+		}
+		case RM_HEAP2_ID_v82:
+		{
+			xl_heap_block_v82	clean;
+
+			if (info == XLOG_HEAP2_FREEZE_v82 ||
+				(scan->server_version >= 80300 &&
+				 (info == XLOG_HEAP2_CLEAN_v83 ||
+				  info == XLOG_HEAP2_CLEAN_MOVE_v83)))
+			{
+				if (!RecordGetData(record, clean, sizeof(clean)))
+					return false;
+				add_block(scan, &clean.node, clean.block);
+			}
+			else if (!(scan->server_version >= 90000 &&
+					   info == XLOG_HEAP2_CLEANUP_INFO_v90))
+				return false;
+			break;
+		}
+		case RM_BTREE_ID_v82:
+		{
+			xl_heaptid_v82	target;		/* xl_btreetid */
+			RelFileNode_v82	node;
+
+			/* only inserting into a leaf modifies just one page */
+			if (info == XLOG_BTREE_INSERT_LEAF_v82 &&
+				RecordGetData(record, target, SizeOfHeapTid_v82))
+				add_block(scan, &target.node,
+					ItemPointerGetBlockNumber_v82(&target.tid));
+			else if (RecordGetData(record, node, sizeof(node)))
+				add_relation(scan, node.spcNode, node.dbNode, node.relNode);
+			else
+				return false;
+			break;
+		}
+		case RM_SEQ_ID_v82:
+		{
+			RelFileNode_v82	node;
+
+			/* a sequence has only one page */
+			if (!RecordGetData(record, node, sizeof(node)))
+				return false;
+			add_block(scan, &node, 0);
+			break;
+		}
+		case RM_HASH_ID_v82:
+		case RM_GIN_ID_v82:
+		case RM_GIST_ID_v82:
+		{
+			RelFileNode_v82	node;
+
+			if (!RecordGetData(record, node, sizeof(node)))
+				return false;
+			add_relation(scan, node.spcNode, node.dbNode, node.relNode);
+			break;
+		}
+		default:
+			/* xlog, xact, clog, tblspc, multixact, relmap, and standby */
+			if (record->xl_rmid > RM_SEQ_ID_v82)
+				return false;
+			break;
+	}
+
+	return true;
+}
+
+static int
+relpagemap_cmp(const RelPageMap *rel, Oid spcnode, Oid dbnode, Oid relnode)
+{
+	if (rel->spcnode != spcnode)
+		return rel->spcnode < spcnode ? -1 : 1;
+	if (rel->dbnode != dbnode)
+		return rel->dbnode < dbnode ? -1 : 1;
+	if (rel->relnode != relnode)
+		return rel->relnode < relnode ? -1 : 1;
+	return 0;
+}
+
+/* binary search of the relation, or the position to insert it */
+static size_t
+search_relpagemap(parray *pagemap, Oid spcnode, Oid dbnode, Oid relnode,
+				  bool *found)
+{
+	size_t	lo = 0;
+	size_t	hi = parray_num(pagemap);
+
+	*found = false;
+	while (lo < hi)
+	{
+		size_t	mid = (lo + hi) / 2;
+		int		cmp;
+
+		cmp = relpagemap_cmp(parray_get(pagemap, mid), spcnode, dbnode, relnode);
+		if (cmp == 0)
+		{
+			*found = true;
+			return mid;
+		}
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static RelPageMap *
+find_relpagemap(parray *pagemap, Oid spcnode, Oid dbnode, Oid relnode)
+{
+	bool	found;
+	size_t	index;
+
+	index = search_relpagemap(pagemap, spcnode, dbnode, relnode, &found);
+	return found ? parray_get(pagemap, index) : NULL;
+}
+
+/* find the relation, or add it if not found */
+static RelPageMap *
+get_relpagemap(parray *pagemap, Oid spcnode, Oid dbnode, Oid relnode)
+{
+	bool		found;
+	size_t		index;
+	RelPageMap *rel;
+
+	index = search_relpagemap(pagemap, spcnode, dbnode, relnode, &found);
+	if (found)
+		return parray_get(pagemap, index);
+
+	rel = pgut_new(RelPageMap);
+	rel->spcnode = spcnode;
+	rel->dbnode = dbnode;
+	rel->relnode = relnode;
+	rel->all = false;
+	rel->pages.bitmap = NULL;
+	rel->pages.bitmapsize = 0;
+	parray_insert(pagemap, index, rel);
+
+	return rel;
+}
+
+/* parse digits at *str, and advance *str */
+static bool
+parse_number(const char **str, uint32 *value)
+{
+	const char *p = *str;
+
+	if (!isdigit((unsigned char) *p))
+		return false;
+	for (*value = 0; isdigit((unsigned char) *p); p++)
+		*value = *value * 10 + (*p - '0');
+
+	*str = p;
+	return true;
+}